@@ -0,0 +1,142 @@
+// A minimal CP/M-like environment to run the instruction
+// exercisers as benchmark workloads.
+
+#ifndef Z80_BENCH_CPM_MACHINE_H
+#define Z80_BENCH_CPM_MACHINE_H
+
+#include <algorithm>
+#include <chrono>
+#include <initializer_list>
+#include <memory>
+
+#include "z80.h"
+
+namespace bench {
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::least_u8;
+
+typedef unsigned long long count_type;
+
+[[noreturn]] inline void error(const char *msg, const char *arg) {
+    std::fprintf(stderr, "bench: %s%s\n", msg, arg);
+    std::exit(EXIT_FAILURE);
+}
+
+// Reads a program image from the supplements directory.
+class program {
+public:
+    program(const char *dir, const char *name)
+        : name(name)
+    {
+        char path[1024];
+        std::snprintf(path, sizeof(path), "%s/%s", dir, name);
+        FILE *f = std::fopen(path, "rb");
+        if(!f)
+            error("cannot open ", path);
+        size = std::fread(image, 1, sizeof(image), f);
+        std::fclose(f);
+    }
+
+    // A program given by its code.
+    program(const char *name, std::initializer_list<least_u8> code)
+        : name(name), size(code.size())
+    {
+        std::copy(code.begin(), code.end(), image);
+    }
+
+    const char *get_name() const { return name; }
+
+    template<typename M>
+    void load(M &mach) const {
+        // Make the program return from BDOS calls and halt on
+        // exiting.
+        const fast_u16 entry = 0x0100;
+        for(std::size_t i = 0; i != size && entry + i < sizeof(image); ++i)
+            mach.write(static_cast<fast_u16>(entry + i), image[i]);
+        mach.write(0x0005, 0xc9);  // ret
+        mach.write(0x0000, 0x76);  // halt
+        mach.set_pc(entry);
+        mach.set_sp(0xf000);
+    }
+
+private:
+    const char *name;
+    std::size_t size = 0;
+    least_u8 image[z80::address_space_size - 0x100];
+};
+
+template<typename B>
+class cpm_machine : public B {
+public:
+    typedef B base;
+
+    // Executes up to the specified number of instructions.
+    // Returns the number of executed instructions.
+    count_type run(count_type num_instrs) {
+        count_type n = 0;
+        while(n != num_instrs && !base::is_halted()) {
+            base::on_step();
+            ++n;
+        }
+        return n;
+    }
+};
+
+class timer {
+public:
+    timer()
+        : start(std::chrono::steady_clock::now())
+    {}
+
+    double get_seconds() const {
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+struct measurement {
+    count_type instrs;
+    count_type ticks;
+    double seconds;
+
+    double get_mips() const {
+        return static_cast<double>(instrs) / seconds / 1e6;
+    }
+
+    // The frequency of an emulated CPU that would run as fast.
+    double get_mhz() const {
+        return static_cast<double>(ticks) / seconds / 1e6;
+    }
+
+    double get_ns_per_instr() const {
+        return seconds * 1e9 / static_cast<double>(instrs);
+    }
+};
+
+// Runs a fresh machine on the program.
+template<typename M>
+measurement measure(const program &prog, count_type num_instrs) {
+    std::unique_ptr<M> mach(new M);
+    prog.load(*mach);
+    auto start_ticks = mach->get_ticks();
+    timer t;
+    count_type n = mach->run(num_instrs);
+    double seconds = t.get_seconds();
+    return {n, static_cast<count_type>(mach->get_ticks() - start_ticks),
+            seconds};
+}
+
+// Returns the rate in millions of instructions per second.
+template<typename M>
+double measure_mips(const program &prog, count_type num_instrs) {
+    return measure<M>(prog, num_instrs).get_mips();
+}
+
+}  // namespace bench
+
+#endif  // Z80_BENCH_CPM_MACHINE_H
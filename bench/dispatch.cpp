@@ -0,0 +1,49 @@
+// Compares decoding instructions with the switches of the
+// decoders against dispatching them through handler tables.
+
+#include "bench/cpm_machine.h"
+
+namespace {
+
+using bench::count_type;
+
+class i8080_switch
+    : public bench::cpm_machine<z80::i8080_machine<i8080_switch>> {};
+class i8080_tables
+    : public bench::cpm_machine<z80::i8080_table_dispatch<
+          z80::i8080_machine<i8080_tables>>> {};
+
+class z80_switch
+    : public bench::cpm_machine<z80::z80_machine<z80_switch>> {};
+class z80_tables
+    : public bench::cpm_machine<z80::z80_table_dispatch<
+          z80::z80_machine<z80_tables>>> {};
+
+template<typename S, typename T>
+void compare(const char *cpu, const bench::program &prog,
+             count_type num_instrs) {
+    double switch_mips = bench::measure_mips<S>(prog, num_instrs);
+    double tables_mips = bench::measure_mips<T>(prog, num_instrs);
+    std::printf("%-6s %-12s switch %8.2f MIPS  tables %8.2f MIPS  "
+                "%+.1f%%\n", cpu, prog.get_name(), switch_mips,
+                tables_mips, (tables_mips / switch_mips - 1) * 100);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    if(argc != 2 && argc != 3)
+        bench::error("usage: dispatch <supplements-dir> "
+                     "[<num-instrs>]", "");
+
+    const char *dir = argv[1];
+    count_type num_instrs = 50000000;
+    if(argc == 3)
+        num_instrs = std::strtoull(argv[2], nullptr, 10);
+
+    static const bench::program i8080_prog(dir, "8080exm.com");
+    compare<i8080_switch, i8080_tables>("i8080", i8080_prog, num_instrs);
+
+    static const bench::program z80_prog(dir, "zexall.com");
+    compare<z80_switch, z80_tables>("z80", z80_prog, num_instrs);
+}
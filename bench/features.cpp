@@ -0,0 +1,63 @@
+// Compares CPUs that maintain all of their state against ones
+// instantiated without the address bus, WZ and R.
+
+#include "bench/cpm_machine.h"
+
+namespace {
+
+using bench::count_type;
+using z80::cpu_features;
+
+class i8080_full
+    : public bench::cpm_machine<z80::i8080_machine<i8080_full>> {};
+class i8080_reduced
+    : public bench::cpm_machine<z80::basic_i8080_machine<
+          i8080_reduced, cpu_features::none>> {};
+
+class z80_full
+    : public bench::cpm_machine<z80::z80_machine<z80_full>> {};
+class z80_reduced
+    : public bench::cpm_machine<z80::basic_z80_machine<
+          z80_reduced, cpu_features::none>> {};
+
+// Takes the best of a few runs, as the differences are easily
+// lost in the noise of the host.
+template<typename M>
+double measure_best_mips(const bench::program &prog, count_type num_instrs) {
+    double best = 0;
+    for(unsigned i = 0; i != 5; ++i) {
+        double mips = bench::measure_mips<M>(prog, num_instrs);
+        if(mips > best)
+            best = mips;
+    }
+    return best;
+}
+
+template<typename F, typename R>
+void compare(const char *cpu, const bench::program &prog,
+             count_type num_instrs) {
+    double full_mips = measure_best_mips<F>(prog, num_instrs);
+    double reduced_mips = measure_best_mips<R>(prog, num_instrs);
+    std::printf("%-6s %-12s full %8.2f MIPS  reduced %8.2f MIPS  "
+                "%+.1f%%\n", cpu, prog.get_name(), full_mips,
+                reduced_mips, (reduced_mips / full_mips - 1) * 100);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    if(argc != 2 && argc != 3)
+        bench::error("usage: features <supplements-dir> "
+                     "[<num-instrs>]", "");
+
+    const char *dir = argv[1];
+    count_type num_instrs = 20000000;
+    if(argc == 3)
+        num_instrs = std::strtoull(argv[2], nullptr, 10);
+
+    static const bench::program i8080_prog(dir, "8080exm.com");
+    compare<i8080_full, i8080_reduced>("i8080", i8080_prog, num_instrs);
+
+    static const bench::program z80_prog(dir, "zexall.com");
+    compare<z80_full, z80_reduced>("z80", z80_prog, num_instrs);
+}
@@ -0,0 +1,48 @@
+// Measures the cost of virtual handlers. Built twice: as
+// 'handlers' with the default virtual handlers and as
+// 'handlers_static' with Z80_NO_VIRTUAL_HANDLERS defined.
+
+#include "bench/cpm_machine.h"
+
+namespace {
+
+using bench::count_type;
+
+#ifdef Z80_NO_VIRTUAL_HANDLERS
+const char config[] = "static";
+#else
+const char config[] = "virtual";
+#endif
+
+class i8080_machine
+    : public bench::cpm_machine<z80::i8080_machine<i8080_machine>> {};
+class z80_machine
+    : public bench::cpm_machine<z80::z80_machine<z80_machine>> {};
+
+template<typename M>
+void measure(const char *cpu, const bench::program &prog,
+             count_type num_instrs) {
+    double mips = bench::measure_mips<M>(prog, num_instrs);
+    std::printf("%-6s %-12s %-8s %8.2f MIPS  %u bytes per instance\n",
+                cpu, prog.get_name(), config, mips,
+                static_cast<unsigned>(sizeof(M)));
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    if(argc != 2 && argc != 3)
+        bench::error("usage: handlers <supplements-dir> "
+                     "[<num-instrs>]", "");
+
+    const char *dir = argv[1];
+    count_type num_instrs = 50000000;
+    if(argc == 3)
+        num_instrs = std::strtoull(argv[2], nullptr, 10);
+
+    static const bench::program i8080_prog(dir, "8080exm.com");
+    measure<i8080_machine>("i8080", i8080_prog, num_instrs);
+
+    static const bench::program z80_prog(dir, "zexall.com");
+    measure<z80_machine>("z80", z80_prog, num_instrs);
+}
@@ -0,0 +1,114 @@
+// Compares a machine that checks for interrupts on every step
+// with one that uses the interrupt controller.
+
+#include "bench/cpm_machine.h"
+
+namespace {
+
+using bench::count_type;
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::least_u8;
+
+const unsigned timer_period = 200;
+
+// Ticks a timer that raises the INT line and installs an ISR
+// that drops it.
+template<typename B>
+class timer_machine : public bench::cpm_machine<B> {
+public:
+    typedef bench::cpm_machine<B> base;
+
+    timer_machine() {
+        static const least_u8 isr[] = {
+            0xf5,        // push af
+            0xd3, 0x00,  // out (0), a
+            0x04,        // inc b
+            0xf1,        // pop af
+            0xfb,        // ei
+            0xed, 0x4d,  // reti
+        };
+        fast_u16 addr = 0x0038;
+        for(least_u8 n : isr)
+            base::write(addr++, n);
+        base::schedule(timer_period, &timer_machine::on_timer);
+    }
+
+    void on_output(fast_u16 port, fast_u8 n) {
+        base::set_int_line(false);
+        base::on_output(port, n);
+    }
+
+private:
+    static void on_timer(typename base::derived &m, void *context) {
+        z80::unused(context);
+        m.set_int_line(true);
+        m.schedule(m.get_ticks() + timer_period, &timer_machine::on_timer);
+    }
+};
+
+// Tries to initiate an interrupt on every step the INT line is
+// active.
+template<typename B>
+class int_polling : public B {
+public:
+    typedef B base;
+
+    void set_int_line(bool active) { int_line = active; }
+
+    void on_step() {
+        if(int_line)
+            base::on_handle_active_int();
+        base::on_step();
+    }
+
+private:
+    bool int_line = false;
+};
+
+class z80_polling : public timer_machine<
+    int_polling<z80::z80_machine<z80_polling>>> {};
+class z80_controller : public timer_machine<
+    z80::int_controller<z80::z80_machine<z80_controller>>> {};
+
+const bench::program z80_prog("interrupts", {
+    0xed, 0x56,  // im 1
+    0xfb,        // ei
+    0x81,        // loop: add a, c
+    0xaa,        // xor d
+    0x93,        // sub e
+    0x3c,        // inc a
+    0x0d,        // dec c
+    0x18, 0xf9,  // jr loop
+});
+
+// Takes the best of a few runs, as the differences are easily
+// lost in the noise of the host.
+template<typename M>
+double measure_best_mips(const bench::program &prog, count_type num_instrs) {
+    double best = 0;
+    for(unsigned i = 0; i != 5; ++i) {
+        double mips = bench::measure_mips<M>(prog, num_instrs);
+        if(mips > best)
+            best = mips;
+    }
+    return best;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    if(argc > 2)
+        bench::error("usage: interrupts [<num-instrs>]", "");
+
+    count_type num_instrs = 20000000;
+    if(argc == 2)
+        num_instrs = std::strtoull(argv[1], nullptr, 10);
+
+    double polling_mips = measure_best_mips<z80_polling>(z80_prog, num_instrs);
+    double controller_mips = measure_best_mips<z80_controller>(z80_prog,
+                                                               num_instrs);
+    std::printf("z80    %-12s polling %8.2f MIPS  controller %8.2f MIPS  "
+                "%+.1f%%\n", z80_prog.get_name(), polling_mips,
+                controller_mips, (controller_mips / polling_mips - 1) * 100);
+}
@@ -0,0 +1,57 @@
+// Measures the overhead of collecting per-address profiles.
+
+#include "bench/cpm_machine.h"
+#include "z80_profiler.h"
+
+namespace {
+
+using bench::count_type;
+
+class i8080_plain
+    : public bench::cpm_machine<z80::i8080_machine<i8080_plain>> {};
+class i8080_profiled
+    : public bench::cpm_machine<z80::profiler<
+          z80::i8080_machine<i8080_profiled>>> {};
+
+class z80_plain
+    : public bench::cpm_machine<z80::z80_machine<z80_plain>> {};
+class z80_profiled
+    : public bench::cpm_machine<z80::profiler<
+          z80::z80_machine<z80_profiled>>> {};
+
+// Takes the best of a few runs of each machine, alternating
+// between the two so that both see the same noise of the host.
+template<typename P, typename Q>
+void compare(const char *cpu, const bench::program &prog,
+             count_type num_instrs) {
+    double plain_mips = 0;
+    double profiled_mips = 0;
+    for(unsigned i = 0; i != 5; ++i) {
+        plain_mips = std::max(plain_mips,
+                              bench::measure_mips<P>(prog, num_instrs));
+        profiled_mips = std::max(profiled_mips,
+                                 bench::measure_mips<Q>(prog, num_instrs));
+    }
+    std::printf("%-6s %-12s plain %8.2f MIPS  profiled %8.2f MIPS  "
+                "%+.1f%%\n", cpu, prog.get_name(), plain_mips,
+                profiled_mips, (profiled_mips / plain_mips - 1) * 100);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    if(argc != 2 && argc != 3)
+        bench::error("usage: profiling <supplements-dir> "
+                     "[<num-instrs>]", "");
+
+    const char *dir = argv[1];
+    count_type num_instrs = 20000000;
+    if(argc == 3)
+        num_instrs = std::strtoull(argv[2], nullptr, 10);
+
+    static const bench::program i8080_prog(dir, "8080exm.com");
+    compare<i8080_plain, i8080_profiled>("i8080", i8080_prog, num_instrs);
+
+    static const bench::program z80_prog(dir, "zexall.com");
+    compare<z80_plain, z80_profiled>("z80", z80_prog, num_instrs);
+}
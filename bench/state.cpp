@@ -0,0 +1,98 @@
+// Compares the default state modules against the ones that keep
+// registers in packed register files.
+
+#include "bench/cpm_machine.h"
+
+namespace {
+
+using bench::count_type;
+using bench::program;
+
+class i8080_default
+    : public bench::cpm_machine<z80::i8080_machine<i8080_default>> {};
+class i8080_packed
+    : public bench::cpm_machine<z80::packed_i8080_machine<i8080_packed>> {};
+
+class z80_default
+    : public bench::cpm_machine<z80::z80_machine<z80_default>> {};
+class z80_packed
+    : public bench::cpm_machine<z80::packed_z80_machine<z80_packed>> {};
+
+// Register pairs only.
+const program z80_pairs("pairs", {
+    0x31, 0x00, 0xf0,        // ld sp, 0xf000
+    0x01, 0x01, 0x00,        // ld bc, 1
+    0x11, 0x02, 0x00,        // ld de, 2
+    0x09,                    // loop: add hl, bc
+    0x19,                    // add hl, de
+    0x29,                    // add hl, hl
+    0x03,                    // inc bc
+    0x1b,                    // dec de
+    0xc5,                    // push bc
+    0xd5,                    // push de
+    0xe1,                    // pop hl
+    0xc1,                    // pop bc
+    0xdd, 0x09,              // add ix, bc
+    0xfd, 0x19,              // add iy, de
+    0xed, 0x42,              // sbc hl, bc
+    0x18, 0xef,              // jr loop
+});
+
+const program i8080_pairs("pairs", {
+    0x31, 0x00, 0xf0,        // lxi sp, 0xf000
+    0x01, 0x01, 0x00,        // lxi b, 1
+    0x11, 0x02, 0x00,        // lxi d, 2
+    0x09,                    // loop: dad b
+    0x19,                    // dad d
+    0x29,                    // dad h
+    0x03,                    // inx b
+    0x1b,                    // dcx d
+    0xc5,                    // push b
+    0xd5,                    // push d
+    0xe1,                    // pop h
+    0xc1,                    // pop b
+    0xeb,                    // xchg
+    0xc3, 0x09, 0x01,        // jmp loop
+});
+
+// Takes the best of a few runs, as the differences are easily
+// lost in the noise of the host.
+template<typename M>
+double measure_best_mips(const program &prog, count_type num_instrs) {
+    double best = 0;
+    for(unsigned i = 0; i != 5; ++i) {
+        double mips = bench::measure_mips<M>(prog, num_instrs);
+        if(mips > best)
+            best = mips;
+    }
+    return best;
+}
+
+template<typename D, typename P>
+void compare(const char *cpu, const program &prog, count_type num_instrs) {
+    double default_mips = measure_best_mips<D>(prog, num_instrs);
+    double packed_mips = measure_best_mips<P>(prog, num_instrs);
+    std::printf("%-6s %-12s default %8.2f MIPS  packed %8.2f MIPS  "
+                "%+.1f%%\n", cpu, prog.get_name(), default_mips,
+                packed_mips, (packed_mips / default_mips - 1) * 100);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    if(argc != 2 && argc != 3)
+        bench::error("usage: state <supplements-dir> [<num-instrs>]", "");
+
+    const char *dir = argv[1];
+    count_type num_instrs = 20000000;
+    if(argc == 3)
+        num_instrs = std::strtoull(argv[2], nullptr, 10);
+
+    static const program i8080_mix(dir, "8080exm.com");
+    compare<i8080_default, i8080_packed>("i8080", i8080_pairs, num_instrs);
+    compare<i8080_default, i8080_packed>("i8080", i8080_mix, num_instrs);
+
+    static const program z80_mix(dir, "zexall.com");
+    compare<z80_default, z80_packed>("z80", z80_pairs, num_instrs);
+    compare<z80_default, z80_packed>("z80", z80_mix, num_instrs);
+}
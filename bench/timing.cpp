@@ -0,0 +1,48 @@
+// Compares reporting ticks on every machine cycle against
+// reporting them once per instruction.
+
+#include "bench/cpm_machine.h"
+
+namespace {
+
+using bench::count_type;
+
+class i8080_cycles
+    : public bench::cpm_machine<z80::i8080_machine<i8080_cycles>> {};
+class i8080_instrs
+    : public bench::cpm_machine<z80::instr_ticks<
+          z80::i8080_machine<i8080_instrs>>> {};
+
+class z80_cycles
+    : public bench::cpm_machine<z80::z80_machine<z80_cycles>> {};
+class z80_instrs
+    : public bench::cpm_machine<z80::instr_ticks<
+          z80::z80_machine<z80_instrs>>> {};
+
+template<typename C, typename I>
+void compare(const char *cpu, const bench::program &prog,
+             count_type num_instrs) {
+    double cycles_mips = bench::measure_mips<C>(prog, num_instrs);
+    double instrs_mips = bench::measure_mips<I>(prog, num_instrs);
+    std::printf("%-6s %-12s per-cycle %8.2f MIPS  per-instr %8.2f MIPS  "
+                "%+.1f%%\n", cpu, prog.get_name(), cycles_mips,
+                instrs_mips, (instrs_mips / cycles_mips - 1) * 100);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    if(argc != 2 && argc != 3)
+        bench::error("usage: timing <supplements-dir> [<num-instrs>]", "");
+
+    const char *dir = argv[1];
+    count_type num_instrs = 50000000;
+    if(argc == 3)
+        num_instrs = std::strtoull(argv[2], nullptr, 10);
+
+    static const bench::program i8080_prog(dir, "8080exm.com");
+    compare<i8080_cycles, i8080_instrs>("i8080", i8080_prog, num_instrs);
+
+    static const bench::program z80_prog(dir, "zexall.com");
+    compare<z80_cycles, z80_instrs>("z80", z80_prog, num_instrs);
+}
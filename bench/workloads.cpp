@@ -0,0 +1,291 @@
+// Runs a fixed set of workloads, reports the rates in JSON and
+// compares them against a baseline.
+//
+//   workloads [--output <file>] [--baseline <file>]
+//             [--threshold <percent>] [--instrs <n>] [--repeat <n>]
+//             <supplements-dir>
+//
+// Results are written one per line, so outputs can be used as
+// baselines. Exits with a non-zero code if any of the workloads
+// has run slower than its baseline by more than the threshold.
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bench/cpm_machine.h"
+
+namespace {
+
+using bench::count_type;
+using bench::measurement;
+using bench::program;
+
+class i8080_machine
+    : public bench::cpm_machine<z80::i8080_machine<i8080_machine>> {};
+class z80_machine
+    : public bench::cpm_machine<z80::z80_machine<z80_machine>> {};
+
+// Workloads start at 0x100 and loop forever.
+const program z80_alu("alu", {
+    0x06, 0x00,              // ld b, 0
+    0x81,                    // loop: add a, c
+    0xaa,                    // xor d
+    0x93,                    // sub e
+    0xa4,                    // and h
+    0xb5,                    // or l
+    0x88,                    // adc a, b
+    0x99,                    // sbc a, c
+    0xba,                    // cp d
+    0x3c,                    // inc a
+    0x0d,                    // dec c
+    0x10, 0xf4,              // djnz loop
+    0x18, 0xf0,              // jr 0x100
+});
+
+const program z80_block_moves("block_moves", {
+    0x21, 0x00, 0x80,        // ld hl, 0x8000
+    0x11, 0x00, 0x90,        // ld de, 0x9000
+    0x01, 0x00, 0x08,        // ld bc, 0x0800
+    0xed, 0xb0,              // ldir
+    0x18, 0xf3,              // jr 0x100
+});
+
+const program z80_index_regs("index_regs", {
+    0xdd, 0x21, 0x00, 0x80,  // ld ix, 0x8000
+    0xfd, 0x21, 0x00, 0x90,  // ld iy, 0x9000
+    0x06, 0x00,              // ld b, 0
+    0xdd, 0x7e, 0x01,        // loop: ld a, (ix + 1)
+    0xfd, 0x86, 0x02,        // add a, (iy + 2)
+    0xdd, 0x77, 0x03,        // ld (ix + 3), a
+    0xdd, 0x23,              // inc ix
+    0xfd, 0x23,              // inc iy
+    0x10, 0xf1,              // djnz loop
+    0x18, 0xe5,              // jr 0x100
+});
+
+const program z80_bit_ops("bit_ops", {
+    0x21, 0x00, 0x80,        // ld hl, 0x8000
+    0xcb, 0x00,              // loop: rlc b
+    0xcb, 0x59,              // bit 3, c
+    0xcb, 0xca,              // set 1, d
+    0xcb, 0x93,              // res 2, e
+    0xcb, 0x3c,              // srl h
+    0xcb, 0x1d,              // rr l
+    0xcb, 0x7e,              // bit 7, (hl)
+    0xdd, 0xcb, 0x01, 0x46,  // bit 0, (ix + 1)
+    0x18, 0xec,              // jr loop
+});
+
+const program z80_calls("calls", {
+    0x31, 0x00, 0xf0,        // ld sp, 0xf000
+    0xcd, 0x0b, 0x01,        // loop: call f
+    0xcd, 0x0b, 0x01,        // call f
+    0x18, 0xf8,              // jr loop
+    0xc5,                    // f: push bc
+    0xc1,                    // pop bc
+    0xc9,                    // ret
+});
+
+const program i8080_alu("alu", {
+    0x06, 0x00,              // mvi b, 0
+    0x81,                    // loop: add c
+    0xaa,                    // xra d
+    0x93,                    // sub e
+    0xa4,                    // ana h
+    0xb5,                    // ora l
+    0x88,                    // adc b
+    0x99,                    // sbb c
+    0xba,                    // cmp d
+    0x3c,                    // inr a
+    0x0d,                    // dcr c
+    0x05,                    // dcr b
+    0xc2, 0x02, 0x01,        // jnz loop
+    0xc3, 0x00, 0x01,        // jmp 0x100
+});
+
+const program i8080_block_moves("block_moves", {
+    0x21, 0x00, 0x80,        // lxi h, 0x8000
+    0x11, 0x00, 0x90,        // lxi d, 0x9000
+    0x01, 0x00, 0x08,        // lxi b, 0x0800
+    0x7e,                    // loop: mov a, m
+    0x12,                    // stax d
+    0x23,                    // inx h
+    0x13,                    // inx d
+    0x0b,                    // dcx b
+    0x78,                    // mov a, b
+    0xb1,                    // ora c
+    0xc2, 0x09, 0x01,        // jnz loop
+    0xc3, 0x00, 0x01,        // jmp 0x100
+});
+
+const program i8080_calls("calls", {
+    0x31, 0x00, 0xf0,        // lxi sp, 0xf000
+    0xcd, 0x0c, 0x01,        // loop: call f
+    0xcd, 0x0c, 0x01,        // call f
+    0xc3, 0x03, 0x01,        // jmp loop
+    0xc5,                    // f: push b
+    0xc1,                    // pop b
+    0xc9,                    // ret
+});
+
+struct result {
+    std::string cpu;
+    std::string workload;
+    double mips;
+    double mhz;
+    double ns_per_instr;
+};
+
+struct options {
+    const char *output = nullptr;
+    const char *baseline = nullptr;
+    double threshold = 20;
+    count_type num_instrs = 20000000;
+    unsigned repeat = 3;
+    const char *dir = nullptr;
+};
+
+// Takes the best of a few runs, as slower ones are due to the
+// noise of the host.
+template<typename M>
+result run(const char *cpu, const program &prog, const options &opts) {
+    measurement best = bench::measure<M>(prog, opts.num_instrs);
+    for(unsigned i = 1; i < opts.repeat; ++i) {
+        measurement m = bench::measure<M>(prog, opts.num_instrs);
+        if(m.get_mips() > best.get_mips())
+            best = m;
+    }
+    result r = {cpu, prog.get_name(), best.get_mips(), best.get_mhz(),
+                best.get_ns_per_instr()};
+    std::fprintf(stderr, "%-6s %-12s %8.2f MIPS %8.2f MHz %8.2f ns\n",
+                 cpu, prog.get_name(), r.mips, r.mhz, r.ns_per_instr);
+    return r;
+}
+
+void write_results(std::FILE *f, const std::vector<result> &results) {
+    std::fprintf(f, "[\n");
+    for(std::size_t i = 0; i != results.size(); ++i) {
+        const result &r = results[i];
+        std::fprintf(f, "  {\"cpu\": \"%s\", \"workload\": \"%s\", "
+                        "\"mips\": %.2f, \"mhz\": %.2f, "
+                        "\"ns_per_instr\": %.2f}%s\n",
+                     r.cpu.c_str(), r.workload.c_str(), r.mips, r.mhz,
+                     r.ns_per_instr, i + 1 == results.size() ? "" : ",");
+    }
+    std::fprintf(f, "]\n");
+}
+
+// Reads results in the format write_results() produces.
+std::vector<result> read_results(const char *path) {
+    std::FILE *f = std::fopen(path, "r");
+    if(!f)
+        bench::error("cannot open ", path);
+    std::vector<result> results;
+    char line[1024];
+    while(std::fgets(line, sizeof(line), f)) {
+        char cpu[32], workload[32];
+        result r;
+        if(std::sscanf(line, " {\"cpu\": \"%31[^\"]\", "
+                             "\"workload\": \"%31[^\"]\", "
+                             "\"mips\": %lf, \"mhz\": %lf, "
+                             "\"ns_per_instr\": %lf",
+                       cpu, workload, &r.mips, &r.mhz,
+                       &r.ns_per_instr) != 5)
+            continue;
+        r.cpu = cpu;
+        r.workload = workload;
+        results.push_back(r);
+    }
+    std::fclose(f);
+    return results;
+}
+
+// Returns the number of regressions.
+unsigned compare(const std::vector<result> &results,
+                 const std::vector<result> &baseline, double threshold) {
+    unsigned num_regressions = 0;
+    for(const result &r : results) {
+        for(const result &b : baseline) {
+            if(r.cpu != b.cpu || r.workload != b.workload)
+                continue;
+            double change = (r.mips / b.mips - 1) * 100;
+            bool is_regression = change < -threshold;
+            std::fprintf(stderr, "%-6s %-12s %8.2f MIPS, baseline %8.2f "
+                                 "MIPS, %+6.1f%%%s\n",
+                         r.cpu.c_str(), r.workload.c_str(), r.mips, b.mips,
+                         change, is_regression ? "  REGRESSION" : "");
+            num_regressions += is_regression;
+        }
+    }
+    return num_regressions;
+}
+
+[[noreturn]] void usage() {
+    bench::error("usage: workloads [--output <file>] "
+                 "[--baseline <file>] [--threshold <percent>] "
+                 "[--instrs <n>] [--repeat <n>] <supplements-dir>", "");
+}
+
+options parse_options(int argc, char *argv[]) {
+    options opts;
+    for(int i = 1; i != argc; ++i) {
+        const char *arg = argv[i];
+        if(arg[0] != '-') {
+            if(opts.dir)
+                usage();
+            opts.dir = arg;
+            continue;
+        }
+        if(i + 1 == argc)
+            usage();
+        const char *value = argv[++i];
+        if(std::strcmp(arg, "--output") == 0)
+            opts.output = value;
+        else if(std::strcmp(arg, "--baseline") == 0)
+            opts.baseline = value;
+        else if(std::strcmp(arg, "--threshold") == 0)
+            opts.threshold = std::strtod(value, nullptr);
+        else if(std::strcmp(arg, "--instrs") == 0)
+            opts.num_instrs = std::strtoull(value, nullptr, 10);
+        else if(std::strcmp(arg, "--repeat") == 0)
+            opts.repeat = static_cast<unsigned>(std::strtoul(value, nullptr,
+                                                             10));
+        else
+            usage();
+    }
+    if(!opts.dir)
+        usage();
+    return opts;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    options opts = parse_options(argc, argv);
+
+    static const program z80_mix(opts.dir, "zexall.com");
+    static const program i8080_mix(opts.dir, "8080exm.com");
+
+    std::vector<result> results;
+    for(const program *prog : {&z80_alu, &z80_block_moves, &z80_index_regs,
+                               &z80_bit_ops, &z80_calls, &z80_mix})
+        results.push_back(run<z80_machine>("z80", *prog, opts));
+    for(const program *prog : {&i8080_alu, &i8080_block_moves, &i8080_calls,
+                               &i8080_mix})
+        results.push_back(run<i8080_machine>("i8080", *prog, opts));
+
+    if(opts.output) {
+        std::FILE *f = std::fopen(opts.output, "w");
+        if(!f)
+            bench::error("cannot create ", opts.output);
+        write_results(f, results);
+        std::fclose(f);
+    } else {
+        write_results(stdout, results);
+    }
+
+    if(opts.baseline &&
+           compare(results, read_results(opts.baseline), opts.threshold))
+        return EXIT_FAILURE;
+}
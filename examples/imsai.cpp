@@ -1,4 +1,5 @@
 #include "z80.h"
+#include "z80_trace.h"
 #include <iostream>
 #include "TMS5501.h"
 #include "8251Uart.h"
@@ -17,6 +18,10 @@ I8251Uart THE_UART(0x2);
 TMS5501 TMSCHA(0x10, true);
 TMS5501 TMSCHB(0x20);
 
+// Global so that the trace is completed on every exit() path.
+z80::trace_writer THE_TRACE;
+static volatile sig_atomic_t interrupted = 0;
+
 //#define DEBUG
 
 #define TOTAL_MEM   40 * 1024
@@ -296,11 +301,14 @@ void enableRawMode() {
 }
 
 extern "C" void cleanup(int) {
-  exit(0);
+  // Writing the trace is not safe in a signal handler, so the
+  // main loop exits instead.
+  interrupted = 1;
 }
 
 extern "C" void beforeExit(void) {
   puts("Dying...\n");
+  THE_TRACE.close();
   disableRawMode();
 }
 
@@ -340,7 +348,11 @@ int main(int argc, char **argv) {
 
   fclose(file);
 
-  FILE *pc_file = fopen("pc_list.txt", "w");
+  // Use z80trace to print the trace.
+  if (!THE_TRACE.open("trace.z80t")) {
+    std::fprintf(stderr, "Cannot open the trace file\n");
+    return 1;
+  }
 
   for (e.cycle = 0;;) {
     e.on_step();
@@ -349,16 +361,16 @@ int main(int argc, char **argv) {
       std::fprintf(stderr, "PC has ran off at @ 0x%04lx", e.get_pc());
       exit(-1);
     }
-    fprintf(pc_file, "%lu\n", (uint64_t) e.get_pc());
-
-    fflush(pc_file);
+    THE_TRACE.record_instr(e.cycle, e.get_pc());
 
     if (e.is_halted()) {
       std::printf("Halted after %zu cycles\n", e.cycle);
       break;
     }
+    if (interrupted)
+      exit(0);
   }
 
-  fclose(pc_file);
+  THE_TRACE.close();
 
 }
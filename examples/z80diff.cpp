@@ -0,0 +1,151 @@
+// Finds the first difference between two execution traces and
+// prints the instructions around it. Instructions are
+// disassembled if the image of the memory they were executed
+// from is given.
+//
+//   z80diff <trace-a> <trace-b> [<image> [<load-addr>]]
+
+#include "z80_diff.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::fast_u64;
+using z80::least_u8;
+using z80::trace_record;
+using z80::trace_record_kind;
+
+namespace {
+
+class disasm : public z80::z80_disasm<disasm> {
+public:
+    typedef z80::z80_disasm<disasm> base;
+
+    explicit disasm(const least_u8 *image)
+        : image(image)
+    {}
+
+    const char *disassemble(fast_u16 addr) {
+        this->addr = addr;
+        output[0] = '\0';
+
+        // Skip prefixes.
+        base::on_disassemble();
+        while(base::get_iregp_kind() != z80::iregp::hl)
+            base::on_disassemble();
+        return output;
+    }
+
+    fast_u8 on_read_next_byte() {
+        fast_u8 n = image[addr];
+        addr = z80::inc16(addr);
+        return n;
+    }
+
+    void on_emit(const char *out) {
+        std::snprintf(output, sizeof(output), "%s", out);
+    }
+
+private:
+    const least_u8 *image;
+    fast_u16 addr = 0;
+    char output[32];
+};
+
+least_u8 image[z80::address_space_size];
+bool has_image = false;
+
+void print_record(const char *prefix, const trace_record &r) {
+    switch(r.kind) {
+    case trace_record_kind::instr:
+        std::printf("%s%llu %llu %04x", prefix,
+                    static_cast<unsigned long long>(r.num_instrs - 1),
+                    static_cast<unsigned long long>(r.ticks),
+                    static_cast<unsigned>(r.pc));
+        if(has_image) {
+            disasm d(image);
+            std::printf("  %s", d.disassemble(r.pc));
+        }
+        std::printf("\n");
+        break;
+    case trace_record_kind::regs:
+        std::printf("%s  regs", prefix);
+        for(unsigned i = 0; i != r.num_regs; ++i)
+            std::printf(" %04x", static_cast<unsigned>(r.regs[i]));
+        std::printf("\n");
+        break;
+    case trace_record_kind::read:
+    case trace_record_kind::write:
+        std::printf("%s  %s %04x %02x\n", prefix,
+                    r.kind == trace_record_kind::read ? "read" : "write",
+                    static_cast<unsigned>(r.addr),
+                    static_cast<unsigned>(r.value));
+        break;
+    }
+}
+
+// Prints records of the specified instructions.
+void print_records(const char *prefix, z80::trace_reader &reader,
+                   fast_u64 from, fast_u64 to) {
+    if(!reader.seek_to_instr(from))
+        return;
+    trace_record r;
+    while(reader.read(r) && r.num_instrs <= to)
+        print_record(prefix, r);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    if(argc < 3 || argc > 5) {
+        std::fprintf(stderr, "usage: z80diff <trace-a> <trace-b> "
+                             "[<image> [<load-addr>]]\n");
+        return EXIT_FAILURE;
+    }
+
+    z80::trace_reader a, b;
+    for(int i = 1; i != 3; ++i) {
+        if(!(i == 1 ? a : b).open(argv[i])) {
+            std::fprintf(stderr, "z80diff: cannot read %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(argc >= 4) {
+        unsigned long load_addr = 0;
+        if(argc == 5)
+            load_addr = std::strtoul(argv[4], nullptr, 0);
+        std::FILE *f = std::fopen(argv[3], "rb");
+        if(!f || load_addr >= z80::address_space_size) {
+            std::fprintf(stderr, "z80diff: cannot load %s\n", argv[3]);
+            return EXIT_FAILURE;
+        }
+        has_image = std::fread(image + load_addr, 1,
+                               sizeof(image) - load_addr, f) != 0;
+        std::fclose(f);
+    }
+
+    z80::trace_divergence d;
+    bool diverged = z80::find_trace_divergence(a, b, d);
+    if(a.has_failed() || b.has_failed()) {
+        std::fprintf(stderr, "z80diff: malformed trace\n");
+        return EXIT_FAILURE;
+    }
+    if(!diverged) {
+        std::printf("traces match, %llu instructions\n",
+                    static_cast<unsigned long long>(a.get_num_instrs()));
+        return EXIT_SUCCESS;
+    }
+
+    // Show a few instructions before the divergence and then both
+    // sides of it.
+    const fast_u64 window = 8;
+    std::printf("traces diverge at instruction %llu\n",
+                static_cast<unsigned long long>(d.instr));
+    fast_u64 from = d.instr < window ? 0 : d.instr - window;
+    print_records("  ", a, from, d.instr);
+    std::printf("a:\n");
+    print_records("  ", a, d.instr, d.instr + window / 2);
+    std::printf("b:\n");
+    print_records("  ", b, d.instr, d.instr + window / 2);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,66 @@
+// Prints records of execution traces written by trace_writer.
+//
+//   z80trace <trace> [<from-tick> [<num-instrs>]]
+
+#include "z80_trace.h"
+
+using z80::trace_record;
+using z80::trace_record_kind;
+
+int main(int argc, char *argv[]) {
+    if(argc < 2 || argc > 4) {
+        std::fprintf(stderr, "usage: z80trace <trace> [<from-tick> "
+                             "[<num-instrs>]]\n");
+        return EXIT_FAILURE;
+    }
+
+    z80::trace_reader reader;
+    if(!reader.open(argv[1])) {
+        std::fprintf(stderr, "z80trace: cannot read %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    std::printf("# %llu instructions in %llu blocks\n",
+                static_cast<unsigned long long>(reader.get_num_instrs()),
+                static_cast<unsigned long long>(reader.get_num_blocks()));
+
+    if(argc >= 3 && !reader.seek_to_ticks(std::strtoull(argv[2], nullptr, 10))) {
+        std::fprintf(stderr, "z80trace: cannot seek\n");
+        return EXIT_FAILURE;
+    }
+
+    unsigned long long num_instrs = static_cast<unsigned long long>(-1);
+    if(argc >= 4)
+        num_instrs = std::strtoull(argv[3], nullptr, 10);
+
+    trace_record r;
+    while(reader.read(r)) {
+        switch(r.kind) {
+        case trace_record_kind::instr:
+            if(num_instrs-- == 0)
+                return EXIT_SUCCESS;
+            std::printf("%llu %llu %04x\n",
+                        static_cast<unsigned long long>(r.num_instrs - 1),
+                        static_cast<unsigned long long>(r.ticks),
+                        static_cast<unsigned>(r.pc));
+            break;
+        case trace_record_kind::regs:
+            std::printf("  regs");
+            for(unsigned i = 0; i != r.num_regs; ++i)
+                std::printf(" %04x", static_cast<unsigned>(r.regs[i]));
+            std::printf("\n");
+            break;
+        case trace_record_kind::read:
+        case trace_record_kind::write:
+            std::printf("  %s %04x %02x\n",
+                        r.kind == trace_record_kind::read ? "read" : "write",
+                        static_cast<unsigned>(r.addr),
+                        static_cast<unsigned>(r.value));
+            break;
+        }
+    }
+
+    if(reader.has_failed()) {
+        std::fprintf(stderr, "z80trace: malformed trace\n");
+        return EXIT_FAILURE;
+    }
+}
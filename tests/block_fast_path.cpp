@@ -0,0 +1,297 @@
+// Test that running repeated block instructions in bulk gives
+// the same results as executing their iterations one by one.
+
+#include <vector>
+
+#include "z80.h"
+#include "testing.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::fast_u32;
+using z80::least_u8;
+using testing::check;
+using testing::error;
+
+namespace {
+
+template<typename B>
+class machine : public testing::machine<B> {
+public:
+    typedef testing::machine<B> base;
+    typedef typename base::ticks_type ticks_type;
+
+    // A device that produces a sequence of bytes and records
+    // all transfers.
+    fast_u8 on_input(fast_u16 port) {
+        return input(base::get_ticks(), port);
+    }
+
+    void on_output(fast_u16 port, fast_u8 n) {
+        transfers.push_back({base::get_ticks(), port, n});
+    }
+
+    bool on_input_block(fast_u16 port, least_u8 *bytes, fast_u32 n,
+                        ticks_type tick) {
+        for(fast_u32 i = 0; i != n; ++i)
+            bytes[i] = static_cast<least_u8>(
+                input(tick + i * 21, get_port(port, i)));
+        return true;
+    }
+
+    bool on_output_block(fast_u16 port, const least_u8 *bytes, fast_u32 n,
+                         ticks_type tick) {
+        for(fast_u32 i = 0; i != n; ++i)
+            transfers.push_back({tick + i * 21, get_port(port, i), bytes[i]});
+        return true;
+    }
+
+    // Records the state in which a scheduled handler is called.
+    // Handlers are called in the middle of instructions, so this
+    // is the state left by the previous iteration.
+    static void record(typename base::derived &m, void *context) {
+        z80::unused(context);
+        m.calls.push_back({m.get_ticks(), m.get_af(), m.get_bc(),
+                           m.get_de(), m.get_hl(), m.get_wz(),
+                           m.get_ir()});
+    }
+
+    struct call {
+        ticks_type tick;
+        fast_u16 af, bc, de, hl, wz, ir;
+    };
+
+    struct transfer {
+        ticks_type tick;
+        fast_u16 port;
+        fast_u8 value;
+    };
+
+    std::vector<call> calls;
+    std::vector<transfer> transfers;
+    fast_u8 next_input = 0;
+    fast_u8 input_step = 0;
+
+private:
+    // Every next byte of a block goes to the port with B one
+    // less.
+    static fast_u16 get_port(fast_u16 port, fast_u32 i) {
+        return z80::sub16(port, static_cast<fast_u16>(i << 8));
+    }
+
+    fast_u8 input(ticks_type tick, fast_u16 port) {
+        fast_u8 n = next_input;
+        next_input = z80::add8(next_input, input_step);
+        transfers.push_back({tick, port, n});
+        return n;
+    }
+};
+
+class plain : public machine<z80::z80_machine<plain>> {};
+class fast
+    : public machine<z80::block_fast_path<z80::z80_machine<fast>>> {};
+
+class mapped_plain : public machine<z80::memory_map<
+    z80::machine_state<z80::z80_cpu<mapped_plain>>>> {};
+class mapped_fast : public machine<z80::block_fast_path<z80::memory_map<
+    z80::machine_state<z80::z80_cpu<mapped_fast>>>>> {};
+
+struct test_case {
+    const char *name;
+    fast_u8 op;
+    fast_u16 pc, bc, de, hl;
+    fast_u8 a, f;
+    fast_u16 fill_addr;
+    fast_u32 fill_size;
+    fast_u8 fill_value;
+    fast_u8 match_value;
+    fast_u16 match_addr;
+    unsigned long event_tick;
+    fast_u8 input_start, input_step;
+};
+
+template<typename A, typename B>
+void check_same_state(const A &a, const B &b, const char *name) {
+    check(a.get_pc() == b.get_pc() && a.get_af() == b.get_af() &&
+              a.get_bc() == b.get_bc() && a.get_de() == b.get_de() &&
+              a.get_hl() == b.get_hl() && a.get_wz() == b.get_wz() &&
+              a.get_ir() == b.get_ir() && a.is_halted() == b.is_halted(),
+          "registers differ", name);
+    check(a.get_ticks() == b.get_ticks(), "ticks differ", name);
+    for(fast_u32 addr = 0; addr != z80::address_space_size; ++addr) {
+        if(a.read(static_cast<fast_u16>(addr)) !=
+               b.read(static_cast<fast_u16>(addr)))
+            error("memory differs", name);
+    }
+    check(a.transfers.size() == b.transfers.size(), "transfers differ", name);
+    for(std::size_t i = 0; i != a.transfers.size(); ++i) {
+        check(a.transfers[i].tick == b.transfers[i].tick &&
+                  a.transfers[i].port == b.transfers[i].port &&
+                  a.transfers[i].value == b.transfers[i].value,
+              "transfers differ", name);
+    }
+    check(a.calls.size() == b.calls.size(), "handler calls differ", name);
+    for(std::size_t i = 0; i != a.calls.size(); ++i) {
+        const auto &x = a.calls[i], &y = b.calls[i];
+        check(x.tick == y.tick && x.af == y.af && x.bc == y.bc &&
+                  x.de == y.de && x.hl == y.hl && x.wz == y.wz &&
+                  x.ir == y.ir,
+              "handler calls differ", name);
+    }
+}
+
+template<typename M>
+void set_up(M &m, const test_case &t) {
+    for(fast_u32 i = 0; i != t.fill_size; ++i)
+        m.write(z80::add16(t.fill_addr, static_cast<fast_u16>(i)),
+                t.fill_value);
+    m.write(t.match_addr, t.match_value);
+    m.write(t.pc, 0xed);
+    m.write(z80::add16(t.pc, 1), t.op);
+    m.write(z80::add16(t.pc, 2), 0x76);  // halt
+    m.set_pc(t.pc);
+    m.set_bc(t.bc);
+    m.set_de(t.de);
+    m.set_hl(t.hl);
+    m.set_a(t.a);
+    m.set_f(t.f);
+    m.set_r(0xfe);
+    m.set_is_halted(false);
+    m.next_input = t.input_start;
+    m.input_step = t.input_step;
+    if(t.event_tick)
+        m.schedule(m.get_ticks() + t.event_tick, &M::record);
+}
+
+template<typename M>
+void run(M &m) {
+    for(unsigned long i = 0; i != 0x100000 && !m.is_halted(); ++i)
+        m.on_step();
+}
+
+template<typename P, typename F>
+void test(P &p, F &f, const test_case &t, bool expect_bulk) {
+    set_up(p, t);
+    set_up(f, t);
+    run(p);
+    run(f);
+    check(p.is_halted(), "the instruction does not end", t.name);
+    check_same_state(p, f, t.name);
+    if(expect_bulk)
+        check(f.num_steps < p.num_steps / 2, "iterations are not run in bulk",
+              t.name);
+}
+
+const fast_u8 ldir = 0xb0, lddr = 0xb8, cpir = 0xb1, cpdr = 0xb9;
+const fast_u8 inir = 0xb2, indr = 0xba, otir = 0xb3, otdr = 0xbb;
+
+const test_case cases[] = {
+    // name              op    pc      bc      de      hl      a     f
+    //   fill_addr fill_size fill_value match_value match_addr event_tick
+    //   input_start input_step
+    {"ldir",             ldir, 0x0100, 0x1000, 0x8000, 0x4000, 0x12, 0xff,
+     0x4000, 0x1000, 0x5a, 0x5a, 0x4000, 0, 0x00, 0x01},
+    {"lddr",             lddr, 0x0100, 0x1000, 0x8fff, 0x4fff, 0x34, 0x00,
+     0x4000, 0x1000, 0xa5, 0xa5, 0x4000, 0, 0x00, 0x01},
+    {"ldir fill",        ldir, 0x0100, 0x0800, 0x4001, 0x4000, 0x00, 0xc1,
+     0x4000, 0x0001, 0x3c, 0x3c, 0x4000, 0, 0x00, 0x01},
+    {"ldir pattern",     ldir, 0x0100, 0x0800, 0x4003, 0x4000, 0x00, 0xc1,
+     0x4000, 0x0001, 0x3c, 0x3c, 0x4000, 0, 0x00, 0x01},
+    {"lddr fill",        lddr, 0x0100, 0x0800, 0x47fe, 0x47ff, 0x00, 0x00,
+     0x47ff, 0x0001, 0x81, 0x81, 0x47ff, 0, 0x00, 0x01},
+    {"ldir wrap",        ldir, 0x0100, 0x0400, 0x2000, 0xfe80, 0x55, 0x00,
+     0xfe80, 0x0180, 0x11, 0x11, 0xfe80, 0, 0x00, 0x01},
+    {"lddr wrap",        lddr, 0x8000, 0x0400, 0x0100, 0x6000, 0x55, 0x00,
+     0x5c00, 0x0400, 0x22, 0x22, 0x5c00, 0, 0x00, 0x01},
+    {"ldir 64k",         ldir, 0x0100, 0x0000, 0x0000, 0x0000, 0x00, 0x00,
+     0x0000, 0x0000, 0x00, 0x00, 0x0000, 0, 0x00, 0x01},
+    {"ldir over code",   ldir, 0x8000, 0x0200, 0x7f00, 0x9000, 0x00, 0x00,
+     0x9000, 0x0200, 0x00, 0x00, 0x9000, 0, 0x00, 0x01},
+    {"ldir event",       ldir, 0x0100, 0x1000, 0x8000, 0x4000, 0x00, 0x00,
+     0x4000, 0x1000, 0x77, 0x77, 0x4000, 30000, 0x00, 0x01},
+    {"cpir found",       cpir, 0x0100, 0x1000, 0x0000, 0x4000, 0x42, 0x01,
+     0x4000, 0x1000, 0x00, 0x42, 0x4abc, 0, 0x00, 0x01},
+    {"cpir not found",   cpir, 0x0100, 0x1000, 0x0000, 0x4000, 0x42, 0x00,
+     0x4000, 0x1000, 0x80, 0x80, 0x4000, 0, 0x00, 0x01},
+    {"cpir half carry",  cpir, 0x0100, 0x0300, 0x0000, 0x4000, 0x10, 0x00,
+     0x4000, 0x0300, 0x0f, 0x10, 0x42ff, 0, 0x00, 0x01},
+    {"cpdr found",       cpdr, 0x0100, 0x1000, 0x0000, 0x4fff, 0x42, 0x01,
+     0x4000, 0x1000, 0x00, 0x42, 0x4123, 0, 0x00, 0x01},
+    {"cpir wrap",        cpir, 0x0100, 0x0400, 0x0000, 0xff00, 0x99, 0x00,
+     0xff00, 0x0100, 0x00, 0x99, 0x0050, 0, 0x00, 0x01},
+    {"cpir 64k",         cpir, 0x0100, 0x0000, 0x0000, 0x0200, 0xed, 0x00,
+     0x0000, 0x0000, 0x00, 0x00, 0x0000, 0, 0x00, 0x01},
+    {"inir",             inir, 0x0100, 0x8012, 0x0000, 0x4000, 0x00, 0x00,
+     0x4000, 0x0000, 0x00, 0x00, 0x4000, 0, 0x70, 0x03},
+    {"indr",             indr, 0x0100, 0x0034, 0x0000, 0x40ff, 0x00, 0x00,
+     0x4000, 0x0000, 0x00, 0x00, 0x4000, 0, 0x00, 0x01},
+    {"otir",             otir, 0x0100, 0xc0fe, 0x0000, 0x4000, 0x00, 0x00,
+     0x4000, 0x0100, 0x9c, 0x01, 0x4040, 0, 0x00, 0x00},
+    {"otdr wrap",        otdr, 0x8000, 0x4001, 0x0000, 0x0010, 0x00, 0x00,
+     0xffd0, 0x0040, 0x33, 0xff, 0x0000, 0, 0x00, 0x00},
+    {"inir over code",   inir, 0x4040, 0x8000, 0x0000, 0x4000, 0x00, 0x00,
+     0x4000, 0x0000, 0x00, 0x00, 0x4000, 0, 0x00, 0x00},
+    {"indr event",       indr, 0x0100, 0xf0a7, 0x0000, 0x48ff, 0x00, 0x00,
+     0x4000, 0x0000, 0x00, 0x00, 0x4000, 2000, 0x10, 0x07},
+    {"otir event",       otir, 0x0100, 0xff00, 0x0000, 0x4000, 0x00, 0x00,
+     0x4000, 0x0000, 0x00, 0x00, 0x4000, 1000, 0x00, 0x00},
+    {"cpdr event",       cpdr, 0x0100, 0x2000, 0x0000, 0x7fff, 0x42, 0x00,
+     0x6000, 0x2000, 0x00, 0x00, 0x6000, 20001, 0x00, 0x01},
+};
+
+// A breakpoint at the instruction stops every iteration.
+void test_breakpoint() {
+    const char *name = "breakpoint";
+    static plain p;
+    static fast f;
+    const test_case t = {name, ldir, 0x0100, 0x1000, 0x8000, 0x4000, 0x00,
+                         0x00, 0x4000, 0x1000, 0x5a, 0x5a, 0x4000, 0, 0x00,
+                         0x01};
+    set_up(p, t);
+    set_up(f, t);
+    p.set_breakpoint(0x0100);
+    f.set_breakpoint(0x0100);
+    p.on_run();
+    f.on_run();
+    check_same_state(p, f, name);
+    check(f.get_bc() == 0x0fff, "more than one iteration is run", name);
+}
+
+// Iterations stop at pages that are not plain RAM.
+void test_memory_map() {
+    const char *name = "memory map";
+    static least_u8 ram[2][0x8000];
+    static least_u8 rom[0x100];
+    static mapped_plain p;
+    static mapped_fast f;
+    p.map_ram(0x0000, 0x8000, ram[0]);
+    f.map_ram(0x0000, 0x8000, ram[1]);
+    p.map_rom(0x5000, sizeof(rom), rom);
+    f.map_rom(0x5000, sizeof(rom), rom);
+    p.map_mmio(0x5800, 0x100);
+    f.map_mmio(0x5800, 0x100);
+    const test_case t = {name, ldir, 0x0100, 0x1000, 0x4800, 0x2000, 0x00,
+                         0x00, 0x2000, 0x1000, 0x66, 0x66, 0x2000, 0, 0x00,
+                         0x01};
+    test(p, f, t, /* expect_bulk= */ true);
+}
+
+}  // anonymous namespace
+
+int main() {
+    for(const test_case &t : cases) {
+        static plain p;
+        static fast f;
+        p.reset();
+        f.reset();
+        p.calls.clear();
+        f.calls.clear();
+        p.transfers.clear();
+        f.transfers.clear();
+        p.num_steps = f.num_steps = 0;
+        bool expect_bulk = t.bc == 0 || t.bc > 0x100;
+        test(p, f, t, expect_bulk);
+    }
+    test_breakpoint();
+    test_memory_map();
+}
@@ -0,0 +1,109 @@
+// Test that CPUs instantiated without some of the features do not
+// maintain the corresponding state and otherwise execute the same
+// way.
+
+#include <initializer_list>
+
+#include "z80.h"
+#include "testing.h"
+
+using z80::cpu_features;
+using z80::fast_u16;
+using z80::least_u8;
+using testing::check;
+
+namespace {
+
+template<typename B>
+class machine : public testing::machine<B> {
+public:
+    typedef testing::machine<B> base;
+
+    void on_set_addr_bus(fast_u16 addr) {
+        z80::unused(addr);
+        ++num_addr_bus_updates;
+    }
+
+    unsigned long num_addr_bus_updates = 0;
+};
+
+class z80_full : public machine<z80::z80_machine<z80_full>> {};
+class z80_reduced
+    : public machine<z80::basic_z80_machine<z80_reduced,
+                                            cpu_features::none>> {};
+
+class i8080_full : public machine<z80::i8080_machine<i8080_full>> {};
+class i8080_reduced
+    : public machine<z80::basic_i8080_machine<i8080_reduced,
+                                              cpu_features::none>> {};
+
+template<typename F, typename R>
+void run(F &f, R &r, std::initializer_list<least_u8> code) {
+    f.load(code);
+    r.load(code);
+    f.run_for(100000);
+    r.run_for(100000);
+}
+
+template<typename F, typename R>
+void check_same_state(const F &f, const R &r, const char *name) {
+    check(f.get_ticks() == r.get_ticks(), "ticks differ", name);
+    check(f.get_pc() == r.get_pc() && f.get_af() == r.get_af() &&
+              f.get_bc() == r.get_bc() && f.get_de() == r.get_de() &&
+              f.get_hl() == r.get_hl() && f.get_sp() == r.get_sp(),
+          "registers differ", name);
+    for(fast_u16 addr = 0x8000; addr != 0x8100; ++addr)
+        check(f.read(addr) == r.read(addr), "memory differs", name);
+    check(f.num_addr_bus_updates != 0, "address bus is not set", name);
+    check(r.num_addr_bus_updates == 0, "address bus is set", name);
+}
+
+void test_z80() {
+    const char *name = "z80";
+    static z80_full f;
+    static z80_reduced r;
+    run(f, r, {
+        0x31, 0x00, 0xf0,  // ld sp, 0xf000
+        0x21, 0x00, 0x80,  // loop: ld hl, 0x8000
+        0x11, 0x80, 0x80,  // ld de, 0x8080
+        0x01, 0x40, 0x00,  // ld bc, 0x0040
+        0xed, 0xb0,        // ldir
+        0x34,              // inc (hl)
+        0xcd, 0x14, 0x00,  // call f
+        0x18, 0xef,        // jr loop
+        0xe5,              // f: push hl
+        0xe1,              // pop hl
+        0xc9,              // ret
+    });
+    check_same_state(f, r, name);
+    check(f.get_wz() != 0 && (f.get_ir() & 0x7f) != 0,
+          "WZ and R are not updated", name);
+    check(r.get_wz() == 0 && r.get_ir() == 0,
+          "WZ and R are updated", name);
+}
+
+void test_i8080() {
+    const char *name = "i8080";
+    static i8080_full f;
+    static i8080_reduced r;
+    run(f, r, {
+        0x31, 0x00, 0xf0,  // lxi sp, 0xf000
+        0x21, 0x00, 0x80,  // loop: lxi h, 0x8000
+        0x34,              // inr m
+        0x7e,              // mov a, m
+        0x32, 0x80, 0x80,  // sta 0x8080
+        0xcd, 0x11, 0x00,  // call f
+        0xc3, 0x03, 0x00,  // jmp loop
+        0xe5,              // f: push h
+        0xe1,              // pop h
+        0xc9,              // ret
+    });
+    check_same_state(f, r, name);
+}
+
+}  // anonymous namespace
+
+int main() {
+    test_z80();
+    test_i8080();
+}
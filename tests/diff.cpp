@@ -0,0 +1,128 @@
+// Test finding divergences between machines and traces.
+
+#include "z80_diff.h"
+#include "testing.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::fast_u64;
+using z80::trace_divergence;
+using z80::trace_record_kind;
+using testing::check;
+
+namespace {
+
+class machine : public testing::machine<z80::z80_machine<machine>> {
+public:
+    typedef testing::machine<z80::z80_machine<machine>> base;
+
+    machine() {
+        load({
+            0x21, 0x00, 0x80,  // ld hl, 0x8000
+            0x77,              // loop: ld (hl), a
+            0x23,              // inc hl
+            0x18, 0xfc,        // jr loop
+        });
+        set_a(0x55);
+    }
+
+    void on_write(fast_u16 addr, fast_u8 n) {
+        // A broken emulator.
+        if(is_broken && addr == 0x9000)
+            n ^= 1;
+        base::on_write(addr, n);
+    }
+
+    bool is_broken = false;
+};
+
+void check_machines() {
+    // The write to 0x9000 is done by the 4097th 'ld (hl), a'.
+    const fast_u64 diverging_instr = 1 + 3 * 0x1000;
+
+    for(fast_u64 interval : {1000, 0x10000}) {
+        std::unique_ptr<machine> a(new machine);
+        std::unique_ptr<machine> b(new machine);
+        b->is_broken = true;
+        fast_u64 instr;
+        check(z80::find_divergence(*a, *b, 100000, instr, interval),
+              "no divergence found");
+        check(instr == diverging_instr, "wrong diverging instruction");
+        check(a->get_pc() == 0x0003 && a->get_hl() == 0x9000 &&
+                  b->get_pc() == 0x0003 && b->get_hl() == 0x9000,
+              "machines are not at the diverging instruction");
+
+        // Same machines do not diverge.
+        b->is_broken = false;
+        check(!z80::find_divergence(*a, *b, 5000, instr, interval),
+              "same machines diverge");
+    }
+
+    // Internal registers are part of the state.
+    std::unique_ptr<machine> a(new machine);
+    std::unique_ptr<machine> b(new machine);
+    b->set_wz(0x1234);
+    check(z80::get_state_hash(*a) != z80::get_state_hash(*b),
+          "WZ is not hashed");
+    b->set_wz(a->get_wz());
+    b->set_is_int_disabled(true);
+    check(z80::get_state_hash(*a) != z80::get_state_hash(*b),
+          "interrupt disabling is not hashed");
+    b->set_is_int_disabled(false);
+    b->set_iregp_kind(z80::iregp::ix);
+    check(z80::get_state_hash(*a) != z80::get_state_hash(*b),
+          "index register prefix is not hashed");
+}
+
+void write_trace(const char *path, unsigned num_instrs, unsigned changed) {
+    z80::trace_writer w;
+    check(w.open(path), "cannot open a trace for writing");
+    fast_u16 pc = 0;
+    for(unsigned n = 0; n != num_instrs; ++n) {
+        pc = z80::add16(pc, static_cast<fast_u16>(n % 3 + 1));
+        w.record_instr(n * 5, pc);
+        if(n % 10 == 0)
+            w.record_write(pc, static_cast<fast_u8>(n == changed ? 1 : 0));
+    }
+    check(w.close(), "cannot write a trace");
+}
+
+void check_traces() {
+    const unsigned num_instrs = 500000;
+    const unsigned changed = 400000;
+    write_trace("diff_a.z80t", num_instrs, num_instrs);
+    write_trace("diff_b.z80t", num_instrs, changed);
+    write_trace("diff_c.z80t", num_instrs, num_instrs);
+    write_trace("diff_d.z80t", num_instrs - 100, num_instrs);
+
+    z80::trace_reader a, b, c, d;
+    check(a.open("diff_a.z80t") && b.open("diff_b.z80t") &&
+              c.open("diff_c.z80t") && d.open("diff_d.z80t"),
+          "cannot open traces");
+
+    trace_divergence div;
+    check(z80::find_trace_divergence(a, b, div), "no divergence found");
+    check(div.instr == changed && div.has_a && div.has_b &&
+              div.a.kind == trace_record_kind::write && div.a.value == 0 &&
+              div.b.kind == trace_record_kind::write && div.b.value == 1,
+          "wrong divergence");
+
+    check(!z80::find_trace_divergence(a, c, div) && !a.has_failed() &&
+              !c.has_failed(),
+          "same traces diverge");
+
+    check(z80::find_trace_divergence(a, d, div), "no divergence found");
+    check(div.instr == num_instrs - 100 && div.has_a && !div.has_b,
+          "wrong divergence with a shorter trace");
+
+    for(const char *path : {"diff_a.z80t", "diff_b.z80t", "diff_c.z80t",
+                            "diff_d.z80t"})
+        std::remove(path);
+}
+
+}  // anonymous namespace
+
+int main() {
+    check_machines();
+    check_traces();
+}
@@ -0,0 +1,121 @@
+// Test that skipping repeated HALTs gives the same results as
+// executing them.
+
+#include <initializer_list>
+#include <vector>
+
+#include "z80.h"
+#include "testing.h"
+
+using z80::least_u8;
+using testing::check;
+
+namespace {
+
+template<typename B>
+class machine : public testing::machine<B> {
+public:
+    typedef testing::machine<B> base;
+    typedef typename base::ticks_type ticks_type;
+
+    std::vector<ticks_type> int_ticks;
+};
+
+// Requests an interrupt every 'period' ticks.
+template<typename B>
+class int_machine : public machine<B> {
+public:
+    typedef machine<B> base;
+    typedef typename base::ticks_type ticks_type;
+
+    void start_timer(ticks_type period) {
+        timer_period = period;
+        base::schedule(period, &int_machine::on_timer);
+    }
+
+    void on_step() {
+        if(is_int_requested && base::on_handle_active_int()) {
+            is_int_requested = false;
+            base::int_ticks.push_back(base::get_ticks());
+        }
+        base::on_step();
+    }
+
+private:
+    static void on_timer(typename base::derived &m, void *context) {
+        z80::unused(context);
+        m.is_int_requested = true;
+        m.schedule(m.get_ticks() + m.timer_period, &int_machine::on_timer);
+    }
+
+    ticks_type timer_period = 0;
+    bool is_int_requested = false;
+};
+
+class z80_plain : public int_machine<z80::z80_machine<z80_plain>> {};
+class z80_fast : public int_machine<
+    z80::halt_fast_forward<z80::z80_machine<z80_fast>>> {};
+
+class i8080_plain : public machine<z80::i8080_machine<i8080_plain>> {};
+class i8080_fast : public machine<
+    z80::halt_fast_forward<z80::i8080_machine<i8080_fast>>> {};
+
+template<typename P, typename F>
+void check_same_state(const P &p, const F &f, const char *name) {
+    check(p.get_ticks() == f.get_ticks(), "ticks differ", name);
+    check(p.get_pc() == f.get_pc() && p.get_af() == f.get_af() &&
+              p.get_sp() == f.get_sp() && p.is_halted() == f.is_halted(),
+          "registers differ", name);
+    check(p.int_ticks == f.int_ticks, "interrupts differ", name);
+    check(f.num_steps < p.num_steps / 10, "HALTs are not skipped", name);
+}
+
+void test_z80() {
+    const char *name = "z80";
+    static z80_plain p;
+    static z80_fast f;
+
+    const std::initializer_list<least_u8> main = {
+        0x31, 0x00, 0xf0,  // ld sp, 0xf000
+        0xed, 0x56,        // im 1
+        0xfb,              // ei
+        0x76,              // loop: halt
+        0x18, 0xfd,        // jr loop
+    };
+    const std::initializer_list<least_u8> isr = {
+        0x3c,              // inc a
+        0xfb,              // ei
+        0xc9,              // ret
+    };
+    p.load(main, 0x0000);
+    f.load(main, 0x0000);
+    p.load(isr, 0x0038);
+    f.load(isr, 0x0038);
+    p.start_timer(3001);
+    f.start_timer(3001);
+
+    // Frames end every 100000 ticks.
+    p.run_to(1000000);
+    f.run_to(1000000);
+    check_same_state(p, f, name);
+    check(p.get_ir() == f.get_ir(), "R differs", name);
+    check(p.int_ticks.size() > 300, "interrupts are not accepted", name);
+}
+
+void test_i8080() {
+    const char *name = "i8080";
+    static i8080_plain p;
+    static i8080_fast f;
+    p.load({0x76}, 0x0000);  // hlt
+    f.load({0x76}, 0x0000);
+    p.run_to(1000000);
+    f.run_to(1000000);
+    check_same_state(p, f, name);
+}
+
+}  // anonymous namespace
+
+int main() {
+    test_z80();
+    test_i8080();
+}
@@ -0,0 +1,203 @@
+// Test that skipping iterations of polling loops gives the same
+// results as executing them.
+
+#include <initializer_list>
+#include <vector>
+
+#include "z80.h"
+#include "testing.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::least_u8;
+using testing::check;
+
+namespace {
+
+// Port 0x10 reads the status of a device that gets ready every
+// 'period' ticks. Reading port 0x11 makes it not ready. The flag
+// at 0x9000 is set along with the status.
+template<typename B>
+class machine : public testing::machine<B> {
+public:
+    typedef testing::machine<B> base;
+    typedef typename base::ticks_type ticks_type;
+
+    void start_device(ticks_type period) {
+        device_period = period;
+        base::schedule(period, &machine::on_ready);
+    }
+
+    fast_u8 on_input(fast_u16 port) {
+        if(z80::get_low8(port) == 0x10)
+            return is_ready ? 0x01 : 0x00;
+        is_ready = false;
+        data_ticks.push_back(base::get_ticks());
+        return static_cast<fast_u8>(data_ticks.size());
+    }
+
+    std::vector<ticks_type> data_ticks;
+
+private:
+    static void on_ready(typename base::derived &m, void *context) {
+        z80::unused(context);
+        m.is_ready = true;
+        m.write(0x9000, 0x01);
+        m.schedule(m.get_ticks() + m.device_period, &machine::on_ready);
+    }
+
+    ticks_type device_period = 0;
+    bool is_ready = false;
+};
+
+class z80_plain : public machine<z80::z80_machine<z80_plain>> {};
+class z80_fast : public machine<
+    z80::idle_loop_fast_forward<z80::z80_machine<z80_fast>>> {};
+
+class i8080_plain : public machine<z80::i8080_machine<i8080_plain>> {};
+class i8080_fast : public machine<
+    z80::idle_loop_fast_forward<z80::i8080_machine<i8080_fast>>> {};
+
+template<typename P, typename F>
+void run(P &p, F &f, std::initializer_list<least_u8> code) {
+    p.load(code);
+    f.load(code);
+    p.start_device(10007);
+    f.start_device(10007);
+    p.run_to(1000000);
+    f.run_to(1000000);
+}
+
+template<typename P, typename F>
+void check_same_state(const P &p, const F &f, const char *name) {
+    check(p.get_ticks() == f.get_ticks(), "ticks differ", name);
+    check(p.get_pc() == f.get_pc() && p.get_af() == f.get_af() &&
+              p.get_bc() == f.get_bc() && p.get_hl() == f.get_hl() &&
+              p.get_sp() == f.get_sp(),
+          "registers differ", name);
+    check(p.data_ticks == f.data_ticks, "device reads differ", name);
+    for(fast_u16 addr = 0x8000; addr != 0x8100; ++addr)
+        check(p.read(addr) == f.read(addr), "memory differs", name);
+}
+
+void test_z80_port() {
+    const char *name = "z80_port";
+    static z80_plain p;
+    static z80_fast f;
+    run(p, f, {
+        0x31, 0x00, 0xf0,  // ld sp, 0xf000
+        0x21, 0x00, 0x80,  // ld hl, 0x8000
+        0xdb, 0x10,        // wait: in a, (0x10)
+        0xe6, 0x01,        // and 1
+        0x28, 0xfa,        // jr z, wait
+        0xdb, 0x11,        // in a, (0x11)
+        0x77,              // ld (hl), a
+        0x23,              // inc hl
+        0x18, 0xf4,        // jr wait
+    });
+    check_same_state(p, f, name);
+    check(p.get_ir() == f.get_ir(), "R differs", name);
+    check(p.data_ticks.size() > 90, "device is not read", name);
+    check(f.num_steps < p.num_steps / 10, "loops are not skipped", name);
+}
+
+void test_z80_memory() {
+    const char *name = "z80_memory";
+    static z80_plain p;
+    static z80_fast f;
+    run(p, f, {
+        0x31, 0x00, 0xf0,  // ld sp, 0xf000
+        0x3a, 0x00, 0x90,  // wait: ld a, (0x9000)
+        0xb7,              // or a
+        0x28, 0xfa,        // jr z, wait
+        0xaf,              // xor a
+        0x32, 0x00, 0x90,  // ld (0x9000), a
+        0x04,              // inc b
+        0x18, 0xf3,        // jr wait
+    });
+    check_same_state(p, f, name);
+    check(p.get_ir() == f.get_ir(), "R differs", name);
+    check(p.get_b() > 90, "flag is not polled", name);
+    check(f.num_steps < p.num_steps / 10, "loops are not skipped", name);
+}
+
+// Loops that write are not idle.
+void test_z80_write() {
+    const char *name = "z80_write";
+    static z80_plain p;
+    static z80_fast f;
+    run(p, f, {
+        0x31, 0x00, 0xf0,  // ld sp, 0xf000
+        0x21, 0x00, 0x80,  // ld hl, 0x8000
+        0x32, 0x00, 0x91,  // wait: ld (0x9100), a
+        0xdb, 0x10,        // in a, (0x10)
+        0xe6, 0x01,        // and 1
+        0x28, 0xf7,        // jr z, wait
+        0xdb, 0x11,        // in a, (0x11)
+        0x77,              // ld (hl), a
+        0x23,              // inc hl
+        0x18, 0xf1,        // jr wait
+    });
+    check_same_state(p, f, name);
+    check(f.num_steps == p.num_steps, "writing loops are skipped", name);
+}
+
+void test_i8080_port() {
+    const char *name = "i8080_port";
+    static i8080_plain p;
+    static i8080_fast f;
+    run(p, f, {
+        0x31, 0x00, 0xf0,  // lxi sp, 0xf000
+        0x21, 0x00, 0x80,  // lxi h, 0x8000
+        0xdb, 0x10,        // wait: in 0x10
+        0xe6, 0x01,        // ani 1
+        0xca, 0x06, 0x00,  // jz wait
+        0xdb, 0x11,        // in 0x11
+        0x77,              // mov m, a
+        0x23,              // inx h
+        0xc3, 0x06, 0x00,  // jmp wait
+    });
+    check_same_state(p, f, name);
+    check(p.data_ticks.size() > 90, "device is not read", name);
+    check(f.num_steps < p.num_steps / 10, "loops are not skipped", name);
+}
+
+// Breakpoints inside polling loops are hit on every iteration.
+void test_z80_breakpoint() {
+    const char *name = "z80_breakpoint";
+    static z80_plain p;
+    static z80_fast f;
+    const std::initializer_list<least_u8> code = {
+        0x3a, 0x00, 0x90,  // wait: ld a, (0x9000)
+        0xb7,              // or a
+        0x28, 0xfa,        // jr z, wait
+    };
+    p.load(code);
+    f.load(code);
+    p.write(0x9000, 0x00);
+    f.write(0x9000, 0x00);
+    // At the head of the loop and in its middle.
+    for(fast_u16 addr : {0x0000, 0x0003}) {
+        p.set_breakpoint(addr);
+        f.set_breakpoint(addr);
+        for(unsigned i = 0; i != 10; ++i) {
+            check(p.on_run() == z80::events_mask::breakpoint_hit,
+                  "breakpoint is not hit", name);
+            check(f.on_run() == z80::events_mask::breakpoint_hit,
+                  "breakpoint is skipped", name);
+            check(p.get_ticks() == f.get_ticks(), "ticks differ", name);
+        }
+        p.clear_breakpoint(addr);
+        f.clear_breakpoint(addr);
+    }
+}
+
+}  // anonymous namespace
+
+int main() {
+    test_z80_port();
+    test_z80_memory();
+    test_z80_write();
+    test_i8080_port();
+    test_z80_breakpoint();
+}
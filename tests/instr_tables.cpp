@@ -0,0 +1,143 @@
+// Test that the instruction descriptor tables agree with what
+// the emulator actually does for every op-code.
+
+#include "z80.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::instr_info;
+using z80::instr_kind;
+
+namespace {
+
+const fast_u16 code_addr = 0x8000;
+
+unsigned num_errors = 0;
+
+void error(const char *cpu, const char *space, fast_u8 op,
+           const char *what, unsigned expected, unsigned actual) {
+    std::fprintf(stderr, "instr_tables: %s %s op 0x%02x: %s is %u, "
+                         "expected %u\n",
+                 cpu, space, static_cast<unsigned>(op), what,
+                 actual, expected);
+    ++num_errors;
+}
+
+template<typename B>
+class machine : public B {
+public:
+    typedef B base;
+
+    void on_tick(unsigned t) {
+        ticks += t;
+        base::on_tick(t);
+    }
+
+    // Executes the given code with the specified flags and
+    // counters.
+    void run(std::initializer_list<fast_u8> code, fast_u8 f, fast_u16 bc,
+             bool is_z80) {
+        fast_u16 addr = code_addr;
+        for(fast_u8 n : code)
+            base::write(addr++, n);
+        base::write(addr++, 0);
+        base::write(addr++, 0);
+
+        base::set_pc(code_addr);
+        base::set_sp(0xc000);
+        base::set_af(z80::make16(0x00, f));
+        base::set_bc(bc);
+        base::set_de(0x9000);
+        base::set_hl(0xa000);
+        ticks = 0;
+        base::on_step();
+        if(is_z80) {
+            // Complete prefixed instructions.
+            while(this->on_get_iregp_kind() != z80::iregp::hl)
+                base::on_step();
+        }
+    }
+
+    unsigned ticks = 0;
+};
+
+template<typename M>
+void check(M &mach, const char *cpu, const char *space, fast_u8 op,
+           const instr_info &info, std::initializer_list<fast_u8> code,
+           bool is_z80) {
+    // Prefixes are described as parts of the prefixed
+    // instructions.
+    if(info.kind == instr_kind::prefix)
+        return;
+
+    // Take the path of untaken conditions and the last iteration
+    // of repeating instructions.
+    unsigned ticks = 0;
+    unsigned size = 0;
+    bool first = true;
+    for(fast_u8 f : {0x00, 0xff}) {
+        for(fast_u16 bc : {0x0001, 0x0101}) {
+            mach.run(code, f, bc, is_z80);
+            unsigned s = static_cast<unsigned>(
+                z80::sub16(mach.get_pc(), code_addr));
+            if(first || mach.ticks < ticks ||
+                   (mach.ticks == ticks && s < size)) {
+                ticks = mach.ticks;
+                size = s;
+                first = false;
+            }
+        }
+    }
+
+    if(ticks != info.ticks)
+        error(cpu, space, op, "number of ticks", info.ticks, ticks);
+
+    switch(info.kind) {
+    case instr_kind::plain:
+    case instr_kind::repeat:
+    case instr_kind::cond_jump:
+    case instr_kind::cond_call:
+    case instr_kind::cond_ret:
+        if(size != info.size)
+            error(cpu, space, op, "size", info.size, size);
+        break;
+    default:
+        break;
+    }
+
+    if(info.x != (op >> 6) || info.y != ((op >> 3) & 7) ||
+           info.z != (op & 7) || info.p != ((op >> 4) & 3) ||
+           info.q != ((op >> 3) & 1))
+        error(cpu, space, op, "op-code part", 0, 1);
+}
+
+class i8080_machine : public machine<z80::i8080_machine<i8080_machine>> {};
+class z80_machine : public machine<z80::z80_machine<z80_machine>> {};
+
+}  // anonymous namespace
+
+int main() {
+    static i8080_machine i8080;
+    static z80_machine z80;
+    for(unsigned n = 0; n != 0x100; ++n) {
+        fast_u8 op = static_cast<fast_u8>(n);
+        check(i8080, "i8080", "unprefixed", op,
+              i8080_machine::get_instr_info(op), {op}, false);
+        check(z80, "z80", "unprefixed", op,
+              z80_machine::get_instr_info(op), {op}, true);
+        check(z80, "z80", "CB", op,
+              z80_machine::get_cb_instr_info(op), {0xcb, op}, true);
+        check(z80, "z80", "ED", op,
+              z80_machine::get_ed_instr_info(op), {0xed, op}, true);
+        check(z80, "z80", "DD", op,
+              z80_machine::get_index_instr_info(op), {0xdd, op}, true);
+        check(z80, "z80", "FD", op,
+              z80_machine::get_index_instr_info(op), {0xfd, op}, true);
+        check(z80, "z80", "DD CB", op,
+              z80_machine::get_index_cb_instr_info(op),
+              {0xdd, 0xcb, 0x00, op}, true);
+    }
+
+    if(num_errors)
+        return EXIT_FAILURE;
+}
@@ -0,0 +1,114 @@
+// Test that reporting ticks once per instruction gives the same
+// tick counts as reporting them on every cycle.
+
+#include <initializer_list>
+#include <vector>
+
+#include "z80.h"
+#include "testing.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::least_u8;
+using testing::check;
+
+namespace {
+
+// Records the ticks at the end of every step, at inputs and the
+// steps during which the timer fires. The timer is rescheduled
+// relative to the tick it was due, as with per-instruction ticks
+// it fires at the ends of instructions.
+template<typename B>
+class machine : public testing::machine<B> {
+public:
+    typedef testing::machine<B> base;
+    typedef typename base::ticks_type ticks_type;
+
+    void start_timer(ticks_type period) {
+        timer_period = period;
+        timer_tick = period;
+        base::schedule(timer_tick, &machine::on_timer);
+    }
+
+    void on_step() {
+        base::on_step();
+        step_ticks.push_back(base::get_ticks());
+    }
+
+    fast_u8 on_input(fast_u16 port) {
+        input_ticks.push_back(base::get_ticks());
+        return z80::get_low8(port);
+    }
+
+    std::vector<ticks_type> step_ticks;
+    std::vector<ticks_type> input_ticks;
+    std::vector<std::size_t> timer_steps;
+
+private:
+    static void on_timer(typename base::derived &m, void *context) {
+        z80::unused(context);
+        m.timer_steps.push_back(m.step_ticks.size());
+        m.timer_tick += m.timer_period;
+        m.schedule(m.timer_tick, &machine::on_timer);
+    }
+
+    ticks_type timer_period = 0;
+    ticks_type timer_tick = 0;
+};
+
+class z80_plain : public machine<z80::z80_machine<z80_plain>> {};
+class z80_fast : public machine<
+    z80::instr_ticks<z80::z80_machine<z80_fast>>> {};
+
+class i8080_plain : public machine<z80::i8080_machine<i8080_plain>> {};
+class i8080_fast : public machine<
+    z80::instr_ticks<z80::i8080_machine<i8080_fast>>> {};
+
+template<typename P, typename F>
+void test(std::initializer_list<least_u8> code, const char *name) {
+    static P p;
+    static F f;
+    p.load(code);
+    f.load(code);
+    p.start_timer(97);
+    f.start_timer(97);
+    p.run_for(100000);
+    f.run_for(100000);
+    check(p.get_ticks() == f.get_ticks(), "ticks differ", name);
+    check(p.step_ticks == f.step_ticks, "step ticks differ", name);
+    check(p.input_ticks == f.input_ticks, "input ticks differ", name);
+    check(!p.input_ticks.empty(), "no inputs", name);
+    check(p.timer_steps == f.timer_steps, "timer steps differ", name);
+    check(p.timer_steps.size() > 1000, "timer does not fire", name);
+}
+
+}  // anonymous namespace
+
+int main() {
+    test<z80_plain, z80_fast>({
+        0x31, 0x00, 0xf0,        // ld sp, 0xf000
+        0x21, 0x00, 0x80,        // ld hl, 0x8000
+        0x11, 0x00, 0x90,        // loop: ld de, 0x9000
+        0x01, 0x10, 0x00,        // ld bc, 0x0010
+        0xed, 0xb0,              // ldir
+        0xdd, 0x7e, 0x05,        // ld a, (ix + 5)
+        0xdb, 0x10,              // in a, (0x10)
+        0xcd, 0x18, 0x00,        // call f
+        0x18, 0xee,              // jr loop
+        0xe5,                    // f: push hl
+        0xe1,                    // pop hl
+        0xc9,                    // ret
+    }, "z80");
+    test<i8080_plain, i8080_fast>({
+        0x31, 0x00, 0xf0,        // lxi sp, 0xf000
+        0x21, 0x00, 0x80,        // lxi h, 0x8000
+        0x7e,                    // loop: mov a, m
+        0xdb, 0x10,              // in 0x10
+        0x77,                    // mov m, a
+        0xcd, 0x10, 0x00,        // call f
+        0xc3, 0x06, 0x00,        // jmp loop
+        0xe5,                    // f: push h
+        0xe1,                    // pop h
+        0xc9,                    // ret
+    }, "i8080");
+}
@@ -0,0 +1,270 @@
+// Test the interrupt controller: the INT line, daisy-chained
+// devices, the three interrupt modes and NMIs.
+
+#include <vector>
+
+#include "z80.h"
+#include "testing.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using testing::check;
+
+namespace {
+
+class machine : public testing::machine<
+    z80::int_controller<z80::z80_machine<machine>>> {
+public:
+    typedef testing::machine<
+        z80::int_controller<z80::z80_machine<machine>>> base;
+
+    void step(unsigned n) {
+        for(unsigned i = 0; i != n; ++i)
+            on_step();
+    }
+
+    // The test device drops the INT line on any output.
+    void on_output(fast_u16 port, fast_u8 n) {
+        set_int_line(false);
+        base::on_output(port, n);
+    }
+
+    // Devices off the chain may drop the INT line on acknowledge.
+    fast_u8 on_int_ack() {
+        fast_u8 n = base::on_int_ack();
+        if(is_int_line_acked) {
+            set_int_line(false);
+            n = bus_byte;
+        }
+        acks.push_back(n);
+        return n;
+    }
+
+    void start_timer(ticks_type period) {
+        timer_period = period;
+        schedule(period, &machine::on_timer);
+    }
+
+    bool is_int_line_acked = false;
+    fast_u8 bus_byte = 0xff;
+    std::vector<fast_u8> acks;
+
+private:
+    static void on_timer(machine &m, void *context) {
+        z80::unused(context);
+        ++m.num_timer_ints;
+        m.set_int_line(true);
+        m.schedule(m.get_ticks() + m.timer_period, &machine::on_timer);
+    }
+
+    ticks_type timer_period = 0;
+
+public:
+    unsigned num_timer_ints = 0;
+};
+
+// The INT line raised from a scheduled handler is answered in
+// mode 1.
+void test_int_line() {
+    const char *name = "int line";
+    static machine m;
+    m.load({
+        0x31, 0x00, 0xf0,  // ld sp, 0xf000
+        0xed, 0x56,        // im 1
+        0xfb,              // ei
+        0x76,              // loop: halt
+        0x18, 0xfd,        // jr loop
+    }, 0x0000);
+    m.load({
+        0x3c,              // inc a
+        0xd3, 0x00,        // out (0), a
+        0xfb,              // ei
+        0xc9,              // ret
+    }, 0x0038);
+    m.start_timer(1000);
+
+    while(m.get_ticks() < 100000)
+        m.run_until(100000);
+    unsigned num_ints = m.get_a();
+    check(num_ints > 90, "interrupts are not accepted", name);
+    check(num_ints == m.num_timer_ints || num_ints + 1 == m.num_timer_ints,
+          "interrupts are lost", name);
+    check(m.acks.size() == num_ints, "mode 1 does not acknowledge", name);
+}
+
+// Daisy-chained devices are acknowledged in mode 1 as well, so
+// they are served once per request.
+void test_mode_1_chain() {
+    const char *name = "mode 1 chain";
+    static machine m;
+    m.load({
+        0x31, 0x00, 0xf0,  // ld sp, 0xf000
+        0xed, 0x56,        // im 1
+        0xfb,              // ei
+        0x00,              // loop: nop
+        0x18, 0xfd,        // jr loop
+    }, 0x0000);
+    m.load({
+        0x3c,              // inc a
+        0xfb,              // ei
+        0xed, 0x4d,        // reti
+    }, 0x0038);
+    m.step(4);
+
+    m.request_int(0, 0x00);
+    m.step(1);
+    check(m.get_pc() == 0x0039, "interrupt not taken", name);
+    check(!m.is_int_requested(0) && m.is_int_in_service(0),
+          "device is not acknowledged", name);
+    m.step(200);
+    check(m.get_a() == 1, "ISR re-entered", name);
+    check(!m.is_int_requested(0) && !m.is_int_in_service(0),
+          "device is still served", name);
+}
+
+// Nested mode 2 interrupts from a daisy chain.
+void test_daisy_chain() {
+    const char *name = "daisy chain";
+    static machine m;
+    m.load({
+        0x31, 0x00, 0xf0,  // ld sp, 0xf000
+        0x3e, 0x80,        // ld a, 0x80
+        0xed, 0x47,        // ld i, a
+        0xed, 0x5e,        // im 2
+        0xfb,              // ei
+        0x00,              // loop: nop
+        0x18, 0xfd,        // jr loop
+    }, 0x0000);
+    m.load({0x00, 0x01, 0x00, 0x02, 0x00, 0x03}, 0x8000);
+    m.load({
+        0xfb,              // ei
+        0xed, 0x4d,        // reti
+    }, 0x0100);
+    m.load({
+        0xfb,              // ei
+        0x00,              // nop
+        0x00,              // nop
+        0x00,              // nop
+        0x00,              // nop
+        0xed, 0x4d,        // reti
+    }, 0x0200);
+    m.load({
+        0xfb,              // ei
+        0xed, 0x4d,        // reti
+    }, 0x0300);
+
+    m.step(6);
+    check(m.get_pc() == 0x000b, "setup failed", name);
+
+    m.request_int(2, 0x04);
+    m.request_int(1, 0x02);
+    m.step(1);
+    check(m.get_pc() == 0x0201, "device 1 is not served first", name);
+    check(m.is_int_in_service(1) && !m.is_int_requested(1),
+          "device 1 is not in service", name);
+    check(m.is_int_requested(2), "device 2 request lost", name);
+
+    // Lower-priority devices wait even with interrupts enabled.
+    m.step(2);
+    check(m.get_pc() == 0x0203 && m.acks.size() == 1,
+          "device 2 is not blocked", name);
+    check(!m.is_int_pending(), "blocked request is pending", name);
+
+    // Higher-priority devices nest.
+    m.request_int(0, 0x00);
+    m.step(1);
+    check(m.get_pc() == 0x0101, "device 0 does not nest", name);
+    check(m.is_int_in_service(0) && m.is_int_in_service(1),
+          "devices are not in service", name);
+    m.step(1);
+    check(m.get_pc() == 0x0203 && !m.is_int_in_service(0) &&
+              m.is_int_in_service(1),
+          "RETI does not end the nested service", name);
+
+    m.step(3);
+    check(!m.is_int_in_service(1), "RETI does not end the service", name);
+    m.step(1);
+    check(m.get_pc() == 0x0301 && m.is_int_in_service(2),
+          "device 2 is not served", name);
+    check((m.acks == std::vector<fast_u8>{0x02, 0x00, 0x04}),
+          "wrong vectors", name);
+}
+
+// Mode 0 executes the instruction on the bus.
+void test_mode_0() {
+    const char *name = "mode 0";
+    static machine m;
+    m.load({
+        0x31, 0x00, 0xf0,  // ld sp, 0xf000
+        0xed, 0x46,        // im 0
+        0xfb,              // ei
+        0x76,              // halt
+    }, 0x0000);
+    m.load({
+        0x3c,              // inc a
+    }, 0x0008);
+    m.step(5);
+    check(m.is_halted(), "not halted", name);
+
+    m.is_int_line_acked = true;
+    m.bus_byte = 0xcf;  // rst 0x08
+    m.set_int_line(true);
+    auto ticks = m.get_ticks();
+    m.step(1);
+    check(m.get_ticks() - ticks == 13 + 4, "wrong ticks", name);
+    check(m.get_pc() == 0x0009 && m.get_a() == 1, "RST not executed", name);
+    check(m.get_sp() == 0xeffe && m.read(0xeffe) == 0x07,
+          "wrong return address", name);
+    check(!m.get_iff1() && !m.get_iff2() && !m.is_int_pending(),
+          "interrupts not disabled", name);
+}
+
+// NMIs are taken regardless of IFF1, but not after EI.
+void test_nmi() {
+    const char *name = "nmi";
+    static machine m;
+    m.load({
+        0x31, 0x00, 0xf0,  // ld sp, 0xf000
+        0xfb,              // ei
+        0x00,              // loop: nop
+        0x18, 0xfd,        // jr loop
+    }, 0x0000);
+    m.load({
+        0x00,              // nop
+        0xed, 0x45,        // retn
+    }, 0x0066);
+    m.step(2);
+    m.request_nmi();
+    m.step(1);
+    check(m.get_pc() == 0x0005, "NMI taken after EI", name);
+
+    auto ticks = m.get_ticks();
+    m.step(1);
+    check(m.get_ticks() - ticks == 11 + 4, "wrong ticks", name);
+    check(m.get_pc() == 0x0067 && m.get_sp() == 0xeffe,
+          "NMI not taken", name);
+    check(!m.get_iff1() && m.get_iff2(), "wrong IFFs", name);
+
+    // The INT line waits until RETN restores IFF1.
+    m.set_int_line(true);
+    check(!m.is_int_pending(), "INT pending with IFF1 reset", name);
+    m.step(1);
+    check(m.get_pc() == 0x0005 && m.get_iff1(), "RETN failed", name);
+    check(m.is_int_pending(), "INT not pending after RETN", name);
+
+    m.set_int_line(false);
+    m.on_set_iff1(false);
+    m.request_nmi();
+    m.step(1);
+    check(m.get_pc() == 0x0067, "NMI masked", name);
+}
+
+}  // anonymous namespace
+
+int main() {
+    test_int_line();
+    test_mode_1_chain();
+    test_daisy_chain();
+    test_mode_0();
+    test_nmi();
+}
@@ -0,0 +1,76 @@
+// Test mapping memory to ROM, RAM, banks and devices.
+
+#include "z80.h"
+#include "testing.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::least_u8;
+using testing::check;
+
+namespace {
+
+class machine
+    : public z80::memory_map<z80::machine_state<z80::z80_cpu<machine>>> {
+public:
+    fast_u8 on_mmio_read(fast_u16 addr) {
+        last_mmio_addr = addr;
+        return 0x5a;
+    }
+
+    void on_mmio_write(fast_u16 addr, fast_u8 n) {
+        last_mmio_addr = addr;
+        last_mmio_value = n;
+    }
+
+    fast_u16 last_mmio_addr = 0;
+    fast_u8 last_mmio_value = 0;
+};
+
+}  // anonymous namespace
+
+int main() {
+    static least_u8 ram[0x8000];
+    static least_u8 banks[2][0x2000];
+    static const least_u8 rom[0x100] = {
+        0x3a, 0x00, 0xf0,  // ld a, (0xf000)
+        0x32, 0x00, 0x80,  // ld (0x8000), a
+        0x32, 0x00, 0x10,  // ld (0x1000), a
+        0x32, 0x01, 0xf0,  // ld (0xf001), a
+        0x32, 0x00, 0xc0,  // ld (0xc000), a
+        0x76,              // halt
+    };
+
+    static machine m;
+    m.map_ram(0x0000, sizeof(ram), ram);
+    m.map_rom(0x8000, sizeof(rom), rom);
+    m.map_ram(0xc000, sizeof(banks[0]), banks[0]);
+    m.map_mmio(0xf000, 0x100);
+    m.unmap(0xdf00, 0x100);
+
+    m.set_pc(0x8000);
+    while(!m.is_halted())
+        m.on_step();
+
+    check(m.get_a() == 0x5a, "MMIO read is not handled");
+    check(m.read(0x8000) == 0x3a, "ROM is writable");
+    check(ram[0x1000] == 0x5a, "RAM write is lost");
+    check(m.last_mmio_addr == 0xf001 && m.last_mmio_value == 0x5a,
+          "MMIO write is not handled");
+    check(banks[0][0] == 0x5a, "banked write is lost");
+    check(m.read(0xe000) == 0xff && m.on_read(0xe000) == 0xff,
+          "unmapped memory does not read as 0xff");
+    check(m.read(0xdf00) == 0xff, "unmapping did not work");
+
+    // Switch banks.
+    m.map_ram(0xc000, sizeof(banks[1]), banks[1]);
+    check(m.read(0xc000) == 0x00, "bank is not switched");
+    m.write(0xc000, 0x33);
+    check(banks[1][0] == 0x33 && banks[0][0] == 0x5a,
+          "write goes to a wrong bank");
+
+    // Transparent accessors do not reach devices.
+    m.last_mmio_addr = 0;
+    check(m.read(0xf000) == 0xff && m.last_mmio_addr == 0,
+          "transparent read reaches a device");
+}
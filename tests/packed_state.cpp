@@ -0,0 +1,61 @@
+// Test that CPUs keeping their registers in packed register files
+// execute the same way as the ones with the default state.
+
+#include "z80_diff.h"
+#include "testing.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::fast_u32;
+using z80::fast_u64;
+using testing::check;
+
+namespace {
+
+// Fills memory with pseudo-random bytes to run as code, so that
+// all kinds of instructions get executed.
+template<typename B>
+class machine : public B {
+public:
+    typedef B base;
+
+    void fill(fast_u32 seed) {
+        for(fast_u32 addr = 0; addr != z80::address_space_size; ++addr) {
+            seed = (seed * 1103515245 + 12345) & 0xffffffff;
+            base::write(static_cast<fast_u16>(addr),
+                        static_cast<fast_u8>(seed >> 16));
+        }
+    }
+
+    fast_u8 on_input(fast_u16 port) {
+        return z80::get_low8(port) ^ z80::get_high8(port);
+    }
+};
+
+class z80_plain : public machine<z80::z80_machine<z80_plain>> {};
+class z80_packed : public machine<z80::packed_z80_machine<z80_packed>> {};
+
+class i8080_plain : public machine<z80::i8080_machine<i8080_plain>> {};
+class i8080_packed
+    : public machine<z80::packed_i8080_machine<i8080_packed>> {};
+
+template<typename P, typename Q>
+void test(const char *name) {
+    for(fast_u32 seed : {1, 2, 3, 4}) {
+        std::unique_ptr<P> p(new P);
+        std::unique_ptr<Q> q(new Q);
+        p->fill(seed);
+        q->fill(seed);
+        fast_u64 instr;
+        check(!z80::find_divergence(*p, *q, 200000, instr, 10000),
+              "machines diverge", name);
+        check(p->get_ticks() == q->get_ticks(), "ticks differ", name);
+    }
+}
+
+}  // anonymous namespace
+
+int main() {
+    test<z80_plain, z80_packed>("z80");
+    test<i8080_plain, i8080_packed>("i8080");
+}
@@ -0,0 +1,96 @@
+// Test collecting per-address profiles.
+
+#include <cstring>
+
+#include "z80_profiler.h"
+#include "testing.h"
+
+using z80::fast_u16;
+using z80::fast_u64;
+using testing::check;
+using testing::error;
+
+namespace {
+
+class machine
+    : public testing::machine<z80::profiler<z80::z80_machine<machine>>> {
+public:
+    machine() {
+        load({
+            0x06, 0x0a,              // 0000  ld b, 10
+            0x10, 0xfe,              // 0002  djnz $
+            0xdd, 0x21, 0x00, 0x80,  // 0004  ld ix, 0x8000
+            0xdd, 0xcb, 0x02, 0xce,  // 0008  set 1, (ix + 2)
+            0xed, 0x44,              // 000c  neg
+            0xcb, 0x47,              // 000e  bit 0, a
+            0x76,                    // 0010  halt
+        });
+        set_ticks_per_frame(0);
+    }
+};
+
+void check_at(const machine &m, fast_u16 addr, fast_u64 instrs,
+              fast_u64 ticks) {
+    if(m.get_instrs_at(addr) != instrs || m.get_ticks_at(addr) != ticks) {
+        std::fprintf(stderr, "%s: at %04x: %llu instrs, %llu ticks\n",
+                     TEST_NAME, static_cast<unsigned>(addr),
+                     static_cast<unsigned long long>(m.get_instrs_at(addr)),
+                     static_cast<unsigned long long>(m.get_ticks_at(addr)));
+        error("wrong counters");
+    }
+}
+
+}  // anonymous namespace
+
+int main() {
+    static machine m;
+    while(!m.is_halted())
+        m.on_step();
+    m.on_step();
+
+    check_at(m, 0x0000, 1, 7);
+    check_at(m, 0x0002, 10, 9 * 13 + 8);
+    check_at(m, 0x0004, 1, 14);
+    check_at(m, 0x0008, 1, 23);
+    check_at(m, 0x000c, 1, 8);
+    check_at(m, 0x000e, 1, 8);
+    check_at(m, 0x0010, 2, 8);
+    for(fast_u16 addr : {0x0001, 0x0003, 0x0005, 0x0009, 0x000a, 0x000b,
+                         0x000d, 0x000f, 0x0011})
+        check_at(m, addr, 0, 0);
+
+    std::FILE *f = std::tmpfile();
+    check(f != nullptr, "cannot create a temporary file");
+    m.write_hotspot_report(f, 2);
+    std::rewind(f);
+    char line[128];
+    check(std::fgets(line, sizeof(line), f) &&
+              std::strcmp(line, "17 instructions, 193 ticks\n") == 0,
+          "wrong report totals");
+    check(std::fgets(line, sizeof(line), f) != nullptr, "no report header");
+    check(std::fgets(line, sizeof(line), f) &&
+              std::strncmp(line, "0002 ", 5) == 0,
+          "wrong hottest address");
+    check(std::fgets(line, sizeof(line), f) &&
+              std::strncmp(line, "0008 ", 5) == 0,
+          "wrong second hottest address");
+    check(!std::fgets(line, sizeof(line), f), "too many report entries");
+    std::fclose(f);
+
+    f = std::tmpfile();
+    check(f != nullptr, "cannot create a temporary file");
+    check(m.write_profile_dump(f), "cannot write a dump");
+    check(std::ftell(f) == 8 + 2 * 8 * 0x10000, "wrong dump size");
+    std::rewind(f);
+    unsigned char dump[8 + 3 * 8];
+    check(std::fread(dump, 1, sizeof(dump), f) == sizeof(dump),
+          "cannot read the dump");
+    check(std::memcmp(dump, machine::dump_signature, 8) == 0,
+          "wrong dump signature");
+    check(dump[8 + 2 * 8] == 10 && dump[8 + 2 * 8 + 1] == 0,
+          "wrong dumped counter");
+    std::fclose(f);
+
+    m.clear_profile();
+    check_at(m, 0x0002, 0, 0);
+}
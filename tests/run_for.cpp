@@ -0,0 +1,49 @@
+// Test running machines for given numbers of ticks.
+
+#include "z80.h"
+#include "testing.h"
+
+using z80::events_mask;
+using testing::check;
+
+namespace {
+
+// Executes NOPs of 4 ticks each.
+class machine : public z80::z80_machine<machine> {};
+
+// Tells whether a run ended within the instruction at the given
+// tick.
+bool ends_at(const machine &m, machine::ticks_type tick) {
+    return m.get_ticks() >= tick && m.get_ticks() <= tick + 4;
+}
+
+}  // anonymous namespace
+
+int main() {
+    static machine m;
+
+    check(m.run_for(10) == events_mask::ticks_limit_hit,
+          "run_for() does not stop on reaching the limit");
+    check(ends_at(m, 10), "run_for() stops at a wrong tick");
+
+    machine::ticks_type ticks = m.get_ticks();
+    check(m.run_until(10) == events_mask::ticks_limit_hit &&
+              m.get_ticks() == ticks,
+          "run_until() for a passed tick executes instructions");
+
+    check(m.on_run() == events_mask::end_of_frame &&
+              ends_at(m, 100000),
+          "the default frame ends at a wrong tick");
+
+    m.set_ticks_per_frame(1000);
+    ticks = m.get_ticks();
+    check(m.run_for(5000) == events_mask::end_of_frame &&
+              ends_at(m, ticks + 1000),
+          "a custom frame ends at a wrong tick");
+
+    m.set_ticks_per_frame(0);
+    ticks = m.get_ticks();
+    check(m.run_for(1000000) == events_mask::ticks_limit_hit &&
+              ends_at(m, ticks + 1000000),
+          "disabled frames still end");
+}
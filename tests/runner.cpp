@@ -0,0 +1,109 @@
+// Test that running machines on a pool of threads gives the
+// same results as running them one after another.
+
+#include "z80_runner.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::events_mask;
+
+namespace {
+
+[[noreturn]] void error(const char *msg, unsigned i) {
+    std::fprintf(stderr, "runner: %s%u\n", msg, i);
+    std::exit(EXIT_FAILURE);
+}
+
+class machine : public z80::z80_machine<machine> {
+public:
+    typedef z80::z80_machine<machine> base;
+
+    // Counts B down from the given value in a loop with a
+    // breakpoint at its exit, so machines take different
+    // numbers of ticks to stop.
+    void load(fast_u8 n) {
+        static const fast_u8 code[] = {
+            0x10, 0xfe,  // djnz $
+            0x0d,        // dec c
+            0x20, 0xfb,  // jr nz, -5
+            0x76,        // halt
+        };
+        for(fast_u16 i = 0; i != sizeof(code); ++i)
+            base::write(i, code[i]);
+        base::set_b(n);
+        base::set_c(n);
+        base::set_breakpoint(0x0005);
+    }
+};
+
+// Records the order in which quanta are run.
+class logging_machine : public z80::z80_machine<logging_machine> {
+public:
+    typedef z80::z80_machine<logging_machine> base;
+
+    events_mask::type run_for(ticks_type n) {
+        log->push_back(id);
+        return base::run_for(n);
+    }
+
+    unsigned id = 0;
+    std::vector<unsigned> *log = nullptr;
+};
+
+}  // anonymous namespace
+
+int main() {
+    const unsigned num_machines = 64;
+    const machine::ticks_type ticks = 400000;
+    const machine::ticks_type quantum = 1000;
+
+    z80::runner<machine> pool(4);
+    for(unsigned i = 0; i != num_machines; ++i)
+        pool.add_machine().load(static_cast<fast_u8>(i * 4));
+    pool.run(ticks, quantum);
+
+    for(unsigned i = 0; i != num_machines; ++i) {
+        std::unique_ptr<machine> single(new machine);
+        single->load(static_cast<fast_u8>(i * 4));
+        events_mask::type events = 0;
+        machine::ticks_type end = ticks;
+        while(single->get_ticks() < end) {
+            machine::ticks_type left = end - single->get_ticks();
+            events = single->run_for(left < quantum ? left : quantum);
+            if(events & events_mask::breakpoint_hit)
+                break;
+        }
+
+        const machine &m = pool.get_machine(i);
+        if(m.get_ticks() != single->get_ticks() ||
+               m.get_pc() != single->get_pc() ||
+               m.get_bc() != single->get_bc() ||
+               pool.get_run_ticks(i) != single->get_ticks())
+            error("state mismatch for machine ", i);
+        if(pool.get_events(i) != events)
+            error("events mismatch for machine ", i);
+    }
+
+    // Machines continue from where they stopped.
+    pool.run(ticks, quantum);
+    for(unsigned i = 0; i != num_machines; ++i) {
+        if(pool.get_run_ticks(i) == 0)
+            error("machine has not run ", i);
+    }
+
+    // A worker takes turns with its machines.
+    std::vector<unsigned> log;
+    z80::runner<logging_machine> single_pool(1);
+    for(unsigned i = 0; i != 3; ++i) {
+        logging_machine &m = single_pool.add_machine();
+        m.id = i;
+        m.log = &log;
+    }
+    single_pool.run(3 * quantum, quantum);
+    if(log.size() != 9)
+        error("wrong number of quanta: ", static_cast<unsigned>(log.size()));
+    for(unsigned i = 0; i != log.size(); ++i) {
+        if(log[i] != i % 3)
+            error("quanta are not interleaved at ", i);
+    }
+}
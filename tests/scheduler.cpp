@@ -0,0 +1,82 @@
+// Test calling handlers scheduled at given ticks.
+
+#include <vector>
+
+#include "z80.h"
+#include "testing.h"
+
+using testing::check;
+
+namespace {
+
+class machine : public testing::machine<z80::z80_machine<machine>> {
+public:
+    machine() {
+        // Loop forever.
+        load({0x18, 0xfe});  // jr $
+        set_ticks_per_frame(0);
+    }
+
+    struct call {
+        unsigned id;
+        ticks_type tick;
+    };
+
+    std::vector<call> calls;
+};
+
+// Instructions are not interrupted, so handlers are called
+// within a few ticks past the scheduled one.
+bool is_called_at(const machine::call &c, machine::ticks_type tick) {
+    return c.tick >= tick && c.tick <= tick + 4;
+}
+
+template<unsigned id>
+void record(machine &m, void *context) {
+    z80::unused(context);
+    m.calls.push_back({id, m.get_ticks()});
+}
+
+// A periodic timer. Rescheduling relative to the planned tick
+// rather than the current one keeps calls from drifting.
+struct timer {
+    unsigned count;
+    machine::ticks_type next_tick;
+};
+
+void tick_timer(machine &m, void *context) {
+    timer &t = *static_cast<timer*>(context);
+    ++t.count;
+    t.next_tick += 100;
+    m.schedule(t.next_tick, tick_timer, context);
+}
+
+}  // anonymous namespace
+
+int main() {
+    static machine m;
+
+    m.schedule(500, record<2>);
+    m.schedule(100, record<1>);
+    m.schedule(500, record<3>);
+    m.schedule(700, record<4>);
+    m.schedule(900, record<5>);
+    m.unschedule(record<4>);
+
+    check(m.run_for(1000) == z80::events_mask::ticks_limit_hit,
+          "scheduled calls stop running");
+    check(m.calls.size() == 4, "wrong number of calls");
+    check(m.calls[0].id == 1 && is_called_at(m.calls[0], 100) &&
+              m.calls[1].id == 2 && is_called_at(m.calls[1], 500) &&
+              m.calls[2].id == 3 && is_called_at(m.calls[2], 500) &&
+              m.calls[3].id == 5 && is_called_at(m.calls[3], 900),
+          "wrong order or time of calls");
+
+    timer t = {0, m.get_ticks() + 100};
+    m.schedule(t.next_tick, tick_timer, &t);
+    m.run_until(t.next_tick + 10000 - 100);
+    check(t.count == 100, "wrong number of periodic calls");
+    m.unschedule(tick_timer, &t);
+    m.run_for(10000);
+    check(t.count == 100, "unscheduled handler is called");
+}
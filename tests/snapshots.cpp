@@ -0,0 +1,99 @@
+// Test taking and restoring memory snapshots.
+
+#include <vector>
+
+#include "z80.h"
+#include "testing.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::fast_u32;
+using z80::least_u8;
+using testing::error;
+
+namespace {
+
+class machine
+    : public z80::memory_snapshots<z80::z80_machine<machine>> {};
+
+typedef std::vector<least_u8> image;
+
+image get_image(const machine &m) {
+    image bytes(z80::address_space_size);
+    for(fast_u32 addr = 0; addr != z80::address_space_size; ++addr)
+        bytes[addr] = static_cast<least_u8>(
+            m.read(static_cast<fast_u16>(addr)));
+    return bytes;
+}
+
+fast_u32 rnd = 0x12345678;
+
+fast_u32 get_random() {
+    rnd = rnd * 1103515245 + 12345;
+    return rnd >> 8;
+}
+
+void test_random_writes() {
+    static machine m;
+    std::vector<machine::snapshot_type> snapshots;
+    std::vector<image> images;
+    for(unsigned round = 0; round != 200; ++round) {
+        snapshots.push_back(m.snapshot());
+        images.push_back(get_image(m));
+
+        // Write to a few random places, sometimes in bulk.
+        unsigned num_writes = get_random() % 64;
+        for(unsigned i = 0; i != num_writes; ++i) {
+            auto addr = static_cast<fast_u16>(get_random() & 0xffff);
+            auto n = static_cast<fast_u8>(get_random() & 0xff);
+            if(i % 2)
+                m.write(addr, n);
+            else
+                m.on_write(addr, n);
+        }
+
+        if(get_random() % 4 == 0) {
+            std::size_t i = get_random() % snapshots.size();
+            m.restore(snapshots[i]);
+            if(get_image(m) != images[i])
+                error("restored memory differs from the snapshot");
+        }
+    }
+
+    // Fork a machine.
+    static machine fork;
+    fork.restore(snapshots.back());
+    if(get_image(fork) != images.back())
+        error("forked memory differs from the snapshot");
+}
+
+void test_code_changes() {
+    static machine m;
+    static const fast_u8 code[] = {
+        0x3e, 0x01,  // ld a, 1
+        0x76,        // halt
+    };
+    for(fast_u16 i = 0; i != sizeof(code); ++i)
+        m.write(static_cast<fast_u16>(0x100 + i), code[i]);
+    machine::snapshot_type s = m.snapshot();
+
+    m.write(0x101, 0x02);
+    m.set_pc(0x100);
+    m.on_step();
+    if(m.get_a() != 0x02)
+        error("wrong result of modified code");
+
+    // Restoring brings back the original code.
+    m.restore(s);
+    m.set_pc(0x100);
+    m.on_step();
+    if(m.get_a() != 0x01)
+        error("wrong result of restored code");
+}
+
+}  // anonymous namespace
+
+int main() {
+    test_random_writes();
+    test_code_changes();
+}
@@ -0,0 +1,69 @@
+#   Z80 CPU Emulator.
+#   https://github.com/kosarev/z80
+#
+#   Copyright (C) 2017-2019 Ivan Kosarev.
+#   ivan@kosarev.info
+#
+#   Published under the MIT license.
+
+# Tests the Python bindings. Run from the root of the source tree
+# after building the extension in place:
+#
+#   python3 setup.py build_ext --inplace
+#   python3 -m unittest tests.test_machine
+
+import unittest
+import z80
+
+
+class TestRun(unittest.TestCase):
+    def check_run(self, m):
+        m.set_ticks_per_frame(0)
+        self.assertEqual(m.get_ticks(), 0)
+
+        # The memory is filled with 4-tick NOPs.
+        self.assertEqual(m.run(100), m._TICKS_LIMIT_HIT)
+        self.assertEqual(m.get_ticks(), 100)
+        self.assertEqual(m.run(2), m._TICKS_LIMIT_HIT)
+        self.assertEqual(m.get_ticks(), 104)
+
+        # Breakpoints stop the run before the ticks are spent.
+        m.set_breakpoint(0x0040)
+        self.assertEqual(m.run(10000), m._BREAKPOINT_HIT)
+        self.assertEqual(m.get_pc(), 0x0040)
+        self.assertEqual(m.get_ticks(), 0x40 * 4)
+
+    def check_frames(self, m):
+        # run() stops at the end of a frame and run_for() goes on.
+        m.set_ticks_per_frame(48)
+        self.assertEqual(m.run(1000), m._END_OF_FRAME)
+        self.assertEqual(m.get_ticks(), 48)
+        self.assertEqual(m.run_for(1000), m._TICKS_LIMIT_HIT)
+        self.assertEqual(m.get_ticks(), 1048)
+
+    def check_watchpoints(self, m):
+        m.set_ticks_per_frame(0)
+        m.set_memory_block(0x0000, bytes([
+            0x3a, 0x00, 0x90,  # ld a, (0x9000)
+            0x32, 0x00, 0xa0,  # ld (0xa000), a
+            0x76]))            # halt
+        m.set_read_watchpoint(0x9000)
+        m.set_write_watchpoint(0xa000, 0x100)
+        self.assertEqual(m.run(1000), m._READ_WATCH_HIT)
+        self.assertEqual(m.get_pc(), 0x0003)
+        self.assertEqual(m.run(1000), m._WRITE_WATCH_HIT)
+        self.assertEqual(m.get_pc(), 0x0006)
+
+    def test_i8080(self):
+        self.check_run(z80.I8080Machine())
+        self.check_frames(z80.I8080Machine())
+        self.check_watchpoints(z80.I8080Machine())
+
+    def test_z80(self):
+        self.check_run(z80.Z80Machine())
+        self.check_frames(z80.Z80Machine())
+        self.check_watchpoints(z80.Z80Machine())
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -120,9 +120,11 @@ public:
         va_end(args);
 
         char buff2[max_line_size];
-        std::snprintf(buff2, max_line_size, "%2u %*s%s",
-                      static_cast<unsigned>(ticks),
-                      static_cast<int>(level * 2), "", buff);
+        int size = std::snprintf(buff2, max_line_size, "%2u %*s%s",
+                                 static_cast<unsigned>(ticks),
+                                 static_cast<int>(level * 2), "", buff);
+        if(size < 0 || static_cast<std::size_t>(size) >= max_line_size)
+            error("expected line is too long");
 
         if(std::strcmp(buff2, line) == 0) {
             reset_skipping_mode();
@@ -712,35 +714,43 @@ private:
     least_u8 image[z80::address_space_size];
 };
 
-class i8080_machine : public machine_base<z80::i8080_cpu<i8080_machine>> {
+template<template<typename> class C>
+class i8080_machine : public machine_base<C<i8080_machine<C>>> {
 public:
+    typedef machine_base<C<i8080_machine<C>>> base;
+
     i8080_machine(test_input &input)
-        : machine_base<z80::i8080_cpu<i8080_machine>>(input)
+        : base(input)
     {}
 
-    void on_set_wz(fast_u16 wz) { match_set_rp("wz", 0, wz);
+    void on_set_wz(fast_u16 wz) { base::match_set_rp("wz", 0, wz);
                                   return base::on_set_wz(wz); }
 
     void on_step() {
         base::on_step();
-        input.read_and_match("done", static_cast<unsigned>(get_ticks()));
+        base::input.read_and_match(
+            "done", static_cast<unsigned>(base::get_ticks()));
     }
 };
 
-class z80_machine : public machine_base<z80::z80_cpu<z80_machine>> {
+template<template<typename> class C>
+class z80_machine : public machine_base<C<z80_machine<C>>> {
 public:
+    typedef machine_base<C<z80_machine<C>>> base;
+
     z80_machine(test_input &input)
-        : machine_base<z80::z80_cpu<z80_machine>>(input)
+        : base(input)
     {}
 
     fast_u8 on_m1_fetch_cycle() {
-        input.read_and_match("m1_fetch",
-                             static_cast<unsigned>(get_ticks()));
-        input_level_guard guard(input);
+        base::input.read_and_match(
+            "m1_fetch", static_cast<unsigned>(base::get_ticks()));
+        input_level_guard guard(base::input);
         return base::on_m1_fetch_cycle();
     }
 
-    void on_set_wz(fast_u16 wz) { match_set_rp("wz", base::get_wz(), wz);
+    void on_set_wz(fast_u16 wz) { base::match_set_rp("wz", base::get_wz(),
+                                                     wz);
                                   return base::on_set_wz(wz); }
 
     void on_step() {
@@ -749,10 +759,17 @@ public:
         while(base::get_iregp_kind() != z80::iregp::hl)
             base::on_step();
 
-        input.read_and_match("done", static_cast<unsigned>(get_ticks()));
+        base::input.read_and_match(
+            "done", static_cast<unsigned>(base::get_ticks()));
     }
 };
 
+template<typename D>
+using i8080_table_cpu = z80::i8080_table_dispatch<z80::i8080_cpu<D>>;
+
+template<typename D>
+using z80_table_cpu = z80::z80_table_dispatch<z80::z80_cpu<D>>;
+
 bool parse_hex_digit(const char *&p, fast_u8 &res) {
     auto c = static_cast<unsigned char>(*p);
     if(c >= static_cast<unsigned char>('0') &&
@@ -866,14 +883,20 @@ void handle_test_entry(test_input &input) {
 enum class cpu_kind {
     unknown,
     i8080,
+    i8080_tables,
     z80,
+    z80_tables,
 };
 
 cpu_kind get_cpu_kind(const char *id) {
     if(std::strcmp(id, "i8080") == 0)
         return cpu_kind::i8080;
+    if(std::strcmp(id, "i8080-tables") == 0)
+        return cpu_kind::i8080_tables;
     if(std::strcmp(id, "z80") == 0)
         return cpu_kind::z80;
+    if(std::strcmp(id, "z80-tables") == 0)
+        return cpu_kind::z80_tables;
     return cpu_kind::unknown;
 }
 
@@ -904,10 +927,18 @@ int main(int argc, char *argv[]) {
 
         switch(cpu) {
         case cpu_kind::i8080:
-            handle_test_entry<i8080_machine, i8080_disasm>(input);
+            handle_test_entry<i8080_machine<z80::i8080_cpu>,
+                              i8080_disasm>(input);
+            break;
+        case cpu_kind::i8080_tables:
+            handle_test_entry<i8080_machine<i8080_table_cpu>,
+                              i8080_disasm>(input);
             break;
         case cpu_kind::z80:
-            handle_test_entry<z80_machine, z80_disasm>(input);
+            handle_test_entry<z80_machine<z80::z80_cpu>, z80_disasm>(input);
+            break;
+        case cpu_kind::z80_tables:
+            handle_test_entry<z80_machine<z80_table_cpu>, z80_disasm>(input);
             break;
         case cpu_kind::unknown:
             unreachable("Unknown CPU.");
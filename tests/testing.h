@@ -0,0 +1,65 @@
+// Helpers shared by the tests of the machine modules.
+
+#ifndef Z80_TESTING_H
+#define Z80_TESTING_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+
+#include "z80.h"
+
+// The build defines it to the name of the test executable.
+#ifndef TEST_NAME
+#define TEST_NAME "test"
+#endif
+
+namespace testing {
+
+// Reports the failure, optionally with the name of the
+// configuration being tested, and exits.
+[[noreturn]] inline void error(const char *msg, const char *name = nullptr) {
+    if(name)
+        std::fprintf(stderr, "%s: %s: %s\n", TEST_NAME, name, msg);
+    else
+        std::fprintf(stderr, "%s: %s\n", TEST_NAME, msg);
+    std::exit(EXIT_FAILURE);
+}
+
+inline void check(bool cond, const char *msg, const char *name = nullptr) {
+    if(!cond)
+        error(msg, name);
+}
+
+// Adds what most tests need on top of a machine: loading code
+// and counting steps, which tells whether modules that skip
+// instructions have done so.
+template<typename B>
+class machine : public B {
+public:
+    typedef B base;
+    typedef typename base::ticks_type ticks_type;
+
+    void load(std::initializer_list<z80::least_u8> code,
+              z80::fast_u16 addr = 0) {
+        for(z80::least_u8 n : code)
+            base::write(addr++, n);
+    }
+
+    void on_step() {
+        ++num_steps;
+        base::on_step();
+    }
+
+    // Runs to the tick regardless of the events raised on the way.
+    void run_to(ticks_type tick) {
+        while(base::get_ticks() < tick)
+            base::run_until(tick);
+    }
+
+    unsigned long num_steps = 0;
+};
+
+}  // namespace testing
+
+#endif  // Z80_TESTING_H
@@ -0,0 +1,190 @@
+// Test writing and reading execution traces.
+
+#include <vector>
+
+#include "z80_trace.h"
+#include "testing.h"
+
+using z80::fast_u8;
+using z80::fast_u16;
+using z80::fast_u64;
+using z80::trace_record;
+using z80::trace_record_kind;
+using testing::check;
+
+namespace {
+
+class random_numbers {
+public:
+    unsigned get(unsigned n) {
+        state = state * 6364136223846793005u + 1442695040888963407u;
+        return static_cast<unsigned>((state >> 33) % n);
+    }
+
+private:
+    fast_u64 state = 1;
+};
+
+// Enough instructions to span a number of blocks.
+const unsigned num_instrs = 500000;
+
+std::vector<trace_record> generate() {
+    std::vector<trace_record> records;
+    random_numbers rnd;
+    fast_u64 ticks = 0;
+    fast_u16 pc = 0;
+    for(unsigned n = 1; n <= num_instrs; ++n) {
+        trace_record r = {};
+        r.kind = trace_record_kind::instr;
+        r.num_instrs = n;
+
+        // Mostly sequential code with occasional jumps and long
+        // instructions.
+        unsigned k = rnd.get(100);
+        pc = z80::add16(pc, k < 5 ? static_cast<fast_u16>(rnd.get(0x10000)) :
+                                    static_cast<fast_u16>(k % 4 + 1));
+        ticks += k < 2 ? rnd.get(1000000) : 4 + rnd.get(20);
+        r.ticks = ticks;
+        r.pc = pc;
+        records.push_back(r);
+
+        if(k >= 95) {
+            r.kind = trace_record_kind::regs;
+            r.num_regs = rnd.get(trace_record::max_regs + 1);
+            for(unsigned i = 0; i != r.num_regs; ++i)
+                r.regs[i] = static_cast<fast_u16>(rnd.get(0x10000));
+            records.push_back(r);
+        } else if(k >= 80) {
+            r.kind = k % 2 ? trace_record_kind::read :
+                             trace_record_kind::write;
+            r.addr = static_cast<fast_u16>(rnd.get(0x10000));
+            r.value = static_cast<fast_u8>(rnd.get(0x100));
+            records.push_back(r);
+        }
+    }
+    return records;
+}
+
+void write(const char *path, const std::vector<trace_record> &records) {
+    z80::trace_writer w;
+    check(w.open(path), "cannot open a trace for writing");
+    for(const trace_record &r : records) {
+        switch(r.kind) {
+        case trace_record_kind::instr:
+            w.record_instr(r.ticks, r.pc);
+            break;
+        case trace_record_kind::regs:
+            w.record_regs(r.regs, r.num_regs);
+            break;
+        case trace_record_kind::read:
+            w.record_read(r.addr, r.value);
+            break;
+        case trace_record_kind::write:
+            w.record_write(r.addr, r.value);
+            break;
+        }
+    }
+    check(w.get_num_instrs() == num_instrs, "wrong number of instructions");
+    check(w.close(), "cannot write a trace");
+}
+
+bool are_equal(const trace_record &a, const trace_record &b) {
+    if(a.kind != b.kind || a.num_instrs != b.num_instrs ||
+           a.ticks != b.ticks || a.pc != b.pc)
+        return false;
+    switch(a.kind) {
+    case trace_record_kind::instr:
+        return true;
+    case trace_record_kind::regs:
+        if(a.num_regs != b.num_regs)
+            return false;
+        for(unsigned i = 0; i != a.num_regs; ++i) {
+            if(a.regs[i] != b.regs[i])
+                return false;
+        }
+        return true;
+    case trace_record_kind::read:
+    case trace_record_kind::write:
+        return a.addr == b.addr && a.value == b.value;
+    }
+    return false;
+}
+
+void check_read(const char *path, const std::vector<trace_record> &records) {
+    z80::trace_reader rd;
+    check(rd.open(path), "cannot open a trace for reading");
+    check(rd.get_num_blocks() > 4, "too few blocks");
+    check(rd.get_num_instrs() == num_instrs, "wrong number of instructions");
+
+    trace_record r;
+    for(const trace_record &expected : records) {
+        check(rd.read(r), "the trace ends early");
+        check(are_equal(r, expected), "wrong record");
+    }
+    check(!rd.read(r) && !rd.has_failed(), "the trace does not end");
+
+    // Seek to ticks of some instructions, to ticks between them
+    // and past the end.
+    random_numbers rnd;
+    for(unsigned n = 0; n != 100; ++n) {
+        const trace_record &target = records[rnd.get(
+            static_cast<unsigned>(records.size()))];
+        fast_u64 ticks = target.ticks - rnd.get(2);
+        check(rd.seek_to_ticks(ticks), "cannot seek");
+
+        const trace_record *expected = nullptr;
+        for(const trace_record &e : records) {
+            if(e.kind == trace_record_kind::instr && e.ticks >= ticks) {
+                expected = &e;
+                break;
+            }
+        }
+        check(rd.read(r) && are_equal(r, *expected), "wrong seek position");
+    }
+    check(rd.seek_to_ticks(records.back().ticks + 1) && !rd.read(r),
+          "seeking past the end");
+
+    for(unsigned n = 0; n != 100; ++n) {
+        fast_u64 instr = n == 0 ? 0 : rnd.get(num_instrs);
+        check(rd.seek_to_instr(instr) && rd.read(r) &&
+                  r.kind == trace_record_kind::instr &&
+                  r.num_instrs == instr + 1,
+              "wrong instruction seek position");
+    }
+    check(rd.seek_to_instr(num_instrs) && !rd.read(r),
+          "seeking past the last instruction");
+}
+
+}  // anonymous namespace
+
+int main() {
+    const char path[] = "trace.z80t";
+    std::vector<trace_record> records = generate();
+    write(path, records);
+    check_read(path, records);
+
+    // Drop the index as if the trace has not been closed.
+    std::FILE *f = std::fopen(path, "rb");
+    check(f != nullptr, "cannot open the trace");
+    std::vector<char> image;
+    char buff[4096];
+    std::size_t n;
+    while((n = std::fread(buff, 1, sizeof(buff), f)) != 0)
+        image.insert(image.end(), buff, buff + n);
+    std::fclose(f);
+    std::size_t num_blocks;
+    {
+        z80::trace_reader rd;
+        check(rd.open(path), "cannot open the trace");
+        num_blocks = rd.get_num_blocks();
+    }
+    std::size_t index_size = num_blocks * (8 + 34) + 8 + 8 + 8;
+    f = std::fopen(path, "wb");
+    check(f != nullptr, "cannot truncate the trace");
+    check(std::fwrite(&image[0], 1, image.size() - index_size, f) ==
+              image.size() - index_size, "cannot truncate the trace");
+    std::fclose(f);
+    check_read(path, records);
+
+    std::remove(path);
+}
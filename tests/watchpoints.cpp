@@ -0,0 +1,175 @@
+// Test breakpoints and read and write watchpoints, also with the
+// modules that skip execution of instructions.
+
+#include <initializer_list>
+
+#include "z80.h"
+#include "testing.h"
+
+using z80::events_mask;
+using z80::least_u8;
+using testing::check;
+
+namespace {
+
+using testing::machine;
+
+class plain_machine : public machine<z80::z80_machine<plain_machine>> {};
+class block_machine : public machine<
+    z80::block_fast_path<z80::z80_machine<block_machine>>> {};
+class halt_machine : public machine<
+    z80::halt_fast_forward<z80::z80_machine<halt_machine>>> {};
+class idle_machine : public machine<
+    z80::idle_loop_fast_forward<z80::z80_machine<idle_machine>>> {};
+
+void test_plain() {
+    static plain_machine m;
+    m.load({
+        0x21, 0x00, 0x80,  // ld hl, 0x8000
+        0x7e,              // loop: ld a, (hl)
+        0x23,              // inc hl
+        0x77,              // ld (hl), a
+        0x18, 0xfb,        // jr loop
+    }, 0x0000);
+    m.set_ticks_per_frame(0);
+
+    // The read of the ld a, (hl) at 0x8010.
+    m.set_read_watchpoint(0x8010);
+    check(m.run_for(100000) == events_mask::read_watch_hit,
+          "read watchpoint is not hit");
+    check(m.get_read_watch_hit().addr == 0x8010 && m.get_pc() == 0x0004,
+          "wrong read watch hit");
+    check(m.get_read_watch_hit().tick == 10 + 32 * 16 + 4,
+          "wrong read watch tick");
+
+    // Writes to the range; the ld (hl), a after the read writes
+    // to 0x8011.
+    m.clear_read_watchpoint(0x8010);
+    m.set_write_watchpoint(0x8012, 0x100);
+    check(m.run_for(100000) == events_mask::write_watch_hit,
+          "write watchpoint is not hit");
+    check(m.get_write_watch_hit().addr == 0x8012 && m.get_pc() == 0x0006,
+          "wrong write watch hit");
+    check(m.get_write_watch_hit().tick == 10 + 32 * 17 + 7 + 6 + 4,
+          "wrong write watch tick");
+    check(m.run_for(100000) == events_mask::write_watch_hit &&
+              m.get_write_watch_hit().addr == 0x8013,
+          "write watch range is not hit");
+
+    // Clearing a part of the range leaves the rest watched.
+    m.clear_write_watchpoint(0x8012, 0xf0);
+    check(m.run_for(100000) == events_mask::write_watch_hit &&
+              m.get_write_watch_hit().addr == 0x8102,
+          "cleared addresses are still watched");
+    m.clear_write_watchpoint(0x8102, 0x10);
+    check(!m.has_marked_addrs(0x0000, 0x10000, 0xff),
+          "addresses are left marked");
+
+    // Breakpoints record hits the same way.
+    m.set_breakpoint(0x0003);
+    check(m.run_for(100000) == events_mask::breakpoint_hit &&
+              m.get_breakpoint_hit().addr == 0x0003 &&
+              m.get_breakpoint_hit().tick <= m.get_ticks() &&
+              m.get_breakpoint_hit().tick + 12 >= m.get_ticks(),
+          "breakpoint is not hit");
+    m.clear_breakpoint(0x0003);
+    check(m.run_for(100000) == events_mask::ticks_limit_hit,
+          "cleared breakpoint is still hit");
+}
+
+// Runs both machines to the next 'num_stops' events and checks
+// they stop in the same state.
+template<typename F>
+void check_same_stops(plain_machine &p, F &f, unsigned num_stops,
+                      const char *msg) {
+    for(unsigned i = 0; i != num_stops; ++i) {
+        events_mask::type events = p.run_for(1000000);
+        check(events != events_mask::ticks_limit_hit, msg);
+        check(f.run_for(1000000) == events &&
+                  f.get_ticks() == p.get_ticks() &&
+                  f.get_pc() == p.get_pc() && f.get_bc() == p.get_bc() &&
+                  f.get_de() == p.get_de() && f.get_hl() == p.get_hl(),
+              msg);
+    }
+}
+
+template<typename M>
+void load_ldir(M &m) {
+    m.load({
+        0x21, 0x00, 0x40,  // loop: ld hl, 0x4000
+        0x11, 0x00, 0x80,  // ld de, 0x8000
+        0x01, 0x00, 0x10,  // ld bc, 0x1000
+        0xed, 0xb0,        // ldir
+        0x18, 0xf3,        // jr loop
+    }, 0x0000);
+    m.set_ticks_per_frame(0);
+}
+
+// Block instructions stop on the iteration that hits.
+void test_block_fast_path() {
+    static plain_machine p;
+    static block_machine f;
+    load_ldir(p);
+    load_ldir(f);
+
+    p.set_write_watchpoint(0x8000);
+    f.set_write_watchpoint(0x8000);
+    check(p.run_for(1000000) == events_mask::write_watch_hit &&
+              p.get_ticks() == 30 + 21 && p.get_bc() == 0x0fff,
+          "LDIR does not stop on write watch");
+    check(f.run_for(1000000) == events_mask::write_watch_hit &&
+              f.get_ticks() == p.get_ticks() && f.get_bc() == p.get_bc(),
+          "fast LDIR does not stop on write watch");
+    check_same_stops(p, f, 3, "fast LDIR skips write watch");
+    p.clear_write_watchpoint(0x8000);
+    f.clear_write_watchpoint(0x8000);
+
+    // Marks anywhere on the page the bytes are on.
+    p.set_read_watchpoint(0x48ff);
+    f.set_read_watchpoint(0x48ff);
+    check_same_stops(p, f, 3, "fast LDIR skips read watch");
+    p.clear_read_watchpoint(0x48ff);
+    f.clear_read_watchpoint(0x48ff);
+
+    p.set_breakpoint(0x0009);
+    f.set_breakpoint(0x0009);
+    check_same_stops(p, f, 3, "fast LDIR skips breakpoint");
+}
+
+// Halted CPUs fetch the HALT instruction on every step.
+void test_halt_fast_forward() {
+    static plain_machine p;
+    static halt_machine f;
+    p.load({0x76}, 0x0000);  // halt
+    f.load({0x76}, 0x0000);
+    p.set_breakpoint(0x0000);
+    f.set_breakpoint(0x0000);
+    check_same_stops(p, f, 10, "fast HALT skips breakpoint");
+}
+
+// Iterations of polling loops that hit watchpoints are executed.
+void test_idle_loop_fast_forward() {
+    static plain_machine p;
+    static idle_machine f;
+    const std::initializer_list<least_u8> code = {
+        0x3a, 0x00, 0x90,  // wait: ld a, (0x9000)
+        0xb7,              // or a
+        0x28, 0xfa,        // jr z, wait
+    };
+    p.load(code, 0x0000);
+    f.load(code, 0x0000);
+    p.write(0x9000, 0x00);
+    f.write(0x9000, 0x00);
+    p.set_read_watchpoint(0x9000);
+    f.set_read_watchpoint(0x9000);
+    check_same_stops(p, f, 10, "polling loop skips read watch");
+}
+
+}  // anonymous namespace
+
+int main() {
+    test_plain();
+    test_block_fast_path();
+    test_halt_fast_forward();
+    test_idle_loop_fast_forward();
+}
@@ -36,6 +36,8 @@ def language_python(**kwargs):
       install:
         - python setup.py install
       script:
+        - python setup.py build_ext --inplace
+        - python -m unittest tests.test_machine
         - cd examples
         - ./exercisers.py'''.format(**kwargs))
 
@@ -15,10 +15,37 @@
 #include <climits>
 #include <cstdint>
 #include <cstdio>
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <type_traits>
 #include <utility>
+#include <vector>
 #include <iostream>
 
+// A few handlers are virtual so that derived classes can mark
+// their implementations with 'override'. Define
+// Z80_NO_VIRTUAL_HANDLERS to resolve all handlers via self()
+// alone, which saves indirect calls and a vtable pointer per
+// instance.
+#ifdef Z80_NO_VIRTUAL_HANDLERS
+#define Z80_VIRTUAL
+#else
+#define Z80_VIRTUAL virtual
+#endif
+
+// Keeps rarely taken paths out of handlers that are inlined
+// into the decoder.
+#if defined(__GNUC__)
+#define Z80_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define Z80_NOINLINE __declspec(noinline)
+#else
+#define Z80_NOINLINE
+#endif
+
 namespace z80 {
 
 #if UINT_FAST8_MAX < UINT_MAX
@@ -34,6 +61,7 @@ typedef uint_fast16_t fast_u16;
 #endif
 
 typedef uint_fast32_t fast_u32;
+typedef uint_fast64_t fast_u64;
 
 typedef uint_least8_t least_u8;
 typedef uint_least16_t least_u16;
@@ -148,6 +176,9 @@ enum class block_ld {
 enum class block_cp {
   cpi, cpd, cpir, cpdr
 };
+enum class block_in {
+  ini, ind, inir, indr
+};
 enum class block_out {
   outi, outd, otir, otdr
 };
@@ -156,6 +187,33 @@ enum class condition {
   nz, z, nc, c, po, pe, p, m
 };
 
+// Control-flow classes of instructions.
+enum class instr_kind {
+  plain,      // Continues with the next instruction.
+  prefix,     // Op-code prefix; see the table for the prefixed space.
+  jump, cond_jump,
+  call, cond_call,
+  ret, cond_ret,
+  rst,
+  halt,
+  repeat      // Block instruction that may re-execute itself.
+};
+
+// Properties of an instruction known from its op-code alone, as
+// the executors implement it. For prefixed instructions the
+// size and ticks cover the prefixes and the x/y/z/p/q parts are
+// those of the last op-code. For conditional and repeating
+// instructions the ticks are those of the untaken and last
+// iteration path. The tables are maintained separately from the
+// decoders and executors; tests/instr_tables.cpp runs every
+// op-code and checks that they agree.
+struct instr_info {
+  least_u8 size;
+  least_u8 ticks;
+  instr_kind kind;
+  least_u8 x, y, z, p, q;
+};
+
 // Entities for internal needs of the library.
 class internals {
 private:
@@ -163,6 +221,278 @@ private:
   template<typename T>
   static constexpr bool get_false() { return false; }
 
+  // Op-codes known at compile time. Decoding functions accept
+  // them in place of fast_u8 values, in which case all the
+  // checks on the op-code fold to the selected handler.
+  template<unsigned n>
+  using opcode = std::integral_constant<fast_u8, n>;
+
+  template<unsigned... ns>
+  struct index_list {};
+
+  template<unsigned n, unsigned... ns>
+  struct make_index_list : make_index_list<n - 1, n - 1, ns...> {};
+
+  template<unsigned... ns>
+  struct make_index_list<0, ns...> {
+    typedef index_list<ns...> type;
+  };
+
+  typedef make_index_list<256>::type opcode_list;
+
+  // Instruction descriptor tables. The entries are constant
+  // expressions, so the tables are built at compile time.
+  class instr_tables {
+  public:
+    template<unsigned... ns>
+    static const instr_info *get_i8080_infos(index_list<ns...>) {
+      static const instr_info infos[] = { get_i8080_info(ns)... };
+      return infos;
+    }
+
+    template<unsigned... ns>
+    static const instr_info *get_z80_infos(index_list<ns...>) {
+      static const instr_info infos[] = { get_z80_info(ns)... };
+      return infos;
+    }
+
+    template<unsigned... ns>
+    static const instr_info *get_z80_cb_infos(index_list<ns...>) {
+      static const instr_info infos[] = { get_z80_cb_info(ns)... };
+      return infos;
+    }
+
+    template<unsigned... ns>
+    static const instr_info *get_z80_ed_infos(index_list<ns...>) {
+      static const instr_info infos[] = { get_z80_ed_info(ns)... };
+      return infos;
+    }
+
+    template<unsigned... ns>
+    static const instr_info *get_z80_index_infos(index_list<ns...>) {
+      static const instr_info infos[] = { get_z80_index_info(ns)... };
+      return infos;
+    }
+
+    template<unsigned... ns>
+    static const instr_info *get_z80_index_cb_infos(index_list<ns...>) {
+      static const instr_info infos[] = { get_z80_index_cb_info(ns)... };
+      return infos;
+    }
+
+  private:
+    static constexpr unsigned get_x(unsigned op) { return op >> 6; }
+    static constexpr unsigned get_y(unsigned op) { return (op >> 3) & 7; }
+    static constexpr unsigned get_z(unsigned op) { return op & 7; }
+    static constexpr unsigned get_p(unsigned op) { return (op >> 4) & 3; }
+    static constexpr unsigned get_q(unsigned op) { return (op >> 3) & 1; }
+
+    static constexpr instr_info make_info(unsigned op, unsigned size,
+                                          unsigned ticks,
+                                          instr_kind kind) {
+      return instr_info{static_cast<least_u8>(size),
+                        static_cast<least_u8>(ticks), kind,
+                        static_cast<least_u8>(get_x(op)),
+                        static_cast<least_u8>(get_y(op)),
+                        static_cast<least_u8>(get_z(op)),
+                        static_cast<least_u8>(get_p(op)),
+                        static_cast<least_u8>(get_q(op))};
+    }
+
+    static constexpr bool is_prefix(unsigned op) {
+      return op == 0xcb || op == 0xdd || op == 0xed || op == 0xfd;
+    }
+
+    // i8080.
+    static constexpr unsigned get_i8080_size(unsigned op) {
+      return get_x(op) == 0 ?
+                 (get_z(op) == 1 && get_q(op) == 0 ? 3 :
+                  get_z(op) == 2 && get_y(op) >= 4 ? 3 :
+                  get_z(op) == 6 ? 2 : 1) :
+             get_x(op) == 3 ?
+                 (get_z(op) == 2 || get_z(op) == 4 ? 3 :
+                  get_z(op) == 3 ? (get_y(op) <= 1 ? 3 :
+                                    get_y(op) <= 3 ? 2 : 1) :
+                  get_z(op) == 5 ? (get_q(op) == 1 ? 3 : 1) :
+                  get_z(op) == 6 ? 2 : 1) :
+             1;
+    }
+
+    static constexpr unsigned get_i8080_ticks(unsigned op) {
+      return get_x(op) == 0 ?
+                 (get_z(op) == 0 ? 4 :
+                  get_z(op) == 1 ? 10 :
+                  get_z(op) == 2 ? (get_y(op) < 4 ? 7 :
+                                    get_y(op) < 6 ? 16 : 13) :
+                  get_z(op) == 3 ? 5 :
+                  get_z(op) <= 5 ? (get_y(op) == 6 ? 10 : 5) :
+                  get_z(op) == 6 ? (get_y(op) == 6 ? 10 : 7) : 4) :
+             get_x(op) == 1 ?
+                 (op == 0x76 ? 7 :
+                  get_y(op) == 6 || get_z(op) == 6 ? 8 : 5) :
+             get_x(op) == 2 ?
+                 (get_z(op) == 6 ? 7 : 4) :
+             get_z(op) == 0 ? 5 :
+             get_z(op) == 1 ? (get_q(op) == 0 || get_p(op) <= 1 ? 10 : 5) :
+             get_z(op) == 2 ? 10 :
+             get_z(op) == 3 ? (get_y(op) <= 3 ? 10 :
+                               get_y(op) == 4 ? 18 :
+                               get_y(op) == 5 ? 5 : 4) :
+             get_z(op) == 4 ? 11 :
+             get_z(op) == 5 ? (get_q(op) == 0 ? 11 : 17) :
+             get_z(op) == 6 ? 7 : 11;
+    }
+
+    static constexpr instr_kind get_i8080_kind(unsigned op) {
+      return op == 0x76 ? instr_kind::halt :
+             get_x(op) != 3 ? instr_kind::plain :
+             get_z(op) == 0 ? instr_kind::cond_ret :
+             get_z(op) == 1 ? (get_q(op) == 0 ? instr_kind::plain :
+                               get_p(op) <= 1 ? instr_kind::ret :
+                               get_p(op) == 2 ? instr_kind::jump :
+                               instr_kind::plain) :
+             get_z(op) == 2 ? instr_kind::cond_jump :
+             get_z(op) == 3 ? (get_y(op) <= 1 ? instr_kind::jump :
+                               instr_kind::plain) :
+             get_z(op) == 4 ? instr_kind::cond_call :
+             get_z(op) == 5 ? (get_q(op) == 1 ? instr_kind::call :
+                               instr_kind::plain) :
+             get_z(op) == 7 ? instr_kind::rst : instr_kind::plain;
+    }
+
+    static constexpr instr_info get_i8080_info(unsigned op) {
+      return make_info(op, get_i8080_size(op), get_i8080_ticks(op),
+                       get_i8080_kind(op));
+    }
+
+    // Z80, unprefixed.
+    static constexpr unsigned get_z80_size(unsigned op) {
+      return is_prefix(op) ? 1 :
+             get_x(op) == 0 ?
+                 (get_z(op) == 0 ? (get_y(op) >= 2 ? 2 : 1) :
+                  get_z(op) == 1 ? (get_q(op) == 0 ? 3 : 1) :
+                  get_z(op) == 2 ? (get_y(op) >= 4 ? 3 : 1) :
+                  get_z(op) == 6 ? 2 : 1) :
+             get_x(op) == 3 ?
+                 (get_z(op) == 2 || get_z(op) == 4 ? 3 :
+                  get_z(op) == 3 ? (get_y(op) == 0 ? 3 :
+                                    get_y(op) <= 3 ? 2 : 1) :
+                  get_z(op) == 5 ? (op == 0xcd ? 3 : 1) :
+                  get_z(op) == 6 ? 2 : 1) :
+             1;
+    }
+
+    static constexpr unsigned get_z80_ticks(unsigned op) {
+      return is_prefix(op) ? 4 :
+             get_x(op) == 0 ?
+                 (get_z(op) == 0 ? (get_y(op) <= 1 ? 4 :
+                                    get_y(op) == 2 ? 8 :
+                                    get_y(op) == 3 ? 12 : 7) :
+                  get_z(op) == 1 ? (get_q(op) == 0 ? 10 : 11) :
+                  get_z(op) == 2 ? (get_y(op) < 4 ? 7 :
+                                    get_y(op) < 6 ? 16 : 13) :
+                  get_z(op) == 3 ? 6 :
+                  get_z(op) <= 5 ? (get_y(op) == 6 ? 11 : 4) :
+                  get_z(op) == 6 ? (get_y(op) == 6 ? 10 : 7) : 4) :
+             get_x(op) == 1 ?
+                 (op != 0x76 && (get_y(op) == 6 || get_z(op) == 6) ? 7 : 4) :
+             get_x(op) == 2 ?
+                 (get_z(op) == 6 ? 7 : 4) :
+             get_z(op) == 0 ? 5 :
+             get_z(op) == 1 ? (get_q(op) == 0 || get_p(op) == 0 ? 10 :
+                               get_p(op) == 3 ? 6 : 4) :
+             get_z(op) == 2 ? 10 :
+             get_z(op) == 3 ? (get_y(op) == 0 ? 10 :
+                               get_y(op) <= 3 ? 11 :
+                               get_y(op) == 4 ? 19 : 4) :
+             get_z(op) == 4 ? 10 :
+             get_z(op) == 5 ? (get_q(op) == 0 ? 11 : 17) :
+             get_z(op) == 6 ? 7 : 11;
+    }
+
+    static constexpr instr_kind get_z80_kind(unsigned op) {
+      return is_prefix(op) ? instr_kind::prefix :
+             op == 0x76 ? instr_kind::halt :
+             op == 0x18 ? instr_kind::jump :
+             op == 0x10 || (get_x(op) == 0 && get_z(op) == 0 &&
+                            get_y(op) >= 4) ? instr_kind::cond_jump :
+             get_x(op) != 3 ? instr_kind::plain :
+             get_z(op) == 0 ? instr_kind::cond_ret :
+             op == 0xc9 ? instr_kind::ret :
+             op == 0xe9 || op == 0xc3 ? instr_kind::jump :
+             get_z(op) == 2 ? instr_kind::cond_jump :
+             get_z(op) == 4 ? instr_kind::cond_call :
+             op == 0xcd ? instr_kind::call :
+             get_z(op) == 7 ? instr_kind::rst : instr_kind::plain;
+    }
+
+    static constexpr instr_info get_z80_info(unsigned op) {
+      return make_info(op, get_z80_size(op), get_z80_ticks(op),
+                       get_z80_kind(op));
+    }
+
+    // Z80, CB-prefixed.
+    static constexpr instr_info get_z80_cb_info(unsigned op) {
+      return make_info(op, 2,
+                       get_z(op) != 6 ? 8 : get_x(op) == 1 ? 12 : 15,
+                       instr_kind::plain);
+    }
+
+    // Z80, ED-prefixed.
+    static constexpr unsigned get_z80_ed_ticks(unsigned op) {
+      return get_x(op) == 1 ?
+                 (get_z(op) <= 1 ? 12 :
+                  get_z(op) == 2 ? 15 :
+                  get_z(op) == 3 ? 20 :
+                  get_z(op) == 4 ? 8 :
+                  get_z(op) == 5 ? 14 :
+                  get_z(op) == 6 ? 8 :
+                  get_y(op) <= 3 ? 9 :
+                  get_y(op) <= 5 ? 18 : 8) :
+             get_x(op) == 2 && get_z(op) <= 3 && get_y(op) >= 4 ? 16 : 8;
+    }
+
+    static constexpr instr_kind get_z80_ed_kind(unsigned op) {
+      return get_x(op) == 1 && get_z(op) == 5 ? instr_kind::ret :
+             get_x(op) == 2 && get_z(op) <= 3 &&
+                 get_y(op) >= 6 ? instr_kind::repeat : instr_kind::plain;
+    }
+
+    static constexpr instr_info get_z80_ed_info(unsigned op) {
+      return make_info(op, get_x(op) == 1 && get_z(op) == 3 ? 4 : 2,
+                       get_z80_ed_ticks(op), get_z80_ed_kind(op));
+    }
+
+    // Z80, DD- and FD-prefixed. Instructions that refer to (HL)
+    // take a displacement and access (IX+d) or (IY+d) instead.
+    static constexpr bool is_z80_indexed(unsigned op) {
+      return (get_x(op) == 1 && op != 0x76 &&
+                  (get_y(op) == 6 || get_z(op) == 6)) ||
+             (get_x(op) == 2 && get_z(op) == 6) ||
+             (get_x(op) == 0 && get_y(op) == 6 &&
+                  get_z(op) >= 4 && get_z(op) <= 6);
+    }
+
+    static constexpr instr_info get_z80_index_info(unsigned op) {
+      return is_prefix(op) ?
+                 make_info(op, 1, 4, instr_kind::prefix) :
+             is_z80_indexed(op) ?
+                 make_info(op, get_z80_size(op) + 2,
+                           get_z80_ticks(op) + (op == 0x36 ? 9 : 12),
+                           get_z80_kind(op)) :
+             make_info(op, get_z80_size(op) + 1, get_z80_ticks(op) + 4,
+                       get_z80_kind(op));
+    }
+
+    // Z80, DD CB- and FD CB-prefixed. BIT forms that specify a
+    // register are executed without accessing memory.
+    static constexpr instr_info get_z80_index_cb_info(unsigned op) {
+      return make_info(op, 4,
+                       get_x(op) != 1 ? 23 : get_z(op) == 6 ? 20 : 16,
+                       instr_kind::plain);
+    }
+  };
+
   template<typename B>
   class decoder_base;
 
@@ -172,10 +502,13 @@ private:
   template<typename B>
   class cpu_state_base;
 
+  template<typename B>
+  class packed_state_base;
+
   template<typename B>
   class executor_base;
 
-  template<typename D> friend
+  template<typename D, unsigned F> friend
   class root;
 
   template<typename B> friend
@@ -196,6 +529,12 @@ private:
   template<typename B> friend
   class z80_state;
 
+  template<typename B> friend
+  class packed_i8080_state;
+
+  template<typename B> friend
+  class packed_z80_state;
+
   template<typename B> friend
   class i8080_executor;
 
@@ -203,11 +542,32 @@ private:
   class z80_executor;
 };
 
-template<typename D>
+// Parts of the CPU state many machines never observe. Features
+// that basic_i8080_cpu<> and basic_z80_cpu<> are instantiated
+// without compile out the code that maintains them. The address
+// bus handler is then never called, WZ is not updated and R is
+// not incremented on M1 cycles.
+class cpu_features {
+public:
+  typedef unsigned type;
+
+  static const type addr_bus = 1u << 0;
+  static const type wz = 1u << 1;
+  static const type r_reg = 1u << 2;
+
+  static const type none = 0;
+  static const type all = addr_bus | wz | r_reg;
+};
+
+template<typename D, cpu_features::type F = cpu_features::all>
 class root {
 public:
   typedef D derived;
 
+  static constexpr bool has_feature(cpu_features::type f) {
+    return (F & f) != 0;
+  }
+
   iregp on_get_iregp_kind() const { return iregp::hl; }
 
   void on_set_iregp_kind(iregp r) { unused(r); }
@@ -270,7 +630,7 @@ public:
 
   fast_u16 on_get_pc() const { return 0; }
 
-  virtual void on_set_pc(fast_u16 n) { unused(n); }
+  Z80_VIRTUAL void on_set_pc(fast_u16 n) { unused(n); }
 
   fast_u16 on_get_sp() const { return 0; }
 
@@ -379,26 +739,35 @@ public:
                   "on_exx_regs() has to be implemented!");
   }
 
-  virtual fast_u8 on_read(fast_u16 addr) {
+  Z80_VIRTUAL fast_u8 on_read(fast_u16 addr) {
     unused(addr);
     return 0x00;
   }
 
-  virtual void on_write(fast_u16 addr, fast_u8 n) {
+  Z80_VIRTUAL void on_write(fast_u16 addr, fast_u8 n) {
     unused(addr, n);
   }
 
   // TODO: Should we provide separate 8-bit and 16-bit versions
   //       of these?
-  virtual fast_u8 on_input(fast_u16 port) {
+  Z80_VIRTUAL fast_u8 on_input(fast_u16 port) {
     unused(port);
     return 0xff;
   }
 
-  virtual void on_output(fast_u16 port, fast_u8 n) {
+  Z80_VIRTUAL void on_output(fast_u16 port, fast_u8 n) {
     unused(port, n);
   }
 
+  // Returns the byte the interrupting device puts on the data bus
+  // when a maskable interrupt is acknowledged. In mode 0 it is
+  // executed as an instruction, in mode 1 it is ignored and in
+  // mode 2 it is the low byte of the vector address. The bus is
+  // pulled up by default.
+  fast_u8 on_int_ack() {
+    return 0xff;
+  }
+
   void on_tick(unsigned t) {
     unused(t);
   }
@@ -421,7 +790,8 @@ public:
   }
 
   fast_u8 on_read_cycle(fast_u16 addr) {
-    self().on_set_addr_bus(addr);
+    if (has_feature(cpu_features::addr_bus))
+      self().on_set_addr_bus(addr);
     fast_u8 n = self().on_read(addr);
     self().on_tick(3);
     return n;
@@ -436,7 +806,8 @@ public:
   }
 
   void on_write_cycle(fast_u16 addr, fast_u8 n) {
-    self().on_set_addr_bus(addr);
+    if (has_feature(cpu_features::addr_bus))
+      self().on_set_addr_bus(addr);
     self().on_write(addr, n);
     self().on_tick(3);
   }
@@ -510,8 +881,18 @@ template<typename B>
 class internals::decoder_base : public B {
 public:
   typedef B base;
+  typedef typename B::derived derived;
+
+  // Executes an instruction whose op-code has already been
+  // fetched.
+  typedef void (*decode_handler)(derived &d);
 
   void on_decode(fast_u8 op) {
+    self().decode_opcode(op);
+  }
+
+  template<typename T>
+  void decode_opcode(T op) {
     fast_u8 y = get_y_part(op);
     fast_u8 z = get_z_part(op);
     fast_u8 p = get_p_part(op);
@@ -813,13 +1194,34 @@ public:
     unreachable("Unknown opcode encountered!");
   }
 
-  void on_fetch_and_decode() {
+  void fetch_and_decode() {
     self().on_decode(self().on_m1_fetch_cycle());
   }
 
+  void on_fetch_and_decode() {
+    fetch_and_decode();
+  }
+
+  template<unsigned n>
+  static void decode_opcode_handler(derived &d) {
+    d.decode_opcode(internals::opcode<n>());
+  }
+
+  void dispatch_opcode(fast_u8 op) {
+    get_decode_handlers(internals::opcode_list())[op](self());
+  }
+
 protected:
   using base::self;
 
+  template<unsigned... ns>
+  static const decode_handler *get_decode_handlers(
+      internals::index_list<ns...>) {
+    static const decode_handler handlers[] = {
+        &decode_opcode_handler<ns>... };
+    return handlers;
+  }
+
   static const fast_u8 x_mask = 0300;
 
   static const fast_u8 y_mask = 0070;
@@ -841,6 +1243,10 @@ template<typename B>
 class i8080_decoder : public internals::decoder_base<B> {
 public:
   typedef internals::decoder_base<B> base;
+  static const instr_info &get_instr_info(fast_u8 op) {
+    return internals::instr_tables::get_i8080_infos(
+        internals::opcode_list())[op];
+  }
 
   void on_decode_alu_r(alu k, reg r) {
     self().on_alu_r(k, r);
@@ -952,6 +1358,12 @@ template<typename B>
 class z80_decoder : public internals::decoder_base<B> {
 public:
   typedef internals::decoder_base<B> base;
+  typedef typename base::derived derived;
+  typedef typename base::decode_handler decode_handler;
+
+  // Executes a CB-prefixed instruction whose displacement and
+  // op-code have already been read.
+  typedef void (*cb_decode_handler)(derived &d, fast_u8 disp);
 
   z80_decoder() {}
 
@@ -1055,21 +1467,20 @@ public:
   }
 
   void on_decode_cb_prefix() {
-    fast_u8 d = 0;
-    iregp irp = self().on_get_iregp_kind();
-    if (irp != iregp::hl)
-      d = self().on_disp_read();
+    fast_u8 d = read_cb_disp();
+    fast_u8 op = fetch_cb_opcode();
+    decode_cb_opcode(op, d);
+  }
 
-    fast_u8 op;
-    if (irp == iregp::hl) {
-      op = self().on_m1_fetch_cycle();
-    } else {
-      // In ddcb- and fdcb-prefixed instructions the
-      // reading of the 3rd opcode is not an M1 cycle.
-      op = self().on_fetch_cycle();
-      self().on_fetch_cycle_extra_1t();
-    }
+  template<typename T>
+  void decode_cb_prefix(T op) {
+    fast_u8 d = read_cb_disp();
+    fetch_cb_opcode();
+    decode_cb_opcode(op, d);
+  }
 
+  template<typename T>
+  void decode_cb_opcode(T op, fast_u8 d) {
     fast_u8 y = get_y_part(op);
     fast_u8 z = get_z_part(op);
 
@@ -1114,7 +1525,11 @@ public:
   }
 
   void on_decode_ed_prefix() {
-    fast_u8 op = self().on_m1_fetch_cycle();
+    decode_ed_opcode(self().on_m1_fetch_cycle());
+  }
+
+  template<typename T>
+  void decode_ed_opcode(T op) {
     fast_u8 y = get_y_part(op);
     fast_u8 p = get_p_part(op);
 
@@ -1212,10 +1627,11 @@ public:
           auto k = static_cast<block_cp>(n);
           return self().on_block_cp(k);
         }
-        case 2:
-          std::fprintf(stderr, "Error at PC = 0x%04lx\n", self().get_pc());
-          assert(0);  // TODO
-          return;
+        case 2: {
+          // INI, IND, INIR, INDR  f(4) f(5) i(4) w(3) + e(5)
+          auto k = static_cast<block_in>(n);
+          return self().on_block_in(k);
+        }
         case 3: {
           // OUTI, OUTD, OTIR, OTDR  f(4) f(5) r(3) o(4) + e(5)
           auto k = static_cast<block_out>(n);
@@ -1227,8 +1643,9 @@ public:
     return self().on_ed_xnop(op);
   }
 
-  void on_decode(fast_u8 op) {
-    base::on_decode(op);
+  template<typename T>
+  void decode_opcode(T op) {
+    base::decode_opcode(op);
 
     // Reset current index register.
     if (op != 0xdd && op != 0xfd)
@@ -1236,9 +1653,73 @@ public:
     // std::printf("reset irp  %04lx\n", self().get_pc());
   }
 
+  template<unsigned n>
+  static void decode_cb_opcode_handler(derived &d, fast_u8 disp) {
+    d.decode_cb_opcode(internals::opcode<n>(), disp);
+  }
+
+  template<unsigned n>
+  static void decode_ed_opcode_handler(derived &d) {
+    d.decode_ed_opcode(internals::opcode<n>());
+  }
+
+  void dispatch_cb_prefix() {
+    fast_u8 d = read_cb_disp();
+    fast_u8 op = fetch_cb_opcode();
+    get_cb_decode_handlers(internals::opcode_list())[op](self(), d);
+  }
+
+  void dispatch_ed_prefix() {
+    fast_u8 op = self().on_m1_fetch_cycle();
+    get_ed_decode_handlers(internals::opcode_list())[op](self());
+  }
+
+  // Descriptors of unprefixed, CB-, ED-, DD/FD- and DD/FD
+  // CB-prefixed instructions, respectively.
+  static const instr_info &get_instr_info(fast_u8 op) {
+    return internals::instr_tables::get_z80_infos(
+        internals::opcode_list())[op];
+  }
+
+  static const instr_info &get_cb_instr_info(fast_u8 op) {
+    return internals::instr_tables::get_z80_cb_infos(
+        internals::opcode_list())[op];
+  }
+
+  static const instr_info &get_ed_instr_info(fast_u8 op) {
+    return internals::instr_tables::get_z80_ed_infos(
+        internals::opcode_list())[op];
+  }
+
+  static const instr_info &get_index_instr_info(fast_u8 op) {
+    return internals::instr_tables::get_z80_index_infos(
+        internals::opcode_list())[op];
+  }
+
+  static const instr_info &get_index_cb_instr_info(fast_u8 op) {
+    return internals::instr_tables::get_z80_index_cb_infos(
+        internals::opcode_list())[op];
+  }
+
 protected:
   using base::self;
 
+  template<unsigned... ns>
+  static const cb_decode_handler *get_cb_decode_handlers(
+      internals::index_list<ns...>) {
+    static const cb_decode_handler handlers[] = {
+        &decode_cb_opcode_handler<ns>... };
+    return handlers;
+  }
+
+  template<unsigned... ns>
+  static const decode_handler *get_ed_decode_handlers(
+      internals::index_list<ns...>) {
+    static const decode_handler handlers[] = {
+        &decode_ed_opcode_handler<ns>... };
+    return handlers;
+  }
+
   using base::x_mask;
   using base::y_mask;
   using base::z_mask;
@@ -1254,6 +1735,21 @@ protected:
   }
 
 private:
+  fast_u8 read_cb_disp() {
+    return is_hl_iregp() ? 0 : self().on_disp_read();
+  }
+
+  fast_u8 fetch_cb_opcode() {
+    if (is_hl_iregp())
+      return self().on_m1_fetch_cycle();
+
+    // In ddcb- and fdcb-prefixed instructions the
+    // reading of the 3rd opcode is not an M1 cycle.
+    fast_u8 op = self().on_fetch_cycle();
+    self().on_fetch_cycle_extra_1t();
+    return op;
+  }
+
   fast_u8 read_disp_or_null(bool may_need_disp = true) {
     if (is_hl_iregp() || !may_need_disp)
       return 0;
@@ -1842,6 +2338,11 @@ public:
         out.append(get_mnemonic(k));
         break;
       }
+      case 'B': {  // A block in instruction.
+        auto k = get_arg<block_in>(args);
+        out.append(get_mnemonic(k));
+        break;
+      }
       case 'T': {  // A block out instruction.
         auto k = get_arg<block_out>(args);
         out.append(get_mnemonic(k));
@@ -1878,6 +2379,10 @@ public:
     self().on_format("L", k);
   }
 
+  void on_block_in(block_in k) {
+    self().on_format("B", k);
+  }
+
   void on_block_out(block_out k) {
     self().on_format("T", k);
   }
@@ -2326,6 +2831,20 @@ public:
     unreachable("Unknown block compare operation.");
   }
 
+  static const char *get_mnemonic(block_in k) {
+    switch (k) {
+      case block_in::ini:
+        return "ini";
+      case block_in::ind:
+        return "ind";
+      case block_in::inir:
+        return "inir";
+      case block_in::indr:
+        return "indr";
+    }
+    unreachable("Unknown block input operation.");
+  }
+
   static const char *get_mnemonic(block_out k) {
     switch (k) {
       case block_out::outi:
@@ -2653,7 +3172,10 @@ public:
 
   fast_u16 on_get_wz() const { return get_wz(); }
 
-  void on_set_wz(fast_u16 n) { set_wz(n); }
+  void on_set_wz(fast_u16 n) {
+    if (base::has_feature(cpu_features::wz))
+      set_wz(n);
+  }
 
   bool get_iff1() const { return iff1.get(); }
 
@@ -2744,1112 +3266,2144 @@ private:
   int_mode im;
 };
 
-template<typename B>
-class internals::executor_base : public B {
+// Keeps the 16-bit registers of a CPU in a single packed array
+// that takes half a cache line. Values are stored in the byte
+// order of the host, so 16-bit registers are loaded and stored
+// directly and halves of register pairs are read as single
+// bytes. Halves are written by updating the whole register, as
+// loading a register right after storing one of its bytes would
+// make the host CPU wait for the byte to be stored.
+class packed_reg_file {
 public:
-  typedef B base;
+  // Register pairs come in the order of the 'regp' values.
+  enum index {
+    bc, de, hl, sp, af, pc, ix, iy, ir, wz,
+    alt_bc, alt_de, alt_hl, alt_af, num_regs
+  };
 
-  executor_base() {}
+  packed_reg_file() {}
 
-  fast_u16 get_pc_on_fetch() { return self().on_get_pc(); }
+  packed_reg_file(const packed_reg_file &other) = delete;
 
-  void set_pc_on_fetch(fast_u16 pc) { self().on_set_pc(pc); }
+  fast_u16 get(unsigned i) const {
+    least_u16 n;
+    std::memcpy(&n, &bytes[i * 2], sizeof(n));
+    return n;
+  }
 
-  fast_u16 get_pc_on_jump() { return self().on_get_pc(); }
+  void set(unsigned i, fast_u16 n) {
+    least_u16 v = static_cast<least_u16>(n);
+    std::memcpy(&bytes[i * 2], &v, sizeof(v));
+  }
 
-  void set_pc_on_jump(fast_u16 pc) { self().on_set_pc(pc); }
+  fast_u8 get_low(unsigned i) const { return bytes[i * 2 + low_byte]; }
 
-  fast_u16 get_pc_on_imm8_read() { return self().on_get_pc(); }
+  void set_low(unsigned i, fast_u8 n) { set(i, make16(get_high(i), n)); }
 
-  void set_pc_on_imm8_read(fast_u16 pc) { self().on_set_pc(pc); }
+  fast_u8 get_high(unsigned i) const { return bytes[i * 2 + high_byte]; }
 
-  fast_u16 get_pc_on_imm16_read() { return self().on_get_pc(); }
+  void set_high(unsigned i, fast_u8 n) { set(i, make16(n, get_low(i))); }
 
-  void set_pc_on_imm16_read(fast_u16 pc) { self().on_set_pc(pc); }
+  void swap(unsigned i, unsigned j) {
+    fast_u16 n = get(i);
+    set(i, get(j));
+    set(j, n);
+  }
 
-  fast_u16 get_pc_on_halt() { return self().on_get_pc(); }
+private:
+  static_assert(sizeof(least_u16) == 2, "Unsupported host.");
 
-  void set_pc_on_halt(fast_u16 pc) { self().on_set_pc(pc); }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  static const unsigned low_byte = 1;
+#else
+  static const unsigned low_byte = 0;
+#endif
+  static const unsigned high_byte = 1 - low_byte;
 
-  void set_pc_on_call(fast_u16 pc) { self().on_set_pc(pc); }
+  least_u8 bytes[num_regs * 2] = {};
+};
 
-  void set_pc_on_return(fast_u16 pc) { self().on_set_pc(pc); }
+// The state modules that keep registers in a packed_reg_file. They
+// provide the same interface as i8080_state<> and z80_state<>,
+// but the handlers for BC, DE and HL access the pairs directly
+// instead of combining their halves with the handlers for 8-bit
+// registers. AF is still accessed via on_get_f() and on_set_f(),
+// so that modules can intercept the flags.
+template<typename B>
+class internals::packed_state_base : public B {
+public:
+  typedef B base;
+  typedef packed_reg_file reg_file;
 
-  void disable_int_on_ei() { self().on_set_is_int_disabled(true); }
+  fast_u8 get_b() const { return regs.get_high(reg_file::bc); }
 
-  fast_u8 get_flag_mask(condition cc) {
-    switch (static_cast<unsigned>(cc) / 2) {
-      case 0:
-        return zf_mask;
-      case 1:
-        return cf_mask;
-      case 2:
-        return pf_mask;
-      case 3:
-        return sf_mask;
-    }
-    unreachable("Unknown condition code.");
-  }
+  void set_b(fast_u8 n) { regs.set_high(reg_file::bc, n); }
 
-  bool check_condition(condition cc) {
-    bool actual = self().on_get_f() & get_flag_mask(cc);
-    bool expected = static_cast<unsigned>(cc) & 1;
-    return actual == expected;
-  }
+  fast_u8 get_c() const { return regs.get_low(reg_file::bc); }
 
-  fast_u8 on_imm8_read() {
-    fast_u16 pc = self().get_pc_on_imm8_read();
-    fast_u8 op = self().on_read_cycle(pc);
-    self().set_pc_on_imm8_read(inc16(pc));
-    return op;
-  }
+  void set_c(fast_u8 n) { regs.set_low(reg_file::bc, n); }
 
-  fast_u16 on_imm16_read() {
-    fast_u16 pc = self().get_pc_on_imm16_read();
-    fast_u8 lo = self().on_read_cycle(pc);
-    pc = inc16(pc);
-    fast_u8 hi = self().on_read_cycle(pc);
-    self().set_pc_on_imm16_read(inc16(pc));
-    return make16(hi, lo);
-  }
+  fast_u8 get_d() const { return regs.get_high(reg_file::de); }
 
-  void on_3t_exec_cycle() {
-    self().on_tick(3);
-  }
+  void set_d(fast_u8 n) { regs.set_high(reg_file::de, n); }
 
-  void on_set_addr_bus(fast_u16 addr) {
-    unused(addr);
-  }
+  fast_u8 get_e() const { return regs.get_low(reg_file::de); }
 
-  void on_push(fast_u16 nn) {
-    fast_u16 sp = self().on_get_sp();
-    sp = dec16(sp);
-    self().on_write_cycle(sp, get_high8(nn));
-    sp = dec16(sp);
-    self().on_write_cycle(sp, get_low8(nn));
-    self().on_set_sp(sp);
-  }
+  void set_e(fast_u8 n) { regs.set_low(reg_file::de, n); }
 
-  fast_u16 on_pop() {
-    fast_u16 sp = self().on_get_sp();
-    fast_u8 lo = self().on_read_cycle(sp);
-    sp = inc16(sp);
-    fast_u8 hi = self().on_read_cycle(sp);
-    sp = inc16(sp);
-    self().on_set_sp(sp);
-    return make16(hi, lo);
-  }
+  fast_u8 get_h() const { return regs.get_high(reg_file::hl); }
 
-  void on_call(fast_u16 nn) {
-    self().on_push(self().on_get_pc());
-    self().on_set_wz(nn);
-    self().set_pc_on_call(nn);
-  }
+  void set_h(fast_u8 n) { regs.set_high(reg_file::hl, n); }
 
-  void on_return() {
-    fast_u16 pc = self().on_pop();
-    self().on_set_wz(pc);
-    self().set_pc_on_return(pc);
-  }
+  fast_u8 get_l() const { return regs.get_low(reg_file::hl); }
 
-  void on_jump(fast_u16 nn) {
-    self().on_set_wz(nn);
-    self().set_pc_on_jump(nn);
-  }
+  void set_l(fast_u8 n) { regs.set_low(reg_file::hl, n); }
 
-  void on_alu_n(alu k, fast_u8 n) {
-    self().do_alu(k, n);
-  }
+  fast_u8 get_a() const { return regs.get_high(reg_file::af); }
 
-  void on_dec_rp(regp rp) {
-    self().on_set_regp(rp, dec16(self().on_get_regp(rp)));
-  }
+  void set_a(fast_u8 n) { regs.set_high(reg_file::af, n); }
 
-  void on_call_nn(fast_u16 nn) {
-    self().on_call(nn);
-  }
+  fast_u8 get_f() const { return regs.get_low(reg_file::af); }
 
-  void on_ex_de_hl() {
-    self().on_ex_de_hl_regs();
-  }
+  void set_f(fast_u8 n) { regs.set_low(reg_file::af, n); }
 
-  void on_halt() {
-    self().on_set_is_halted(true);
-    // TODO: It seems 'HLT' doesn't really reset PC? Does 'HALT' do?
-    self().set_pc_on_halt(dec16(self().get_pc_on_halt()));
+  fast_u8 get_reg(reg r) {
+    switch (r) {
+      case reg::b:
+        return get_b();
+      case reg::c:
+        return get_c();
+      case reg::d:
+        return get_d();
+      case reg::e:
+        return get_e();
+      case reg::h:
+        return get_h();
+      case reg::l:
+        return get_l();
+      case reg::at_hl:
+        unreachable("Can't get (HL) value.");
+      case reg::a:
+        return get_a();
+    }
+    unreachable("Unknown register.");
   }
 
-  void on_jp_nn(fast_u16 nn) {
-    self().on_jump(nn);
-  }
+  fast_u16 get_bc() const { return regs.get(reg_file::bc); }
 
-  void on_jp_cc_nn(condition cc, fast_u16 nn) {
-    if (check_condition(cc))
-      self().on_jump(nn);
-    else
-      self().on_set_wz(nn);
-  }
+  void set_bc(fast_u16 n) { regs.set(reg_file::bc, n); }
 
-  void on_inc_rp(regp rp) {
-    self().on_set_regp(rp, inc16(self().on_get_regp(rp)));
-  }
+  fast_u16 get_de() const { return regs.get(reg_file::de); }
 
-  void on_ld_a_at_nn(fast_u16 nn) {
-    self().on_set_wz(inc16(nn));
-    self().on_set_a(self().on_read_cycle(nn));
-  }
+  void set_de(fast_u16 n) { regs.set(reg_file::de, n); }
 
-  void on_ld_at_nn_a(fast_u16 nn) {
-    fast_u8 a = self().on_get_a();
-    self().on_set_wz(make16(a, inc8(get_low8(nn))));
-    self().on_write_cycle(nn, a);
-  }
+  fast_u16 get_hl() const { return regs.get(reg_file::hl); }
 
-  void on_ld_a_at_rp(regp rp) {
-    fast_u16 nn = self().on_get_regp(rp);
-    self().on_set_wz(inc16(nn));
-    self().on_set_a(self().on_read_cycle(nn));
-  }
+  void set_hl(fast_u16 n) { regs.set(reg_file::hl, n); }
 
-  void on_ld_at_rp_a(regp rp) {
-    fast_u16 nn = self().on_get_regp(rp);
-    fast_u8 a = self().on_get_a();
-    self().on_set_wz(make16(a, get_low8(nn + 1)));
-    self().on_write_cycle(nn, a);
-  }
+  fast_u16 get_af() const { return regs.get(reg_file::af); }
 
-  void on_ld_rp_nn(regp rp, fast_u16 nn) {
-    self().on_set_regp(rp, nn);
-  }
+  void set_af(fast_u16 n) { regs.set(reg_file::af, n); }
 
-  void on_nop() {}
+  fast_u16 get_pc() const { return regs.get(reg_file::pc); }
 
-  void on_push_rp(regp2 rp) {
-    self().on_push(self().on_get_regp2(rp));
-  }
+  void set_pc(fast_u16 n) { regs.set(reg_file::pc, n); }
 
-  void on_ret() {
-    self().on_return();
-  }
+  fast_u16 get_sp() const { return regs.get(reg_file::sp); }
 
-  void on_ret_cc(condition cc) {
-    if (check_condition(cc))
-      self().on_return();
-  }
+  void set_sp(fast_u16 n) { regs.set(reg_file::sp, n); }
 
-  void on_rst(fast_u16 nn) {
-    self().on_call(nn);
-  }
+  bool is_int_disabled() const { return int_disabled.get(); }
 
-  void on_step() {
-    self().on_set_is_int_disabled(false);  // TODO: Should we really do that for both the CPUs?
-    self().on_fetch_and_decode();
-  }
+  void set_is_int_disabled(bool disabled) { int_disabled.set(disabled); }
 
-protected:
-  using base::self;
+  bool is_halted() const { return halted.get(); }
 
-  static const unsigned sf_bit = 7;
-  static const unsigned zf_bit = 6;
-  static const unsigned yf_bit = 5;
-  static const unsigned hf_bit = 4;
-  static const unsigned xf_bit = 3;
-  static const unsigned pf_bit = 2;
-  static const unsigned nf_bit = 1;
-  static const unsigned cf_bit = 0;
+  void set_is_halted(bool is_halted) { halted.set(is_halted); }
 
-  static const fast_u8 sf_mask = 1 << sf_bit;
-  static const fast_u8 zf_mask = 1 << zf_bit;
-  static const fast_u8 yf_mask = 1 << yf_bit;
-  static const fast_u8 hf_mask = 1 << hf_bit;
-  static const fast_u8 xf_mask = 1 << xf_bit;
-  static const fast_u8 pf_mask = 1 << pf_bit;
-  static const fast_u8 nf_mask = 1 << nf_bit;
-  static const fast_u8 cf_mask = 1 << cf_bit;
+  void on_ex_de_hl_regs() { regs.swap(reg_file::de, reg_file::hl); }
 
-  template<typename T>
-  static fast_u8 zf_ari(T n) {
-    return (n == 0 ? 1u : 0u) << zf_bit;
-  }
+  fast_u8 on_get_b() const { return get_b(); }
 
-  template<typename T>
-  fast_u8 hf_ari(T r, T a, T b) {
-    return (r ^ a ^ b) & hf_mask;
-  }
+  void on_set_b(fast_u8 b) { set_b(b); }
 
-  fast_u8 hf_dec(fast_u8 n) {
-    return (n & 0xf) == 0xf ? hf_mask : 0;
-  }
+  fast_u8 on_get_c() const { return get_c(); }
 
-  fast_u8 hf_inc(fast_u8 n) {
-    return (n & 0xf) == 0x0 ? hf_mask : 0;
-  }
+  void on_set_c(fast_u8 c) { set_c(c); }
 
-  template<typename T>
-  fast_u8 pf_ari(T r, T a, T b) {
-    fast_u16 x = r ^a ^b;
-    return ((x >> 6) ^ (x >> 5)) & pf_mask;
-  }
+  fast_u8 on_get_d() const { return get_d(); }
 
-  fast_u8 pf_log(fast_u8 n) {
-    // Compute parity. First, half the range of bits to
-    // consider by xor'ing nibbles of the passed value. Then,
-    // use a bit pattern to determine whether the resulting
-    // four-bit value has an even number of raised bits.
-    fast_u8 n4 = ((n >> 4) ^ n) & 0xf;
-    return ((0x9669 << pf_bit) >> n4) & pf_mask;
-  }
+  void on_set_d(fast_u8 d) { set_d(d); }
 
-  fast_u8 pf_dec(fast_u8 n) {
-    return n == 0x7f ? pf_mask : 0;
-  }
+  fast_u8 on_get_e() const { return get_e(); }
 
-  fast_u8 pf_inc(fast_u8 n) {
-    return n == 0x80 ? pf_mask : 0;
+  void on_set_e(fast_u8 e) { set_e(e); }
+
+  fast_u8 on_get_h() const { return get_h(); }
+
+  void on_set_h(fast_u8 h) { set_h(h); }
+
+  fast_u8 on_get_l() const { return get_l(); }
+
+  void on_set_l(fast_u8 l) { set_l(l); }
+
+  fast_u8 on_get_a() const { return get_a(); }
+
+  void on_set_a(fast_u8 a) { set_a(a); }
+
+  fast_u8 on_get_f() const { return get_f(); }
+
+  void on_set_f(fast_u8 f) { set_f(f); }
+
+  fast_u16 on_get_bc() const { return get_bc(); }
+
+  void on_set_bc(fast_u16 n) { set_bc(n); }
+
+  fast_u16 on_get_de() const { return get_de(); }
+
+  void on_set_de(fast_u16 n) { set_de(n); }
+
+  fast_u16 on_get_hl() const { return get_hl(); }
+
+  void on_set_hl(fast_u16 n) { set_hl(n); }
+
+  fast_u16 on_get_pc() const { return get_pc(); }
+
+  void on_set_pc(fast_u16 n) { set_pc(n); }
+
+  fast_u16 on_get_sp() { return get_sp(); }
+
+  void on_set_sp(fast_u16 n) { set_sp(n); }
+
+  bool on_is_int_disabled() const { return is_int_disabled(); }
+
+  void on_set_is_int_disabled(bool f) { set_is_int_disabled(f); }
+
+  bool on_is_halted() const { return is_halted(); }
+
+  void on_set_is_halted(bool f) { set_is_halted(f); }
+
+protected:
+  using base::self;
+
+  reg_file regs;
+
+private:
+  flipflop int_disabled;
+  flipflop halted;
+};
+
+template<typename B>
+class packed_i8080_state : public internals::packed_state_base<B> {
+public:
+  typedef internals::packed_state_base<B> base;
+  typedef typename base::reg_file reg_file;
+
+  bool get_iff() const { return iff.get(); }
+
+  void set_iff(bool f) { iff.set(f); }
+
+  fast_u16 get_regp(regp rp) const {
+    return base::regs.get(static_cast<unsigned>(rp));
   }
 
-  fast_u8 cf_ari(bool c) {
-    return c ? cf_mask : 0;
+  void set_regp(regp rp, fast_u16 n) {
+    base::regs.set(static_cast<unsigned>(rp), n);
   }
+
+private:
+  flipflop iff;
 };
 
 template<typename B>
-class i8080_executor : public internals::executor_base<B> {
+class packed_z80_state
+    : public internals::packed_state_base<z80_decoder_state<B>> {
 public:
-  typedef internals::executor_base<B> base;
+  typedef internals::packed_state_base<z80_decoder_state<B>> base;
+  typedef typename base::reg_file reg_file;
 
-  using base::cf_mask;
-  using base::hf_mask;
-  using base::nf_mask;
-  using base::sf_mask;
-  using base::xf_mask;
-  using base::yf_mask;
-  using base::zf_mask;
-  using base::pf_mask;
+  packed_z80_state() {}
 
-  using base::cf_ari;
-  using base::hf_ari;
-  using base::hf_dec;
-  using base::hf_inc;
-  using base::pf_log;
-  using base::zf_ari;
+  fast_u8 get_ixh() const { return base::regs.get_high(reg_file::ix); }
 
-  void set_iff_on_di(bool iff) { self().on_set_iff(iff); }
+  void set_ixh(fast_u8 n) { base::regs.set_high(reg_file::ix, n); }
 
-  void set_iff_on_ei(bool iff) { self().on_set_iff(iff); }
+  fast_u8 get_ixl() const { return base::regs.get_low(reg_file::ix); }
 
-  fast_u8 on_get_m() {
-    return self().on_read_cycle(self().on_get_hl());
-  }
+  void set_ixl(fast_u8 n) { base::regs.set_low(reg_file::ix, n); }
 
-  void on_set_m(fast_u8 n) {
-    self().on_write_cycle(self().on_get_hl(), n);
-  }
+  fast_u8 get_iyh() const { return base::regs.get_high(reg_file::iy); }
 
-  fast_u8 on_get_reg(reg r) {
-    switch (r) {
-      case reg::b:
-        return self().on_get_b();
-      case reg::c:
-        return self().on_get_c();
-      case reg::d:
-        return self().on_get_d();
-      case reg::e:
-        return self().on_get_e();
-      case reg::at_hl:
-        return self().on_get_m();
-      case reg::a:
-        return self().on_get_a();
-      case reg::h:
-        return self().on_get_h();
-      case reg::l:
-        return self().on_get_l();
-    }
-    unreachable("Unknown register.");
-  }
+  void set_iyh(fast_u8 n) { base::regs.set_high(reg_file::iy, n); }
 
-  virtual void on_set_reg(reg r, fast_u8 n) {
-    switch (r) {
-      case reg::b:
-        return self().on_set_b(n);
-      case reg::c:
-        return self().on_set_c(n);
-      case reg::d:
-        return self().on_set_d(n);
-      case reg::e:
-        return self().on_set_e(n);
-      case reg::at_hl:
-        return self().on_set_m(n);
-      case reg::a:
-        return self().on_set_a(n);
-      case reg::h:
-        return self().on_set_h(n);
-      case reg::l:
-        return self().on_set_l(n);
-    }
-    unreachable("Unknown register.");
-  }
+  fast_u8 get_iyl() const { return base::regs.get_low(reg_file::iy); }
 
-  fast_u16 on_get_regp(regp rp) {
-    switch (rp) {
-      case regp::bc:
-        return self().on_get_bc();
-      case regp::de:
-        return self().on_get_de();
-      case regp::hl:
-        return self().on_get_hl();
-      case regp::sp:
-        return self().on_get_sp();
-    }
-    unreachable("Unknown register.");
-  }
+  void set_iyl(fast_u8 n) { base::regs.set_low(reg_file::iy, n); }
 
-  void on_set_regp(regp rp, fast_u16 nn) {
-    switch (rp) {
-      case regp::bc:
-        return self().on_set_bc(nn);
-      case regp::de:
-        return self().on_set_de(nn);
-      case regp::hl:
-        return self().on_set_hl(nn);
-      case regp::sp:
-        return self().on_set_sp(nn);
-    }
-    unreachable("Unknown register.");
-  }
+  fast_u8 get_i() const { return base::regs.get_high(reg_file::ir); }
 
-  fast_u16 on_get_regp2(regp2 rp) {
-    switch (rp) {
-      case regp2::bc:
-        return self().on_get_bc();
-      case regp2::de:
-        return self().on_get_de();
-      case regp2::hl:
-        return self().on_get_hl();
-      case regp2::af:
-        return self().on_get_af();
-    }
-    unreachable("Unknown register.");
-  }
+  void set_i(fast_u8 n) { base::regs.set_high(reg_file::ir, n); }
 
-  void on_set_regp2(regp2 rp, fast_u16 nn) {
-    switch (rp) {
-      case regp2::bc:
-        return self().on_set_bc(nn);
-      case regp2::de:
-        return self().on_set_de(nn);
-      case regp2::hl:
-        return self().on_set_hl(nn);
-      case regp2::af:
-        return self().on_set_af(nn);
-    }
-    unreachable("Unknown register.");
-  }
+  fast_u8 get_r() const { return base::regs.get_low(reg_file::ir); }
 
-  fast_u8 on_fetch_cycle() {
-    fast_u16 addr = self().get_pc_on_fetch();
-    self().on_set_addr_bus(addr);
-    fast_u8 n = self().on_read(addr);
-    self().on_tick(4);
-    self().set_pc_on_fetch(inc16(addr));
-    return n;
-  }
+  void set_r(fast_u8 n) { base::regs.set_low(reg_file::ir, n); }
 
-  fast_u8 on_input_cycle(fast_u8 port) {
-    self().on_tick(3);
-    return self().on_input(port);
-  }
+  fast_u16 get_alt_af() const { return base::regs.get(reg_file::alt_af); }
 
-  void on_output_cycle(fast_u8 port, fast_u8 n) {
-    self().on_tick(3);
-    self().on_output(port, n);
-  }
+  void set_alt_af(fast_u16 n) { base::regs.set(reg_file::alt_af, n); }
 
-  void do_alu(alu k, fast_u8 n) {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    switch (k) {
-      case alu::add: {
-        fast_u8 t = add8(a, n);
-        fast_u8 hf = (a & 0xf) + (n & 0xf) > 0xf ? hf_mask : 0;
-        f = (t & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
-            zf_ari(t) | hf | pf_log(t) | cf_ari(t < a);
-        a = t;
-        break;
-      }
-      case alu::adc: {
-        // TODO: The cf evaluation can be simplified by
-        // comparing the sum before truncation. +Revisit the
-        // other cases in this switch.
-        fast_u8 cfv = (f & cf_mask) ? 1 : 0;
-        fast_u8 t = mask8(a + n + cfv);
-        fast_u8 hf = (a & 0xf) + (n & 0xf) + cfv > 0xf ? hf_mask : 0;
-        f = (t & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
-            zf_ari(t) | hf | pf_log(t) |
-            cf_ari(t < a || (cfv && n == 0xff));
-        a = t;
-        break;
-      }
-      case alu::sub:
-      case alu::cp: {
-        fast_u8 t = sub8(a, n);
-        fast_u8 hf = (a & 0xf) >= (n & 0xf) ? hf_mask : 0;
-        f = (t & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
-            zf_ari(t) | hf | pf_log(t) | cf_ari(t > a);
-        a = t;
-        break;
-      }
-      case alu::sbc: {
-        fast_u8 cfv = (f & cf_mask) ? 1 : 0;
-        fast_u8 t = mask8(a - n - cfv);
-        fast_u8 hf = (a & 0xf) >= (n & 0xf) + cfv ? hf_mask : 0;
-        f = (t & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
-            zf_ari(t) | hf | pf_log(t) |
-            cf_ari(t > a || (cfv && n == 0xff));
-        a = t;
-        break;
-      }
-      case alu::and_a: {
-        // Alexander Demin notes that the half-carry flag has
-        // its own special logic for the ANA and ANI
-        // instructions.
-        // http://demin.ws/blog/english/2012/12/24/my-i8080-collection/
-        // TODO: AMD chips do not set the flag. Support them
-        // as a variant of the original Intel chip.
-        fast_u8 hf = ((a | n) & 0x8) != 0 ? hf_mask : 0;
-        a &= n;
-        f = (a & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
-            zf_ari(a) | pf_log(a) | hf;
-        break;
-      }
-      case alu::xor_a:
-        a ^= n;
-        f = (a & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
-            zf_ari(a) | pf_log(a);
-        break;
-      case alu::or_a:
-        a |= n;
-        f = (a & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
-            zf_ari(a) | pf_log(a);
-        break;
-    }
-    if (k != alu::cp)
-      self().on_set_a(a);
-    self().on_set_f(f);
-  }
+  fast_u16 get_alt_hl() const { return base::regs.get(reg_file::alt_hl); }
 
-  void on_add_irp_rp(regp rp) {
-    self().on_3t_exec_cycle();
-    self().on_3t_exec_cycle();
+  void set_alt_hl(fast_u16 n) { base::regs.set(reg_file::alt_hl, n); }
 
-    fast_u16 i = self().on_get_hl();
-    fast_u16 n = self().on_get_regp(rp);
-    fast_u8 f = self().on_get_f();
-    fast_u16 r = add16(i, n);
-    f = (f & ~base::cf_mask) | base::cf_ari(r < i);
-    self().on_set_wz(inc16(i));
-    self().on_set_hl(r);
-    self().on_set_f(f);
-  }
+  fast_u16 get_alt_bc() const { return base::regs.get(reg_file::alt_bc); }
 
-  void on_alu_r(alu k, reg r) {
-    do_alu(k, self().on_get_reg(r));
-  }
+  void set_alt_bc(fast_u16 n) { base::regs.set(reg_file::alt_bc, n); }
 
-  void on_call_cc_nn(condition cc, fast_u16 nn) {
-    if (base::check_condition(cc))
-      self().on_call(nn);
-    else
-      self().on_set_wz(nn);
-  }
+  fast_u16 get_alt_de() const { return base::regs.get(reg_file::alt_de); }
 
-  void on_ccf() {
-    self().on_set_f(self().on_get_f() ^ base::cf_mask);
-  }
+  void set_alt_de(fast_u16 n) { base::regs.set(reg_file::alt_de, n); }
 
-  void on_cpl() {
-    self().on_set_a(self().on_get_a() ^ 0xff);
-  }
+  fast_u16 get_ix() const { return base::regs.get(reg_file::ix); }
 
-  void on_daa() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    bool cf = f & cf_mask;
-    bool hf = f & hf_mask;
+  void set_ix(fast_u16 n) { base::regs.set(reg_file::ix, n); }
 
-    fast_u8 d = 0x00;
-    if (cf || a > 0x99) {
-      d |= 0x60;
-      f |= cf_mask;
-    }
-    if (hf || (a & 0x0f) > 0x09) {
-      d |= 0x06;
-    }
+  fast_u16 get_iy() const { return base::regs.get(reg_file::iy); }
 
-    fast_u8 n = add8(a, d);
-    fast_u8 hfm = (a & 0x0f) > 0x09 ? hf_mask : 0;  // TODO
-    f = (f & (cf_mask | xf_mask | yf_mask | nf_mask)) |
-        (n & sf_mask) | zf_ari(n) | hfm | pf_log(n);
-    self().on_set_a(n);
-    self().on_set_f(f);
-  }
+  void set_iy(fast_u16 n) { base::regs.set(reg_file::iy, n); }
 
-  void on_dec_r(reg r) {
-    fast_u8 n = self().on_get_reg(r);
-    fast_u8 f = self().on_get_f();
-    fast_u8 hf = (n & 0xf) > 0 ? hf_mask : 0;
-    n = dec8(n);
-    f = (f & (cf_mask | yf_mask | xf_mask | nf_mask)) |
-        (n & sf_mask) | zf_ari(n) | hf | pf_log(n);
-    self().on_set_reg(r, n);
-    self().on_set_f(f);
-  }
+  fast_u16 get_ir() const { return base::regs.get(reg_file::ir); }
 
-  void on_di() {
-    self().set_iff_on_di(false);
-  }
+  void set_ir(fast_u16 n) { base::regs.set(reg_file::ir, n); }
 
-  void on_ei() {
-    self().set_iff_on_ei(true);
-    self().disable_int_on_ei();
+  fast_u16 get_wz() const { return base::regs.get(reg_file::wz); }
+
+  void set_wz(fast_u16 n) { base::regs.set(reg_file::wz, n); }
+
+  bool get_iff1() const { return iff1.get(); }
+
+  void set_iff1(bool f) { iff1.set(f); }
+
+  bool get_iff2() const { return iff2.get(); }
+
+  void set_iff2(bool f) { iff2.set(f); }
+
+  unsigned get_int_mode() const { return im.get(); }
+
+  void set_int_mode(unsigned mode) { im.set(mode); }
+
+  fast_u16 get_index_rp(iregp irp) {
+    return base::regs.get(get_index_rp_index(irp));
   }
 
-  void on_ex_at_sp_irp() {
-    fast_u16 sp = self().on_get_sp();
-    fast_u8 lo = self().on_read_cycle(sp);
-    sp = inc16(sp);
-    fast_u8 hi = self().on_read_cycle(sp);
-    fast_u16 nn = make16(hi, lo);
-    fast_u16 hl = self().on_get_hl();
-    std::swap(nn, hl);
-    self().on_write_cycle(sp, get_high8(nn));
-    sp = dec16(sp);
-    self().on_write_cycle(sp, get_low8(nn));
-    self().on_write_cycle_extra_2t();
-    self().on_set_wz(hl);
-    self().on_set_hl(hl);
+  // Accesses HL, IX or IY for regp::hl, depending on the
+  // current index register.
+  fast_u16 get_regp(regp rp) const {
+    return base::regs.get(get_regp_index(rp));
   }
 
-  void on_jp_irp() {
-    self().set_pc_on_jump(self().on_get_hl());
+  void set_regp(regp rp, fast_u16 n) {
+    base::regs.set(get_regp_index(rp), n);
   }
 
-  void on_in_a_n(fast_u8 n) {
-    self().on_set_a(self().on_input_cycle(n));
+  fast_u16 get_iregp() const {
+    return base::regs.get(get_index_rp_index(base::get_iregp_kind()));
   }
 
-  void on_inc_r(reg r) {
-    fast_u8 n = self().on_get_reg(r);
-    fast_u8 f = self().on_get_f();
-    fast_u8 hf = (n & 0xf) > 0xe ? hf_mask : 0;
-    n = inc8(n);
-    f = (f & (cf_mask | yf_mask | xf_mask | nf_mask)) |
-        (n & sf_mask) | zf_ari(n) | hf | pf_log(n);
-    self().on_set_reg(r, n);
-    self().on_set_f(f);
+  void set_iregp(fast_u16 n) {
+    base::regs.set(get_index_rp_index(base::get_iregp_kind()), n);
   }
 
-  void on_ld_r_n(reg r, fast_u8 n) {
-    self().on_set_reg(r, n);
-  }
+  void ex_af_alt_af_regs() { base::regs.swap(reg_file::af, reg_file::alt_af); }
 
-  void on_ld_r_r(reg rd, reg rs) {
-    self().on_fetch_cycle_extra_1t();
-    self().on_set_reg(rd, self().on_get_reg(rs));
+  void exx_regs() {
+    base::regs.swap(reg_file::bc, reg_file::alt_bc);
+    base::regs.swap(reg_file::de, reg_file::alt_de);
+    base::regs.swap(reg_file::hl, reg_file::alt_hl);
   }
 
-  void on_ld_sp_irp() {
-    self().on_set_sp(self().on_get_hl());
-  }
+  fast_u8 on_get_ixh() const { return get_ixh(); }
 
-  void on_ld_irp_at_nn(fast_u16 nn) {
-    fast_u8 lo = self().on_read_cycle(nn);
-    nn = inc16(nn);
-    self().on_set_wz(nn);
-    fast_u8 hi = self().on_read_cycle(nn);
-    self().on_set_hl(make16(hi, lo));
-  }
+  void on_set_ixh(fast_u8 ixh) { set_ixh(ixh); }
 
-  void on_ld_at_nn_irp(fast_u16 nn) {
-    fast_u16 irp = self().on_get_hl();
-    self().on_write_cycle(nn, get_low8(irp));
-    nn = inc16(nn);
-    self().on_set_wz(nn);
-    self().on_write_cycle(nn, get_high8(irp));
-  }
+  fast_u8 on_get_ixl() const { return get_ixl(); }
 
-  void on_out_n_a(fast_u8 n) {
-    self().on_output_cycle(n, self().on_get_a());
-  }
+  void on_set_ixl(fast_u8 ixl) { set_ixl(ixl); }
 
-  void on_pop_rp(regp2 rp) {
-    fast_u16 n = self().on_pop();
-    if (rp == regp2::af) {
-      // Not all flags are updated on pop psw.
-      n = (n & ~(xf_mask | yf_mask)) | nf_mask;
-    }
-    self().on_set_regp2(rp, n);
-  }
+  fast_u8 on_get_iyh() const { return get_iyh(); }
 
-  void on_rla() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    fast_u8 r = mask8(a << 1) | ((f & base::cf_mask) ? 1 : 0);
-    f = (f & (0xff & ~base::cf_mask)) | base::cf_ari(a & 0x80);
-    self().on_set_a(r);
-    self().on_set_f(f);
-  }
+  void on_set_iyh(fast_u8 iyh) { set_iyh(iyh); }
 
-  void on_rra() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    fast_u8 r = (a >> 1) | ((f & base::cf_mask) ? 0x80 : 0);
-    f = (f & ~base::cf_mask) | base::cf_ari(a & 0x1);
-    self().on_set_a(r);
-    self().on_set_f(f);
-  }
+  fast_u8 on_get_iyl() const { return get_iyl(); }
 
-  void on_rlca() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    a = rol8(a);
-    f = (f & ~base::cf_mask) | base::cf_ari(a & 0x1);
-    self().on_set_a(a);
-    self().on_set_f(f);
-  }
+  void on_set_iyl(fast_u8 iyl) { set_iyl(iyl); }
 
-  void on_rrca() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    a = ror8(a);
-    f = (f & ~base::cf_mask) | base::cf_ari(a & 0x80);
-    self().on_set_a(a);
-    self().on_set_f(f);
-  }
+  fast_u8 on_get_i() const { return get_i(); }
 
-  void on_scf() {
-    self().on_set_f(self().on_get_f() | base::cf_mask);
+  void on_set_i(fast_u8 i) { set_i(i); }
+
+  fast_u8 on_get_r() const { return get_r(); }
+
+  void on_set_r(fast_u8 r) { set_r(r); }
+
+  fast_u16 on_get_ir() const { return get_ir(); }
+
+  fast_u16 on_get_wz() const { return get_wz(); }
+
+  void on_set_wz(fast_u16 n) {
+    if (base::has_feature(cpu_features::wz))
+      set_wz(n);
   }
 
-protected:
-  using base::self;
-};
+  bool on_get_iff1() const { return get_iff1(); }
 
-template<typename B>
-class z80_executor : public internals::executor_base<B> {
-public:
-  typedef internals::executor_base<B> base;
+  void on_set_iff1(bool f) { set_iff1(f); }
 
-  z80_executor() {}
+  bool on_get_iff2() const { return get_iff2(); }
 
-  using base::sf_bit;
-  using base::zf_bit;
-  using base::yf_bit;
-  using base::hf_bit;
-  using base::xf_bit;
-  using base::pf_bit;
-  using base::nf_bit;
-  using base::cf_bit;
+  void on_set_iff2(bool f) { set_iff2(f); }
 
-  using base::sf_mask;
-  using base::zf_mask;
-  using base::yf_mask;
-  using base::hf_mask;
-  using base::xf_mask;
-  using base::pf_mask;
-  using base::nf_mask;
-  using base::cf_mask;
+  unsigned on_get_int_mode() const { return get_int_mode(); }
 
-  using base::zf_ari;
-  using base::hf_ari;
-  using base::hf_dec;
-  using base::hf_inc;
-  using base::pf_ari;
-  using base::pf_log;
-  using base::pf_dec;
-  using base::pf_inc;
-  using base::cf_ari;
+  void on_set_int_mode(unsigned mode) { set_int_mode(mode); }
 
-  void set_i_on_ld(fast_u8 i) { self().on_set_i(i); }
+  void on_ex_af_alt_af_regs() { ex_af_alt_af_regs(); }
 
-  void on_inc_r_reg() {
-    // TODO: Consider splitting R into R[7] and R[6:0].
-    fast_u8 r = self().on_get_r();
-    r = (r & 0x80) | (inc8(r) & 0x7f);
-    self().on_set_r(r);
-  }
+  void on_exx_regs() { exx_regs(); }
 
-  fast_u16 on_get_ix() {
-    // Always get the low byte first.
-    fast_u8 l = self().on_get_ixl();
-    fast_u8 h = self().on_get_ixh();
-    return make16(h, l);
+private:
+  static unsigned get_index_rp_index(iregp irp) {
+    return irp == iregp::hl ? reg_file::hl :
+           irp == iregp::ix ? reg_file::ix : reg_file::iy;
   }
 
-  void on_set_ix(fast_u16 ix) {
-    // Always set the low byte first.
-    self().on_set_ixl(get_low8(ix));
-    self().on_set_ixh(get_high8(ix));
+  unsigned get_regp_index(regp rp) const {
+    return rp == regp::hl ? get_index_rp_index(base::get_iregp_kind()) :
+                            static_cast<unsigned>(rp);
   }
 
-  fast_u16 on_get_iy() {
-    // Always get the low byte first.
-    fast_u8 l = self().on_get_iyl();
-    fast_u8 h = self().on_get_iyh();
-    return make16(h, l);
-  }
+  flipflop iff1, iff2;
+  int_mode im;
+};
 
-  void on_set_iy(fast_u16 iy) {
-    // Always set the low byte first.
-    self().on_set_iyl(get_low8(iy));
-    self().on_set_iyh(get_high8(iy));
-  }
+template<typename B>
+class internals::executor_base : public B {
+public:
+  typedef B base;
 
-  fast_u16 get_pc_on_disp_read() { return self().on_get_pc(); }
+  executor_base() {}
 
-  void set_pc_on_disp_read(fast_u16 pc) { self().on_set_pc(pc); }
+  fast_u16 get_pc_on_fetch() { return self().on_get_pc(); }
 
-  fast_u16 get_pc_on_block_instr() { return self().on_get_pc(); }
+  void set_pc_on_fetch(fast_u16 pc) { self().on_set_pc(pc); }
 
-  void set_pc_on_block_instr(fast_u16 pc) { self().on_set_pc(pc); }
+  fast_u16 get_pc_on_jump() { return self().on_get_pc(); }
 
-  fast_u16 get_ir_on_refresh() { return self().on_get_ir(); }
+  void set_pc_on_jump(fast_u16 pc) { self().on_set_pc(pc); }
 
-  void set_iff1_on_di(bool f) { self().on_set_iff1(f); }
+  fast_u16 get_pc_on_imm8_read() { return self().on_get_pc(); }
 
-  void set_iff1_on_ei(bool f) { self().on_set_iff1(f); }
+  void set_pc_on_imm8_read(fast_u16 pc) { self().on_set_pc(pc); }
 
-  void set_iff1_on_retn(bool f) { self().on_set_iff1(f); }
+  fast_u16 get_pc_on_imm16_read() { return self().on_get_pc(); }
 
-  void set_iff2_on_di(bool f) { self().on_set_iff2(f); }
+  void set_pc_on_imm16_read(fast_u16 pc) { self().on_set_pc(pc); }
 
-  void set_iff2_on_ei(bool f) { self().on_set_iff2(f); }
+  fast_u16 get_pc_on_halt() { return self().on_get_pc(); }
 
-  bool get_iff2_on_retn() { return self().on_get_iff2(); }
+  void set_pc_on_halt(fast_u16 pc) { self().on_set_pc(pc); }
 
-  fast_u16 get_disp_target(fast_u16 base, fast_u8 d) {
-    return !get_sign8(d) ? add16(base, d) : sub16(base, neg8(d));
-  }
+  void set_pc_on_call(fast_u16 pc) { self().on_set_pc(pc); }
 
-  fast_u8 read_at_disp(fast_u8 d, bool long_read_cycle = false) {
-    fast_u16 addr = get_disp_target(self().on_get_iregp(), d);
-    fast_u8 res = self().on_read_cycle(addr);
-    if (long_read_cycle)  // TODO: Remove. Do extra ticks manually.
-      self().on_read_cycle_extra_1t();
-    if (!is_hl_iregp())
-      self().on_set_wz(addr);
-    return res;
-  }
+  void set_pc_on_return(fast_u16 pc) { self().on_set_pc(pc); }
 
-  void write_at_disp(fast_u8 d, fast_u8 n) {
-    fast_u16 addr = get_disp_target(self().on_get_iregp(), d);
-    self().on_write_cycle(addr, n);
-    if (!is_hl_iregp())
-      self().on_set_wz(addr);
-  }
+  void disable_int_on_ei() { self().on_set_is_int_disabled(true); }
 
-  fast_u8 on_get_reg(reg r, iregp irp, fast_u8 d = 0,
-                     bool long_read_cycle = false) {
-    switch (r) {
-      case reg::b:
-        return self().on_get_b();
-      case reg::c:
-        return self().on_get_c();
-      case reg::d:
-        return self().on_get_d();
-      case reg::e:
-        return self().on_get_e();
-      case reg::at_hl:
-        return read_at_disp(d, long_read_cycle);
-      case reg::a:
-        return self().on_get_a();
-      case reg::h:
-        switch (irp) {
-          case iregp::hl:
-            return self().on_get_h();
-          case iregp::ix:
-            return self().on_get_ixh();
-          case iregp::iy:
-            return self().on_get_iyh();
-        }
-        break;
-      case reg::l:
-        switch (irp) {
-          case iregp::hl:
-            return self().on_get_l();
-          case iregp::ix:
-            return self().on_get_ixl();
-          case iregp::iy:
-            return self().on_get_iyl();
-        }
-        break;
+  fast_u8 get_flag_mask(condition cc) {
+    switch (static_cast<unsigned>(cc) / 2) {
+      case 0:
+        return zf_mask;
+      case 1:
+        return cf_mask;
+      case 2:
+        return pf_mask;
+      case 3:
+        return sf_mask;
     }
-    unreachable("Unknown register.");
+    unreachable("Unknown condition code.");
   }
 
-  virtual void on_set_reg(reg r, iregp irp, fast_u8 d, fast_u8 n) {
-    switch (r) {
-      case reg::b:
-        return self().on_set_b(n);
+  bool check_condition(condition cc) {
+    bool actual = self().on_get_f() & get_flag_mask(cc);
+    bool expected = static_cast<unsigned>(cc) & 1;
+    return actual == expected;
+  }
+
+  fast_u8 on_imm8_read() {
+    fast_u16 pc = self().get_pc_on_imm8_read();
+    fast_u8 op = self().on_read_cycle(pc);
+    self().set_pc_on_imm8_read(inc16(pc));
+    return op;
+  }
+
+  fast_u16 on_imm16_read() {
+    fast_u16 pc = self().get_pc_on_imm16_read();
+    fast_u8 lo = self().on_read_cycle(pc);
+    pc = inc16(pc);
+    fast_u8 hi = self().on_read_cycle(pc);
+    self().set_pc_on_imm16_read(inc16(pc));
+    return make16(hi, lo);
+  }
+
+  void on_3t_exec_cycle() {
+    self().on_tick(3);
+  }
+
+  void on_set_addr_bus(fast_u16 addr) {
+    unused(addr);
+  }
+
+  void on_push(fast_u16 nn) {
+    fast_u16 sp = self().on_get_sp();
+    sp = dec16(sp);
+    self().on_write_cycle(sp, get_high8(nn));
+    sp = dec16(sp);
+    self().on_write_cycle(sp, get_low8(nn));
+    self().on_set_sp(sp);
+  }
+
+  fast_u16 on_pop() {
+    fast_u16 sp = self().on_get_sp();
+    fast_u8 lo = self().on_read_cycle(sp);
+    sp = inc16(sp);
+    fast_u8 hi = self().on_read_cycle(sp);
+    sp = inc16(sp);
+    self().on_set_sp(sp);
+    return make16(hi, lo);
+  }
+
+  void on_call(fast_u16 nn) {
+    self().on_push(self().on_get_pc());
+    self().on_set_wz(nn);
+    self().set_pc_on_call(nn);
+  }
+
+  void on_return() {
+    fast_u16 pc = self().on_pop();
+    self().on_set_wz(pc);
+    self().set_pc_on_return(pc);
+  }
+
+  void on_jump(fast_u16 nn) {
+    self().on_set_wz(nn);
+    self().set_pc_on_jump(nn);
+  }
+
+  void on_alu_n(alu k, fast_u8 n) {
+    self().do_alu(k, n);
+  }
+
+  void on_dec_rp(regp rp) {
+    self().on_set_regp(rp, dec16(self().on_get_regp(rp)));
+  }
+
+  void on_call_nn(fast_u16 nn) {
+    self().on_call(nn);
+  }
+
+  void on_ex_de_hl() {
+    self().on_ex_de_hl_regs();
+  }
+
+  void on_halt() {
+    self().on_set_is_halted(true);
+    // TODO: It seems 'HLT' doesn't really reset PC? Does 'HALT' do?
+    self().set_pc_on_halt(dec16(self().get_pc_on_halt()));
+  }
+
+  void on_jp_nn(fast_u16 nn) {
+    self().on_jump(nn);
+  }
+
+  void on_jp_cc_nn(condition cc, fast_u16 nn) {
+    if (check_condition(cc))
+      self().on_jump(nn);
+    else
+      self().on_set_wz(nn);
+  }
+
+  void on_inc_rp(regp rp) {
+    self().on_set_regp(rp, inc16(self().on_get_regp(rp)));
+  }
+
+  void on_ld_a_at_nn(fast_u16 nn) {
+    self().on_set_wz(inc16(nn));
+    self().on_set_a(self().on_read_cycle(nn));
+  }
+
+  void on_ld_at_nn_a(fast_u16 nn) {
+    fast_u8 a = self().on_get_a();
+    self().on_set_wz(make16(a, inc8(get_low8(nn))));
+    self().on_write_cycle(nn, a);
+  }
+
+  void on_ld_a_at_rp(regp rp) {
+    fast_u16 nn = self().on_get_regp(rp);
+    self().on_set_wz(inc16(nn));
+    self().on_set_a(self().on_read_cycle(nn));
+  }
+
+  void on_ld_at_rp_a(regp rp) {
+    fast_u16 nn = self().on_get_regp(rp);
+    fast_u8 a = self().on_get_a();
+    self().on_set_wz(make16(a, get_low8(nn + 1)));
+    self().on_write_cycle(nn, a);
+  }
+
+  void on_ld_rp_nn(regp rp, fast_u16 nn) {
+    self().on_set_regp(rp, nn);
+  }
+
+  void on_nop() {}
+
+  void on_push_rp(regp2 rp) {
+    self().on_push(self().on_get_regp2(rp));
+  }
+
+  void on_ret() {
+    self().on_return();
+  }
+
+  void on_ret_cc(condition cc) {
+    if (check_condition(cc))
+      self().on_return();
+  }
+
+  void on_rst(fast_u16 nn) {
+    self().on_call(nn);
+  }
+
+  void on_step() {
+    self().on_set_is_int_disabled(false);  // TODO: Should we really do that for both the CPUs?
+    self().on_fetch_and_decode();
+  }
+
+protected:
+  using base::self;
+
+  static const unsigned sf_bit = 7;
+  static const unsigned zf_bit = 6;
+  static const unsigned yf_bit = 5;
+  static const unsigned hf_bit = 4;
+  static const unsigned xf_bit = 3;
+  static const unsigned pf_bit = 2;
+  static const unsigned nf_bit = 1;
+  static const unsigned cf_bit = 0;
+
+  static const fast_u8 sf_mask = 1 << sf_bit;
+  static const fast_u8 zf_mask = 1 << zf_bit;
+  static const fast_u8 yf_mask = 1 << yf_bit;
+  static const fast_u8 hf_mask = 1 << hf_bit;
+  static const fast_u8 xf_mask = 1 << xf_bit;
+  static const fast_u8 pf_mask = 1 << pf_bit;
+  static const fast_u8 nf_mask = 1 << nf_bit;
+  static const fast_u8 cf_mask = 1 << cf_bit;
+
+  template<typename T>
+  static fast_u8 zf_ari(T n) {
+    return (n == 0 ? 1u : 0u) << zf_bit;
+  }
+
+  template<typename T>
+  static fast_u8 hf_ari(T r, T a, T b) {
+    return (r ^ a ^ b) & hf_mask;
+  }
+
+  static fast_u8 hf_dec(fast_u8 n) {
+    return (n & 0xf) == 0xf ? hf_mask : 0;
+  }
+
+  static fast_u8 hf_inc(fast_u8 n) {
+    return (n & 0xf) == 0x0 ? hf_mask : 0;
+  }
+
+  template<typename T>
+  static fast_u8 pf_ari(T r, T a, T b) {
+    fast_u16 x = r ^a ^b;
+    return ((x >> 6) ^ (x >> 5)) & pf_mask;
+  }
+
+  static fast_u8 pf_log(fast_u8 n) {
+    // Compute parity. First, half the range of bits to
+    // consider by xor'ing nibbles of the passed value. Then,
+    // use a bit pattern to determine whether the resulting
+    // four-bit value has an even number of raised bits.
+    fast_u8 n4 = ((n >> 4) ^ n) & 0xf;
+    return ((0x9669 << pf_bit) >> n4) & pf_mask;
+  }
+
+  static fast_u8 pf_dec(fast_u8 n) {
+    return n == 0x7f ? pf_mask : 0;
+  }
+
+  static fast_u8 pf_inc(fast_u8 n) {
+    return n == 0x80 ? pf_mask : 0;
+  }
+
+  static fast_u8 cf_ari(bool c) {
+    return c ? cf_mask : 0;
+  }
+};
+
+template<typename B>
+class i8080_executor : public internals::executor_base<B> {
+public:
+  typedef internals::executor_base<B> base;
+
+  using base::cf_mask;
+  using base::hf_mask;
+  using base::nf_mask;
+  using base::sf_mask;
+  using base::xf_mask;
+  using base::yf_mask;
+  using base::zf_mask;
+  using base::pf_mask;
+
+  using base::cf_ari;
+  using base::hf_ari;
+  using base::hf_dec;
+  using base::hf_inc;
+  using base::pf_log;
+  using base::zf_ari;
+
+  void set_iff_on_di(bool iff) { self().on_set_iff(iff); }
+
+  void set_iff_on_ei(bool iff) { self().on_set_iff(iff); }
+
+  fast_u8 on_get_m() {
+    return self().on_read_cycle(self().on_get_hl());
+  }
+
+  void on_set_m(fast_u8 n) {
+    self().on_write_cycle(self().on_get_hl(), n);
+  }
+
+  fast_u8 on_get_reg(reg r) {
+    switch (r) {
+      case reg::b:
+        return self().on_get_b();
       case reg::c:
-        return self().on_set_c(n);
+        return self().on_get_c();
       case reg::d:
-        return self().on_set_d(n);
+        return self().on_get_d();
       case reg::e:
-        return self().on_set_e(n);
+        return self().on_get_e();
       case reg::at_hl:
-        return write_at_disp(d, n);
+        return self().on_get_m();
+      case reg::a:
+        return self().on_get_a();
+      case reg::h:
+        return self().on_get_h();
+      case reg::l:
+        return self().on_get_l();
+    }
+    unreachable("Unknown register.");
+  }
+
+  Z80_VIRTUAL void on_set_reg(reg r, fast_u8 n) {
+    switch (r) {
+      case reg::b:
+        return self().on_set_b(n);
+      case reg::c:
+        return self().on_set_c(n);
+      case reg::d:
+        return self().on_set_d(n);
+      case reg::e:
+        return self().on_set_e(n);
+      case reg::at_hl:
+        return self().on_set_m(n);
       case reg::a:
         return self().on_set_a(n);
       case reg::h:
-        switch (irp) {
-          case iregp::hl:
-            return self().on_set_h(n);
-          case iregp::ix:
-            return self().on_set_ixh(n);
-          case iregp::iy:
-            return self().on_set_iyh(n);
-        }
-        break;
+        return self().on_set_h(n);
       case reg::l:
-        switch (irp) {
-          case iregp::hl:
-            return self().on_set_l(n);
-          case iregp::ix:
-            return self().on_set_ixl(n);
-          case iregp::iy:
-            return self().on_set_iyl(n);
-        }
+        return self().on_set_l(n);
+    }
+    unreachable("Unknown register.");
+  }
+
+  fast_u16 on_get_regp(regp rp) {
+    switch (rp) {
+      case regp::bc:
+        return self().on_get_bc();
+      case regp::de:
+        return self().on_get_de();
+      case regp::hl:
+        return self().on_get_hl();
+      case regp::sp:
+        return self().on_get_sp();
+    }
+    unreachable("Unknown register.");
+  }
+
+  void on_set_regp(regp rp, fast_u16 nn) {
+    switch (rp) {
+      case regp::bc:
+        return self().on_set_bc(nn);
+      case regp::de:
+        return self().on_set_de(nn);
+      case regp::hl:
+        return self().on_set_hl(nn);
+      case regp::sp:
+        return self().on_set_sp(nn);
+    }
+    unreachable("Unknown register.");
+  }
+
+  fast_u16 on_get_regp2(regp2 rp) {
+    switch (rp) {
+      case regp2::bc:
+        return self().on_get_bc();
+      case regp2::de:
+        return self().on_get_de();
+      case regp2::hl:
+        return self().on_get_hl();
+      case regp2::af:
+        return self().on_get_af();
+    }
+    unreachable("Unknown register.");
+  }
+
+  void on_set_regp2(regp2 rp, fast_u16 nn) {
+    switch (rp) {
+      case regp2::bc:
+        return self().on_set_bc(nn);
+      case regp2::de:
+        return self().on_set_de(nn);
+      case regp2::hl:
+        return self().on_set_hl(nn);
+      case regp2::af:
+        return self().on_set_af(nn);
+    }
+    unreachable("Unknown register.");
+  }
+
+  fast_u8 on_fetch_cycle() {
+    fast_u16 addr = self().get_pc_on_fetch();
+    if (base::has_feature(cpu_features::addr_bus))
+      self().on_set_addr_bus(addr);
+    fast_u8 n = self().on_read(addr);
+    self().on_tick(4);
+    self().set_pc_on_fetch(inc16(addr));
+    return n;
+  }
+
+  fast_u8 on_input_cycle(fast_u8 port) {
+    self().on_tick(3);
+    return self().on_input(port);
+  }
+
+  void on_output_cycle(fast_u8 port, fast_u8 n) {
+    self().on_tick(3);
+    self().on_output(port, n);
+  }
+
+  void do_alu(alu k, fast_u8 n) {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    switch (k) {
+      case alu::add: {
+        fast_u8 t = add8(a, n);
+        fast_u8 hf = (a & 0xf) + (n & 0xf) > 0xf ? hf_mask : 0;
+        f = (t & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
+            zf_ari(t) | hf | pf_log(t) | cf_ari(t < a);
+        a = t;
+        break;
+      }
+      case alu::adc: {
+        // TODO: The cf evaluation can be simplified by
+        // comparing the sum before truncation. +Revisit the
+        // other cases in this switch.
+        fast_u8 cfv = (f & cf_mask) ? 1 : 0;
+        fast_u8 t = mask8(a + n + cfv);
+        fast_u8 hf = (a & 0xf) + (n & 0xf) + cfv > 0xf ? hf_mask : 0;
+        f = (t & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
+            zf_ari(t) | hf | pf_log(t) |
+            cf_ari(t < a || (cfv && n == 0xff));
+        a = t;
+        break;
+      }
+      case alu::sub:
+      case alu::cp: {
+        fast_u8 t = sub8(a, n);
+        fast_u8 hf = (a & 0xf) >= (n & 0xf) ? hf_mask : 0;
+        f = (t & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
+            zf_ari(t) | hf | pf_log(t) | cf_ari(t > a);
+        a = t;
+        break;
+      }
+      case alu::sbc: {
+        fast_u8 cfv = (f & cf_mask) ? 1 : 0;
+        fast_u8 t = mask8(a - n - cfv);
+        fast_u8 hf = (a & 0xf) >= (n & 0xf) + cfv ? hf_mask : 0;
+        f = (t & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
+            zf_ari(t) | hf | pf_log(t) |
+            cf_ari(t > a || (cfv && n == 0xff));
+        a = t;
+        break;
+      }
+      case alu::and_a: {
+        // Alexander Demin notes that the half-carry flag has
+        // its own special logic for the ANA and ANI
+        // instructions.
+        // http://demin.ws/blog/english/2012/12/24/my-i8080-collection/
+        // TODO: AMD chips do not set the flag. Support them
+        // as a variant of the original Intel chip.
+        fast_u8 hf = ((a | n) & 0x8) != 0 ? hf_mask : 0;
+        a &= n;
+        f = (a & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
+            zf_ari(a) | pf_log(a) | hf;
         break;
+      }
+      case alu::xor_a:
+        a ^= n;
+        f = (a & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
+            zf_ari(a) | pf_log(a);
+        break;
+      case alu::or_a:
+        a |= n;
+        f = (a & sf_mask) | (f & (yf_mask | xf_mask | nf_mask)) |
+            zf_ari(a) | pf_log(a);
+        break;
+    }
+    if (k != alu::cp)
+      self().on_set_a(a);
+    self().on_set_f(f);
+  }
+
+  void on_add_irp_rp(regp rp) {
+    self().on_3t_exec_cycle();
+    self().on_3t_exec_cycle();
+
+    fast_u16 i = self().on_get_hl();
+    fast_u16 n = self().on_get_regp(rp);
+    fast_u8 f = self().on_get_f();
+    fast_u16 r = add16(i, n);
+    f = (f & ~base::cf_mask) | base::cf_ari(r < i);
+    self().on_set_wz(inc16(i));
+    self().on_set_hl(r);
+    self().on_set_f(f);
+  }
+
+  void on_alu_r(alu k, reg r) {
+    do_alu(k, self().on_get_reg(r));
+  }
+
+  void on_call_cc_nn(condition cc, fast_u16 nn) {
+    if (base::check_condition(cc))
+      self().on_call(nn);
+    else
+      self().on_set_wz(nn);
+  }
+
+  void on_ccf() {
+    self().on_set_f(self().on_get_f() ^ base::cf_mask);
+  }
+
+  void on_cpl() {
+    self().on_set_a(self().on_get_a() ^ 0xff);
+  }
+
+  void on_daa() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    bool cf = f & cf_mask;
+    bool hf = f & hf_mask;
+
+    fast_u8 d = 0x00;
+    if (cf || a > 0x99) {
+      d |= 0x60;
+      f |= cf_mask;
+    }
+    if (hf || (a & 0x0f) > 0x09) {
+      d |= 0x06;
+    }
+
+    fast_u8 n = add8(a, d);
+    fast_u8 hfm = (a & 0x0f) > 0x09 ? hf_mask : 0;  // TODO
+    f = (f & (cf_mask | xf_mask | yf_mask | nf_mask)) |
+        (n & sf_mask) | zf_ari(n) | hfm | pf_log(n);
+    self().on_set_a(n);
+    self().on_set_f(f);
+  }
+
+  void on_dec_r(reg r) {
+    fast_u8 n = self().on_get_reg(r);
+    fast_u8 f = self().on_get_f();
+    fast_u8 hf = (n & 0xf) > 0 ? hf_mask : 0;
+    n = dec8(n);
+    f = (f & (cf_mask | yf_mask | xf_mask | nf_mask)) |
+        (n & sf_mask) | zf_ari(n) | hf | pf_log(n);
+    self().on_set_reg(r, n);
+    self().on_set_f(f);
+  }
+
+  void on_di() {
+    self().set_iff_on_di(false);
+  }
+
+  void on_ei() {
+    self().set_iff_on_ei(true);
+    self().disable_int_on_ei();
+  }
+
+  void on_ex_at_sp_irp() {
+    fast_u16 sp = self().on_get_sp();
+    fast_u8 lo = self().on_read_cycle(sp);
+    sp = inc16(sp);
+    fast_u8 hi = self().on_read_cycle(sp);
+    fast_u16 nn = make16(hi, lo);
+    fast_u16 hl = self().on_get_hl();
+    std::swap(nn, hl);
+    self().on_write_cycle(sp, get_high8(nn));
+    sp = dec16(sp);
+    self().on_write_cycle(sp, get_low8(nn));
+    self().on_write_cycle_extra_2t();
+    self().on_set_wz(hl);
+    self().on_set_hl(hl);
+  }
+
+  void on_jp_irp() {
+    self().set_pc_on_jump(self().on_get_hl());
+  }
+
+  void on_in_a_n(fast_u8 n) {
+    self().on_set_a(self().on_input_cycle(n));
+  }
+
+  void on_inc_r(reg r) {
+    fast_u8 n = self().on_get_reg(r);
+    fast_u8 f = self().on_get_f();
+    fast_u8 hf = (n & 0xf) > 0xe ? hf_mask : 0;
+    n = inc8(n);
+    f = (f & (cf_mask | yf_mask | xf_mask | nf_mask)) |
+        (n & sf_mask) | zf_ari(n) | hf | pf_log(n);
+    self().on_set_reg(r, n);
+    self().on_set_f(f);
+  }
+
+  void on_ld_r_n(reg r, fast_u8 n) {
+    self().on_set_reg(r, n);
+  }
+
+  void on_ld_r_r(reg rd, reg rs) {
+    self().on_fetch_cycle_extra_1t();
+    self().on_set_reg(rd, self().on_get_reg(rs));
+  }
+
+  void on_ld_sp_irp() {
+    self().on_set_sp(self().on_get_hl());
+  }
+
+  void on_ld_irp_at_nn(fast_u16 nn) {
+    fast_u8 lo = self().on_read_cycle(nn);
+    nn = inc16(nn);
+    self().on_set_wz(nn);
+    fast_u8 hi = self().on_read_cycle(nn);
+    self().on_set_hl(make16(hi, lo));
+  }
+
+  void on_ld_at_nn_irp(fast_u16 nn) {
+    fast_u16 irp = self().on_get_hl();
+    self().on_write_cycle(nn, get_low8(irp));
+    nn = inc16(nn);
+    self().on_set_wz(nn);
+    self().on_write_cycle(nn, get_high8(irp));
+  }
+
+  void on_out_n_a(fast_u8 n) {
+    self().on_output_cycle(n, self().on_get_a());
+  }
+
+  void on_pop_rp(regp2 rp) {
+    fast_u16 n = self().on_pop();
+    if (rp == regp2::af) {
+      // Not all flags are updated on pop psw.
+      n = (n & ~(xf_mask | yf_mask)) | nf_mask;
+    }
+    self().on_set_regp2(rp, n);
+  }
+
+  void on_rla() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    fast_u8 r = mask8(a << 1) | ((f & base::cf_mask) ? 1 : 0);
+    f = (f & (0xff & ~base::cf_mask)) | base::cf_ari(a & 0x80);
+    self().on_set_a(r);
+    self().on_set_f(f);
+  }
+
+  void on_rra() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    fast_u8 r = (a >> 1) | ((f & base::cf_mask) ? 0x80 : 0);
+    f = (f & ~base::cf_mask) | base::cf_ari(a & 0x1);
+    self().on_set_a(r);
+    self().on_set_f(f);
+  }
+
+  void on_rlca() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    a = rol8(a);
+    f = (f & ~base::cf_mask) | base::cf_ari(a & 0x1);
+    self().on_set_a(a);
+    self().on_set_f(f);
+  }
+
+  void on_rrca() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    a = ror8(a);
+    f = (f & ~base::cf_mask) | base::cf_ari(a & 0x80);
+    self().on_set_a(a);
+    self().on_set_f(f);
+  }
+
+  void on_scf() {
+    self().on_set_f(self().on_get_f() | base::cf_mask);
+  }
+
+protected:
+  using base::self;
+};
+
+template<typename B>
+class z80_executor : public internals::executor_base<B> {
+public:
+  typedef internals::executor_base<B> base;
+
+  z80_executor() {}
+
+  using base::sf_bit;
+  using base::zf_bit;
+  using base::yf_bit;
+  using base::hf_bit;
+  using base::xf_bit;
+  using base::pf_bit;
+  using base::nf_bit;
+  using base::cf_bit;
+
+  using base::sf_mask;
+  using base::zf_mask;
+  using base::yf_mask;
+  using base::hf_mask;
+  using base::xf_mask;
+  using base::pf_mask;
+  using base::nf_mask;
+  using base::cf_mask;
+
+  using base::zf_ari;
+  using base::hf_ari;
+  using base::hf_dec;
+  using base::hf_inc;
+  using base::pf_ari;
+  using base::pf_log;
+  using base::pf_dec;
+  using base::pf_inc;
+  using base::cf_ari;
+
+  void set_i_on_ld(fast_u8 i) { self().on_set_i(i); }
+
+  void on_inc_r_reg() {
+    if (!base::has_feature(cpu_features::r_reg))
+      return;
+    // TODO: Consider splitting R into R[7] and R[6:0].
+    fast_u8 r = self().on_get_r();
+    r = (r & 0x80) | (inc8(r) & 0x7f);
+    self().on_set_r(r);
+  }
+
+  fast_u16 on_get_ix() {
+    // Always get the low byte first.
+    fast_u8 l = self().on_get_ixl();
+    fast_u8 h = self().on_get_ixh();
+    return make16(h, l);
+  }
+
+  void on_set_ix(fast_u16 ix) {
+    // Always set the low byte first.
+    self().on_set_ixl(get_low8(ix));
+    self().on_set_ixh(get_high8(ix));
+  }
+
+  fast_u16 on_get_iy() {
+    // Always get the low byte first.
+    fast_u8 l = self().on_get_iyl();
+    fast_u8 h = self().on_get_iyh();
+    return make16(h, l);
+  }
+
+  void on_set_iy(fast_u16 iy) {
+    // Always set the low byte first.
+    self().on_set_iyl(get_low8(iy));
+    self().on_set_iyh(get_high8(iy));
+  }
+
+  fast_u16 get_pc_on_disp_read() { return self().on_get_pc(); }
+
+  void set_pc_on_disp_read(fast_u16 pc) { self().on_set_pc(pc); }
+
+  fast_u16 get_pc_on_block_instr() { return self().on_get_pc(); }
+
+  void set_pc_on_block_instr(fast_u16 pc) { self().on_set_pc(pc); }
+
+  fast_u16 get_ir_on_refresh() { return self().on_get_ir(); }
+
+  void set_iff1_on_di(bool f) { self().on_set_iff1(f); }
+
+  void set_iff1_on_ei(bool f) { self().on_set_iff1(f); }
+
+  void set_iff1_on_retn(bool f) { self().on_set_iff1(f); }
+
+  void set_iff2_on_di(bool f) { self().on_set_iff2(f); }
+
+  void set_iff2_on_ei(bool f) { self().on_set_iff2(f); }
+
+  bool get_iff2_on_retn() { return self().on_get_iff2(); }
+
+  fast_u16 get_disp_target(fast_u16 base, fast_u8 d) {
+    return !get_sign8(d) ? add16(base, d) : sub16(base, neg8(d));
+  }
+
+  fast_u8 read_at_disp(fast_u8 d, bool long_read_cycle = false) {
+    fast_u16 addr = get_disp_target(self().on_get_iregp(), d);
+    fast_u8 res = self().on_read_cycle(addr);
+    if (long_read_cycle)  // TODO: Remove. Do extra ticks manually.
+      self().on_read_cycle_extra_1t();
+    if (!is_hl_iregp())
+      self().on_set_wz(addr);
+    return res;
+  }
+
+  void write_at_disp(fast_u8 d, fast_u8 n) {
+    fast_u16 addr = get_disp_target(self().on_get_iregp(), d);
+    self().on_write_cycle(addr, n);
+    if (!is_hl_iregp())
+      self().on_set_wz(addr);
+  }
+
+  fast_u8 on_get_reg(reg r, iregp irp, fast_u8 d = 0,
+                     bool long_read_cycle = false) {
+    switch (r) {
+      case reg::b:
+        return self().on_get_b();
+      case reg::c:
+        return self().on_get_c();
+      case reg::d:
+        return self().on_get_d();
+      case reg::e:
+        return self().on_get_e();
+      case reg::at_hl:
+        return read_at_disp(d, long_read_cycle);
+      case reg::a:
+        return self().on_get_a();
+      case reg::h:
+        switch (irp) {
+          case iregp::hl:
+            return self().on_get_h();
+          case iregp::ix:
+            return self().on_get_ixh();
+          case iregp::iy:
+            return self().on_get_iyh();
+        }
+        break;
+      case reg::l:
+        switch (irp) {
+          case iregp::hl:
+            return self().on_get_l();
+          case iregp::ix:
+            return self().on_get_ixl();
+          case iregp::iy:
+            return self().on_get_iyl();
+        }
+        break;
+    }
+    unreachable("Unknown register.");
+  }
+
+  Z80_VIRTUAL void on_set_reg(reg r, iregp irp, fast_u8 d, fast_u8 n) {
+    switch (r) {
+      case reg::b:
+        return self().on_set_b(n);
+      case reg::c:
+        return self().on_set_c(n);
+      case reg::d:
+        return self().on_set_d(n);
+      case reg::e:
+        return self().on_set_e(n);
+      case reg::at_hl:
+        return write_at_disp(d, n);
+      case reg::a:
+        return self().on_set_a(n);
+      case reg::h:
+        switch (irp) {
+          case iregp::hl:
+            return self().on_set_h(n);
+          case iregp::ix:
+            return self().on_set_ixh(n);
+          case iregp::iy:
+            return self().on_set_iyh(n);
+        }
+        break;
+      case reg::l:
+        switch (irp) {
+          case iregp::hl:
+            return self().on_set_l(n);
+          case iregp::ix:
+            return self().on_set_ixl(n);
+          case iregp::iy:
+            return self().on_set_iyl(n);
+        }
+        break;
+    }
+    unreachable("Unknown register.");
+  }
+
+  fast_u16 on_get_regp(regp rp) {
+    switch (rp) {
+      case regp::bc:
+        return self().on_get_bc();
+      case regp::de:
+        return self().on_get_de();
+      case regp::hl:
+        return self().on_get_iregp();
+      case regp::sp:
+        return self().on_get_sp();
+    }
+    unreachable("Unknown register.");
+  }
+
+  Z80_VIRTUAL void on_set_regp(regp rp, fast_u16 nn) {
+    switch (rp) {
+      case regp::bc:
+        return self().on_set_bc(nn);
+      case regp::de:
+        return self().on_set_de(nn);
+      case regp::hl:
+        return self().on_set_iregp(nn);
+      case regp::sp:
+        return self().on_set_sp(nn);
+    }
+    unreachable("Unknown register.");
+  }
+
+  fast_u16 on_get_regp2(regp2 rp) {
+    switch (rp) {
+      case regp2::bc:
+        return self().on_get_bc();
+      case regp2::de:
+        return self().on_get_de();
+      case regp2::hl:
+        return self().on_get_iregp();
+      case regp2::af:
+        return self().on_get_af();
+    }
+    unreachable("Unknown register.");
+  }
+
+  void on_set_regp2(regp2 rp, fast_u16 nn) {
+    switch (rp) {
+      case regp2::bc:
+        return self().on_set_bc(nn);
+      case regp2::de:
+        return self().on_set_de(nn);
+      case regp2::hl:
+        return self().on_set_iregp(nn);
+      case regp2::af:
+        return self().on_set_af(nn);
+    }
+    unreachable("Unknown register.");
+  }
+
+  fast_u16 on_get_iregp() {
+    switch (self().on_get_iregp_kind()) {
+      case iregp::hl:
+        return self().on_get_hl();
+      case iregp::ix:
+        return self().on_get_ix();
+      case iregp::iy:
+        return self().on_get_iy();
+    }
+    unreachable("Unknown index register.");
+  }
+
+  Z80_VIRTUAL void on_set_iregp(fast_u16 nn) {
+    switch (self().on_get_iregp_kind()) {
+      case iregp::hl:
+        return self().on_set_hl(nn);
+      case iregp::ix:
+        return self().on_set_ix(nn);
+      case iregp::iy:
+        return self().on_set_iy(nn);
+    }
+    unreachable("Unknown index register.");
+  }
+
+  void do_sub(fast_u8 &a, fast_u8 &f, fast_u8 n) {
+    fast_u8 t = sub8(a, n);
+    f = (t & (sf_mask | yf_mask | xf_mask)) | zf_ari(t) |
+        hf_ari(t, a, n) | pf_ari(a - n, a, n) | cf_ari(t > a) | nf_mask;
+    a = t;
+  }
+
+  // Flags of block input and output instructions. 'b' is the
+  // decremented value of B, 'n' is the byte transferred and 'k'
+  // is the sum of the byte and the new value of L for outputs
+  // or the adjusted value of C for inputs.
+  static fast_u8 get_block_io_flags(fast_u8 b, fast_u8 n, fast_u16 k) {
+    fast_u8 pf = (get_low8(k) & 7) ^ b;
+    return (b & (sf_mask | yf_mask | xf_mask)) | zf_ari(b) |
+           ((n & 0x80) >> (7 - nf_bit)) | pf_log(pf) |
+           ((k < 0x100) ? 0 : (hf_mask | cf_mask));
+  }
+
+  static void do_cp(fast_u8 a, fast_u8 &f, fast_u8 n) {
+    fast_u8 t = sub8(a, n);
+    f = (t & sf_mask) | zf_ari(t) | (n & (yf_mask | xf_mask)) |
+        hf_ari(t, a, n) | pf_ari(a - n, a, n) | cf_ari(t > a) | nf_mask;
+  }
+
+  void do_alu(alu k, fast_u8 n) {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = 0;
+    switch (k) {
+      case alu::add: {
+        fast_u8 t = add8(a, n);
+        f = (t & (sf_mask | yf_mask | xf_mask)) | zf_ari(t) |
+            hf_ari(t, a, n) | pf_ari(a + n, a, n) | cf_ari(t < a);
+        a = t;
+        break;
+      }
+      case alu::adc: {
+        f = self().on_get_f();
+        fast_u8 cfv = (f & cf_mask) ? 1 : 0;
+        fast_u8 t = mask8(a + n + cfv);
+        f = (t & (sf_mask | yf_mask | xf_mask)) | zf_ari(t) |
+            hf_ari(t, a, n) | pf_ari(a + n + cfv, a, n) |
+            cf_ari(t < a || (cfv && n == 0xff));
+        a = t;
+        break;
+      }
+      case alu::sub: {
+        do_sub(a, f, n);
+        break;
+      }
+      case alu::sbc: {
+        f = self().on_get_f();
+        fast_u8 cfv = (f & cf_mask) ? 1 : 0;
+        fast_u8 t = mask8(a - n - cfv);
+        f = (t & (sf_mask | yf_mask | xf_mask)) | zf_ari(t) |
+            hf_ari(t, a, n) | pf_ari(a - n - cfv, a, n) |
+            cf_ari(t > a || (cfv && n == 0xff)) | nf_mask;
+        a = t;
+        break;
+      }
+      case alu::and_a:
+        a &= n;
+        f = (a & (sf_mask | yf_mask | xf_mask)) | zf_ari(a) | pf_log(a) |
+            hf_mask;
+        break;
+      case alu::xor_a:
+        a ^= n;
+        f = (a & (sf_mask | yf_mask | xf_mask)) | zf_ari(a) | pf_log(a);
+        break;
+      case alu::or_a:
+        a |= n;
+        f = (a & (sf_mask | yf_mask | xf_mask)) | zf_ari(a) | pf_log(a);
+        break;
+      case alu::cp:
+        do_cp(a, f, n);
+        break;
+    }
+    if (k != alu::cp)
+      self().on_set_a(a);
+    self().on_set_f(f);
+  }
+
+  void do_rot(rot k, fast_u8 &n, fast_u8 &f) {
+    fast_u8 t = n;
+    bool cf = f & cf_mask;
+    switch (k) {
+      case rot::rlc:
+        n = rol8(n);
+        f = (n & (sf_mask | yf_mask | xf_mask | cf_mask)) | zf_ari(n) |
+            pf_log(n);
+        break;
+      case rot::rrc:
+        n = mask8((n >> 1) | (n << 7));
+        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
+            cf_ari(t & 0x01);
+        break;
+      case rot::rl:
+        n = mask8((n << 1) | (cf ? 1 : 0));
+        // TODO: We don't need to read F here.
+        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
+            cf_ari(t & 0x80);
+        break;
+      case rot::rr:
+        n = (n >> 1) | ((cf ? 1u : 0u) << 7);
+        // TODO: We don't need to read F here.
+        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
+            cf_ari(t & 0x01);
+        break;
+      case rot::sla:
+        n = mask8(n << 1);
+        // TODO: We don't need to read F here.
+        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
+            cf_ari(t & 0x80);
+        break;
+      case rot::sra:
+        n = (n >> 1) | (n & 0x80);
+        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
+            cf_ari(t & 0x01);
+        break;
+      case rot::sll:
+        n = mask8(n << 1) | 1;
+        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
+            cf_ari(t & 0x80);
+        break;
+      case rot::srl:
+        n >>= 1;
+        // TODO: We don't need to read F here.
+        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
+            cf_ari(t & 0x1);
+        break;
+    }
+  }
+
+  void on_relative_jump(fast_u8 d) {
+    self().on_5t_exec_cycle();
+    self().on_jump(get_disp_target(self().get_pc_on_jump(), d));
+  }
+
+  void on_add_irp_rp(regp rp) {
+    fast_u16 i = self().on_get_iregp();
+    fast_u16 n = self().on_get_regp(rp);
+    fast_u8 f = self().on_get_f();
+
+    self().on_4t_exec_cycle();
+    self().on_3t_exec_cycle();
+
+    fast_u16 r = add16(i, n);
+    f = (f & (sf_mask | zf_mask | pf_mask)) |
+        (get_high8(r) & (yf_mask | xf_mask)) |
+        hf_ari(r >> 8, i >> 8, n >> 8) | cf_ari(r < i);
+
+    self().on_set_wz(inc16(i));
+    self().on_set_iregp(r);
+    self().on_set_f(f);
+  }
+
+  void on_adc_hl_rp(regp rp) {
+    fast_u16 hl = self().on_get_hl();
+    fast_u16 n = self().on_get_regp(rp);
+    bool cf = self().on_get_f() & cf_mask;
+
+    self().on_4t_exec_cycle();
+    self().on_3t_exec_cycle();
+
+    fast_u16 t = add16(n, cf);
+    bool of = cf && t == 0;
+    fast_u32 r32 = hl + t;
+    fast_u16 r16 = mask16(r32);
+    fast_u8 f = (get_high8(r16) & (sf_mask | yf_mask | xf_mask)) |
+                zf_ari(r16) | hf_ari(r16 >> 8, hl >> 8, n >> 8) |
+                (pf_ari(r32 >> 8, hl >> 8, n >> 8) ^
+                 (of ? pf_mask : 0)) |
+                cf_ari(r16 < hl || of);
+
+    self().on_set_wz(inc16(hl));
+    self().on_set_hl(r16);
+    self().on_set_f(f);
+  }
+
+  void on_alu_r(alu k, reg r, fast_u8 d) {
+    iregp irp = self().on_get_iregp_kind();
+    do_alu(k, self().on_get_reg(r, irp, d));
+  }
+
+  void on_block_cp(block_cp k) {
+    fast_u16 bc = self().on_get_bc();
+    fast_u16 wz = self().on_get_wz();
+    fast_u16 hl = self().on_get_hl();
+    // TODO: Block comparisons implicitly depend on the
+    // register 'a'. We probably want to request its value
+    // here with a special handler.
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+
+    fast_u8 t = self().on_read_cycle(hl);
+    fast_u8 tf = f;
+    do_cp(a, tf, t);
+
+    self().on_5t_exec_cycle();
+    bc = dec16(bc);
+
+    t = a - t - ((tf & hf_mask) ? 1 : 0);
+    f = (tf & (sf_mask | zf_mask | hf_mask)) |
+        ((t << 4) & yf_mask) | (t & xf_mask) |
+        (bc != 0 ? pf_mask : 0) | nf_mask | (f & cf_mask);
+
+    if (static_cast<unsigned>(k) & 1) {
+      // CPD, CPDR
+      hl = dec16(hl);
+      wz = dec16(wz);
+    } else {
+      // CPI, CPIR
+      hl = inc16(hl);
+      wz = inc16(wz);
+    }
+
+    self().on_set_bc(bc);
+    self().on_set_wz(wz);
+    self().on_set_hl(hl);
+    self().on_set_f(f);
+
+    // CPIR, CPDR
+    if ((static_cast<unsigned>(k) & 2) && bc && !(f & zf_mask)) {
+      self().on_5t_exec_cycle();
+      fast_u16 pc = self().get_pc_on_block_instr();
+      self().on_set_wz(dec16(pc));
+      self().set_pc_on_block_instr(sub16(pc, 2));
+    }
+  }
+
+  void on_block_ld(block_ld k) {
+    fast_u16 bc = self().on_get_bc();
+    fast_u16 de = self().on_get_de();
+    fast_u16 hl = self().on_get_hl();
+    // TODO: Block loads implicitly depend on the register 'a'. We probably
+    // want to request its value here with a special handler.
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+
+    fast_u8 t = self().on_read_cycle(hl);
+
+    self().on_write_cycle(de, t);
+    self().on_write_cycle_extra_2t();
+    bc = dec16(bc);
+
+    t += a;
+    f = (f & (sf_mask | zf_mask | cf_mask)) |
+        ((t << 4) & yf_mask) | (t & xf_mask) | (bc != 0 ? pf_mask : 0);
+    if (static_cast<unsigned>(k) & 1) {
+      // LDD, LDDR
+      hl = dec16(hl);
+      de = dec16(de);
+    } else {
+      // LDI, LDIR
+      hl = inc16(hl);
+      de = inc16(de);
+    }
+
+    self().on_set_bc(bc);
+    self().on_set_de(de);
+    self().on_set_hl(hl);
+    self().on_set_f(f);
+
+    // LDIR, LDDR
+    if ((static_cast<unsigned>(k) & 2) && bc) {
+      self().on_5t_exec_cycle();
+      fast_u16 pc = self().get_pc_on_block_instr();
+      self().on_set_wz(dec16(pc));
+      self().set_pc_on_block_instr(sub16(pc, 2));
+    }
+  }
+
+  void on_block_in(block_in k) {
+    fast_u16 bc = self().on_get_bc();
+    fast_u16 hl = self().on_get_hl();
+
+    self().on_fetch_cycle_extra_1t();
+    fast_u8 r = self().on_input_cycle(bc);
+    self().on_write_cycle(hl, r);
+    fast_u8 c = get_low8(bc);
+    fast_u16 wz;
+
+    if (static_cast<unsigned>(k) & 1) {
+      // IND, INDR
+      hl = dec16(hl);
+      wz = dec16(bc);
+      c = dec8(c);
+    } else {
+      // INI, INIR
+      hl = inc16(hl);
+      wz = inc16(bc);
+      c = inc8(c);
+    }
+
+    bc = sub16(bc, 0x0100);
+    fast_u8 s = get_high8(bc);
+    fast_u8 f = get_block_io_flags(s, r, c + r);
+
+    self().on_set_bc(bc);
+    self().on_set_wz(wz);
+    self().on_set_hl(hl);
+    self().on_set_f(f);
+
+    // INIR, INDR
+    if ((static_cast<unsigned>(k) & 2) && s) {
+      self().on_5t_exec_cycle();
+      fast_u16 pc = self().get_pc_on_block_instr();
+      self().set_pc_on_block_instr(sub16(pc, 2));
+    }
+  }
+
+  void on_block_out(block_out k) {
+    fast_u16 bc = self().on_get_bc();
+    fast_u16 wz = self().on_get_wz();
+    fast_u16 hl = self().on_get_hl();
+    fast_u8 f = self().on_get_f();
+
+    self().on_fetch_cycle_extra_1t();
+    fast_u8 r = self().on_read_cycle(hl);
+    self().on_output_cycle(bc, r);
+    bc = sub16(bc, 0x0100);
+    fast_u8 s = get_high8(bc);
+
+    if (static_cast<unsigned>(k) & 1) {
+      // OUTD, OTDR
+      hl = dec16(hl);
+      wz = dec16(bc);
+    } else {
+      // OUTI, OTIR
+      hl = inc16(hl);
+      wz = inc16(bc);
+    }
+
+    f = get_block_io_flags(s, r, get_low8(hl) + r);
+
+    self().on_set_bc(bc);
+    self().on_set_wz(wz);
+    self().on_set_hl(hl);
+    self().on_set_f(f);
+
+    // OTIR, OTDR
+    if ((static_cast<unsigned>(k) & 2) && s) {
+      self().on_5t_exec_cycle();
+      fast_u16 pc = self().get_pc_on_block_instr();
+      self().set_pc_on_block_instr(sub16(pc, 2));
+    }
+  }
+
+  void on_bit(unsigned b, reg r, fast_u8 d) {
+    iregp irp = self().on_get_iregp_kind();
+    fast_u8 v = self().on_get_reg(r, irp, d, /* long_read_cycle= */ true);
+    fast_u8 f = self().on_get_f();
+    fast_u8 m = v & (1u << b);
+    // TODO: Is it always (m & sf_mask)? Regardless of whether m is zero or not?
+    f = (f & cf_mask) | hf_mask | (m ? (m & sf_mask) : (zf_mask | pf_mask));
+    if (!is_hl_iregp() || r == reg::at_hl)
+      v = get_high8(self().on_get_wz());
+    f |= v & (xf_mask | yf_mask);
+    self().on_set_f(f);
+  }
+
+  void on_call_cc_nn(condition cc, fast_u16 nn) {
+    if (base::check_condition(cc)) {
+      self().on_read_cycle_extra_1t();
+      self().on_call(nn);
+    } else {
+      self().on_set_wz(nn);
     }
-    unreachable("Unknown register.");
   }
 
-  fast_u16 on_get_regp(regp rp) {
-    switch (rp) {
-      case regp::bc:
-        return self().on_get_bc();
-      case regp::de:
-        return self().on_get_de();
-      case regp::hl:
-        return self().on_get_iregp();
-      case regp::sp:
-        return self().on_get_sp();
+  void on_ccf() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    bool cf = f & cf_mask;
+    f = (f & (sf_mask | zf_mask | pf_mask)) | (a & (yf_mask | xf_mask)) |
+        (cf ? hf_mask : 0) | cf_ari(!cf);
+    self().on_set_f(f);
+  }
+
+  void on_daa() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    bool cf = f & cf_mask;
+    bool hf = f & hf_mask;
+    bool nf = f & nf_mask;
+
+    fast_u8 d = 0x00;
+    if (cf || a >= 0x9a) {
+      d |= 0x60;
+      f |= cf_mask;
     }
-    unreachable("Unknown register.");
+    if (hf || (a & 0x0f) >= 0x0a) {
+      d |= 0x06;
+    }
+
+    if (!nf) {
+      f = (f & cf_mask) | ((a & 0x0f) >= 0x0a ? hf_mask : 0);
+      a = add8(a, d);
+    } else {
+      f = (f & cf_mask) | (hf && (a & 0x0f) <= 0x05 ? hf_mask : 0) |
+          nf_mask;
+      a = sub8(a, d);
+    }
+    f |= (a & (sf_mask | xf_mask | yf_mask)) | pf_log(a) | zf_ari(a);
+
+    self().on_set_a(a);
+    self().on_set_f(f);
+  }
+
+  void on_cpl() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    a ^= 0xff;
+    f = (f & (sf_mask | zf_mask | pf_mask | cf_mask)) |
+        (a & (yf_mask | xf_mask)) | hf_mask | nf_mask;
+    self().on_set_a(a);
+    self().on_set_f(f);
+  }
+
+  void on_dec_r(reg r, fast_u8 d) {
+    iregp irp = self().on_get_iregp_kind();
+    fast_u8 v = self().on_get_reg(r, irp, d, /* long_read_cycle= */ true);
+    fast_u8 f = self().on_get_f();
+    v = dec8(v);
+    f = (f & cf_mask) | (v & (sf_mask | yf_mask | xf_mask)) | zf_ari(v) |
+        hf_dec(v) | pf_dec(v) | nf_mask;
+    self().on_set_reg(r, irp, d, v);
+    self().on_set_f(f);
+  }
+
+  void on_di() {
+    self().set_iff1_on_di(false);
+    self().set_iff2_on_di(false);
+  }
+
+  void on_djnz(fast_u8 d) {
+    fast_u8 b = self().on_get_b();
+    b = dec8(b);
+    self().on_set_b(b);
+    if (b)
+      self().on_relative_jump(d);
+  }
+
+  void on_ei() {
+    self().set_iff1_on_ei(true);
+    self().set_iff2_on_ei(true);
+    self().disable_int_on_ei();
+  }
+
+  void on_ex_af_alt_af() {
+    self().on_ex_af_alt_af_regs();
+  }
+
+  void on_ex_at_sp_irp() {
+    fast_u16 sp = self().on_get_sp();
+    fast_u8 lo = self().on_read_cycle(sp);
+    sp = inc16(sp);
+    fast_u8 hi = self().on_read_cycle(sp);
+    self().on_read_cycle_extra_1t();
+    fast_u16 nn = make16(hi, lo);
+    fast_u16 irp = self().on_get_iregp();
+    std::swap(nn, irp);
+    self().on_write_cycle(sp, get_high8(nn));
+    sp = dec16(sp);
+    self().on_write_cycle(sp, get_low8(nn));
+    self().on_write_cycle_extra_2t();
+    self().on_set_wz(irp);
+    self().on_set_iregp(irp);
+  }
+
+  void on_exx() {
+    self().on_exx_regs();
+  }
+
+  void on_im(unsigned mode) {
+    self().on_set_int_mode(mode);
+  }
+
+  void on_in_a_n(fast_u8 n) {
+    fast_u8 a = self().on_get_a();
+    fast_u16 port = make16(a, n);
+    self().on_set_wz(inc16(port));
+    self().on_set_a(self().on_input_cycle(port));
+  }
+
+  void on_in_r_c(reg r) {
+    fast_u16 bc = self().on_get_bc();
+    fast_u8 f = self().on_get_f();
+    self().on_set_wz(inc16(bc));
+    fast_u8 n = self().on_input_cycle(bc);
+    iregp irp = self().on_get_iregp_kind();
+    if (r != reg::at_hl)
+      self().on_set_reg(r, irp, /* d= */ 0, n);
+    f = (f & cf_mask) | (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) |
+        pf_log(n);
+    self().on_set_f(f);
+  }
+
+  void on_inc_r(reg r, fast_u8 d) {
+    iregp irp = self().on_get_iregp_kind();
+    fast_u8 v = self().on_get_reg(r, irp, d, /* long_read_cycle= */ true);
+    fast_u8 f = self().on_get_f();
+    v = inc8(v);
+    f = (f & cf_mask) | (v & (sf_mask | yf_mask | xf_mask)) | zf_ari(v) |
+        hf_inc(v) | pf_inc(v);
+    self().on_set_reg(r, irp, d, v);
+    self().on_set_f(f);
+  }
+
+  void on_jp_irp() {
+    self().set_pc_on_jump(self().on_get_iregp());
+  }
+
+  void on_jr(fast_u8 d) {
+    self().on_relative_jump(d);
+  }
+
+  void on_jr_cc(condition cc, fast_u8 d) {
+    if (base::check_condition(cc))
+      self().on_relative_jump(d);
+  }
+
+  void on_ld_a_r() {
+    fast_u8 n = self().on_get_r();
+    fast_u8 f = self().on_get_f();
+    f = (f & cf_mask) | (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) |
+        ((self().on_get_iff2() ? 1u : 0u) << pf_bit);
+    self().on_set_a(n);
+    self().on_set_f(f);
+  }
+
+  void on_ld_r_a() {
+    self().on_set_r(self().on_get_a());
+  }
+
+  void on_ld_a_i() {
+    fast_u8 i = self().on_get_i();
+    fast_u8 f = self().on_get_f();
+    f = (f & cf_mask) | (i & (sf_mask | yf_mask | xf_mask)) |
+        zf_ari(i) | (self().on_get_iff2() ? pf_mask : 0);
+    self().on_set_a(i);
+    self().on_set_f(f);
+  }
+
+  void on_ld_i_a() {
+    self().set_i_on_ld(self().on_get_a());
+  }
+
+  void on_ld_r_r(reg rd, reg rs, fast_u8 d) {
+    iregp irp = self().on_get_iregp_kind();
+    iregp irpd = rs == reg::at_hl ? iregp::hl : irp;
+    iregp irps = rd == reg::at_hl ? iregp::hl : irp;
+    self().on_set_reg(rd, irpd, d, self().on_get_reg(rs, irps, d));
+  }
+
+  void on_ld_r_n(reg r, fast_u8 d, fast_u8 n) {
+    iregp irp = self().on_get_iregp_kind();
+    self().on_set_reg(r, irp, d, n);
+  }
+
+  void on_ld_irp_at_nn(fast_u16 nn) {
+    fast_u8 lo = self().on_read_cycle(nn);
+    nn = inc16(nn);
+    self().on_set_wz(nn);
+    fast_u8 hi = self().on_read_cycle(nn);
+    self().on_set_iregp(make16(hi, lo));
+  }
+
+  void on_ld_at_nn_irp(fast_u16 nn) {
+    fast_u16 irp = self().on_get_iregp();
+    self().on_write_cycle(nn, get_low8(irp));
+    nn = inc16(nn);
+    self().on_set_wz(nn);
+    self().on_write_cycle(nn, get_high8(irp));
+  }
+
+  void on_ld_rp_at_nn(regp rp, fast_u16 nn) {
+    fast_u8 lo = self().on_read_cycle(nn);
+    nn = inc16(nn);
+    self().on_set_wz(nn);
+    fast_u8 hi = self().on_read_cycle(nn);
+    self().on_set_regp(rp, make16(hi, lo));
+  }
+
+  void on_ld_at_nn_rp(fast_u16 nn, regp rp) {
+    fast_u16 rpv = self().on_get_regp(rp);
+    self().on_write_cycle(nn, get_low8(rpv));
+    nn = inc16(nn);
+    self().on_set_wz(nn);
+    self().on_write_cycle(nn, get_high8(rpv));
+  }
+
+  void on_ld_sp_irp() {
+    self().on_set_sp(self().on_get_iregp());
+  }
+
+  void on_neg() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    fast_u8 n = a;
+    a = 0;
+    do_sub(a, f, n);
+    self().on_set_a(a);
+    self().on_set_f(f);
   }
 
-  virtual void on_set_regp(regp rp, fast_u16 nn) {
-    switch (rp) {
-      case regp::bc:
-        return self().on_set_bc(nn);
-      case regp::de:
-        return self().on_set_de(nn);
-      case regp::hl:
-        return self().on_set_iregp(nn);
-      case regp::sp:
-        return self().on_set_sp(nn);
-    }
-    unreachable("Unknown register.");
+  void on_out_c_r(reg r) {
+    fast_u16 bc = self().on_get_bc();
+    self().on_set_wz(inc16(bc));
+    iregp irp = self().on_get_iregp_kind();
+    fast_u8 n = (r == reg::at_hl) ?
+                0 : self().on_get_reg(r, irp, /* d= */ 0);
+    self().on_output_cycle(bc, n);
   }
 
-  fast_u16 on_get_regp2(regp2 rp) {
-    switch (rp) {
-      case regp2::bc:
-        return self().on_get_bc();
-      case regp2::de:
-        return self().on_get_de();
-      case regp2::hl:
-        return self().on_get_iregp();
-      case regp2::af:
-        return self().on_get_af();
-    }
-    unreachable("Unknown register.");
+  void on_out_n_a(fast_u8 n) {
+    fast_u8 a = self().on_get_a();
+    self().on_output_cycle(make16(a, n), a);
+    self().on_set_wz(make16(a, inc8(n)));
   }
 
-  void on_set_regp2(regp2 rp, fast_u16 nn) {
-    switch (rp) {
-      case regp2::bc:
-        return self().on_set_bc(nn);
-      case regp2::de:
-        return self().on_set_de(nn);
-      case regp2::hl:
-        return self().on_set_iregp(nn);
-      case regp2::af:
-        return self().on_set_af(nn);
-    }
-    unreachable("Unknown register.");
+  void on_pop_rp(regp2 rp) {
+    self().on_set_regp2(rp, self().on_pop());
   }
 
-  fast_u16 on_get_iregp() {
-    switch (self().on_get_iregp_kind()) {
-      case iregp::hl:
-        return self().on_get_hl();
-      case iregp::ix:
-        return self().on_get_ix();
-      case iregp::iy:
-        return self().on_get_iy();
-    }
-    unreachable("Unknown index register.");
+  void on_res(unsigned b, reg r, fast_u8 d) {
+    iregp irp = self().on_get_iregp_kind();
+    reg access_r = irp == iregp::hl ? r : reg::at_hl;
+    fast_u8 v = self().on_get_reg(access_r, irp, d,
+            /* long_read_cycle= */ true);
+    v &= ~(1u << b);
+    self().on_set_reg(access_r, irp, d, v);
+    if (irp != iregp::hl && r != reg::at_hl)
+      self().on_set_reg(r, irp, /* d= */ 0, v);
   }
 
-  virtual void on_set_iregp(fast_u16 nn) {
-    switch (self().on_get_iregp_kind()) {
-      case iregp::hl:
-        return self().on_set_hl(nn);
-      case iregp::ix:
-        return self().on_set_ix(nn);
-      case iregp::iy:
-        return self().on_set_iy(nn);
-    }
-    unreachable("Unknown index register.");
+  void on_reti() {
+    self().on_return();
   }
 
-  void do_sub(fast_u8 &a, fast_u8 &f, fast_u8 n) {
-    fast_u8 t = sub8(a, n);
-    f = (t & (sf_mask | yf_mask | xf_mask)) | zf_ari(t) |
-        hf_ari(t, a, n) | pf_ari(a - n, a, n) | cf_ari(t > a) | nf_mask;
-    a = t;
+  void on_retn() {
+    self().set_iff1_on_retn(self().get_iff2_on_retn());
+    self().on_return();
   }
 
-  void do_cp(fast_u8 a, fast_u8 &f, fast_u8 n) {
-    fast_u8 t = sub8(a, n);
-    f = (t & sf_mask) | zf_ari(t) | (n & (yf_mask | xf_mask)) |
-        hf_ari(t, a, n) | pf_ari(a - n, a, n) | cf_ari(t > a) | nf_mask;
+  void on_rla() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    bool cf = f & cf_mask;
+    fast_u8 r = mask8((a << 1) | (cf ? 1 : 0));
+    f = (f & (sf_mask | zf_mask | pf_mask)) | (r & (yf_mask | xf_mask)) |
+        cf_ari(a & 0x80);
+    self().on_set_a(r);
+    self().on_set_f(f);
   }
 
-  void do_alu(alu k, fast_u8 n) {
+  void on_rlca() {
     fast_u8 a = self().on_get_a();
-    fast_u8 f = 0;
-    switch (k) {
-      case alu::add: {
-        fast_u8 t = add8(a, n);
-        f = (t & (sf_mask | yf_mask | xf_mask)) | zf_ari(t) |
-            hf_ari(t, a, n) | pf_ari(a + n, a, n) | cf_ari(t < a);
-        a = t;
-        break;
-      }
-      case alu::adc: {
-        f = self().on_get_f();
-        fast_u8 cfv = (f & cf_mask) ? 1 : 0;
-        fast_u8 t = mask8(a + n + cfv);
-        f = (t & (sf_mask | yf_mask | xf_mask)) | zf_ari(t) |
-            hf_ari(t, a, n) | pf_ari(a + n + cfv, a, n) |
-            cf_ari(t < a || (cfv && n == 0xff));
-        a = t;
-        break;
-      }
-      case alu::sub: {
-        do_sub(a, f, n);
-        break;
-      }
-      case alu::sbc: {
-        f = self().on_get_f();
-        fast_u8 cfv = (f & cf_mask) ? 1 : 0;
-        fast_u8 t = mask8(a - n - cfv);
-        f = (t & (sf_mask | yf_mask | xf_mask)) | zf_ari(t) |
-            hf_ari(t, a, n) | pf_ari(a - n - cfv, a, n) |
-            cf_ari(t > a || (cfv && n == 0xff)) | nf_mask;
-        a = t;
-        break;
-      }
-      case alu::and_a:
-        a &= n;
-        f = (a & (sf_mask | yf_mask | xf_mask)) | zf_ari(a) | pf_log(a) |
-            hf_mask;
-        break;
-      case alu::xor_a:
-        a ^= n;
-        f = (a & (sf_mask | yf_mask | xf_mask)) | zf_ari(a) | pf_log(a);
-        break;
-      case alu::or_a:
-        a |= n;
-        f = (a & (sf_mask | yf_mask | xf_mask)) | zf_ari(a) | pf_log(a);
-        break;
-      case alu::cp:
-        do_cp(a, f, n);
-        break;
-    }
-    if (k != alu::cp)
-      self().on_set_a(a);
+    fast_u8 f = self().on_get_f();
+    a = rol8(a);
+    f = (f & (sf_mask | zf_mask | pf_mask)) |
+        (a & (yf_mask | xf_mask | cf_mask));
+    self().on_set_a(a);
     self().on_set_f(f);
   }
 
-  void do_rot(rot k, fast_u8 &n, fast_u8 &f) {
-    fast_u8 t = n;
-    bool cf = f & cf_mask;
-    switch (k) {
-      case rot::rlc:
-        n = rol8(n);
-        f = (n & (sf_mask | yf_mask | xf_mask | cf_mask)) | zf_ari(n) |
-            pf_log(n);
-        break;
-      case rot::rrc:
-        n = mask8((n >> 1) | (n << 7));
-        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
-            cf_ari(t & 0x01);
-        break;
-      case rot::rl:
-        n = mask8((n << 1) | (cf ? 1 : 0));
-        // TODO: We don't need to read F here.
-        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
-            cf_ari(t & 0x80);
-        break;
-      case rot::rr:
-        n = (n >> 1) | ((cf ? 1u : 0u) << 7);
-        // TODO: We don't need to read F here.
-        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
-            cf_ari(t & 0x01);
-        break;
-      case rot::sla:
-        n = mask8(n << 1);
-        // TODO: We don't need to read F here.
-        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
-            cf_ari(t & 0x80);
-        break;
-      case rot::sra:
-        n = (n >> 1) | (n & 0x80);
-        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
-            cf_ari(t & 0x01);
-        break;
-      case rot::sll:
-        n = mask8(n << 1) | 1;
-        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
-            cf_ari(t & 0x80);
-        break;
-      case rot::srl:
-        n >>= 1;
-        // TODO: We don't need to read F here.
-        f = (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) | pf_log(n) |
-            cf_ari(t & 0x1);
-        break;
-    }
+  void on_rld() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    fast_u16 hl = self().on_get_hl();
+    self().on_set_wz(inc16(hl));
+    fast_u16 t = make16(a, self().on_read_cycle(hl));
+    self().on_4t_exec_cycle();
+
+    t = (t & 0xf000) | ((t & 0xff) << 4) | ((t & 0x0f00) >> 8);
+    a = get_high8(t);
+    f = (f & cf_mask) | (a & (sf_mask | yf_mask | xf_mask)) | zf_ari(a) |
+        pf_log(a);
+
+    self().on_set_a(a);
+    self().on_set_f(f);
+    self().on_write_cycle(hl, get_low8(t));
   }
 
-  void on_relative_jump(fast_u8 d) {
-    self().on_5t_exec_cycle();
-    self().on_jump(get_disp_target(self().get_pc_on_jump(), d));
+  void on_rot(rot k, reg r, fast_u8 d) {
+    iregp irp = self().on_get_iregp_kind();
+    reg access_r = irp == iregp::hl ? r : reg::at_hl;
+    fast_u8 n = self().on_get_reg(access_r, irp, d,
+            /* long_read_cycle= */ true);
+    fast_u8 f = self().on_get_f();
+    do_rot(k, n, f);
+    self().on_set_reg(access_r, irp, d, n);
+    if (irp != iregp::hl && r != reg::at_hl)
+      self().on_set_reg(r, irp, /* d= */ 0, n);
+    self().on_set_f(f);
   }
 
-  void on_add_irp_rp(regp rp) {
-    fast_u16 i = self().on_get_iregp();
-    fast_u16 n = self().on_get_regp(rp);
+  void on_rra() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    fast_u8 r = (a >> 1) | ((f & cf_mask) ? 0x80 : 0);
+    f = (f & (sf_mask | zf_mask | pf_mask)) | (r & (yf_mask | xf_mask)) |
+        cf_ari(a & 0x1);
+    self().on_set_a(r);
+    self().on_set_f(f);
+  }
+
+  void on_rrca() {
+    fast_u8 a = self().on_get_a();
     fast_u8 f = self().on_get_f();
+    a = ror8(a);
+    f = (f & (sf_mask | zf_mask | pf_mask)) | (a & (yf_mask | xf_mask)) |
+        cf_ari(a & 0x80);
+    self().on_set_a(a);
+    self().on_set_f(f);
+  }
 
+  void on_rrd() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    fast_u16 hl = self().on_get_hl();
+    self().on_set_wz(inc16(hl));
+    fast_u16 t = make16(a, self().on_read_cycle(hl));
     self().on_4t_exec_cycle();
-    self().on_3t_exec_cycle();
 
-    fast_u16 r = add16(i, n);
-    f = (f & (sf_mask | zf_mask | pf_mask)) |
-        (get_high8(r) & (yf_mask | xf_mask)) |
-        hf_ari(r >> 8, i >> 8, n >> 8) | cf_ari(r < i);
+    t = (t & 0xf000) | ((t & 0xf) << 8) | ((t & 0x0ff0) >> 4);
+    a = get_high8(t);
+    f = (f & cf_mask) | (a & (sf_mask | yf_mask | xf_mask)) | zf_ari(a) |
+        pf_log(a);
 
-    self().on_set_wz(inc16(i));
-    self().on_set_iregp(r);
+    self().on_set_a(a);
     self().on_set_f(f);
+    self().on_write_cycle(hl, get_low8(t));
   }
 
-  void on_adc_hl_rp(regp rp) {
+  void on_scf() {
+    fast_u8 a = self().on_get_a();
+    fast_u8 f = self().on_get_f();
+    f = (f & (sf_mask | zf_mask | pf_mask)) | (a & (yf_mask | xf_mask)) |
+        cf_mask;
+    self().on_set_f(f);
+  }
+
+  void on_set(unsigned b, reg r, fast_u8 d) {
+    iregp irp = self().on_get_iregp_kind();
+    reg access_r = irp == iregp::hl ? r : reg::at_hl;
+    fast_u8 v = self().on_get_reg(access_r, irp, d,
+            /* long_read_cycle= */ true);
+    v |= 1u << b;
+    self().on_set_reg(access_r, irp, d, v);
+    if (irp != iregp::hl && r != reg::at_hl)
+      self().on_set_reg(r, irp, /* d= */ 0, v);
+  }
+
+  void on_sbc_hl_rp(regp rp) {
     fast_u16 hl = self().on_get_hl();
     fast_u16 n = self().on_get_regp(rp);
     bool cf = self().on_get_f() & cf_mask;
@@ -3859,827 +5413,1662 @@ public:
 
     fast_u16 t = add16(n, cf);
     bool of = cf && t == 0;
-    fast_u32 r32 = hl + t;
+    fast_u32 r32 = hl - t;
     fast_u16 r16 = mask16(r32);
     fast_u8 f = (get_high8(r16) & (sf_mask | yf_mask | xf_mask)) |
                 zf_ari(r16) | hf_ari(r16 >> 8, hl >> 8, n >> 8) |
                 (pf_ari(r32 >> 8, hl >> 8, n >> 8) ^
                  (of ? pf_mask : 0)) |
-                cf_ari(r16 < hl || of);
+                cf_ari(r16 > hl || of) | nf_mask;
 
     self().on_set_wz(inc16(hl));
     self().on_set_hl(r16);
     self().on_set_f(f);
   }
 
-  void on_alu_r(alu k, reg r, fast_u8 d) {
-    iregp irp = self().on_get_iregp_kind();
-    do_alu(k, self().on_get_reg(r, irp, d));
+  fast_u8 on_fetch_cycle() {
+    fast_u16 addr = self().get_pc_on_fetch();
+    if (base::has_feature(cpu_features::addr_bus))
+      self().on_set_addr_bus(addr);
+    fast_u8 n = self().on_read(addr);
+    self().on_tick(2);
+    if (base::has_feature(cpu_features::addr_bus))
+      self().on_set_addr_bus(self().get_ir_on_refresh());
+    self().on_tick(2);
+    self().set_pc_on_fetch(inc16(addr));
+    return n;
   }
 
-  void on_block_cp(block_cp k) {
-    fast_u16 bc = self().on_get_bc();
-    fast_u16 wz = self().on_get_wz();
-    fast_u16 hl = self().on_get_hl();
-    // TODO: Block comparisons implicitly depend on the
-    // register 'a'. We probably want to request its value
-    // here with a special handler.
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
+  fast_u8 on_m1_fetch_cycle() {
+    fast_u8 n = self().on_fetch_cycle();
+    self().on_inc_r_reg();
+    return n;
+  }
 
-    fast_u8 t = self().on_read_cycle(hl);
-    fast_u8 tf = f;
-    do_cp(a, tf, t);
+  fast_u8 on_disp_read_cycle(fast_u16 addr) {
+    return self().on_read_cycle(addr);
+  }
 
-    self().on_5t_exec_cycle();
-    bc = dec16(bc);
+  void on_4t_exec_cycle() {
+    self().on_tick(4);
+  }
 
-    t = a - t - ((tf & hf_mask) ? 1 : 0);
-    f = (tf & (sf_mask | zf_mask | hf_mask)) |
-        ((t << 4) & yf_mask) | (t & xf_mask) |
-        (bc != 0 ? pf_mask : 0) | nf_mask | (f & cf_mask);
+  void on_5t_exec_cycle() {
+    self().on_tick(5);
+  }
 
-    if (static_cast<unsigned>(k) & 1) {
-      // CPD, CPDR
-      hl = dec16(hl);
-      wz = dec16(wz);
-    } else {
-      // CPI, CPIR
-      hl = inc16(hl);
-      wz = inc16(wz);
+  fast_u8 on_input_cycle(fast_u16 port) {
+    // Z80 samples the value at t4 of the input cycle, see
+    // <http://ramsoft.bbk.org.omegahg.com/floatingbus.html>.
+    self().on_tick(4);
+    // TODO: Shall we set the address bus here?
+    fast_u8 n = self().on_input(port);
+    return n;
+  }
+
+  void on_output_cycle(fast_u16 port, fast_u8 n) {
+    // TODO: Shall we set the address bus here?
+    self().on_tick(4);
+    self().on_output(port, n);
+  }
+
+  fast_u8 on_disp_read() {
+    fast_u16 pc = self().get_pc_on_disp_read();
+    fast_u8 op = self().on_disp_read_cycle(pc);
+    self().set_pc_on_disp_read(inc16(pc));
+    return op;
+  }
+
+  void initiate_int() {
+    self().on_set_iff1(false);
+    self().on_set_iff2(false);
+
+    fast_u16 pc = self().on_get_pc();
+
+    // Get past the HALT instruction, if halted. Note that
+    // HALT instructions need to be executed at least once to
+    // be skipped on an interrupt, so checking if the PC is
+    // at a HALT instruction is not enough here.
+    if (self().on_is_halted()) {
+      pc = inc16(pc);
+      self().on_set_pc(pc);
+      self().on_set_is_halted(false);
     }
 
-    self().on_set_bc(bc);
-    self().on_set_wz(wz);
-    self().on_set_hl(hl);
-    self().on_set_f(f);
+    self().on_inc_r_reg();
 
-    // CPIR, CPDR
-    if ((static_cast<unsigned>(k) & 2) && bc && !(f & zf_mask)) {
-      self().on_5t_exec_cycle();
-      fast_u16 pc = self().get_pc_on_block_instr();
-      self().on_set_wz(dec16(pc));
-      self().set_pc_on_block_instr(sub16(pc, 2));
+    if (self().on_get_int_mode() == 0) {
+      // The device is supposed to put a single-byte instruction
+      // on the bus, usually an RST, which is then executed as if
+      // it was fetched.
+      // RST: ack(6) f(1) w(3) w(3)
+      self().on_tick(6);
+      self().on_decode(self().on_int_ack());
+      return;
     }
-  }
 
-  void on_block_ld(block_ld k) {
-    fast_u16 bc = self().on_get_bc();
-    fast_u16 de = self().on_get_de();
-    fast_u16 hl = self().on_get_hl();
-    // TODO: Block loads implicitly depend on the register 'a'. We probably
-    // want to request its value here with a special handler.
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
+    // The acknowledge cycle is performed in every mode, so that
+    // the interrupting device knows it is being served. In mode 1
+    // the byte on the bus is ignored.
+    self().on_tick(7);
+    fast_u8 bus = self().on_int_ack();
+    self().on_push(pc);
 
-    fast_u8 t = self().on_read_cycle(hl);
+    fast_u16 isr_addr;
+    switch (self().on_get_int_mode()) {
+      case 1:
+        // ack(7) w(3) w(3)
+        isr_addr = 0x0038;
+        break;
+      case 2: {
+        // ack(7) w(3) w(3) r(3) r(3)
+        fast_u16 vector_addr = make16(self().on_get_i(), bus);
+        fast_u8 lo = self().on_read_cycle(vector_addr);
+        fast_u8 hi = self().on_read_cycle(inc16(vector_addr));
+        isr_addr = make16(hi, lo);
+      }
+        break;
+      default:
+        unreachable("Unknown interrupts mode.");
+    }
 
-    self().on_write_cycle(de, t);
-    self().on_write_cycle_extra_2t();
-    bc = dec16(bc);
+    self().on_jump(isr_addr);
+  }
 
-    t += a;
-    f = (f & (sf_mask | zf_mask | cf_mask)) |
-        ((t << 4) & yf_mask) | (t & xf_mask) | (bc != 0 ? pf_mask : 0);
-    if (static_cast<unsigned>(k) & 1) {
-      // LDD, LDDR
-      hl = dec16(hl);
-      de = dec16(de);
-    } else {
-      // LDI, LDIR
-      hl = inc16(hl);
-      de = inc16(de);
+  // NMIs leave IFF2 as is, so that RETN can restore IFF1 from it.
+  void initiate_nmi() {
+    self().on_set_iff1(false);
+
+    fast_u16 pc = self().on_get_pc();
+    if (self().on_is_halted()) {
+      pc = inc16(pc);
+      self().on_set_pc(pc);
+      self().on_set_is_halted(false);
     }
 
-    self().on_set_bc(bc);
-    self().on_set_de(de);
-    self().on_set_hl(hl);
-    self().on_set_f(f);
+    // f(5) w(3) w(3)
+    self().on_inc_r_reg();
+    self().on_tick(5);
+    self().on_push(pc);
+    self().on_jump(0x0066);
+  }
 
-    // LDIR, LDDR
-    if ((static_cast<unsigned>(k) & 2) && bc) {
-      self().on_5t_exec_cycle();
-      fast_u16 pc = self().get_pc_on_block_instr();
-      self().on_set_wz(dec16(pc));
-      self().set_pc_on_block_instr(sub16(pc, 2));
+  bool on_handle_active_int() {
+    bool accepted = false;
+    if (!self().on_is_int_disabled() && self().on_get_iff1()) {
+      initiate_int();
+      accepted = true;
     }
+    return accepted;
+  }
+
+protected:
+  using base::self;
+
+  bool is_hl_iregp() {
+    return self().on_get_iregp_kind() == iregp::hl;
+  }
+};
+
+// CPUs with the specified set of features.
+template<typename D, cpu_features::type F>
+class basic_i8080_cpu
+    : public i8080_executor<i8080_decoder<i8080_state<root<D, F>>>> {
+};
+
+template<typename D, cpu_features::type F>
+class basic_z80_cpu
+    : public z80_executor<z80_decoder<z80_state<root<D, F>>>> {
+};
+
+template<typename D>
+class i8080_cpu : public basic_i8080_cpu<D, cpu_features::all> {
+};
+
+template<typename D>
+class z80_cpu : public basic_z80_cpu<D, cpu_features::all> {
+};
+
+// CPUs that keep their registers in a packed_reg_file. Register
+// pairs the instructions refer to by their encodings are looked
+// up in the register file directly, without calling the handlers
+// for the individual pairs.
+template<typename D>
+class packed_i8080_cpu
+    : public i8080_executor<i8080_decoder<packed_i8080_state<root<D>>>> {
+public:
+  typedef i8080_executor<i8080_decoder<packed_i8080_state<root<D>>>> base;
+
+  fast_u16 on_get_regp(regp rp) { return base::get_regp(rp); }
+
+  void on_set_regp(regp rp, fast_u16 nn) { base::set_regp(rp, nn); }
+
+  fast_u16 on_get_regp2(regp2 rp) {
+    if (rp == regp2::af)
+      return self().on_get_af();
+    return base::get_regp(static_cast<regp>(rp));
+  }
+
+  void on_set_regp2(regp2 rp, fast_u16 nn) {
+    if (rp == regp2::af)
+      return self().on_set_af(nn);
+    base::set_regp(static_cast<regp>(rp), nn);
+  }
+
+protected:
+  using base::self;
+};
+
+template<typename D>
+class packed_z80_cpu
+    : public z80_executor<z80_decoder<packed_z80_state<root<D>>>> {
+public:
+  typedef z80_executor<z80_decoder<packed_z80_state<root<D>>>> base;
+
+  fast_u16 on_get_regp(regp rp) { return base::get_regp(rp); }
+
+  void on_set_regp(regp rp, fast_u16 nn) { base::set_regp(rp, nn); }
+
+  fast_u16 on_get_regp2(regp2 rp) {
+    if (rp == regp2::af)
+      return self().on_get_af();
+    return base::get_regp(static_cast<regp>(rp));
+  }
+
+  void on_set_regp2(regp2 rp, fast_u16 nn) {
+    if (rp == regp2::af)
+      return self().on_set_af(nn);
+    base::set_regp(static_cast<regp>(rp), nn);
   }
 
-  void on_block_out(block_out k) {
-    fast_u16 bc = self().on_get_bc();
-    fast_u16 wz = self().on_get_wz();
-    fast_u16 hl = self().on_get_hl();
-    fast_u8 f = self().on_get_f();
+  fast_u16 on_get_iregp() { return base::get_iregp(); }
 
-    self().on_fetch_cycle_extra_1t();
-    fast_u8 r = self().on_read_cycle(hl);
-    self().on_output_cycle(bc, r);
-    bc = sub16(bc, 0x0100);
-    fast_u8 s = get_high8(bc);
+  void on_set_iregp(fast_u16 nn) { base::set_iregp(nn); }
 
-    if (static_cast<unsigned>(k) & 1) {
-      // OUTD, OTDR
-      hl = dec16(hl);
-      wz = dec16(bc);
-    } else {
-      // OUTI, OTIR
-      hl = inc16(hl);
-      wz = inc16(bc);
-    }
+  fast_u16 on_get_ix() { return base::get_ix(); }
 
-    fast_u16 cf = get_low8(hl) + r;
-    fast_u8 pf = (get_low8(cf) & 7) ^s;
-    f = (s & (sf_mask | yf_mask | xf_mask)) | zf_ari(s) |
-        ((r & 0x80) >> (7 - nf_bit)) | pf_log(pf) |
-        ((cf < 0x100) ? 0 : (hf_mask | cf_mask));
+  void on_set_ix(fast_u16 nn) { base::set_ix(nn); }
 
-    self().on_set_bc(bc);
-    self().on_set_wz(wz);
-    self().on_set_hl(hl);
-    self().on_set_f(f);
+  fast_u16 on_get_iy() { return base::get_iy(); }
 
-    // OTIR, OTDR
-    if ((static_cast<unsigned>(k) & 2) && s) {
-      self().on_5t_exec_cycle();
-      fast_u16 pc = self().get_pc_on_block_instr();
-      self().set_pc_on_block_instr(sub16(pc, 2));
+  void on_set_iy(fast_u16 nn) { base::set_iy(nn); }
+
+protected:
+  using base::self;
+};
+
+static const fast_u32 address_space_size = 0x10000;  // 64K bytes.
+
+template<typename B>
+class machine_memory : public B {
+public:
+  typedef B base;
+
+  machine_memory() { reset(); }
+
+  void reset() {
+    uint_fast32_t rnd = 0xde347a01;
+    for (auto &b : memory_bytes) {
+      b = static_cast<least_u8>(rnd & 0xff);
+      rnd = (rnd * 0x74392cef) ^ (rnd >> 16);
     }
   }
 
-  void on_bit(unsigned b, reg r, fast_u8 d) {
-    iregp irp = self().on_get_iregp_kind();
-    fast_u8 v = self().on_get_reg(r, irp, d, /* long_read_cycle= */ true);
-    fast_u8 f = self().on_get_f();
-    fast_u8 m = v & (1u << b);
-    // TODO: Is it always (m & sf_mask)? Regardless of whether m is zero or not?
-    f = (f & cf_mask) | hf_mask | (m ? (m & sf_mask) : (zf_mask | pf_mask));
-    if (!is_hl_iregp() || r == reg::at_hl)
-      v = get_high8(self().on_get_wz());
-    f |= v & (xf_mask | yf_mask);
-    self().on_set_f(f);
+  fast_u8 read(fast_u16 addr) const {
+    assert(addr < address_space_size);
+    return memory_bytes[addr];
   }
 
-  void on_call_cc_nn(condition cc, fast_u16 nn) {
-    if (base::check_condition(cc)) {
-      self().on_read_cycle_extra_1t();
-      self().on_call(nn);
-    } else {
-      self().on_set_wz(nn);
-    }
+  void write(fast_u16 addr, fast_u8 n) {
+    assert(addr < address_space_size);
+    memory_bytes[addr] = static_cast<least_u8>(n);
   }
 
-  void on_ccf() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    bool cf = f & cf_mask;
-    f = (f & (sf_mask | zf_mask | pf_mask)) | (a & (yf_mask | xf_mask)) |
-        (cf ? hf_mask : 0) | cf_ari(!cf);
-    self().on_set_f(f);
+  fast_u8 on_read(fast_u16 addr) { return read(addr); }
+
+  void on_write(fast_u16 addr, fast_u8 n) { write(addr, n); }
+
+  // Returns the host memory of a byte that can be read and
+  // written directly, without side effects, along with the
+  // rest of its page of ram_page_size bytes. Null if there is
+  // no such memory.
+  static const fast_u32 ram_page_size = address_space_size;
+
+  least_u8 *get_ram_ptr(fast_u16 addr) {
+    assert(addr < address_space_size);
+    return &memory_bytes[addr];
   }
 
-  void on_daa() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    bool cf = f & cf_mask;
-    bool hf = f & hf_mask;
-    bool nf = f & nf_mask;
+protected:
+  using base::self;
 
-    fast_u8 d = 0x00;
-    if (cf || a >= 0x9a) {
-      d |= 0x60;
-      f |= cf_mask;
-    }
-    if (hf || (a & 0x0f) >= 0x0a) {
-      d |= 0x06;
-    }
+private:
+  least_u8 memory_bytes[address_space_size] = {};
+};
 
-    if (!nf) {
-      f = (f & cf_mask) | ((a & 0x0f) >= 0x0a ? hf_mask : 0);
-      a = add8(a, d);
-    } else {
-      f = (f & cf_mask) | (hf && (a & 0x0f) <= 0x05 ? hf_mask : 0) |
-          nf_mask;
-      a = sub8(a, d);
-    }
-    f |= (a & (sf_mask | xf_mask | yf_mask)) | pf_log(a) | zf_ari(a);
+// Maps the address space in pages of 256 bytes to host memory
+// and memory-mapped devices. Reading or writing RAM takes a
+// table lookup and a load or store. Pages of ROM ignore writes,
+// accesses to memory-mapped I/O pages go to on_mmio_read() and
+// on_mmio_write(), and unmapped pages read as 0xff. Switching
+// banks is a matter of mapping the pages to other host memory.
+// The module is an alternative to machine_memory<>; the host
+// memory is owned by the user.
+template<typename B>
+class memory_map : public B {
+public:
+  typedef B base;
 
-    self().on_set_a(a);
-    self().on_set_f(f);
-  }
+  static const unsigned page_size = 0x100;
+  static const unsigned num_pages = address_space_size / page_size;
 
-  void on_cpl() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    a ^= 0xff;
-    f = (f & (sf_mask | zf_mask | pf_mask | cf_mask)) |
-        (a & (yf_mask | xf_mask)) | hf_mask | nf_mask;
-    self().on_set_a(a);
-    self().on_set_f(f);
-  }
+  memory_map() { unmap(0, address_space_size); }
 
-  void on_dec_r(reg r, fast_u8 d) {
-    iregp irp = self().on_get_iregp_kind();
-    fast_u8 v = self().on_get_reg(r, irp, d, /* long_read_cycle= */ true);
-    fast_u8 f = self().on_get_f();
-    v = dec8(v);
-    f = (f & cf_mask) | (v & (sf_mask | yf_mask | xf_mask)) | zf_ari(v) |
-        hf_dec(v) | pf_dec(v) | nf_mask;
-    self().on_set_reg(r, irp, d, v);
-    self().on_set_f(f);
+  // The ranges shall consist of whole pages.
+  void map_ram(fast_u16 addr, fast_u32 size, least_u8 *mem) {
+    map(addr, size, mem, mem, page_kind::memory);
   }
 
-  void on_di() {
-    self().set_iff1_on_di(false);
-    self().set_iff2_on_di(false);
+  void map_rom(fast_u16 addr, fast_u32 size, const least_u8 *mem) {
+    map(addr, size, mem, nullptr, page_kind::memory);
   }
 
-  void on_djnz(fast_u8 d) {
-    fast_u8 b = self().on_get_b();
-    b = dec8(b);
-    self().on_set_b(b);
-    if (b)
-      self().on_relative_jump(d);
+  void map_mmio(fast_u16 addr, fast_u32 size) {
+    map(addr, size, nullptr, nullptr, page_kind::mmio);
   }
 
-  void on_ei() {
-    self().set_iff1_on_ei(true);
-    self().set_iff2_on_ei(true);
-    self().disable_int_on_ei();
+  void unmap(fast_u16 addr, fast_u32 size) {
+    map(addr, size, nullptr, nullptr, page_kind::unmapped);
   }
 
-  void on_ex_af_alt_af() {
-    self().on_ex_af_alt_af_regs();
+  // Transparent accessors do not reach memory-mapped devices.
+  fast_u8 read(fast_u16 addr) const {
+    const least_u8 *p = read_pages[get_page(addr)];
+    return p ? p[addr % page_size] : unmapped_value;
   }
 
-  void on_ex_at_sp_irp() {
-    fast_u16 sp = self().on_get_sp();
-    fast_u8 lo = self().on_read_cycle(sp);
-    sp = inc16(sp);
-    fast_u8 hi = self().on_read_cycle(sp);
-    self().on_read_cycle_extra_1t();
-    fast_u16 nn = make16(hi, lo);
-    fast_u16 irp = self().on_get_iregp();
-    std::swap(nn, irp);
-    self().on_write_cycle(sp, get_high8(nn));
-    sp = dec16(sp);
-    self().on_write_cycle(sp, get_low8(nn));
-    self().on_write_cycle_extra_2t();
-    self().on_set_wz(irp);
-    self().on_set_iregp(irp);
+  void write(fast_u16 addr, fast_u8 n) {
+    least_u8 *p = write_pages[get_page(addr)];
+    if (p)
+      p[addr % page_size] = static_cast<least_u8>(n);
   }
 
-  void on_exx() {
-    self().on_exx_regs();
+  fast_u8 on_read(fast_u16 addr) {
+    fast_u16 page = get_page(addr);
+    if (const least_u8 *p = read_pages[page])
+      return p[addr % page_size];
+    if (page_kinds[page] == page_kind::mmio)
+      return self().on_mmio_read(addr);
+    return unmapped_value;
   }
 
-  void on_im(unsigned mode) {
-    self().on_set_int_mode(mode);
+  void on_write(fast_u16 addr, fast_u8 n) {
+    fast_u16 page = get_page(addr);
+    if (least_u8 *p = write_pages[page])
+      p[addr % page_size] = static_cast<least_u8>(n);
+    else if (page_kinds[page] == page_kind::mmio)
+      self().on_mmio_write(addr, n);
   }
 
-  void on_in_a_n(fast_u8 n) {
-    fast_u8 a = self().on_get_a();
-    fast_u16 port = make16(a, n);
-    self().on_set_wz(inc16(port));
-    self().on_set_a(self().on_input_cycle(port));
+  fast_u8 on_mmio_read(fast_u16 addr) {
+    unused(addr);
+    return unmapped_value;
   }
 
-  void on_in_r_c(reg r) {
-    fast_u16 bc = self().on_get_bc();
-    fast_u8 f = self().on_get_f();
-    self().on_set_wz(inc16(bc));
-    fast_u8 n = self().on_input_cycle(bc);
-    iregp irp = self().on_get_iregp_kind();
-    if (r != reg::at_hl)
-      self().on_set_reg(r, irp, /* d= */ 0, n);
-    f = (f & cf_mask) | (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) |
-        pf_log(n);
-    self().on_set_f(f);
+  void on_mmio_write(fast_u16 addr, fast_u8 n) {
+    unused(addr, n);
   }
 
-  void on_inc_r(reg r, fast_u8 d) {
-    iregp irp = self().on_get_iregp_kind();
-    fast_u8 v = self().on_get_reg(r, irp, d, /* long_read_cycle= */ true);
-    fast_u8 f = self().on_get_f();
-    v = inc8(v);
-    f = (f & cf_mask) | (v & (sf_mask | yf_mask | xf_mask)) | zf_ari(v) |
-        hf_inc(v) | pf_inc(v);
-    self().on_set_reg(r, irp, d, v);
-    self().on_set_f(f);
+  // See machine_memory<>::get_ram_ptr(). ROM does not count.
+  static const fast_u32 ram_page_size = page_size;
+
+  least_u8 *get_ram_ptr(fast_u16 addr) {
+    fast_u16 page = get_page(addr);
+    least_u8 *p = write_pages[page];
+    return p && p == read_pages[page] ? p + addr % page_size : nullptr;
   }
 
-  void on_jp_irp() {
-    self().set_pc_on_jump(self().on_get_iregp());
+protected:
+  using base::self;
+
+private:
+  enum class page_kind { unmapped, memory, mmio };
+
+  static const fast_u8 unmapped_value = 0xff;
+
+  static fast_u16 get_page(fast_u16 addr) {
+    assert(addr < address_space_size);
+    return addr / page_size;
+  }
+
+  void map(fast_u16 addr, fast_u32 size, const least_u8 *read_mem,
+           least_u8 *write_mem, page_kind kind) {
+    assert(addr % page_size == 0 && size % page_size == 0);
+    assert(addr + size <= address_space_size);
+    for (fast_u32 i = 0; i != size / page_size; ++i) {
+      fast_u32 page = addr / page_size + i;
+      fast_u32 offset = i * page_size;
+      read_pages[page] = read_mem ? read_mem + offset : nullptr;
+      write_pages[page] = write_mem ? write_mem + offset : nullptr;
+      page_kinds[page] = kind;
+    }
   }
 
-  void on_jr(fast_u8 d) {
-    self().on_relative_jump(d);
+  const least_u8 *read_pages[num_pages];
+  least_u8 *write_pages[num_pages];
+  page_kind page_kinds[num_pages];
+};
+
+class events_mask {
+public:
+  typedef fast_u32 type;
+
+  static const type end_of_frame = 1u << 0;
+  static const type breakpoint_hit = 1u << 1;
+  static const type end = 1u << 2;
+  static const type ticks_limit_hit = 1u << 3;
+  static const type read_watch_hit = 1u << 4;
+  static const type write_watch_hit = 1u << 5;
+};
+
+template<typename B>
+class machine_state : public B {
+public:
+  typedef B base;
+  typedef typename base::derived derived;
+  typedef fast_u64 ticks_type;
+
+  // Scheduled handlers get the machine and the context passed
+  // to schedule().
+  typedef void (*scheduled_handler)(derived &d, void *context);
+
+  // The address and the tick of the access that raised an
+  // event.
+  struct watch_hit {
+    fast_u16 addr;
+    ticks_type tick;
+  };
+
+  machine_state() {}
+
+  bool is_marked_addr(fast_u16 addr, fast_u8 marks) const {
+    return (address_marks[mask16(addr)] & marks) != 0;
   }
 
-  void on_jr_cc(condition cc, fast_u8 d) {
-    if (base::check_condition(cc))
-      self().on_relative_jump(d);
+  // Returns whether any address of the page of the specified
+  // address has any of the marks. Pages are 256 bytes long.
+  bool is_marked_page(fast_u16 addr, fast_u8 marks) const {
+    return (page_marks[mask16(addr) / marks_page_size] & marks) != 0;
   }
 
-  void on_ld_a_r() {
-    fast_u8 n = self().on_get_r();
-    fast_u8 f = self().on_get_f();
-    f = (f & cf_mask) | (n & (sf_mask | yf_mask | xf_mask)) | zf_ari(n) |
-        ((self().on_get_iff2() ? 1u : 0u) << pf_bit);
-    self().on_set_a(n);
-    self().on_set_f(f);
+  void mark_addr(fast_u16 addr, fast_u8 marks) {
+    addr = mask16(addr);
+    address_marks[addr] |= static_cast<least_u8>(marks);
+    page_marks[addr / marks_page_size] |= static_cast<least_u8>(marks);
   }
 
-  void on_ld_r_a() {
-    self().on_set_r(self().on_get_a());
+  // The range may wrap around.
+  void mark_addrs(fast_u16 addr, fast_u32 size, fast_u8 marks) {
+    for (fast_u32 i = 0; i != size; ++i)
+      mark_addr(static_cast<fast_u16>(addr + i), marks);
   }
 
-  void on_ld_a_i() {
-    fast_u8 i = self().on_get_i();
-    fast_u8 f = self().on_get_f();
-    f = (f & cf_mask) | (i & (sf_mask | yf_mask | xf_mask)) |
-        zf_ari(i) | (self().on_get_iff2() ? pf_mask : 0);
-    self().on_set_a(i);
-    self().on_set_f(f);
+  void unmark_addr(fast_u16 addr, fast_u8 marks) {
+    unmark_addrs(addr, 1, marks);
+  }
+
+  void unmark_addrs(fast_u16 addr, fast_u32 size, fast_u8 marks) {
+    for (fast_u32 i = 0; i != size; ++i) {
+      fast_u16 a = mask16(addr + i);
+      address_marks[a] &= static_cast<least_u8>(~marks);
+      if (i + 1 == size || (a + 1) % marks_page_size == 0)
+        update_page_marks(a / marks_page_size);
+    }
   }
 
-  void on_ld_i_a() {
-    self().set_i_on_ld(self().on_get_a());
+  bool is_breakpoint_addr(fast_u16 addr) const {
+    return is_marked_addr(addr, breakpoint_mark);
   }
 
-  void on_ld_r_r(reg rd, reg rs, fast_u8 d) {
-    iregp irp = self().on_get_iregp_kind();
-    iregp irpd = rs == reg::at_hl ? iregp::hl : irp;
-    iregp irps = rd == reg::at_hl ? iregp::hl : irp;
-    self().on_set_reg(rd, irpd, d, self().on_get_reg(rs, irps, d));
+  void set_breakpoint(fast_u16 addr) {
+    mark_addr(addr, breakpoint_mark);
   }
 
-  void on_ld_r_n(reg r, fast_u8 d, fast_u8 n) {
-    iregp irp = self().on_get_iregp_kind();
-    self().on_set_reg(r, irp, d, n);
+  void clear_breakpoint(fast_u16 addr) {
+    unmark_addr(addr, breakpoint_mark);
   }
 
-  void on_ld_irp_at_nn(fast_u16 nn) {
-    fast_u8 lo = self().on_read_cycle(nn);
-    nn = inc16(nn);
-    self().on_set_wz(nn);
-    fast_u8 hi = self().on_read_cycle(nn);
-    self().on_set_iregp(make16(hi, lo));
+  // Watchpoints raise events on memory read and write cycles
+  // accessing any of the addresses of the range. Instruction
+  // fetches are only caught by breakpoints.
+  void set_read_watchpoint(fast_u16 addr, fast_u32 size = 1) {
+    mark_addrs(addr, size, read_watch_mark);
   }
 
-  void on_ld_at_nn_irp(fast_u16 nn) {
-    fast_u16 irp = self().on_get_iregp();
-    self().on_write_cycle(nn, get_low8(irp));
-    nn = inc16(nn);
-    self().on_set_wz(nn);
-    self().on_write_cycle(nn, get_high8(irp));
+  void clear_read_watchpoint(fast_u16 addr, fast_u32 size = 1) {
+    unmark_addrs(addr, size, read_watch_mark);
   }
 
-  void on_ld_rp_at_nn(regp rp, fast_u16 nn) {
-    fast_u8 lo = self().on_read_cycle(nn);
-    nn = inc16(nn);
-    self().on_set_wz(nn);
-    fast_u8 hi = self().on_read_cycle(nn);
-    self().on_set_regp(rp, make16(hi, lo));
+  void set_write_watchpoint(fast_u16 addr, fast_u32 size = 1) {
+    mark_addrs(addr, size, write_watch_mark);
   }
 
-  void on_ld_at_nn_rp(fast_u16 nn, regp rp) {
-    fast_u16 rpv = self().on_get_regp(rp);
-    self().on_write_cycle(nn, get_low8(rpv));
-    nn = inc16(nn);
-    self().on_set_wz(nn);
-    self().on_write_cycle(nn, get_high8(rpv));
+  void clear_write_watchpoint(fast_u16 addr, fast_u32 size = 1) {
+    unmark_addrs(addr, size, write_watch_mark);
   }
 
-  void on_ld_sp_irp() {
-    self().on_set_sp(self().on_get_iregp());
+  // The first hits of the kinds since the last run started.
+  // Valid when the corresponding event is raised.
+  const watch_hit &get_breakpoint_hit() const { return last_breakpoint; }
+  const watch_hit &get_read_watch_hit() const { return last_read_watch; }
+  const watch_hit &get_write_watch_hit() const { return last_write_watch; }
+
+  // Returns whether any of the addresses in the range has any
+  // of the marks. The range may wrap around.
+  bool has_marked_addrs(fast_u16 addr, fast_u32 size, fast_u8 marks) const {
+    for (fast_u32 i = 0; i != size; ++i) {
+      if (address_marks[mask16(static_cast<fast_u16>(addr + i))] & marks)
+        return true;
+    }
+    return false;
   }
 
-  void on_neg() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    fast_u8 n = a;
-    a = 0;
-    do_sub(a, f, n);
-    self().on_set_a(a);
-    self().on_set_f(f);
+  // The number of ticks passed since the machine was created.
+  ticks_type get_ticks() const { return ticks; }
+
+  // The tick at which on_tick() is going to raise an event or
+  // call a scheduled handler next. Modules that advance the
+  // counter by many ticks at once use it to know how far they
+  // can go.
+  ticks_type get_next_event_tick() const { return limit; }
+
+  ticks_type get_ticks_per_frame() const { return ticks_per_frame; }
+
+  // Starts a new frame of the specified length at the current
+  // tick. Zero disables end-of-frame events.
+  void set_ticks_per_frame(ticks_type n) {
+    ticks_per_frame = n;
+    frame_end = n ? ticks + n : no_limit;
+    update_limit();
   }
 
-  void on_out_c_r(reg r) {
-    fast_u16 bc = self().on_get_bc();
-    self().on_set_wz(inc16(bc));
-    iregp irp = self().on_get_iregp_kind();
-    fast_u8 n = (r == reg::at_hl) ?
-                0 : self().on_get_reg(r, irp, /* d= */ 0);
-    self().on_output_cycle(bc, n);
+  // Calls the handler as soon as the tick counter reaches the
+  // specified value. Handlers are called from on_tick(), that
+  // is, possibly in the middle of an instruction, which suits
+  // updating devices and requesting interrupts. Handlers
+  // scheduled for the same tick are called in the order they
+  // were scheduled.
+  void schedule(ticks_type tick, scheduled_handler handler,
+                void *context = nullptr) {
+    scheduled.push_back({tick, next_seq++, handler, context});
+    std::push_heap(scheduled.begin(), scheduled.end(), is_later);
+    update_limit();
   }
 
-  void on_out_n_a(fast_u8 n) {
-    fast_u8 a = self().on_get_a();
-    self().on_output_cycle(make16(a, n), a);
-    self().on_set_wz(make16(a, inc8(n)));
+  // Removes all occurrences of the handler with the context.
+  void unschedule(scheduled_handler handler, void *context = nullptr) {
+    auto i = std::remove_if(
+        scheduled.begin(), scheduled.end(),
+        [&](const scheduled_call &c) {
+          return c.handler == handler && c.context == context; });
+    scheduled.erase(i, scheduled.end());
+    std::make_heap(scheduled.begin(), scheduled.end(), is_later);
+    update_limit();
   }
 
-  void on_pop_rp(regp2 rp) {
-    self().on_set_regp2(rp, self().on_pop());
+  void on_tick(unsigned t) {
+    ticks += t;
+    if (ticks >= limit)
+      handle_limit();
   }
 
-  void on_res(unsigned b, reg r, fast_u8 d) {
-    iregp irp = self().on_get_iregp_kind();
-    reg access_r = irp == iregp::hl ? r : reg::at_hl;
-    fast_u8 v = self().on_get_reg(access_r, irp, d,
-            /* long_read_cycle= */ true);
-    v &= ~(1u << b);
-    self().on_set_reg(access_r, irp, d, v);
-    if (irp != iregp::hl && r != reg::at_hl)
-      self().on_set_reg(r, irp, /* d= */ 0, v);
+  void on_set_pc(fast_u16 n) {
+    if (is_breakpoint_addr(n))
+      record_hit(events_mask::breakpoint_hit, last_breakpoint, n);
+    base::on_set_pc(n);
   }
 
-  void on_reti() {
-    self().on_return();
+  // Addresses are only looked up on pages that have marks, so
+  // reads and writes elsewhere take a single check.
+  fast_u8 on_read_cycle(fast_u16 addr) {
+    if (is_marked_page(addr, read_watch_mark))
+      check_read_watch(addr);
+    return base::on_read_cycle(addr);
   }
 
-  void on_retn() {
-    self().set_iff1_on_retn(self().get_iff2_on_retn());
-    self().on_return();
+  void on_write_cycle(fast_u16 addr, fast_u8 n) {
+    if (is_marked_page(addr, write_watch_mark))
+      check_write_watch(addr);
+    base::on_write_cycle(addr, n);
   }
 
-  void on_rla() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    bool cf = f & cf_mask;
-    fast_u8 r = mask8((a << 1) | (cf ? 1 : 0));
-    f = (f & (sf_mask | zf_mask | pf_mask)) | (r & (yf_mask | xf_mask)) |
-        cf_ari(a & 0x80);
-    self().on_set_a(r);
-    self().on_set_f(f);
+  events_mask::type get_events() const { return events; }
+
+  events_mask::type on_run() {
+    events = 0;
+    while (!events)
+      self().on_step();
+    return events;
   }
 
-  void on_rlca() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    a = rol8(a);
-    f = (f & (sf_mask | zf_mask | pf_mask)) |
-        (a & (yf_mask | xf_mask | cf_mask));
-    self().on_set_a(a);
-    self().on_set_f(f);
+  // Runs until the tick counter reaches the specified value or
+  // any other event occurs. As instructions are not
+  // interrupted, the counter may go past the limit by a few
+  // ticks.
+  events_mask::type run_until(ticks_type tick) {
+    if (ticks >= tick)
+      return events = events_mask::ticks_limit_hit;
+    run_end = tick;
+    update_limit();
+    events_mask::type e = self().on_run();
+    run_end = no_limit;
+    update_limit();
+    return e;
   }
 
-  void on_rld() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    fast_u16 hl = self().on_get_hl();
-    self().on_set_wz(inc16(hl));
-    fast_u16 t = make16(a, self().on_read_cycle(hl));
-    self().on_4t_exec_cycle();
+  events_mask::type run_for(ticks_type n) {
+    return run_until(n < no_limit - ticks ? ticks + n : no_limit);
+  }
 
-    t = (t & 0xf000) | ((t & 0xff) << 4) | ((t & 0x0f00) >> 8);
-    a = get_high8(t);
-    f = (f & cf_mask) | (a & (sf_mask | yf_mask | xf_mask)) | zf_ari(a) |
-        pf_log(a);
+protected:
+  using base::self;
 
-    self().on_set_a(a);
-    self().on_set_f(f);
-    self().on_write_cycle(hl, get_low8(t));
+private:
+  static const ticks_type no_limit = static_cast<ticks_type>(-1);
+
+  struct scheduled_call {
+    ticks_type tick;
+    fast_u64 seq;
+    scheduled_handler handler;
+    void *context;
+  };
+
+  static bool is_later(const scheduled_call &a, const scheduled_call &b) {
+    return a.tick != b.tick ? a.tick > b.tick : a.seq > b.seq;
   }
 
-  void on_rot(rot k, reg r, fast_u8 d) {
-    iregp irp = self().on_get_iregp_kind();
-    reg access_r = irp == iregp::hl ? r : reg::at_hl;
-    fast_u8 n = self().on_get_reg(access_r, irp, d,
-            /* long_read_cycle= */ true);
-    fast_u8 f = self().on_get_f();
-    do_rot(k, n, f);
-    self().on_set_reg(access_r, irp, d, n);
-    if (irp != iregp::hl && r != reg::at_hl)
-      self().on_set_reg(r, irp, /* d= */ 0, n);
-    self().on_set_f(f);
+  Z80_NOINLINE void check_read_watch(fast_u16 addr) {
+    if (is_marked_addr(addr, read_watch_mark))
+      record_hit(events_mask::read_watch_hit, last_read_watch, addr);
   }
 
-  void on_rra() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    fast_u8 r = (a >> 1) | ((f & cf_mask) ? 0x80 : 0);
-    f = (f & (sf_mask | zf_mask | pf_mask)) | (r & (yf_mask | xf_mask)) |
-        cf_ari(a & 0x1);
-    self().on_set_a(r);
-    self().on_set_f(f);
+  Z80_NOINLINE void check_write_watch(fast_u16 addr) {
+    if (is_marked_addr(addr, write_watch_mark))
+      record_hit(events_mask::write_watch_hit, last_write_watch, addr);
   }
 
-  void on_rrca() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    a = ror8(a);
-    f = (f & (sf_mask | zf_mask | pf_mask)) | (a & (yf_mask | xf_mask)) |
-        cf_ari(a & 0x80);
-    self().on_set_a(a);
-    self().on_set_f(f);
+  Z80_NOINLINE void record_hit(events_mask::type e, watch_hit &hit,
+                               fast_u16 addr) {
+    if (!(events & e)) {
+      events |= e;
+      hit = {mask16(addr), self().get_ticks()};
+    }
   }
 
-  void on_rrd() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    fast_u16 hl = self().on_get_hl();
-    self().on_set_wz(inc16(hl));
-    fast_u16 t = make16(a, self().on_read_cycle(hl));
-    self().on_4t_exec_cycle();
+  void update_page_marks(fast_u32 page) {
+    least_u8 marks = 0;
+    const least_u8 *p = &address_marks[page * marks_page_size];
+    for (fast_u32 i = 0; i != marks_page_size; ++i)
+      marks |= p[i];
+    page_marks[page] = marks;
+  }
 
-    t = (t & 0xf000) | ((t & 0xf) << 8) | ((t & 0x0ff0) >> 4);
-    a = get_high8(t);
-    f = (f & cf_mask) | (a & (sf_mask | yf_mask | xf_mask)) | zf_ari(a) |
-        pf_log(a);
+  void update_limit() {
+    limit = frame_end < run_end ? frame_end : run_end;
+    if (!scheduled.empty() && scheduled.front().tick < limit)
+      limit = scheduled.front().tick;
+  }
 
-    self().on_set_a(a);
-    self().on_set_f(f);
-    self().on_write_cycle(hl, get_low8(t));
+  void handle_limit() {
+    if (ticks >= frame_end) {
+      events |= events_mask::end_of_frame;
+      do
+        frame_end += ticks_per_frame;
+      while (frame_end <= ticks);
+    }
+    if (ticks >= run_end)
+      events |= events_mask::ticks_limit_hit;
+
+    // Handlers may schedule further calls.
+    while (!scheduled.empty() && scheduled.front().tick <= ticks) {
+      std::pop_heap(scheduled.begin(), scheduled.end(), is_later);
+      scheduled_call c = scheduled.back();
+      scheduled.pop_back();
+      c.handler(self(), c.context);
+    }
+    update_limit();
   }
 
-  void on_scf() {
-    fast_u8 a = self().on_get_a();
-    fast_u8 f = self().on_get_f();
-    f = (f & (sf_mask | zf_mask | pf_mask)) | (a & (yf_mask | xf_mask)) |
-        cf_mask;
-    self().on_set_f(f);
+  ticks_type ticks = 0;
+
+  // The tick counter is compared against the nearest of the
+  // limits, so on_tick() takes a single check.
+  ticks_type ticks_per_frame = 100 * 1000;
+  ticks_type frame_end = ticks_per_frame;
+  ticks_type run_end = no_limit;
+  ticks_type limit = frame_end;
+
+  // A binary heap with the earliest call on top.
+  std::vector<scheduled_call> scheduled;
+  fast_u64 next_seq = 0;
+
+  events_mask::type events = 0;
+
+  static const fast_u8 breakpoint_mark = 1u << 0;
+  static const fast_u8 read_watch_mark = 1u << 1;
+  static const fast_u8 write_watch_mark = 1u << 2;
+  least_u8 address_marks[address_space_size] = {};
+
+  // Every page has the union of the marks of its addresses.
+  static const fast_u32 marks_page_size = 0x100;
+  least_u8 page_marks[address_space_size / marks_page_size] = {};
+
+  watch_hit last_breakpoint = watch_hit();
+  watch_hit last_read_watch = watch_hit();
+  watch_hit last_write_watch = watch_hit();
+};
+
+template<typename D, cpu_features::type F>
+class basic_i8080_machine
+    : public machine_memory<machine_state<basic_i8080_cpu<D, F>>> {
+};
+
+template<typename D, cpu_features::type F>
+class basic_z80_machine
+    : public machine_memory<machine_state<basic_z80_cpu<D, F>>> {
+};
+
+template<typename D>
+class i8080_machine : public basic_i8080_machine<D, cpu_features::all> {
+};
+
+template<typename D>
+class z80_machine : public basic_z80_machine<D, cpu_features::all> {
+};
+
+template<typename D>
+class packed_i8080_machine
+    : public machine_memory<machine_state<packed_i8080_cpu<D>>> {
+};
+
+template<typename D>
+class packed_z80_machine
+    : public machine_memory<machine_state<packed_z80_cpu<D>>> {
+};
+
+// Takes page-granular copy-on-write snapshots of memory. Taking a
+// snapshot copies only the pages written since the previous one
+// and shares the rest with it, and restoring a snapshot only
+// rewrites pages that differ from it. The module shall be put on
+// top of a memory module; restored bytes are written with
+// write(), so that modules above it see the changes.
+template<typename B>
+class memory_snapshots : public B {
+public:
+  typedef B base;
+
+  static const unsigned page_size = 0x400;
+  static const unsigned num_pages = address_space_size / page_size;
+
+  class snapshot_type {
+  private:
+    struct page {
+      least_u8 bytes[page_size];
+    };
+
+    std::shared_ptr<const page> pages[num_pages];
+
+    friend class memory_snapshots;
+  };
+
+  memory_snapshots() {
+    for (auto &d : dirty_pages)
+      d = true;
   }
 
-  void on_set(unsigned b, reg r, fast_u8 d) {
-    iregp irp = self().on_get_iregp_kind();
-    reg access_r = irp == iregp::hl ? r : reg::at_hl;
-    fast_u8 v = self().on_get_reg(access_r, irp, d,
-            /* long_read_cycle= */ true);
-    v |= 1u << b;
-    self().on_set_reg(access_r, irp, d, v);
-    if (irp != iregp::hl && r != reg::at_hl)
-      self().on_set_reg(r, irp, /* d= */ 0, v);
+  void write(fast_u16 addr, fast_u8 n) {
+    dirty_pages[get_page(addr)] = true;
+    base::write(addr, n);
+  }
+
+  void on_write(fast_u16 addr, fast_u8 n) {
+    dirty_pages[get_page(addr)] = true;
+    base::on_write(addr, n);
+  }
+
+  snapshot_type snapshot() {
+    for (unsigned p = 0; p != num_pages; ++p) {
+      if (!dirty_pages[p])
+        continue;
+      typedef typename snapshot_type::page page;
+      std::shared_ptr<page> copy(new page);
+      fast_u16 addr = static_cast<fast_u16>(p * page_size);
+      for (unsigned i = 0; i != page_size; ++i)
+        copy->bytes[i] = static_cast<least_u8>(self().read(
+            static_cast<fast_u16>(addr + i)));
+      last.pages[p] = std::move(copy);
+      dirty_pages[p] = false;
+    }
+    return last;
+  }
+
+  // Snapshots taken from other instances can be restored as
+  // well, which makes a cheap way to fork machines.
+  void restore(const snapshot_type &s) {
+    for (unsigned p = 0; p != num_pages; ++p) {
+      assert(s.pages[p] && "Not a snapshot taken with snapshot()!");
+      if (!dirty_pages[p] && last.pages[p] == s.pages[p])
+        continue;
+      const least_u8 *bytes = s.pages[p]->bytes;
+      fast_u16 addr = static_cast<fast_u16>(p * page_size);
+      for (unsigned i = 0; i != page_size; ++i) {
+        auto a = static_cast<fast_u16>(addr + i);
+        if (self().read(a) != bytes[i])
+          self().write(a, bytes[i]);
+      }
+    }
+    last = s;
+    for (auto &d : dirty_pages)
+      d = false;
   }
 
-  void on_sbc_hl_rp(regp rp) {
-    fast_u16 hl = self().on_get_hl();
-    fast_u16 n = self().on_get_regp(rp);
-    bool cf = self().on_get_f() & cf_mask;
+protected:
+  using base::self;
+
+private:
+  static fast_u16 get_page(fast_u16 addr) { return addr / page_size; }
+
+  snapshot_type last;
+  bool dirty_pages[num_pages];
+};
+
+// Dispatches op-codes through tables of handlers specialized for
+// every op-code instead of analyzing them in the switches of the
+// decoder, which remain the reference implementation. This way
+// every op-code gets its own indirect jump the host CPU can learn
+// to predict. Instructions prefixed with DD and FD use the same
+// tables as unprefixed ones, as the index register is part of the
+// decoder state.
+template<typename B>
+class i8080_table_dispatch : public B {
+public:
+  typedef B base;
+
+  i8080_table_dispatch() {}
+
+  void on_decode(fast_u8 op) { base::dispatch_opcode(op); }
+};
+
+template<typename B>
+class z80_table_dispatch : public B {
+public:
+  typedef B base;
 
-    self().on_4t_exec_cycle();
-    self().on_3t_exec_cycle();
+  z80_table_dispatch() {}
 
-    fast_u16 t = add16(n, cf);
-    bool of = cf && t == 0;
-    fast_u32 r32 = hl - t;
-    fast_u16 r16 = mask16(r32);
-    fast_u8 f = (get_high8(r16) & (sf_mask | yf_mask | xf_mask)) |
-                zf_ari(r16) | hf_ari(r16 >> 8, hl >> 8, n >> 8) |
-                (pf_ari(r32 >> 8, hl >> 8, n >> 8) ^
-                 (of ? pf_mask : 0)) |
-                cf_ari(r16 > hl || of) | nf_mask;
+  void on_decode(fast_u8 op) { base::dispatch_opcode(op); }
+  void on_decode_cb_prefix() { base::dispatch_cb_prefix(); }
+  void on_decode_ed_prefix() { base::dispatch_ed_prefix(); }
+};
 
-    self().on_set_wz(inc16(hl));
-    self().on_set_hl(r16);
-    self().on_set_f(f);
+// Executes repeated iterations of LDIR, LDDR, CPIR and CPDR in
+// bulk. Once an iteration of such an instruction is executed
+// as usual and is to be repeated, the module runs the following
+// ones, except the final, in a single pass over host memory and
+// then advances the tick counter and the R register by the
+// amounts the iterations would take, leaving the registers,
+// flags and WZ as they would be after the last of them. The
+// final iteration then gets executed as usual. INIR, INDR, OTIR
+// and OTDR are run the same way if the machine transfers the
+// bytes with on_input_block() and on_output_block().
+//
+// Iterations are only run in bulk while the code, the source
+// and the destination bytes are in memory for which
+// get_ram_ptr() gives access to host memory, are not on pages
+// with address marks, such as breakpoints and watchpoints, and
+// before the next event or scheduled handler is due, so that
+// interrupts requested from them are accepted between the same
+// iterations. Ticks of the iterations are passed to on_tick() as
+// a single call, and no other handlers, e.g., on_read(),
+// on_write() and on_m1_fetch_cycle(), are called for them. This
+// makes the module unsuitable for machines with modules that
+// track memory writes, such as memory_snapshots<>.
+// The module is supposed to be placed on top of a Z80 machine.
+template<typename B>
+class block_fast_path : public B {
+public:
+  typedef B base;
+  typedef typename base::ticks_type ticks_type;
+
+  block_fast_path() {}
+
+  // Ticks of a repeated iteration: two M1 fetches, a 3-tick
+  // memory access, a 4-tick I/O access or a 5-tick write or
+  // exec cycle, the extra tick of block I/O fetches or the 2
+  // extra ticks of block load writes, and the 5 ticks of
+  // repeating.
+  static const unsigned iteration_ticks = 21;
+
+  // Devices that can take or produce a block of bytes at once
+  // implement these handlers to speed up block I/O. The bytes
+  // are listed in the order they are transferred. The first of
+  // them is transferred at the specified tick and port, and
+  // every next one follows in iteration_ticks ticks with the
+  // high byte of the port, that is, register B, one less. The
+  // handlers return false to have the bytes transferred one by
+  // one with on_input() and on_output().
+  bool on_input_block(fast_u16 port, least_u8 *bytes, fast_u32 n,
+                      ticks_type tick) {
+    unused(port, bytes, n, tick);
+    return false;
+  }
+
+  bool on_output_block(fast_u16 port, const least_u8 *bytes, fast_u32 n,
+                       ticks_type tick) {
+    unused(port, bytes, n, tick);
+    return false;
+  }
+
+  // Events raised by the iteration executed as usual, including
+  // breakpoint and watchpoint hits, are handled before the
+  // following iterations.
+  void on_block_ld(block_ld k) {
+    ticks_type event_tick = self().get_next_event_tick();
+    events_mask::type events = self().get_events();
+    base::on_block_ld(k);
+    if ((k == block_ld::ldir || k == block_ld::lddr) &&
+            can_repeat(event_tick, events))
+      repeat_block_ld(k == block_ld::lddr);
   }
 
-  fast_u8 on_fetch_cycle() {
-    fast_u16 addr = self().get_pc_on_fetch();
-    self().on_set_addr_bus(addr);
-    fast_u8 n = self().on_read(addr);
-    self().on_tick(2);
-    self().on_set_addr_bus(self().get_ir_on_refresh());
-    self().on_tick(2);
-    self().set_pc_on_fetch(inc16(addr));
-    return n;
+  void on_block_cp(block_cp k) {
+    ticks_type event_tick = self().get_next_event_tick();
+    events_mask::type events = self().get_events();
+    base::on_block_cp(k);
+    if ((k == block_cp::cpir || k == block_cp::cpdr) &&
+            can_repeat(event_tick, events))
+      repeat_block_cp(k == block_cp::cpdr);
   }
 
-  fast_u8 on_m1_fetch_cycle() {
-    fast_u8 n = self().on_fetch_cycle();
-    self().on_inc_r_reg();
-    return n;
+  void on_block_in(block_in k) {
+    ticks_type event_tick = self().get_next_event_tick();
+    events_mask::type events = self().get_events();
+    base::on_block_in(k);
+    if ((k == block_in::inir || k == block_in::indr) &&
+            can_repeat(event_tick, events))
+      repeat_block_in(k == block_in::indr);
   }
 
-  fast_u8 on_disp_read_cycle(fast_u16 addr) {
-    return self().on_read_cycle(addr);
+  void on_block_out(block_out k) {
+    ticks_type event_tick = self().get_next_event_tick();
+    events_mask::type events = self().get_events();
+    base::on_block_out(k);
+    if ((k == block_out::otir || k == block_out::otdr) &&
+            can_repeat(event_tick, events))
+      repeat_block_out(k == block_out::otdr);
   }
 
-  void on_4t_exec_cycle() {
-    self().on_tick(4);
+protected:
+  using base::self;
+
+private:
+  // Ticks from the start of an iteration to the moment the
+  // byte is transferred.
+  static const unsigned input_ticks = 13;
+  static const unsigned output_ticks = 16;
+
+  bool can_repeat(ticks_type event_tick, events_mask::type events) const {
+    return self().get_ticks() < event_tick && self().get_events() == events;
   }
 
-  void on_5t_exec_cycle() {
-    self().on_tick(5);
+  bool is_plain_code(fast_u16 pc, least_u8 *&code0, least_u8 *&code1) {
+    code0 = self().get_ram_ptr(pc);
+    code1 = self().get_ram_ptr(inc16(pc));
+    return code0 && code1 && !self().has_marked_addrs(pc, 2, 0xff);
   }
 
-  fast_u8 on_input_cycle(fast_u16 port) {
-    // Z80 samples the value at t4 of the input cycle, see
-    // <http://ramsoft.bbk.org.omegahg.com/floatingbus.html>.
-    self().on_tick(4);
-    // TODO: Shall we set the address bus here?
-    fast_u8 n = self().on_input(port);
+  // The number of iterations that can be run before the next
+  // event. The last of them shall end before the event tick.
+  fast_u32 get_max_iterations_before_event() const {
+    ticks_type ticks = self().get_ticks();
+    ticks_type limit = self().get_next_event_tick();
+    if (limit <= ticks)
+      return 0;
+    ticks_type n = (limit - ticks - 1) / iteration_ticks;
+    return n < address_space_size ? static_cast<fast_u32>(n) :
+                                    address_space_size;
+  }
+
+  // The number of bytes in the page of the address in the
+  // direction of moving.
+  static fast_u32 get_span(fast_u16 addr, bool backward) {
+    return backward ? addr % base::ram_page_size + 1 :
+                      base::ram_page_size - addr % base::ram_page_size;
+  }
+
+  // Limits the number of bytes written to keep the instruction
+  // itself intact, as otherwise the next fetch would see it
+  // changed.
+  static fast_u32 limit_to_code(fast_u32 n, const least_u8 *dest,
+                                const least_u8 *code, bool backward) {
+    if (backward) {
+      if (code <= dest && code > dest - n)
+        n = static_cast<fast_u32>(dest - code);
+    } else {
+      if (code >= dest && code < dest + n)
+        n = static_cast<fast_u32>(code - dest);
+    }
     return n;
   }
 
-  void on_output_cycle(fast_u16 port, fast_u8 n) {
-    // TODO: Shall we set the address bus here?
-    self().on_tick(4);
-    self().on_output(port, n);
+  // Collects pointers to up to 'n' successive bytes of plain
+  // memory. Returns the number of bytes collected.
+  fast_u32 get_ram_ptrs(fast_u16 addr, fast_u32 n, bool backward,
+                        least_u8 **ptrs, const least_u8 *code0,
+                        const least_u8 *code1) {
+    for (fast_u32 i = 0; i != n; ++i) {
+      least_u8 *p = self().get_ram_ptr(addr);
+      if (!p || p == code0 || p == code1 ||
+              self().is_marked_page(addr, 0xff))
+        return i;
+      ptrs[i] = p;
+      addr = backward ? dec16(addr) : inc16(addr);
+    }
+    return n;
   }
 
-  fast_u8 on_disp_read() {
-    fast_u16 pc = self().get_pc_on_disp_read();
-    fast_u8 op = self().on_disp_read_cycle(pc);
-    self().set_pc_on_disp_read(inc16(pc));
-    return op;
+  // The number of block I/O iterations to run in bulk. The
+  // final iteration is left to be executed as usual.
+  fast_u32 get_max_io_iterations(fast_u8 b) const {
+    if (!b)
+      return 0;
+    fast_u32 n = get_max_iterations_before_event();
+    return n < b - 1u ? n : b - 1u;
   }
 
-  void initiate_int() {
-    self().on_set_iff1(false);
-    self().on_set_iff2(false);
+  void finish_iterations(fast_u32 n) {
+    if (base::has_feature(cpu_features::r_reg)) {
+      fast_u8 r = self().on_get_r();
+      r = (r & 0x80) | static_cast<fast_u8>((r + 2 * n) & 0x7f);
+      self().on_set_r(r);
+    }
+    self().on_tick(static_cast<unsigned>(n * iteration_ticks));
+  }
 
+  void repeat_block_ld(bool backward) {
+    fast_u16 bc = self().on_get_bc();
     fast_u16 pc = self().on_get_pc();
+    least_u8 *code0, *code1;
+    if (!bc || !is_plain_code(pc, code0, code1))
+      return;
 
-    // Get past the HALT instruction, if halted. Note that
-    // HALT instructions need to be executed at least once to
-    // be skipped on an interrupt, so checking if the PC is
-    // at a HALT instruction is not enough here.
-    if (self().on_is_halted()) {
-      pc = inc16(pc);
-      self().on_set_pc(pc);
-      self().on_set_is_halted(false);
+    // Leave the final iteration to be executed as usual.
+    fast_u32 n = get_max_iterations_before_event();
+    if (n > static_cast<fast_u32>(bc - 1))
+      n = bc - 1;
+
+    fast_u16 de = self().on_get_de();
+    fast_u16 hl = self().on_get_hl();
+    fast_u32 done = 0;
+    fast_u8 last = 0;
+    while (done != n) {
+      least_u8 *src = self().get_ram_ptr(hl);
+      least_u8 *dest = self().get_ram_ptr(de);
+      if (!src || !dest)
+        break;
+      fast_u32 c = n - done;
+      if (c > get_span(hl, backward))
+        c = get_span(hl, backward);
+      if (c > get_span(de, backward))
+        c = get_span(de, backward);
+      c = limit_to_code(c, dest, code0, backward);
+      c = limit_to_code(c, dest, code1, backward);
+      if (!c || self().has_marked_addrs(backward ? sub16(hl, c - 1) : hl,
+                                        c, 0xff) ||
+              self().has_marked_addrs(backward ? sub16(de, c - 1) : de,
+                                      c, 0xff))
+        break;
+
+      // Overlapping ranges where every byte is copied before
+      // it is overwritten can be moved at once; otherwise the
+      // bytes written get copied again.
+      if (backward) {
+        if (dest < src && dest > src - c) {
+          for (fast_u32 i = 0; i != c; ++i)
+            *(dest - i) = *(src - i);
+        } else {
+          std::memmove(dest - (c - 1), src - (c - 1), c);
+        }
+        last = *(dest - (c - 1));
+        hl = sub16(hl, static_cast<fast_u16>(c));
+        de = sub16(de, static_cast<fast_u16>(c));
+      } else {
+        if (dest > src && dest < src + c) {
+          for (fast_u32 i = 0; i != c; ++i)
+            dest[i] = src[i];
+        } else {
+          std::memmove(dest, src, c);
+        }
+        last = dest[c - 1];
+        hl = add16(hl, static_cast<fast_u16>(c));
+        de = add16(de, static_cast<fast_u16>(c));
+      }
+      done += c;
     }
+    if (!done)
+      return;
 
-    self().on_inc_r_reg();
-    self().on_tick(7);
-    self().on_push(pc);
+    fast_u8 f = self().on_get_f();
+    fast_u8 t = add8(last, self().on_get_a());
+    f = (f & (base::sf_mask | base::zf_mask | base::cf_mask)) |
+        ((t << 4) & base::yf_mask) | (t & base::xf_mask) | base::pf_mask;
 
-    fast_u16 isr_addr;
-    switch (self().on_get_int_mode()) {
-      case 0:
-        isr_addr = 0;
-        assert(0);  // TODO
+    self().on_set_bc(sub16(bc, static_cast<fast_u16>(done)));
+    self().on_set_de(de);
+    self().on_set_hl(hl);
+    self().on_set_f(f);
+    finish_iterations(done);
+  }
+
+  void repeat_block_cp(bool backward) {
+    fast_u16 bc = self().on_get_bc();
+    fast_u16 pc = self().on_get_pc();
+    fast_u8 f = self().on_get_f();
+    least_u8 *code0, *code1;
+    if (!bc || (f & base::zf_mask) || !is_plain_code(pc, code0, code1))
+      return;
+
+    fast_u32 n = get_max_iterations_before_event();
+    if (n > static_cast<fast_u32>(bc - 1))
+      n = bc - 1;
+
+    fast_u8 a = self().on_get_a();
+    fast_u16 hl = self().on_get_hl();
+    fast_u32 done = 0;
+    fast_u8 last = 0;
+    while (done != n) {
+      const least_u8 *src = self().get_ram_ptr(hl);
+      if (!src)
         break;
-      case 1:
-        // ack(7) w(3) w(3)
-        isr_addr = 0x0038;
+      fast_u32 c = n - done;
+      if (c > get_span(hl, backward))
+        c = get_span(hl, backward);
+      if (self().has_marked_addrs(backward ? sub16(hl, c - 1) : hl, c, 0xff))
         break;
-      case 2: {
-        // ack(7) w(3) w(3) r(3) r(3)
-        fast_u16 vector_addr = make16(self().on_get_i(), 0xff);
-        fast_u8 lo = self().on_read_cycle(vector_addr);
-        fast_u8 hi = self().on_read_cycle(inc16(vector_addr));
-        isr_addr = make16(hi, lo);
+
+      // Stop before the matching byte; its iteration is the
+      // final one.
+      fast_u32 m = 0;
+      if (backward) {
+        while (m != c && *(src - m) != a)
+          ++m;
+        if (m)
+          last = *(src - (m - 1));
+        hl = sub16(hl, static_cast<fast_u16>(m));
+      } else {
+        const void *p = std::memchr(src, static_cast<int>(a), c);
+        m = p ? static_cast<fast_u32>(static_cast<const least_u8*>(p) - src) :
+                c;
+        if (m)
+          last = src[m - 1];
+        hl = add16(hl, static_cast<fast_u16>(m));
       }
+      done += m;
+      if (m != c)
         break;
-      default:
-        unreachable("Unknown interrupts mode.");
     }
+    if (!done)
+      return;
 
-    self().on_jump(isr_addr);
+    fast_u8 tf;
+    base::do_cp(a, tf, last);
+    fast_u8 t = mask8(a - last - ((tf & base::hf_mask) ? 1 : 0));
+    f = (tf & (base::sf_mask | base::zf_mask | base::hf_mask)) |
+        ((t << 4) & base::yf_mask) | (t & base::xf_mask) |
+        base::pf_mask | base::nf_mask | (f & base::cf_mask);
+
+    self().on_set_bc(sub16(bc, static_cast<fast_u16>(done)));
+    self().on_set_hl(hl);
+    self().on_set_f(f);
+    finish_iterations(done);
   }
 
-  bool on_handle_active_int() {
-    bool accepted = false;
-    if (!self().on_is_int_disabled() && self().on_get_iff1()) {
-      initiate_int();
-      accepted = true;
+  void repeat_block_in(bool backward) {
+    fast_u16 bc = self().on_get_bc();
+    fast_u16 pc = self().on_get_pc();
+    least_u8 *code0, *code1;
+    fast_u32 n = get_max_io_iterations(get_high8(bc));
+    if (!n || !is_plain_code(pc, code0, code1))
+      return;
+
+    // The input bytes shall not overwrite the instruction.
+    fast_u16 hl = self().on_get_hl();
+    least_u8 *ptrs[0x100];
+    n = get_ram_ptrs(hl, n, backward, ptrs, code0, code1);
+    least_u8 bytes[0x100];
+    if (!n || !self().on_input_block(bc, bytes, n,
+                                     self().get_ticks() + input_ticks))
+      return;
+    for (fast_u32 i = 0; i != n; ++i)
+      *ptrs[i] = bytes[i];
+
+    auto d = static_cast<fast_u16>(n);
+    fast_u16 last_bc = sub16(bc, static_cast<fast_u16>((n - 1) << 8));
+    fast_u8 c = get_low8(bc);
+    fast_u8 b = get_high8(sub16(bc, static_cast<fast_u16>(n << 8)));
+    fast_u8 r = bytes[n - 1];
+    fast_u16 wz;
+    if (backward) {
+      hl = sub16(hl, d);
+      wz = dec16(last_bc);
+      c = dec8(c);
+    } else {
+      hl = add16(hl, d);
+      wz = inc16(last_bc);
+      c = inc8(c);
     }
-    return accepted;
+
+    self().on_set_bc(make16(b, get_low8(bc)));
+    self().on_set_wz(wz);
+    self().on_set_hl(hl);
+    self().on_set_f(base::get_block_io_flags(b, r, c + r));
+    finish_iterations(n);
   }
 
-protected:
-  using base::self;
+  void repeat_block_out(bool backward) {
+    fast_u16 bc = self().on_get_bc();
+    fast_u16 pc = self().on_get_pc();
+    least_u8 *code0, *code1;
+    fast_u32 n = get_max_io_iterations(get_high8(bc));
+    if (!n || !is_plain_code(pc, code0, code1))
+      return;
 
-  bool is_hl_iregp() {
-    return self().on_get_iregp_kind() == iregp::hl;
+    fast_u16 hl = self().on_get_hl();
+    least_u8 *ptrs[0x100];
+    n = get_ram_ptrs(hl, n, backward, ptrs, nullptr, nullptr);
+    least_u8 bytes[0x100];
+    for (fast_u32 i = 0; i != n; ++i)
+      bytes[i] = *ptrs[i];
+    if (!n || !self().on_output_block(bc, bytes, n,
+                                      self().get_ticks() + output_ticks))
+      return;
+
+    auto d = static_cast<fast_u16>(n);
+    bc = sub16(bc, static_cast<fast_u16>(n << 8));
+    fast_u8 b = get_high8(bc);
+    fast_u8 r = bytes[n - 1];
+    fast_u16 wz;
+    if (backward) {
+      hl = sub16(hl, d);
+      wz = dec16(bc);
+    } else {
+      hl = add16(hl, d);
+      wz = inc16(bc);
+    }
+
+    self().on_set_bc(bc);
+    self().on_set_wz(wz);
+    self().on_set_hl(hl);
+    self().on_set_f(base::get_block_io_flags(b, r, get_low8(hl) + r));
+    finish_iterations(n);
   }
 };
 
-template<typename D>
-class i8080_cpu : public i8080_executor<i8080_decoder<i8080_state<root<D>>>> {
-};
+// Skips the repeated executions of HALT. Once the CPU has
+// executed HALT again while halted, the module advances the tick
+// counter by the number of ticks the following executions would
+// take up to the next event or scheduled handler, as well as the
+// R register for the Z80. The tick counter ends up where it would
+// be after the same number of HALTs, so the event then occurs at
+// the same tick in the middle of the next one.
+//
+// Only events and scheduled handlers are considered to wake up
+// the CPU, so interrupts shall be requested from them. The
+// skipped executions call no handlers except a single on_tick()
+// call for all their ticks, and they do not count as steps.
+template<typename B>
+class halt_fast_forward : public B {
+public:
+  typedef B base;
+  typedef typename base::ticks_type ticks_type;
 
-template<typename D>
-class z80_cpu : public z80_executor<z80_decoder<z80_state<root<D>>>> {
-};
+  halt_fast_forward() {}
 
-static const fast_u32 address_space_size = 0x10000;  // 64K bytes.
+  void on_step() {
+    if (!self().is_halted())
+      return base::on_step();
+
+    ticks_type event_tick = self().get_next_event_tick();
+    ticks_type start = self().get_ticks();
+    events_mask::type events = self().get_events();
+    base::on_step();
+
+    // Let the caller handle events raised during the step, such
+    // as breakpoint hits.
+    ticks_type ticks = self().get_ticks();
+    if (!self().is_halted() || self().get_events() != events ||
+          ticks >= event_tick || ticks == start)
+      return;
+
+    ticks_type n = (event_tick - ticks - 1) / (ticks - start);
+    if (n > max_skipped_steps)
+      n = max_skipped_steps;
+    if (!n)
+      return;
+    // Every HALT executes an M1 cycle. The i8080 has no R.
+    if (base::has_feature(cpu_features::r_reg)) {
+      fast_u8 r = self().on_get_r();
+      self().on_set_r((r & 0x80) | static_cast<fast_u8>((r + n) & 0x7f));
+    }
+    self().on_tick(static_cast<unsigned>(n * (ticks - start)));
+  }
+
+protected:
+  using base::self;
 
+private:
+  // Keeps the number of ticks within what on_tick() takes and
+  // lets the caller regain control every now and then when no
+  // events are due.
+  static const fast_u32 max_skipped_steps = 1u << 24;
+};
+
+// Fast-forwards polling loops to the next event. A loop is a
+// backward jump of no more than 'max_loop_size' bytes. Once an
+// iteration of it finishes in the same state of registers it
+// started in, with no writes to memory or output ports made in
+// between, the following iterations are all the same, provided
+// reads return the same values. Such iterations are then skipped
+// up to the next event. Reads are therefore supposed to have no
+// side effects and the values of memory and input ports to only
+// change on events. On skipped iterations the on_read() and
+// on_input() handlers are not called. Loops with marked
+// addresses in their code, such as breakpoints, and iterations
+// that raise events are executed as usual.
 template<typename B>
-class machine_memory : public B {
+class idle_loop_fast_forward : public B {
 public:
   typedef B base;
+  typedef typename base::ticks_type ticks_type;
 
-  machine_memory() { reset(); }
+  idle_loop_fast_forward() {}
 
-  void reset() {
-    uint_fast32_t rnd = 0xde347a01;
-    for (auto &b : memory_bytes) {
-      b = static_cast<least_u8>(rnd & 0xff);
-      rnd = (rnd * 0x74392cef) ^ (rnd >> 16);
+  void on_step() {
+    fast_u16 prev_pc = self().get_pc();
+    events_mask::type events = self().get_events();
+    base::on_step();
+
+    // Events such as breakpoint and watchpoint hits are left to
+    // the caller, who may resume in the middle of the iteration.
+    if (self().get_events() != events)
+      has_events = true;
+
+    fast_u16 pc = self().get_pc();
+    if (is_in_loop && pc == loop_pc) {
+      skip_iterations();
+      start_iteration();
+      return;
     }
-  }
 
-  fast_u8 read(fast_u16 addr) const {
-    assert(addr < address_space_size);
-    return memory_bytes[addr];
+    if (pc <= prev_pc && prev_pc - pc < max_loop_size) {
+      loop_pc = pc;
+      loop_size = prev_pc - pc + max_jump_size;
+      is_in_loop = !is_loop_marked();
+      if (is_in_loop)
+        start_iteration();
+    } else if (pc < loop_pc || pc - loop_pc >= max_loop_size) {
+      is_in_loop = false;
+    }
   }
 
-  void write(fast_u16 addr, fast_u8 n) {
-    assert(addr < address_space_size);
-    memory_bytes[addr] = static_cast<least_u8>(n);
+  void on_write(fast_u16 addr, fast_u8 n) {
+    has_side_effects = true;
+    base::on_write(addr, n);
   }
 
-  fast_u8 on_read(fast_u16 addr) { return read(addr); }
-
-  void on_write(fast_u16 addr, fast_u8 n) { write(addr, n); }
+  void on_output(fast_u16 port, fast_u8 n) {
+    has_side_effects = true;
+    base::on_output(port, n);
+  }
 
 protected:
   using base::self;
 
 private:
-  least_u8 memory_bytes[address_space_size] = {};
+  static const unsigned max_regs = 16;
+
+  struct loop_state {
+    fast_u16 regs[max_regs];
+  };
+
+  template<typename S>
+  static std::true_type is_z80_state(const z80_state<S> *);
+  template<typename S>
+  static std::true_type is_z80_state(const packed_z80_state<S> *);
+  template<typename S>
+  static std::false_type is_z80_state(const i8080_state<S> *);
+  template<typename S>
+  static std::false_type is_z80_state(const packed_i8080_state<S> *);
+
+  template<typename D>
+  static void get_state(loop_state &st, const D &s, std::false_type) {
+    fast_u16 regs[] = {s.get_af(), s.get_bc(), s.get_de(), s.get_hl(),
+                       s.get_sp(), s.get_iff(), s.is_halted(),
+                       s.is_int_disabled()};
+    std::copy(std::begin(regs), std::end(regs), st.regs);
+  }
+
+  // R is not compared as it changes on every iteration.
+  template<typename D>
+  static void get_state(loop_state &st, const D &s, std::true_type) {
+    fast_u16 regs[] = {s.get_af(), s.get_bc(), s.get_de(), s.get_hl(),
+                       s.get_sp(), s.get_ix(), s.get_iy(),
+                       s.get_alt_af(), s.get_alt_bc(), s.get_alt_de(),
+                       s.get_alt_hl(), s.get_wz(), s.get_i(),
+                       static_cast<fast_u16>(s.get_iff1() |
+                                             (s.get_iff2() << 1) |
+                                             (s.get_int_mode() << 2)),
+                       static_cast<fast_u16>(s.is_halted() |
+                                             (s.is_int_disabled() << 1)),
+                       static_cast<fast_u16>(s.get_iregp_kind())};
+    std::copy(std::begin(regs), std::end(regs), st.regs);
+  }
+
+  void get_state(loop_state &st) const {
+    st = loop_state();
+    get_state(st, self(), decltype(is_z80_state(&self()))());
+  }
+
+  // Loops with breakpoints or watchpoints on their code are
+  // executed as usual, so every hit is reported.
+  bool is_loop_marked() const {
+    return self().has_marked_addrs(loop_pc, loop_size, 0xff);
+  }
+
+  void start_iteration() {
+    get_state(start_state);
+    start_tick = self().get_ticks();
+    start_event_tick = self().get_next_event_tick();
+    start_r = self().on_get_r();
+    has_side_effects = false;
+    has_events = false;
+  }
+
+  void skip_iterations() {
+    ticks_type ticks = self().get_ticks();
+    if (has_side_effects || has_events ||
+          ticks >= start_event_tick ||
+          self().get_next_event_tick() != start_event_tick ||
+          ticks == start_tick)
+      return;
+
+    loop_state st;
+    get_state(st);
+    if (!std::equal(std::begin(st.regs), std::end(st.regs),
+                    std::begin(start_state.regs)))
+      return;
+
+    ticks_type iteration_ticks = ticks - start_tick;
+    ticks_type n = (start_event_tick - ticks - 1) / iteration_ticks;
+    if (n > max_skipped_iterations)
+      n = max_skipped_iterations;
+    if (!n || is_loop_marked())
+      return;
+
+    // The i8080 has no R.
+    fast_u8 r = self().on_get_r();
+    fast_u32 r_delta = (r - start_r) & 0x7f;
+    self().on_set_r((r & 0x80) |
+                    static_cast<fast_u8>((r + n * r_delta) & 0x7f));
+    self().on_tick(static_cast<unsigned>(n * iteration_ticks));
+  }
+
+  // Keeps the number of ticks within what on_tick() takes and
+  // lets the caller regain control every now and then when no
+  // events are due.
+  static const fast_u32 max_skipped_iterations = 1u << 16;
+  static const fast_u16 max_loop_size = 16;
+
+  // The longest jump instruction that may close a loop.
+  static const fast_u16 max_jump_size = 3;
+
+  fast_u16 loop_pc = 0;
+  fast_u16 loop_size = 0;
+  bool is_in_loop = false;
+  bool has_side_effects = false;
+  bool has_events = false;
+  loop_state start_state = loop_state();
+  ticks_type start_tick = 0;
+  ticks_type start_event_tick = 0;
+  fast_u8 start_r = 0;
 };
 
-class events_mask {
+// Reports ticks once per instruction instead of once per machine
+// cycle. Ticks of the cycles of an instruction are accumulated
+// and passed to the on_tick() handler of the underlying machine
+// when the step ends, so events are raised and scheduled
+// handlers are called at the end of the instruction during which
+// they are due rather than in its middle. get_ticks() includes
+// the accumulated ticks, so handlers such as on_input() still
+// see the tick counter the way they would otherwise. Machines
+// with devices that need to act at exact ticks within
+// instructions shall not use the module.
+template<typename B>
+class instr_ticks : public B {
 public:
-  typedef fast_u32 type;
+  typedef B base;
+  typedef typename base::ticks_type ticks_type;
 
-  static const type end_of_frame = 1u << 0;
-  static const type breakpoint_hit = 1u << 1;
-  static const type end = 1u << 2;
+  instr_ticks() {}
+
+  ticks_type get_ticks() const { return base::get_ticks() + pending; }
+
+  void on_tick(unsigned t) { pending += t; }
+
+  void on_step() {
+    base::on_step();
+    unsigned t = pending;
+    pending = 0;
+    base::on_tick(t);
+  }
+
+protected:
+  using base::self;
+
+private:
+  unsigned pending = 0;
 };
 
+// Models the INT and NMI lines of the Z80 along with a daisy chain
+// of Z80 peripherals. Devices of the chain are identified by their
+// positions in it, with lower numbers having higher priority. A
+// device that has its interrupt acknowledged stays in service,
+// blocking requests from itself and lower-priority devices, until
+// the CPU executes RETI. Devices outside of the chain drive the
+// INT line with set_int_line() and supply the acknowledge byte,
+// if any, with on_int_ack(). The module keeps a flag that is only
+// updated when the lines, the chain or IFF1 change, so steps with
+// no interrupts pending take a single check. IFF1 changes shall
+// be made with on_set_iff1() or followed by a call to
+// update_int_pending(). The module is supposed to be placed on
+// top of a Z80 CPU or machine.
 template<typename B>
-class machine_state : public B {
+class int_controller : public B {
 public:
   typedef B base;
-  typedef unsigned ticks_type;
 
-  machine_state() {}
+  static const unsigned max_int_devices = 32;
 
-  bool is_marked_addr(fast_u16 addr, fast_u8 marks) const {
-    return (address_marks[mask16(addr)] & marks) != 0;
+  int_controller() {}
+
+  void set_int_line(bool active) {
+    int_line = active;
+    update_int_pending();
   }
 
-  void mark_addr(fast_u16 addr, fast_u8 marks) {
-    address_marks[mask16(addr)] |= static_cast<least_u8>(marks);
+  // The vector is the byte the device puts on the data bus when
+  // the request is acknowledged.
+  void request_int(unsigned device, fast_u8 vector) {
+    assert(device < max_int_devices);
+    requested |= get_device_mask(device);
+    vectors[device] = static_cast<least_u8>(vector);
+    update_int_pending();
   }
 
-  void mark_addrs(fast_u16 addr, fast_u16 size, fast_u8 marks) {
-    for (fast_u16 i = 0; i != size; ++i)
-      mark_addr(addr + i, marks);
+  void cancel_int(unsigned device) {
+    assert(device < max_int_devices);
+    requested &= ~get_device_mask(device);
+    update_int_pending();
   }
 
-  void unmark_addr(fast_u16 addr, fast_u8 marks) {
-    address_marks[addr] &= ~marks;
+  bool is_int_requested(unsigned device) const {
+    return (requested & get_device_mask(device)) != 0;
   }
 
-  bool is_breakpoint_addr(fast_u16 addr) const {
-    return is_marked_addr(addr, breakpoint_mark);
+  bool is_int_in_service(unsigned device) const {
+    return (in_service & get_device_mask(device)) != 0;
   }
 
-  void set_breakpoint(fast_u16 addr) {
-    mark_addr(addr, breakpoint_mark);
+  // NMIs are edge-triggered, so every request is accepted once.
+  void request_nmi() {
+    is_nmi_requested = true;
+    update_int_pending();
   }
 
-  void clear_breakpoint(fast_u16 addr) {
-    unmark_addr(addr, breakpoint_mark);
+  bool is_int_pending() const { return is_pending; }
+
+  void update_int_pending() {
+    is_pending = is_nmi_requested ||
+                 (self().on_get_iff1() && (int_line || get_chain_requests()));
   }
 
-  void on_tick(unsigned t) {
-    frame_tick += t;
-    if (frame_tick >= ticks_per_frame) {
-      frame_tick %= ticks_per_frame;
-      events |= events_mask::end_of_frame;
-    }
+  void on_step() {
+    if (is_pending)
+      handle_pending_ints();
+    base::on_step();
   }
 
-  void on_set_pc(fast_u16 n) {
-    if (is_breakpoint_addr(n))
-      events |= events_mask::breakpoint_hit;
-    base::on_set_pc(n);
+  void on_set_iff1(bool f) {
+    base::on_set_iff1(f);
+    update_int_pending();
   }
 
-  events_mask::type on_run() {
-    events = 0;
-    while (!events)
-      self().on_step();
-    return events;
+  fast_u8 on_int_ack() {
+    fast_u32 requests = get_chain_requests();
+    if (!requests)
+      return base::on_int_ack();
+
+    // Acknowledge the highest-priority device.
+    fast_u32 mask = requests & (~requests + 1);
+    requested &= ~mask;
+    in_service |= mask;
+    unsigned device = 0;
+    while (!(mask & get_device_mask(device)))
+      ++device;
+    return vectors[device];
+  }
+
+  void on_reti() {
+    // The highest-priority device in service is the one being
+    // served.
+    in_service &= in_service - 1;
+    base::on_reti();
+    update_int_pending();
   }
 
 protected:
   using base::self;
 
 private:
-  ticks_type frame_tick = 0;
-  static const ticks_type ticks_per_frame = 100 * 1000;
-
-  events_mask::type events = 0;
+  static fast_u32 get_device_mask(unsigned device) {
+    return static_cast<fast_u32>(1) << device;
+  }
 
-  static const fast_u8 breakpoint_mark = 1u << 0;
-  least_u8 address_marks[address_space_size] = {};
-};
+  // Requests not blocked by devices in service.
+  fast_u32 get_chain_requests() const {
+    fast_u32 blocking = in_service & (~in_service + 1);
+    return blocking ? requested & (blocking - 1) : requested;
+  }
 
-template<typename D>
-class i8080_machine : public machine_memory<machine_state<i8080_cpu<D>>> {
-};
+  void handle_pending_ints() {
+    // Interrupts are not accepted after EI and index prefixes.
+    if (self().on_is_int_disabled())
+      return;
+    if (is_nmi_requested) {
+      is_nmi_requested = false;
+      self().initiate_nmi();
+    } else {
+      self().initiate_int();
+    }
+    update_int_pending();
+  }
 
-template<typename D>
-class z80_machine : public machine_memory<machine_state<z80_cpu<D>>> {
+  bool int_line = false;
+  bool is_nmi_requested = false;
+  bool is_pending = false;
+  fast_u32 requested = 0;
+  fast_u32 in_service = 0;
+  least_u8 vectors[max_int_devices] = {};
 };
 
 }  // namespace z80
@@ -99,17 +99,38 @@ class _MachineBase(object):
     _NO_EVENTS = 0
     _END_OF_FRAME = 1 << 0
     _BREAKPOINT_HIT = 1 << 1
+    _TICKS_LIMIT_HIT = 1 << 3
+    _READ_WATCH_HIT = 1 << 4
+    _WRITE_WATCH_HIT = 1 << 5
 
     # Address marks.
     _NO_MARKS = 0
     _BREAKPOINT_MARK = 1 << 0
+    _READ_WATCH_MARK = 1 << 1
+    _WRITE_WATCH_MARK = 1 << 2
 
     def mark_addr(self, addr, marks):
         self.mark_addrs(addr, 1, marks)
 
+    def run_for(self, ticks):
+        # Unlike run(ticks), goes on past the ends of frames.
+        # Returns _TICKS_LIMIT_HIT once the ticks are spent or
+        # the events that stopped the machine earlier.
+        end = self.get_ticks() + ticks
+        while True:
+            events = self.run(max(end - self.get_ticks(), 0))
+            if events & (self._TICKS_LIMIT_HIT | ~self._END_OF_FRAME):
+                return events
+
     def set_breakpoint(self, addr):
         self.mark_addr(addr, self._BREAKPOINT_MARK)
 
+    def set_read_watchpoint(self, addr, size=1):
+        self.mark_addrs(addr, size, self._READ_WATCH_MARK)
+
+    def set_write_watchpoint(self, addr, size=1):
+        self.mark_addrs(addr, size, self._WRITE_WATCH_MARK)
+
 
 class I8080Machine(_MachineBase, _I8080Machine, I8080State):
     def __init__(self):
@@ -0,0 +1,375 @@
+/*  Z80 CPU Emulator.
+    https://github.com/kosarev/z80
+
+    Copyright (C) 2017-2019 Ivan Kosarev.
+    ivan@kosarev.info
+
+    Published under the MIT license.
+*/
+
+#ifndef Z80_DIFF_H
+#define Z80_DIFF_H
+
+#include <memory>
+
+#include "z80_trace.h"
+
+namespace z80 {
+
+// FNV-1a.
+inline fast_u64 hash_u8(fast_u64 hash, fast_u8 n) {
+  return (hash ^ n) * 0x100000001b3 & 0xffffffffffffffff;
+}
+
+inline fast_u64 hash_u16(fast_u64 hash, fast_u16 n) {
+  return hash_u8(hash_u8(hash, get_low8(n)), get_high8(n));
+}
+
+template<typename S>
+fast_u64 hash_i8080_cpu_state(fast_u64 hash, const S &s) {
+  for (fast_u16 n : {s.get_af(), s.get_bc(), s.get_de(), s.get_hl(),
+                     s.get_pc(), s.get_sp()})
+    hash = hash_u16(hash, n);
+  hash = hash_u8(hash, s.get_iff());
+  hash = hash_u8(hash, s.is_int_disabled());
+  return hash_u8(hash, s.is_halted());
+}
+
+template<typename S>
+fast_u64 hash_z80_cpu_state(fast_u64 hash, const S &s) {
+  for (fast_u16 n : {s.get_af(), s.get_bc(), s.get_de(), s.get_hl(),
+                     s.get_pc(), s.get_sp(), s.get_ix(), s.get_iy(),
+                     s.get_alt_af(), s.get_alt_bc(), s.get_alt_de(),
+                     s.get_alt_hl(), s.get_ir(), s.get_wz()})
+    hash = hash_u16(hash, n);
+  hash = hash_u8(hash, s.get_iff1());
+  hash = hash_u8(hash, s.get_iff2());
+  hash = hash_u8(hash, static_cast<fast_u8>(s.get_int_mode()));
+  hash = hash_u8(hash, s.is_int_disabled());
+  hash = hash_u8(hash, static_cast<fast_u8>(s.get_iregp_kind()));
+  return hash_u8(hash, s.is_halted());
+}
+
+template<typename B>
+fast_u64 hash_cpu_state(fast_u64 hash, const i8080_state<B> &s) {
+  return hash_i8080_cpu_state(hash, s);
+}
+
+template<typename B>
+fast_u64 hash_cpu_state(fast_u64 hash, const packed_i8080_state<B> &s) {
+  return hash_i8080_cpu_state(hash, s);
+}
+
+template<typename B>
+fast_u64 hash_cpu_state(fast_u64 hash, const z80_state<B> &s) {
+  return hash_z80_cpu_state(hash, s);
+}
+
+template<typename B>
+fast_u64 hash_cpu_state(fast_u64 hash, const packed_z80_state<B> &s) {
+  return hash_z80_cpu_state(hash, s);
+}
+
+// Hashes the registers and the memory of a machine, that is,
+// everything save_state() saves. Machines in the same state have
+// the same hashes.
+template<typename M>
+fast_u64 get_state_hash(const M &m) {
+  fast_u64 hash = hash_cpu_state(0xcbf29ce484222325, m);
+  for (fast_u32 addr = 0; addr != address_space_size; ++addr)
+    hash = hash_u8(hash, m.read(static_cast<fast_u16>(addr)));
+  return hash;
+}
+
+// Registers, including the internal ones, and memory of a
+// machine. The state of devices and the tick counter are not
+// part of it.
+struct saved_state {
+  fast_u16 af, bc, de, hl, pc, sp, ix, iy;
+  fast_u16 alt_af, alt_bc, alt_de, alt_hl, ir, wz;
+  bool iff1, iff2, is_halted, is_int_disabled;
+  unsigned int_mode;
+  iregp irp;
+  least_u8 memory[address_space_size];
+};
+
+template<typename S>
+void save_i8080_cpu_state(saved_state &st, const S &s) {
+  st.af = s.get_af();
+  st.bc = s.get_bc();
+  st.de = s.get_de();
+  st.hl = s.get_hl();
+  st.pc = s.get_pc();
+  st.sp = s.get_sp();
+  st.iff1 = s.get_iff();
+  st.is_halted = s.is_halted();
+  st.is_int_disabled = s.is_int_disabled();
+}
+
+template<typename S>
+void restore_i8080_cpu_state(S &s, const saved_state &st) {
+  s.set_af(st.af);
+  s.set_bc(st.bc);
+  s.set_de(st.de);
+  s.set_hl(st.hl);
+  s.set_pc(st.pc);
+  s.set_sp(st.sp);
+  s.set_iff(st.iff1);
+  s.set_is_halted(st.is_halted);
+  s.set_is_int_disabled(st.is_int_disabled);
+}
+
+template<typename S>
+void save_z80_cpu_state(saved_state &st, const S &s) {
+  st.af = s.get_af();
+  st.bc = s.get_bc();
+  st.de = s.get_de();
+  st.hl = s.get_hl();
+  st.pc = s.get_pc();
+  st.sp = s.get_sp();
+  st.ix = s.get_ix();
+  st.iy = s.get_iy();
+  st.alt_af = s.get_alt_af();
+  st.alt_bc = s.get_alt_bc();
+  st.alt_de = s.get_alt_de();
+  st.alt_hl = s.get_alt_hl();
+  st.ir = s.get_ir();
+  st.wz = s.get_wz();
+  st.iff1 = s.get_iff1();
+  st.iff2 = s.get_iff2();
+  st.int_mode = s.get_int_mode();
+  st.is_halted = s.is_halted();
+  st.is_int_disabled = s.is_int_disabled();
+  st.irp = s.get_iregp_kind();
+}
+
+template<typename S>
+void restore_z80_cpu_state(S &s, const saved_state &st) {
+  s.set_af(st.af);
+  s.set_bc(st.bc);
+  s.set_de(st.de);
+  s.set_hl(st.hl);
+  s.set_pc(st.pc);
+  s.set_sp(st.sp);
+  s.set_ix(st.ix);
+  s.set_iy(st.iy);
+  s.set_alt_af(st.alt_af);
+  s.set_alt_bc(st.alt_bc);
+  s.set_alt_de(st.alt_de);
+  s.set_alt_hl(st.alt_hl);
+  s.set_ir(st.ir);
+  s.set_wz(st.wz);
+  s.set_iff1(st.iff1);
+  s.set_iff2(st.iff2);
+  s.set_int_mode(st.int_mode);
+  s.set_is_halted(st.is_halted);
+  s.set_is_int_disabled(st.is_int_disabled);
+  s.set_iregp_kind(st.irp);
+}
+
+template<typename B>
+void save_cpu_state(saved_state &st, const i8080_state<B> &s) {
+  save_i8080_cpu_state(st, s);
+}
+
+template<typename B>
+void save_cpu_state(saved_state &st, const packed_i8080_state<B> &s) {
+  save_i8080_cpu_state(st, s);
+}
+
+template<typename B>
+void restore_cpu_state(i8080_state<B> &s, const saved_state &st) {
+  restore_i8080_cpu_state(s, st);
+}
+
+template<typename B>
+void restore_cpu_state(packed_i8080_state<B> &s, const saved_state &st) {
+  restore_i8080_cpu_state(s, st);
+}
+
+template<typename B>
+void save_cpu_state(saved_state &st, const z80_state<B> &s) {
+  save_z80_cpu_state(st, s);
+}
+
+template<typename B>
+void save_cpu_state(saved_state &st, const packed_z80_state<B> &s) {
+  save_z80_cpu_state(st, s);
+}
+
+template<typename B>
+void restore_cpu_state(z80_state<B> &s, const saved_state &st) {
+  restore_z80_cpu_state(s, st);
+}
+
+template<typename B>
+void restore_cpu_state(packed_z80_state<B> &s, const saved_state &st) {
+  restore_z80_cpu_state(s, st);
+}
+
+template<typename M>
+void save_state(saved_state &st, const M &m) {
+  save_cpu_state(st, m);
+  for (fast_u32 addr = 0; addr != address_space_size; ++addr)
+    st.memory[addr] = static_cast<least_u8>(
+        m.read(static_cast<fast_u16>(addr)));
+}
+
+template<typename M>
+void restore_state(M &m, const saved_state &st) {
+  restore_cpu_state(m, st);
+  for (fast_u32 addr = 0; addr != address_space_size; ++addr)
+    m.write(static_cast<fast_u16>(addr), st.memory[addr]);
+}
+
+// Runs two machines side by side, e.g., built with different
+// versions of the emulator, and finds the first instruction after
+// which their states differ. The states are compared every
+// 'interval' instructions. Once they differ, the interval is
+// bisected by re-running parts of it from saved states. As the
+// state of devices is not saved, the machines shall only depend
+// on their registers and memory.
+//
+// Bisection assumes that machines that have diverged stay
+// different. States that differ only between two comparisons and
+// then become the same again are not detected, and if that
+// happens within a bisected interval, a later divergence may be
+// reported instead of the first one. Smaller intervals narrow
+// that window at the cost of more hashing.
+//
+// Returns whether the machines diverge within the specified number
+// of instructions. If they do, 'instr' is set to the number of
+// instructions executed before the diverging one and the machines
+// are left in their states right before it. Otherwise, they have
+// both executed all the instructions.
+template<typename A, typename B>
+bool find_divergence(A &a, B &b, fast_u64 num_instrs, fast_u64 &instr,
+                     fast_u64 interval = 0x10000) {
+  instr = 0;
+  if (get_state_hash(a) != get_state_hash(b))
+    return true;
+
+  std::unique_ptr<saved_state> saved_a(new saved_state);
+  std::unique_ptr<saved_state> saved_b(new saved_state);
+  auto save = [&]() {
+    save_state(*saved_a, a);
+    save_state(*saved_b, b);
+  };
+  auto restore = [&]() {
+    restore_state(a, *saved_a);
+    restore_state(b, *saved_b);
+  };
+  save();
+
+  auto run = [&](fast_u64 n) {
+    for (fast_u64 i = 0; i != n; ++i) {
+      a.on_step();
+      b.on_step();
+    }
+    return get_state_hash(a) == get_state_hash(b);
+  };
+
+  while (instr != num_instrs) {
+    fast_u64 n = num_instrs - instr < interval ? num_instrs - instr :
+                                                 interval;
+    if (run(n)) {
+      save();
+      instr += n;
+      continue;
+    }
+
+    // The machines are the same after 'lo' instructions from
+    // the saved states and differ after 'hi' ones.
+    fast_u64 lo = 0, hi = n;
+    while (hi - lo > 1) {
+      fast_u64 mid = lo + (hi - lo) / 2;
+      restore();
+      if (run(mid - lo)) {
+        save();
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    restore();
+    instr += lo;
+    return true;
+  }
+  return false;
+}
+
+struct trace_divergence {
+  // The zero-based number of the first instruction whose records
+  // differ.
+  fast_u64 instr = 0;
+
+  // The first differing records. A trace that has ended has no
+  // record.
+  bool has_a = false;
+  bool has_b = false;
+  trace_record a;
+  trace_record b;
+};
+
+inline bool are_trace_records_equal(const trace_record &a,
+                                    const trace_record &b) {
+  if (a.kind != b.kind || a.num_instrs != b.num_instrs ||
+        a.ticks != b.ticks || a.pc != b.pc)
+    return false;
+  switch (a.kind) {
+    case trace_record_kind::instr:
+      return true;
+    case trace_record_kind::regs:
+      if (a.num_regs != b.num_regs)
+        return false;
+      for (unsigned i = 0; i != a.num_regs; ++i) {
+        if (a.regs[i] != b.regs[i])
+          return false;
+      }
+      return true;
+    case trace_record_kind::read:
+    case trace_record_kind::write:
+      return a.addr == b.addr && a.value == b.value;
+  }
+  unreachable("Unknown trace record.");
+}
+
+// Finds the first record at which two traces differ. The chained
+// hashes of the blocks are bisected via the indexes of the
+// traces, so only the first differing block gets decoded. Returns
+// whether the traces differ. Read errors are reported by the
+// readers' has_failed().
+inline bool find_trace_divergence(trace_reader &a, trace_reader &b,
+                                  trace_divergence &d) {
+  std::size_t lo = 0;
+  std::size_t hi = a.get_num_blocks() < b.get_num_blocks() ?
+                       a.get_num_blocks() : b.get_num_blocks();
+  while (lo != hi) {
+    std::size_t mid = lo + (hi - lo) / 2;
+    if (a.get_block_hash(mid) == b.get_block_hash(mid))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (!a.seek_to_block(lo) || !b.seek_to_block(lo))
+    return false;
+
+  for (;;) {
+    d.has_a = a.read(d.a);
+    d.has_b = b.read(d.b);
+    if (!d.has_a && !d.has_b)
+      return false;
+    if (d.has_a && d.has_b && are_trace_records_equal(d.a, d.b))
+      continue;
+
+    fast_u64 n = d.has_a ? d.a.num_instrs : d.b.num_instrs;
+    if (d.has_a && d.has_b && d.b.num_instrs < n)
+      n = d.b.num_instrs;
+    d.instr = n ? n - 1 : 0;
+    return true;
+  }
+}
+
+}  // namespace z80
+
+#endif  // Z80_DIFF_H
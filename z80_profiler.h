@@ -0,0 +1,186 @@
+/*  Z80 CPU Emulator.
+    https://github.com/kosarev/z80
+
+    Copyright (C) 2017-2019 Ivan Kosarev.
+    ivan@kosarev.info
+
+    Published under the MIT license.
+*/
+
+#ifndef Z80_PROFILER_H
+#define Z80_PROFILER_H
+
+#include <algorithm>
+#include <vector>
+
+#include "z80.h"
+
+namespace z80 {
+
+// Counts the instructions executed and the ticks spent at every
+// address. An instruction is counted at the address of its first
+// op-code byte on its M1 fetch cycle; the M1 cycles that fetch
+// the rest of a prefixed op-code are recognized with the help of
+// the decoder's instruction tables. Ticks are attributed to the
+// instruction being executed, so the ticks of accepting an
+// interrupt go to the instruction executed before it. The ticks
+// are taken from the machine's tick counter, so the module shall
+// be put on top of a machine module.
+template<typename B>
+class profiler : public B {
+public:
+  typedef B base;
+
+  profiler() {}
+
+  profiler(const profiler &) = delete;
+  profiler &operator = (const profiler &) = delete;
+
+  fast_u64 get_instrs_at(fast_u16 addr) const {
+    return counters[mask16(addr)].instrs;
+  }
+
+  fast_u64 get_ticks_at(fast_u16 addr) const {
+    addr = mask16(addr);
+    return counters[addr].ticks + (addr == instr_pc ? get_instr_ticks() : 0);
+  }
+
+  void clear_profile() {
+    for (auto &c : counters)
+      c = address_counters();
+    instr_start = self().get_ticks();
+  }
+
+  // Ticks are added to the counter of the address of an
+  // instruction when the next one is fetched, so nothing has to
+  // be done per tick.
+  fast_u8 on_m1_fetch_cycle() {
+    if (!prefix) {
+      fast_u64 now = self().get_ticks();
+      counters[instr_pc].ticks += now - instr_start;
+      instr_start = now;
+      instr_pc = self().get_pc_on_fetch();
+      ++counters[instr_pc].instrs;
+    }
+    fast_u8 op = base::on_m1_fetch_cycle();
+    if (prefix || is_prefix_byte(op))
+      prefix = get_next_prefix(op);
+    return op;
+  }
+
+  // Lists addresses in order of decreasing number of ticks
+  // spent at them. Zero means no limit.
+  void write_hotspot_report(std::FILE *f, unsigned max_entries = 0) const {
+    std::vector<fast_u16> addrs;
+    fast_u64 total_instrs = 0, total_ticks = 0;
+    for (fast_u32 addr = 0; addr != address_space_size; ++addr) {
+      total_instrs += counters[addr].instrs;
+      total_ticks += get_ticks_at(static_cast<fast_u16>(addr));
+      if (counters[addr].instrs || get_ticks_at(static_cast<fast_u16>(addr)))
+        addrs.push_back(static_cast<fast_u16>(addr));
+    }
+    std::stable_sort(addrs.begin(), addrs.end(),
+                     [this](fast_u16 a, fast_u16 b) {
+                       return get_ticks_at(a) > get_ticks_at(b); });
+    if (max_entries && addrs.size() > max_entries)
+      addrs.resize(max_entries);
+
+    std::fprintf(f, "%llu instructions, %llu ticks\n",
+                 static_cast<unsigned long long>(total_instrs),
+                 static_cast<unsigned long long>(total_ticks));
+    std::fprintf(f, "addr  %14s %6s %14s %6s\n",
+                 "instrs", "%", "ticks", "%");
+    for (fast_u16 addr : addrs) {
+      std::fprintf(f, "%04x  %14llu %6.2f %14llu %6.2f\n",
+                   static_cast<unsigned>(addr),
+                   static_cast<unsigned long long>(counters[addr].instrs),
+                   get_percentage(counters[addr].instrs, total_instrs),
+                   static_cast<unsigned long long>(get_ticks_at(addr)),
+                   get_percentage(get_ticks_at(addr), total_ticks));
+    }
+  }
+
+  // Writes the 8-byte signature followed by the instruction
+  // counters and then the tick counters for all addresses, each
+  // as a little-endian 64-bit value. Returns false on errors.
+  bool write_profile_dump(std::FILE *f) const {
+    if (std::fwrite(dump_signature, 1, sizeof(dump_signature), f) !=
+            sizeof(dump_signature))
+      return false;
+    return write_counters(f, &profiler::get_instrs_at) &&
+           write_counters(f, &profiler::get_ticks_at);
+  }
+
+  static const char dump_signature[8];
+
+protected:
+  using base::self;
+
+private:
+  fast_u64 get_instr_ticks() const {
+    return self().get_ticks() - instr_start;
+  }
+
+  static bool is_prefix_byte(fast_u8 op) {
+    return op == 0xcb || op == 0xed || op == 0xdd || op == 0xfd;
+  }
+
+  // Only called for what may be prefixes and the bytes that
+  // follow them, so the tables are not looked up on every M1
+  // cycle.
+  Z80_NOINLINE fast_u8 get_next_prefix(fast_u8 op) const {
+    // The byte following CB and ED is the last M1-fetched one.
+    if (prefix == 0xcb || prefix == 0xed)
+      return 0;
+
+    if (!is_prefix_byte(op) ||
+            base::get_instr_info(op).kind != instr_kind::prefix)
+      return 0;
+
+    // In DD CB and FD CB instructions the op-code is not read
+    // in an M1 cycle.
+    if (prefix && op == 0xcb)
+      return 0;
+    return op;
+  }
+
+  static double get_percentage(fast_u64 n, fast_u64 total) {
+    return total ? 100.0 * static_cast<double>(n) /
+                       static_cast<double>(total) : 0.0;
+  }
+
+  bool write_counters(std::FILE *f,
+                      fast_u64 (profiler::*get)(fast_u16 addr) const) const {
+    least_u8 buff[8 * 0x100];
+    for (fast_u32 i = 0; i != address_space_size; i += 0x100) {
+      for (unsigned j = 0; j != 0x100; ++j) {
+        fast_u64 n = (this->*get)(static_cast<fast_u16>(i + j));
+        for (unsigned k = 0; k != 8; ++k)
+          buff[j * 8 + k] = static_cast<least_u8>((n >> (k * 8)) & 0xff);
+      }
+      if (std::fwrite(buff, 1, sizeof(buff), f) != sizeof(buff))
+        return false;
+    }
+    return true;
+  }
+
+  fast_u16 instr_pc = 0;
+  fast_u64 instr_start = 0;
+  fast_u8 prefix = 0;
+
+  // Both counters of an address share a cache line.
+  struct address_counters {
+    fast_u64 instrs = 0;
+    fast_u64 ticks = 0;
+  };
+
+  address_counters counters[address_space_size];
+};
+
+template<typename B>
+const char profiler<B>::dump_signature[8] = {
+    'Z', '8', '0', 'P', 'R', 'O', 'F', '1' };
+
+}  // namespace z80
+
+#endif  // Z80_PROFILER_H
@@ -0,0 +1,256 @@
+/*  Z80 CPU Emulator.
+    https://github.com/kosarev/z80
+
+    Copyright (C) 2017-2019 Ivan Kosarev.
+    ivan@kosarev.info
+
+    Published under the MIT license.
+*/
+
+#ifndef Z80_RUNNER_H
+#define Z80_RUNNER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "z80.h"
+
+namespace z80 {
+
+// Runs a set of independent machines on a pool of worker
+// threads. Machines are run for quanta of ticks with
+// run_for(); after each quantum a machine is put to the back of
+// the queue of the worker that ran it, so the worker takes
+// turns with its machines. Workers take machines from the front
+// of their queues and steal from the back of other queues when
+// they run out of them. Every queue has its own lock, so workers
+// only contend when stealing. Workers that find no machines to
+// steal sleep until one is queued.
+template<typename M>
+class runner {
+public:
+  typedef M machine;
+  typedef typename M::ticks_type ticks_type;
+
+  // Zero means the number of hardware threads.
+  explicit runner(unsigned num_threads = 0) {
+    if (!num_threads)
+      num_threads = std::thread::hardware_concurrency();
+    if (!num_threads)
+      num_threads = 1;
+    for (unsigned i = 0; i != num_threads; ++i)
+      workers.emplace_back(new worker);
+    for (unsigned i = 0; i != num_threads; ++i)
+      workers[i]->thread = std::thread(&runner::work, this, i);
+  }
+
+  ~runner() {
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      is_shutting_down = true;
+    }
+    start_cv.notify_all();
+    for (auto &w : workers)
+      w->thread.join();
+  }
+
+  runner(const runner &) = delete;
+  runner &operator = (const runner &) = delete;
+
+  unsigned get_num_threads() const {
+    return static_cast<unsigned>(workers.size());
+  }
+
+  // Machines shall not be added while running.
+  M &add_machine() {
+    instances.emplace_back(new instance);
+    return instances.back()->mach;
+  }
+
+  unsigned get_num_machines() const {
+    return static_cast<unsigned>(instances.size());
+  }
+
+  M &get_machine(unsigned i) { return instances[i]->mach; }
+  const M &get_machine(unsigned i) const { return instances[i]->mach; }
+
+  // The events that stopped the machine during the last run()
+  // and the number of ticks it ran for.
+  events_mask::type get_events(unsigned i) const {
+    return instances[i]->events;
+  }
+
+  ticks_type get_run_ticks(unsigned i) const {
+    return instances[i]->run_ticks;
+  }
+
+  // Runs every machine for the specified number of ticks in
+  // quanta of the specified size, which shall not be zero. A
+  // machine stops early on any event except end_of_frame and
+  // ticks_limit_hit. Returns when all machines have stopped.
+  void run(ticks_type ticks, ticks_type quantum) {
+    assert(quantum != 0);
+    if (instances.empty())
+      return;
+    this->quantum = quantum;
+    for (std::size_t i = 0; i != instances.size(); ++i) {
+      instance &inst = *instances[i];
+      inst.start_tick = inst.mach.get_ticks();
+      inst.end_tick = inst.start_tick + ticks;
+      inst.events = 0;
+      inst.run_ticks = 0;
+      worker &w = *workers[i % workers.size()];
+      std::lock_guard<std::mutex> lock(w.mutex);
+      w.queue.push_back(&inst);
+    }
+
+    num_queued = instances.size();
+    num_running = instances.size();
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      ++generation;
+    }
+    start_cv.notify_all();
+
+    std::unique_lock<std::mutex> lock(state_mutex);
+    done_cv.wait(lock, [this] { return num_running == 0; });
+  }
+
+private:
+  struct instance {
+    M mach;
+    ticks_type start_tick = 0;
+    ticks_type end_tick = 0;
+    ticks_type run_ticks = 0;
+    events_mask::type events = 0;
+  };
+
+  struct worker {
+    std::thread thread;
+    std::mutex mutex;
+    std::deque<instance*> queue;
+  };
+
+  instance *pop(unsigned id) {
+    {
+      worker &w = *workers[id];
+      std::lock_guard<std::mutex> lock(w.mutex);
+      if (!w.queue.empty()) {
+        instance *inst = w.queue.front();
+        w.queue.pop_front();
+        --num_queued;
+        return inst;
+      }
+    }
+    for (std::size_t i = 1; i != workers.size(); ++i) {
+      worker &victim = *workers[(id + i) % workers.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.queue.empty()) {
+        instance *inst = victim.queue.back();
+        victim.queue.pop_back();
+        --num_queued;
+        return inst;
+      }
+    }
+    return nullptr;
+  }
+
+  void push(unsigned id, instance *inst) {
+    {
+      worker &w = *workers[id];
+      std::lock_guard<std::mutex> lock(w.mutex);
+      w.queue.push_back(inst);
+      ++num_queued;
+    }
+
+    // An idle worker registers itself before it checks for
+    // queued machines, so either it sees this one or it is
+    // counted here and waits for the notification.
+    if (num_idle != 0) {
+      { std::lock_guard<std::mutex> lock(state_mutex); }
+      work_cv.notify_one();
+    }
+  }
+
+  // Waits until there may be machines to steal or all machines
+  // have stopped.
+  void wait_for_work() {
+    std::unique_lock<std::mutex> lock(state_mutex);
+    ++num_idle;
+    work_cv.wait(lock, [this] {
+      return num_queued != 0 || num_running == 0; });
+    --num_idle;
+  }
+
+  // Runs a quantum. Returns whether the machine has to go on.
+  bool run_quantum(instance &inst) {
+    M &mach = inst.mach;
+    ticks_type ticks = mach.get_ticks();
+    ticks_type left = inst.end_tick - ticks;
+    events_mask::type e = mach.run_for(left < quantum ? left : quantum);
+    inst.run_ticks = mach.get_ticks() - inst.start_tick;
+    const events_mask::type ignored =
+        events_mask::end_of_frame | events_mask::ticks_limit_hit;
+    if ((e & ~ignored) || mach.get_ticks() >= inst.end_tick) {
+      inst.events = e;
+      return false;
+    }
+    return true;
+  }
+
+  void work(unsigned id) {
+    unsigned long seen_generation = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(state_mutex);
+        start_cv.wait(lock, [&] {
+          return is_shutting_down || generation != seen_generation; });
+        if (is_shutting_down)
+          return;
+        seen_generation = generation;
+      }
+
+      // Machines that are being run by other workers may come
+      // back to their queues, so keep looking until all are
+      // done.
+      while (num_running != 0) {
+        instance *inst = pop(id);
+        if (!inst) {
+          wait_for_work();
+          continue;
+        }
+        if (run_quantum(*inst)) {
+          push(id, inst);
+        } else if (--num_running == 0) {
+          std::lock_guard<std::mutex> lock(state_mutex);
+          done_cv.notify_all();
+          work_cv.notify_all();
+        }
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<instance>> instances;
+  std::vector<std::unique_ptr<worker>> workers;
+
+  ticks_type quantum = 0;
+  std::atomic<std::size_t> num_queued{0};
+  std::atomic<std::size_t> num_running{0};
+  std::atomic<unsigned> num_idle{0};
+
+  std::mutex state_mutex;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+  std::condition_variable work_cv;
+  unsigned long generation = 0;
+  bool is_shutting_down = false;
+};
+
+}  // namespace z80
+
+#endif  // Z80_RUNNER_H
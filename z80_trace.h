@@ -0,0 +1,743 @@
+/*  Z80 CPU Emulator.
+    https://github.com/kosarev/z80
+
+    Copyright (C) 2017-2019 Ivan Kosarev.
+    ivan@kosarev.info
+
+    Published under the MIT license.
+*/
+
+#ifndef Z80_TRACE_H
+#define Z80_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <sys/types.h>
+#endif
+
+#include "z80.h"
+
+namespace z80 {
+
+// Execution traces are files that consist of an 8-byte
+// signature, a sequence of blocks and an index of the blocks.
+//
+// Every block starts with a header that holds the size of the
+// block's data, the number of instruction records in it, the
+// number of instruction records before the block and the ticks
+// and the address of the last instruction before the block. The
+// records in the block are encoded relative to these, so blocks
+// can be decoded independently of each other. The header also
+// holds a hash of the data of the block and all blocks before it,
+// so that traces can be compared without decoding them.
+//
+// An instruction record is the address of the instruction and
+// the tick at which it started, both as deltas to the previous
+// instruction. Sequential instructions that take less than 32
+// ticks are encoded as single bytes. Register records hold a
+// number of 16-bit values and memory records an address and a
+// byte. Records that follow an instruction record are meant to
+// belong to that instruction.
+//
+// The index lists the file offsets of the blocks along with
+// copies of their headers and is followed by the offset of the index,
+// the number of blocks and another 8-byte signature. Traces that
+// have not been closed properly lack the index; readers then
+// find blocks by scanning their headers.
+enum class trace_record_kind { instr, regs, read, write };
+
+struct trace_record {
+  static const unsigned max_regs = 16;
+
+  trace_record_kind kind;
+
+  // The number of instruction records up to and including this
+  // record.
+  fast_u64 num_instrs;
+
+  // For instruction records; those of the last instruction
+  // otherwise.
+  fast_u64 ticks;
+  fast_u16 pc;
+
+  // For memory records.
+  fast_u16 addr;
+  fast_u8 value;
+
+  // For register records.
+  unsigned num_regs;
+  fast_u16 regs[max_regs];
+};
+
+class trace_format {
+protected:
+  static const unsigned signature_size = 8;
+  static const char *get_signature() { return "Z80TRC01"; }
+  static const char *get_index_signature() { return "Z80TIDX1"; }
+
+  static const unsigned block_header_size = 4 + 4 + 8 + 8 + 2 + 8;
+  static const unsigned index_entry_size = 8 + block_header_size;
+  static const unsigned footer_size = 8 + 8 + signature_size;
+
+  // Largest record: a tag, the number of registers and the
+  // registers.
+  static const unsigned max_record_size = 2 + 2 * trace_record::max_regs;
+
+  // Record tags. Short instruction records have the high bit
+  // set, the address delta minus one in bits 5 and 6 and the
+  // ticks delta in bits 0 to 4.
+  static const fast_u8 instr_tag = 0x00;
+  static const fast_u8 regs_tag = 0x01;
+  static const fast_u8 read_tag = 0x02;
+  static const fast_u8 write_tag = 0x03;
+  static const fast_u8 short_instr_tag = 0x80;
+
+  struct block_header {
+    fast_u32 size = 0;
+    fast_u32 num_instrs = 0;
+    fast_u64 first_instr = 0;
+    fast_u64 base_ticks = 0;
+    fast_u16 base_pc = 0;
+    fast_u64 hash = 0;
+  };
+
+  struct index_entry {
+    fast_u64 offset;
+    block_header header;
+  };
+
+  static least_u8 *put_le(least_u8 *p, fast_u64 n, unsigned size) {
+    for (unsigned i = 0; i != size; ++i)
+      *p++ = static_cast<least_u8>((n >> (i * 8)) & 0xff);
+    return p;
+  }
+
+  static fast_u64 get_le(const least_u8 *p, unsigned size) {
+    fast_u64 n = 0;
+    for (unsigned i = 0; i != size; ++i)
+      n |= static_cast<fast_u64>(p[i]) << (i * 8);
+    return n;
+  }
+
+  static least_u8 *put_varint(least_u8 *p, fast_u64 n) {
+    while (n >= 0x80) {
+      *p++ = static_cast<least_u8>((n & 0x7f) | 0x80);
+      n >>= 7;
+    }
+    *p++ = static_cast<least_u8>(n);
+    return p;
+  }
+
+  static void encode_block_header(least_u8 *p, const block_header &h) {
+    p = put_le(p, h.size, 4);
+    p = put_le(p, h.num_instrs, 4);
+    p = put_le(p, h.first_instr, 8);
+    p = put_le(p, h.base_ticks, 8);
+    p = put_le(p, h.base_pc, 2);
+    put_le(p, h.hash, 8);
+  }
+
+  static block_header decode_block_header(const least_u8 *p) {
+    block_header h;
+    h.size = static_cast<fast_u32>(get_le(p, 4));
+    h.num_instrs = static_cast<fast_u32>(get_le(p + 4, 4));
+    h.first_instr = get_le(p + 8, 8);
+    h.base_ticks = get_le(p + 16, 8);
+    h.base_pc = static_cast<fast_u16>(get_le(p + 24, 2));
+    h.hash = get_le(p + 26, 8);
+    return h;
+  }
+
+  // FNV-1a.
+  static const fast_u64 initial_hash = 0xcbf29ce484222325;
+
+  static fast_u64 hash_bytes(fast_u64 hash, const least_u8 *p,
+                             std::size_t size) {
+    for (std::size_t i = 0; i != size; ++i)
+      hash = mask64((hash ^ p[i]) * 0x100000001b3);
+    return hash;
+  }
+
+  static fast_u64 mask64(fast_u64 n) {
+    return n & static_cast<fast_u64>(0xffffffffffffffff);
+  }
+
+  // fseek() and ftell() take offsets as long, which is 32 bits
+  // wide on LLP64 hosts, so traces larger than 2 GiB need the
+  // 64-bit variants.
+  static bool seek(std::FILE *file, fast_u64 offset, int whence) {
+#if defined(_WIN32)
+    if (offset > static_cast<fast_u64>(INT64_MAX))
+      return false;
+    return ::_fseeki64(file, static_cast<__int64>(offset), whence) == 0;
+#else
+    off_t off = static_cast<off_t>(offset);
+    if (off < 0 || static_cast<fast_u64>(off) != offset)
+      return false;
+    return ::fseeko(file, off, whence) == 0;
+#endif
+  }
+
+  static bool tell(std::FILE *file, fast_u64 &offset) {
+#if defined(_WIN32)
+    __int64 off = ::_ftelli64(file);
+#else
+    off_t off = ::ftello(file);
+#endif
+    if (off < 0)
+      return false;
+    offset = static_cast<fast_u64>(off);
+    return true;
+  }
+};
+
+// Records traces from the emulating thread. The records are
+// encoded into blocks which a background thread then writes to
+// the file. Blocks are passed between the threads via lock-free
+// rings, so recording never waits for I/O unless the writing
+// thread falls behind by all the blocks of the pool. The writing
+// thread sleeps until a block is full or the trace is closed.
+class trace_writer : public trace_format {
+public:
+  trace_writer() {}
+
+  ~trace_writer() { close(); }
+
+  trace_writer(const trace_writer &) = delete;
+  trace_writer &operator = (const trace_writer &) = delete;
+
+  bool is_open() const { return file != nullptr; }
+
+  bool open(const char *path) {
+    close();
+    file = std::fopen(path, "wb");
+    if (!file)
+      return false;
+    failed = false;
+    is_closing = false;
+    index.clear();
+    file_pos = 0;
+    hash = initial_hash;
+    num_instrs = 0;
+    prev_ticks = 0;
+    prev_pc = 0;
+
+    if (!blocks)
+      blocks.reset(new block[num_blocks]);
+    for (unsigned i = 0; i != num_blocks; ++i)
+      free_blocks.push(&blocks[i]);
+    begin_block();
+
+    write_bytes(get_signature(), signature_size);
+    thread = std::thread(&trace_writer::drain, this);
+    return true;
+  }
+
+  // Writes the remaining records and the index. Returns false if
+  // any writes have failed.
+  bool close() {
+    if (!file)
+      return true;
+    end_block();
+    current = nullptr;
+    is_closing.store(true, std::memory_order_release);
+    wake_drain();
+    thread.join();
+    while (free_blocks.pop()) {}
+
+    fast_u64 index_pos = file_pos;
+    least_u8 buff[index_entry_size];
+    for (const index_entry &e : index) {
+      encode_block_header(put_le(buff, e.offset, 8), e.header);
+      write_bytes(buff, index_entry_size);
+    }
+    least_u8 *p = put_le(buff, index_pos, 8);
+    put_le(p, index.size(), 8);
+    write_bytes(buff, 16);
+    write_bytes(get_index_signature(), signature_size);
+
+    if (std::fclose(file) != 0)
+      failed = true;
+    file = nullptr;
+    return !failed;
+  }
+
+  // Instructions shall be recorded in order of their ticks.
+  void record_instr(fast_u64 ticks, fast_u16 pc) {
+    reserve(max_record_size);
+    fast_u16 pc_delta = sub16(pc, prev_pc);
+    fast_u64 ticks_delta = ticks - prev_ticks;
+    least_u8 *p = pos;
+    if (pc_delta >= 1 && pc_delta <= 4 && ticks_delta < 32) {
+      *p++ = static_cast<least_u8>(short_instr_tag | ((pc_delta - 1) << 5) |
+                                   static_cast<fast_u8>(ticks_delta));
+    } else {
+      *p++ = instr_tag;
+      p = put_le(p, pc_delta, 2);
+      p = put_varint(p, ticks_delta);
+    }
+    pos = p;
+    prev_pc = pc;
+    prev_ticks = ticks;
+    ++current->header.num_instrs;
+    ++num_instrs;
+  }
+
+  void record_regs(const fast_u16 *regs, unsigned num_regs) {
+    assert(num_regs <= trace_record::max_regs);
+    reserve(max_record_size);
+    least_u8 *p = pos;
+    *p++ = regs_tag;
+    *p++ = static_cast<least_u8>(num_regs);
+    for (unsigned i = 0; i != num_regs; ++i)
+      p = put_le(p, regs[i], 2);
+    pos = p;
+  }
+
+  void record_regs(std::initializer_list<fast_u16> regs) {
+    record_regs(regs.begin(), static_cast<unsigned>(regs.size()));
+  }
+
+  void record_read(fast_u16 addr, fast_u8 n) {
+    record_access(read_tag, addr, n);
+  }
+
+  void record_write(fast_u16 addr, fast_u8 n) {
+    record_access(write_tag, addr, n);
+  }
+
+  fast_u64 get_num_instrs() const { return num_instrs; }
+
+private:
+  static const unsigned block_size = 64 * 1024;
+  static const unsigned num_blocks = 16;
+
+  struct block {
+    block_header header;
+    least_u8 data[block_size];
+  };
+
+  // A single-producer single-consumer ring large enough to hold
+  // all the blocks.
+  class block_ring {
+  public:
+    void push(block *b) {
+      unsigned t = tail.load(std::memory_order_relaxed);
+      items[t] = b;
+      tail.store((t + 1) % size, std::memory_order_release);
+    }
+
+    bool is_empty() const {
+      return head.load(std::memory_order_relaxed) ==
+             tail.load(std::memory_order_acquire);
+    }
+
+    block *pop() {
+      unsigned h = head.load(std::memory_order_relaxed);
+      if (h == tail.load(std::memory_order_acquire))
+        return nullptr;
+      block *b = items[h];
+      head.store((h + 1) % size, std::memory_order_release);
+      return b;
+    }
+
+  private:
+    static const unsigned size = num_blocks + 1;
+
+    block *items[size] = {};
+    std::atomic<unsigned> head{0};
+    std::atomic<unsigned> tail{0};
+  };
+
+  void begin_block() {
+    while (!(current = free_blocks.pop()))
+      std::this_thread::yield();
+    block_header &h = current->header;
+    h.size = 0;
+    h.num_instrs = 0;
+    h.first_instr = num_instrs;
+    h.base_ticks = prev_ticks;
+    h.base_pc = prev_pc;
+    pos = current->data;
+    end = current->data + block_size;
+  }
+
+  void reserve(unsigned size) {
+    if (static_cast<unsigned>(end - pos) >= size)
+      return;
+    end_block();
+    begin_block();
+  }
+
+  void end_block() {
+    current->header.size = static_cast<fast_u32>(pos - current->data);
+    full_blocks.push(current);
+    wake_drain();
+  }
+
+  // Taking the mutex makes sure the writing thread either sees
+  // the new state when it checks for work or is already waiting
+  // and gets the notification.
+  void wake_drain() {
+    { std::lock_guard<std::mutex> lock(drain_mutex); }
+    drain_cond.notify_one();
+  }
+
+  void record_access(fast_u8 tag, fast_u16 addr, fast_u8 n) {
+    reserve(max_record_size);
+    least_u8 *p = pos;
+    *p++ = static_cast<least_u8>(tag);
+    p = put_le(p, addr, 2);
+    *p++ = static_cast<least_u8>(n);
+    pos = p;
+  }
+
+  void write_bytes(const void *p, std::size_t size) {
+    if (std::fwrite(p, 1, size, file) != size)
+      failed = true;
+    file_pos += size;
+  }
+
+  // Runs on the background thread.
+  void drain() {
+    for (;;) {
+      block *b = full_blocks.pop();
+      if (!b) {
+        if (is_closing.load(std::memory_order_acquire)) {
+          // All blocks are pushed before the flag is set.
+          b = full_blocks.pop();
+          if (!b)
+            return;
+        } else {
+          std::unique_lock<std::mutex> lock(drain_mutex);
+          drain_cond.wait(lock, [this] {
+            return !full_blocks.is_empty() ||
+                   is_closing.load(std::memory_order_acquire); });
+          continue;
+        }
+      }
+
+      hash = hash_bytes(hash, b->data, b->header.size);
+      b->header.hash = hash;
+      least_u8 buff[block_header_size];
+      encode_block_header(buff, b->header);
+      index.push_back({file_pos, b->header});
+      write_bytes(buff, block_header_size);
+      write_bytes(b->data, b->header.size);
+      free_blocks.push(b);
+    }
+  }
+
+  std::FILE *file = nullptr;
+  std::thread thread;
+  std::atomic<bool> is_closing{false};
+  std::mutex drain_mutex;
+  std::condition_variable drain_cond;
+
+  std::unique_ptr<block[]> blocks;
+  block_ring free_blocks;
+  block_ring full_blocks;
+
+  // Owned by the recording thread.
+  block *current = nullptr;
+  least_u8 *pos = nullptr;
+  least_u8 *end = nullptr;
+  fast_u64 num_instrs = 0;
+  fast_u64 prev_ticks = 0;
+  fast_u16 prev_pc = 0;
+
+  // Owned by the writing thread until it is joined.
+  std::vector<index_entry> index;
+  fast_u64 file_pos = 0;
+  fast_u64 hash = 0;
+  bool failed = false;
+};
+
+// Reads traces written by trace_writer.
+class trace_reader : public trace_format {
+public:
+  trace_reader() {}
+
+  ~trace_reader() { close(); }
+
+  trace_reader(const trace_reader &) = delete;
+  trace_reader &operator = (const trace_reader &) = delete;
+
+  bool is_open() const { return file != nullptr; }
+
+  // Positions the reader at the first record.
+  bool open(const char *path) {
+    close();
+    file = std::fopen(path, "rb");
+    if (!file)
+      return false;
+    char sig[signature_size];
+    if (std::fread(sig, 1, signature_size, file) != signature_size ||
+          std::memcmp(sig, get_signature(), signature_size) != 0 ||
+          !(load_index() || scan_blocks())) {
+      close();
+      return false;
+    }
+    return seek_to_block(0);
+  }
+
+  void close() {
+    if (file)
+      std::fclose(file);
+    file = nullptr;
+    index.clear();
+    data.clear();
+    data_pos = 0;
+    next_block = 0;
+    failed = false;
+  }
+
+  std::size_t get_num_blocks() const { return index.size(); }
+
+  // The number of instruction records in the trace.
+  fast_u64 get_num_instrs() const {
+    if (index.empty())
+      return 0;
+    const block_header &h = index.back().header;
+    return h.first_instr + h.num_instrs;
+  }
+
+  // The number of instruction records before the block.
+  fast_u64 get_block_first_instr(std::size_t i) const {
+    return index[i].header.first_instr;
+  }
+
+  // The hash of the data of the block and all blocks before it.
+  // Traces of the same records have the same hashes.
+  fast_u64 get_block_hash(std::size_t i) const {
+    return index[i].header.hash;
+  }
+
+  bool seek_to_block(std::size_t i) {
+    next_block = i;
+    data.clear();
+    data_pos = 0;
+    if (i == index.size())
+      return true;
+    return load_block();
+  }
+
+  // Positions the reader at the first instruction record that
+  // starts at or after the specified tick. Blocks are found via
+  // the index, so only one block is to be decoded to get there.
+  bool seek_to_ticks(fast_u64 ticks) {
+    // Find the first block that may contain the instruction.
+    std::size_t i = static_cast<std::size_t>(
+        std::lower_bound(index.begin(), index.end(), ticks,
+                         [](const index_entry &e, fast_u64 t) {
+                           return e.header.base_ticks < t; }) -
+        index.begin());
+    if (i)
+      --i;
+    if (!seek_to_block(i))
+      return false;
+
+    for (;;) {
+      if (!load_data())
+        return !failed;
+      std::size_t saved_pos = data_pos;
+      fast_u64 saved_num_instrs = num_instrs, saved_ticks = prev_ticks;
+      fast_u16 saved_pc = prev_pc;
+      trace_record r;
+      if (!read(r))
+        return false;
+      if (r.kind == trace_record_kind::instr && r.ticks >= ticks) {
+        // Get back to the record. Records are never split
+        // between blocks, so the block is still loaded.
+        data_pos = saved_pos;
+        num_instrs = saved_num_instrs;
+        prev_ticks = saved_ticks;
+        prev_pc = saved_pc;
+        return true;
+      }
+    }
+  }
+
+  // Positions the reader at the instruction record of the
+  // specified zero-based number, or the end of the trace.
+  bool seek_to_instr(fast_u64 n) {
+    std::size_t i = static_cast<std::size_t>(
+        std::upper_bound(index.begin(), index.end(), n,
+                         [](fast_u64 m, const index_entry &e) {
+                           return m < e.header.first_instr; }) -
+        index.begin());
+    if (!seek_to_block(i ? i - 1 : 0))
+      return false;
+    for (;;) {
+      if (!load_data())
+        return !failed;
+      fast_u8 tag = data[data_pos];
+      if (num_instrs == n && ((tag & short_instr_tag) || tag == instr_tag))
+        return true;
+      trace_record r;
+      if (!read(r))
+        return false;
+    }
+  }
+
+  // Returns false at the end of the trace or on errors.
+  bool read(trace_record &r) {
+    if (!load_data())
+      return false;
+
+    const least_u8 *p = &data[data_pos];
+    std::size_t left = data.size() - data_pos;
+    fast_u8 tag = *p;
+    std::size_t size;
+    if (tag & short_instr_tag) {
+      r.kind = trace_record_kind::instr;
+      prev_pc = add16(prev_pc, ((tag >> 5) & 0x3) + 1);
+      prev_ticks += tag & 0x1f;
+      ++num_instrs;
+      size = 1;
+    } else if (tag == instr_tag) {
+      if (left < 4)
+        return fail();
+      r.kind = trace_record_kind::instr;
+      prev_pc = add16(prev_pc, static_cast<fast_u16>(get_le(p + 1, 2)));
+      fast_u64 ticks_delta = 0;
+      size = 3;
+      for (unsigned shift = 0; ; shift += 7) {
+        if (size == left || shift > 63)
+          return fail();
+        fast_u8 b = p[size++];
+        ticks_delta |= static_cast<fast_u64>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+          break;
+      }
+      prev_ticks += ticks_delta;
+      ++num_instrs;
+    } else if (tag == regs_tag) {
+      if (left < 2 || p[1] > trace_record::max_regs ||
+            left < 2 + 2 * static_cast<std::size_t>(p[1]))
+        return fail();
+      r.kind = trace_record_kind::regs;
+      r.num_regs = p[1];
+      for (unsigned i = 0; i != r.num_regs; ++i)
+        r.regs[i] = static_cast<fast_u16>(get_le(p + 2 + 2 * i, 2));
+      size = 2 + 2 * r.num_regs;
+    } else if (tag == read_tag || tag == write_tag) {
+      if (left < 4)
+        return fail();
+      r.kind = tag == read_tag ? trace_record_kind::read :
+                                 trace_record_kind::write;
+      r.addr = static_cast<fast_u16>(get_le(p + 1, 2));
+      r.value = p[3];
+      size = 4;
+    } else {
+      return fail();
+    }
+    data_pos += size;
+    r.num_instrs = num_instrs;
+    r.ticks = prev_ticks;
+    r.pc = prev_pc;
+    return true;
+  }
+
+  // Tells whether reading has stopped because of a malformed
+  // trace or a read error.
+  bool has_failed() const { return failed; }
+
+private:
+  bool fail() {
+    failed = true;
+    return false;
+  }
+
+  // Loads blocks until there is a record to read.
+  bool load_data() {
+    while (data_pos == data.size()) {
+      if (next_block == index.size() || !load_block())
+        return false;
+    }
+    return true;
+  }
+
+  bool read_at(fast_u64 offset, least_u8 *buff, std::size_t size) {
+    return seek(file, offset, SEEK_SET) &&
+           std::fread(buff, 1, size, file) == size;
+  }
+
+  bool load_index() {
+    fast_u64 file_size;
+    if (!seek(file, 0, SEEK_END) || !tell(file, file_size) ||
+          file_size < signature_size + footer_size)
+      return false;
+    least_u8 footer[footer_size];
+    fast_u64 footer_pos = file_size - footer_size;
+    if (!read_at(footer_pos, footer, footer_size) ||
+          std::memcmp(footer + 16, get_index_signature(),
+                      signature_size) != 0)
+      return false;
+    fast_u64 index_pos = get_le(footer, 8);
+    fast_u64 num_entries = get_le(footer + 8, 8);
+    if (index_pos > footer_pos ||
+          (footer_pos - index_pos) / index_entry_size != num_entries)
+      return false;
+
+    std::vector<least_u8> buff(
+        static_cast<std::size_t>(num_entries * index_entry_size));
+    if (!buff.empty() && !read_at(index_pos, &buff[0], buff.size()))
+      return false;
+    for (std::size_t i = 0; i != num_entries; ++i) {
+      const least_u8 *p = &buff[i * index_entry_size];
+      index.push_back({get_le(p, 8), decode_block_header(p + 8)});
+    }
+    return true;
+  }
+
+  bool scan_blocks() {
+    index.clear();
+    fast_u64 offset = signature_size;
+    least_u8 header[block_header_size];
+    while (read_at(offset, header, block_header_size)) {
+      block_header h = decode_block_header(header);
+      index.push_back({offset, h});
+      offset += block_header_size + h.size;
+    }
+    return true;
+  }
+
+  bool load_block() {
+    const index_entry &e = index[next_block];
+    data.resize(e.header.size);
+    if (!data.empty() &&
+          !read_at(e.offset + block_header_size, &data[0], data.size()))
+      return fail();
+    data_pos = 0;
+    num_instrs = e.header.first_instr;
+    prev_ticks = e.header.base_ticks;
+    prev_pc = e.header.base_pc;
+    ++next_block;
+    return true;
+  }
+
+  std::FILE *file = nullptr;
+  std::vector<index_entry> index;
+  bool failed = false;
+
+  std::vector<least_u8> data;
+  std::size_t data_pos = 0;
+  std::size_t next_block = 0;
+  fast_u64 num_instrs = 0;
+  fast_u64 prev_ticks = 0;
+  fast_u16 prev_pc = 0;
+};
+
+}  // namespace z80
+
+#endif  // Z80_TRACE_H